@@ -0,0 +1,283 @@
+/* Microbenchmarks of library internals, build with "make bench" and run "./bench <name>" where name is one of:
+ *
+ *   ctr       - AES-256-CTR throughput of the per-block path that psync_crypto_aes256_ctr_encode_decode_inplace() used to have
+ *               against the current bulk keystream path, in GB/s
+ *   intervals - the AVL interval tree that tracked written ranges of open files before against the current chunked interval set,
+ *               for random and sequential writes, in million operations per second
+ */
+
+#include "pcompat.h"
+#include "plibs.h"
+#include "pssl.h"
+#include "pcrypto.h"
+#include "ptree.h"
+#include "pintervaltree.h"
+#include <stdio.h>
+#include <string.h>
+#include <stddef.h>
+#include <time.h>
+
+#define BENCH_CTR_SIZE (64*1024*1024)
+#define BENCH_CTR_ROUNDS 4
+#define BENCH_INTERVALS_CNT 1000000
+#define BENCH_INTERVALS_LOOKUPS 1000000
+#define BENCH_INTERVALS_WRITE 4096
+
+static double bench_time(){
+  struct timespec tm;
+  psync_nanotime(&tm);
+  return tm.tv_sec+tm.tv_nsec/1000000000.0;
+}
+
+/* the pre-batching implementation: one AES block at a time, then a byte-wise XOR */
+static void ctr_per_block_inplace(psync_crypto_aes256_ctr_encoder_decoder_t enc, unsigned char *data, size_t datalen, uint64_t dataoffset){
+  unsigned char ctr[PSYNC_AES256_BLOCK_SIZE], ks[PSYNC_AES256_BLOCK_SIZE];
+  uint64_t counter, w;
+  size_t skip, len, i;
+  counter=dataoffset/PSYNC_AES256_BLOCK_SIZE;
+  skip=dataoffset%PSYNC_AES256_BLOCK_SIZE;
+  while (datalen){
+    memcpy(ctr, enc->iv, PSYNC_AES256_BLOCK_SIZE);
+    memcpy(&w, ctr, sizeof(w));
+    w^=counter++;
+    memcpy(ctr, &w, sizeof(w));
+    psync_aes256_encode_block(enc->encoder, ctr, ks);
+    len=PSYNC_AES256_BLOCK_SIZE-skip;
+    if (len>datalen)
+      len=datalen;
+    for (i=0; i<len; i++)
+      data[i]^=ks[skip+i];
+    data+=len;
+    datalen-=len;
+    skip=0;
+  }
+}
+
+static double bench_ctr_run(psync_crypto_aes256_ctr_encoder_decoder_t enc, unsigned char *data, size_t len, int bulk){
+  double start;
+  int i;
+  start=bench_time();
+  for (i=0; i<BENCH_CTR_ROUNDS; i++)
+    if (bulk)
+      psync_crypto_aes256_ctr_encode_decode_inplace(enc, data, len, i);
+    else
+      ctr_per_block_inplace(enc, data, len, i);
+  return (double)len*BENCH_CTR_ROUNDS/(bench_time()-start)/1000000000.0;
+}
+
+static int bench_ctr(){
+  psync_symmetric_key_t key;
+  psync_crypto_aes256_ctr_encoder_decoder_t enc;
+  unsigned char *buf, *ref;
+  size_t i;
+  /* psync_crypto_aes256_ctr_gen_key() seeds from the database, a fixed key is just as good here */
+  key=(psync_symmetric_key_t)psync_malloc(offsetof(psync_symmetric_key_struct_t, key)+PSYNC_AES256_KEY_SIZE+PSYNC_AES256_BLOCK_SIZE);
+  key->keylen=PSYNC_AES256_KEY_SIZE+PSYNC_AES256_BLOCK_SIZE;
+  for (i=0; i<key->keylen; i++)
+    key->key[i]=(unsigned char)(i*37+11);
+  enc=psync_crypto_aes256_ctr_encoder_decoder_create(key);
+  psync_ssl_free_symmetric_key(key);
+  buf=(unsigned char *)psync_malloc(BENCH_CTR_SIZE+1);
+  ref=(unsigned char *)psync_malloc(BENCH_CTR_SIZE+1);
+  for (i=0; i<BENCH_CTR_SIZE+1; i++)
+    buf[i]=ref[i]=(unsigned char)(i*131);
+  /* both paths have to produce the same output, including from an offset that is not on a block boundary */
+  ctr_per_block_inplace(enc, ref+1, BENCH_CTR_SIZE, 7);
+  psync_crypto_aes256_ctr_encode_decode_inplace(enc, buf+1, BENCH_CTR_SIZE, 7);
+  if (memcmp(buf, ref, BENCH_CTR_SIZE+1)){
+    fprintf(stderr, "ctr: bulk and per-block output differ\n");
+    return 1;
+  }
+  printf("ctr: %u MiB x %u rounds\n", (unsigned)(BENCH_CTR_SIZE/(1024*1024)), (unsigned)BENCH_CTR_ROUNDS);
+  printf("  per-block aligned:   %.3f GB/s\n", bench_ctr_run(enc, buf, BENCH_CTR_SIZE, 0));
+  printf("  bulk aligned:        %.3f GB/s\n", bench_ctr_run(enc, buf, BENCH_CTR_SIZE, 1));
+  printf("  per-block unaligned: %.3f GB/s\n", bench_ctr_run(enc, buf+1, BENCH_CTR_SIZE, 0));
+  printf("  bulk unaligned:      %.3f GB/s\n", bench_ctr_run(enc, buf+1, BENCH_CTR_SIZE, 1));
+  psync_free(ref);
+  psync_free(buf);
+  psync_crypto_aes256_ctr_encoder_decoder_free(enc);
+  return 0;
+}
+
+/* Reference copy of the AVL based interval tree that psync_interval_tree_t replaced, only the parts needed for adding and lookups. */
+typedef struct {
+  psync_tree tree;
+  uint64_t from;
+  uint64_t to;
+} avl_interval_t;
+
+#define avl_interval_element(a) psync_tree_element(a, avl_interval_t, tree)
+
+static avl_interval_t *avl_interval_new(uint64_t from, uint64_t to){
+  avl_interval_t *e=psync_new(avl_interval_t);
+  e->from=from;
+  e->to=to;
+  return e;
+}
+
+static avl_interval_t *avl_interval_next(avl_interval_t *e){
+  return avl_interval_element(psync_tree_get_next(&e->tree));
+}
+
+static avl_interval_t *avl_interval_consume(avl_interval_t *tree, avl_interval_t *e){
+  avl_interval_t *next;
+  while ((next=avl_interval_next(e))){
+    if (next->from>e->to)
+      break;
+    tree=avl_interval_element(psync_tree_get_del(&tree->tree, &next->tree));
+    if (next->to>=e->to){
+      e->to=next->to;
+      psync_free(next);
+      break;
+    }
+    psync_free(next);
+  }
+  return tree;
+}
+
+static avl_interval_t *avl_interval_add(avl_interval_t *tree, uint64_t from, uint64_t to){
+  avl_interval_t *e, *e2;
+  if (!tree){
+    e=avl_interval_new(from, to);
+    return avl_interval_element(psync_tree_get_add_after(PSYNC_TREE_EMPTY, NULL, &e->tree));
+  }
+  e=tree;
+  while (1){
+    if (e->from<=from && e->to>=from){
+      if (e->to>=to)
+        return tree;
+      e->to=to;
+      return avl_interval_consume(tree, e);
+    }
+    else if (e->from>from){
+      if (e->tree.left)
+        e=avl_interval_element(e->tree.left);
+      else if (e->from<=to && e->to>=to){
+        e->from=from;
+        return tree;
+      }
+      else{
+        e2=avl_interval_new(from, to);
+        return avl_interval_consume(avl_interval_element(psync_tree_get_add_before(&tree->tree, &e->tree, &e2->tree)), e2);
+      }
+    }
+    else{
+      if (e->tree.right)
+        e=avl_interval_element(e->tree.right);
+      else{
+        e2=avl_interval_new(from, to);
+        return avl_interval_consume(avl_interval_element(psync_tree_get_add_after(&tree->tree, &e->tree, &e2->tree)), e2);
+      }
+    }
+  }
+}
+
+static avl_interval_t *avl_interval_containing_or_after(avl_interval_t *tree, uint64_t point){
+  while (tree){
+    if (point>=tree->to){
+      if (tree->tree.right)
+        tree=avl_interval_element(tree->tree.right);
+      else{
+        tree=avl_interval_next(tree);
+        break;
+      }
+    }
+    else if (point>=tree->from || !tree->tree.left)
+      break;
+    else
+      tree=avl_interval_element(tree->tree.left);
+  }
+  return tree;
+}
+
+static void avl_interval_free(avl_interval_t *tree){
+  if (!tree)
+    return;
+  avl_interval_free(avl_interval_element(tree->tree.left));
+  avl_interval_free(avl_interval_element(tree->tree.right));
+  psync_free(tree);
+}
+
+static uint64_t bench_rand(uint64_t *state){
+  *state^=*state<<13;
+  *state^=*state>>7;
+  *state^=*state<<17;
+  return *state;
+}
+
+static double bench_mops(double start, uint64_t ops){
+  return ops/(bench_time()-start)/1000000.0;
+}
+
+/* Writes of BENCH_INTERVALS_WRITE bytes, either at random offsets of a file large enough to keep most of them apart or one after
+ * another with a gap of one write between them, so both workloads end up with many intervals. Every lookup point is checked to
+ * get the same answer from both structures. */
+static int bench_intervals_run(const char *name, int random){
+  psync_interval_tree_t *set;
+  psync_interval_tree_iter_t it;
+  const psync_interval_t *iv;
+  avl_interval_t *avl, *a;
+  uint64_t *offs, state, sum;
+  double start, avladd, setadd, avllook, setlook;
+  size_t i;
+  offs=psync_new_cnt(uint64_t, BENCH_INTERVALS_CNT);
+  state=88172645463325252ULL;
+  for (i=0; i<BENCH_INTERVALS_CNT; i++)
+    if (random)
+      offs[i]=bench_rand(&state)%((uint64_t)BENCH_INTERVALS_CNT*64)*BENCH_INTERVALS_WRITE;
+    else
+      offs[i]=(uint64_t)i*2*BENCH_INTERVALS_WRITE;
+  avl=NULL;
+  start=bench_time();
+  for (i=0; i<BENCH_INTERVALS_CNT; i++)
+    avl=avl_interval_add(avl, offs[i], offs[i]+BENCH_INTERVALS_WRITE);
+  avladd=bench_mops(start, BENCH_INTERVALS_CNT);
+  set=NULL;
+  start=bench_time();
+  for (i=0; i<BENCH_INTERVALS_CNT; i++)
+    psync_interval_tree_add(&set, offs[i], offs[i]+BENCH_INTERVALS_WRITE);
+  setadd=bench_mops(start, BENCH_INTERVALS_CNT);
+  for (i=0; i<BENCH_INTERVALS_LOOKUPS; i++)
+    offs[i%BENCH_INTERVALS_CNT]=bench_rand(&state)%((uint64_t)BENCH_INTERVALS_CNT*128*BENCH_INTERVALS_WRITE);
+  sum=0;
+  start=bench_time();
+  for (i=0; i<BENCH_INTERVALS_LOOKUPS; i++)
+    if ((a=avl_interval_containing_or_after(avl, offs[i%BENCH_INTERVALS_CNT])))
+      sum+=a->from;
+  avllook=bench_mops(start, BENCH_INTERVALS_LOOKUPS);
+  start=bench_time();
+  for (i=0; i<BENCH_INTERVALS_LOOKUPS; i++)
+    if ((iv=psync_interval_tree_first_interval_containing_or_after(set, offs[i%BENCH_INTERVALS_CNT], &it)))
+      sum-=iv->from;
+  setlook=bench_mops(start, BENCH_INTERVALS_LOOKUPS);
+  printf("%s: %lu intervals\n", name, (unsigned long)psync_interval_tree_count(set));
+  printf("  add    avl: %7.2f Mops/s  chunked: %7.2f Mops/s\n", avladd, setadd);
+  printf("  lookup avl: %7.2f Mops/s  chunked: %7.2f Mops/s\n", avllook, setlook);
+  avl_interval_free(avl);
+  psync_interval_tree_free(set);
+  psync_free(offs);
+  if (sum){
+    fprintf(stderr, "%s: avl and chunked lookups differ\n", name);
+    return 1;
+  }
+  return 0;
+}
+
+static int bench_intervals(){
+  if (bench_intervals_run("random writes", 1))
+    return 1;
+  return bench_intervals_run("sequential writes", 0);
+}
+
+int main(int argc, char **argv){
+  if (argc!=2){
+    fprintf(stderr, "usage: %s ctr|intervals\n", argv[0]);
+    return 2;
+  }
+  if (!strcmp(argv[1], "ctr"))
+    return bench_ctr();
+  if (!strcmp(argv[1], "intervals"))
+    return bench_intervals();
+  fprintf(stderr, "unknown benchmark %s\n", argv[1]);
+  return 2;
+}
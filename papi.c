@@ -29,6 +29,7 @@
 #include "psynclib.h"
 #include "plibs.h"
 #include "psettings.h"
+#include "pmetrics.h"
 #include <string.h>
 #include <stddef.h>
 
@@ -101,6 +102,9 @@ static const binresult NUM_SMALL[VSMALL_NUMBER_NUM]={
 
 static uint32_t connfailures=0;
 
+PSYNC_METRIC_HISTOGRAM(metric_api_roundtrip, "api_roundtrip_usec");
+PSYNC_METRIC_COUNTER(metric_api_errors, "api_errors");
+
 psync_socket *psync_api_connect(int usessl){
   if (connfailures%5==4)
     return psync_socket_connect(PSYNC_API_AHOST, usessl?PSYNC_API_APORT_SSL:PSYNC_API_APORT, usessl);
@@ -224,7 +228,25 @@ static ssize_t calc_ret_len(unsigned char **restrict data, size_t *restrict data
     return -1;
 }
 
-static binresult *do_parse_result(unsigned char **restrict indata, unsigned char **restrict odata, binresult **restrict strings, size_t *restrict nextstrid){
+/* Elements of the arrays and hashes that are being parsed are collected on a stack shared by all nesting levels, so parsing a
+ * result does not allocate per array or hash.
+ */
+typedef struct {
+  binresult **data;
+  size_t cnt;
+  size_t alloc;
+} parse_stack_t;
+
+static void parse_stack_push(parse_stack_t *stack, binresult *el){
+  if (unlikely(stack->cnt==stack->alloc)){
+    stack->alloc*=2;
+    stack->data=(binresult **)psync_realloc(stack->data, sizeof(binresult *)*stack->alloc);
+  }
+  stack->data[stack->cnt++]=el;
+}
+
+static binresult *do_parse_result(unsigned char **restrict indata, unsigned char **restrict odata, binresult **restrict strings,
+                                  size_t *restrict nextstrid, parse_stack_t *stack){
   binresult *ret;
   long cond;
   psync_uint_t type, len;
@@ -280,59 +302,50 @@ static binresult *do_parse_result(unsigned char **restrict indata, unsigned char
   else if (type==RPARAM_BFALSE)
     return (binresult *)&BOOL_FALSE;
   else if (type==RPARAM_ARRAY){
-    binresult **arr;
-    psync_uint_t cnt, alloc;
+    binresult *el;
+    size_t base, cnt;
     ret=(binresult *)(*odata);
     *odata+=sizeof(binresult);
     ret->type=PARAM_ARRAY;
-    arr=NULL;
-    cnt=0;
-    alloc=128;
-    arr=(binresult **)psync_malloc(sizeof(binresult *)*alloc);
+    base=stack->cnt;
     while (**indata!=RPARAM_END){
-      if (cnt==alloc){
-        alloc*=2;
-        arr=(binresult **)psync_realloc(arr, sizeof(binresult *)*alloc);
-      }
-      arr[cnt++]=do_parse_result(indata, odata, strings, nextstrid);
+      el=do_parse_result(indata, odata, strings, nextstrid, stack);
+      parse_stack_push(stack, el);
     }
     (*indata)++;
+    cnt=stack->cnt-base;
     ret->length=cnt;
     ret->array=(struct _binresult **)*odata;
     *odata+=sizeof(struct _binresult *)*cnt;
-    memcpy(ret->array, arr, sizeof(struct _binresult *)*cnt);
-    psync_free(arr);
+    memcpy(ret->array, stack->data+base, sizeof(struct _binresult *)*cnt);
+    stack->cnt=base;
     return ret;
   }
   else if (type==RPARAM_HASH){
-    struct _hashpair *arr;
-    psync_uint_t cnt, alloc;
-    binresult *key;
+    binresult *key, *value;
+    size_t base, cnt, i;
     ret=(binresult *)(*odata);
     *odata+=sizeof(binresult);
     ret->type=PARAM_HASH;
-    arr=NULL;
-    cnt=0;
-    alloc=32;
-    arr=(struct _hashpair *)psync_malloc(sizeof(struct _hashpair)*alloc);
+    base=stack->cnt;
     while (**indata!=RPARAM_END){
-      if (cnt==alloc){
-        alloc*=2;
-        arr=(struct _hashpair *)psync_realloc(arr, sizeof(struct _hashpair)*alloc);
-      }
-      key=do_parse_result(indata, odata, strings, nextstrid);
-      arr[cnt].value=do_parse_result(indata, odata, strings, nextstrid);
+      key=do_parse_result(indata, odata, strings, nextstrid, stack);
+      value=do_parse_result(indata, odata, strings, nextstrid, stack);
       if (key->type==PARAM_STR){
-        arr[cnt].key=key->str;
-        cnt++;
+        parse_stack_push(stack, key);
+        parse_stack_push(stack, value);
       }
     }
     (*indata)++;
+    cnt=(stack->cnt-base)/2;
     ret->length=cnt;
     ret->hash=(struct _hashpair *)*odata;
     *odata+=sizeof(struct _hashpair)*cnt;
-    memcpy(ret->hash, arr, sizeof(struct _hashpair)*cnt);
-    psync_free(arr);
+    for (i=0; i<cnt; i++){
+      ret->hash[i].key=stack->data[base+i*2]->str;
+      ret->hash[i].value=stack->data[base+i*2+1];
+    }
+    stack->cnt=base;
     return ret;
   }
   else if (type==RPARAM_DATA){
@@ -347,6 +360,7 @@ static binresult *do_parse_result(unsigned char **restrict indata, unsigned char
 }
 
 static binresult *parse_result(unsigned char *data, size_t datalen){
+  parse_stack_t stack;
   unsigned char *datac;
   binresult **strings;
   binresult *res;
@@ -361,7 +375,11 @@ static binresult *parse_result(unsigned char *data, size_t datalen){
   datac=psync_new_cnt(unsigned char, retlen);
   strings=psync_new_cnt(binresult *, strcnt);
   strcnt=0;
-  res=do_parse_result(&data, &datac, strings, &strcnt);
+  stack.alloc=256;
+  stack.cnt=0;
+  stack.data=psync_new_cnt(binresult *, stack.alloc);
+  res=do_parse_result(&data, &datac, strings, &strcnt, &stack);
+  psync_free(stack.data);
   psync_free(strings);
   return res;
 }
@@ -495,27 +513,40 @@ unsigned char *do_prepare_command(const char *command, size_t cmdlen, const binp
   return sdata;
 }
 
+/* round trips are measured only for commands that read the result here, from before the command is sent until the result is
+ * parsed */
 binresult *do_send_command(psync_socket *sock, const char *command, size_t cmdlen, const binparam *params, size_t paramcnt, int64_t datalen, int readres){
   unsigned char *sdata;
+  binresult *res;
+  uint64_t start;
   size_t plen;
+  start=psync_metric_time();
   sdata=do_prepare_command(command, cmdlen, params, paramcnt, datalen, 0, &plen);
   if (!sdata)
     return NULL;
   if (readres&2){
     if (unlikely_log(psync_socket_writeall_thread(sock, sdata, plen)!=plen)){
       psync_free(sdata);
+      psync_metric_inc(&metric_api_errors);
       return NULL;
     }
   }
   else{
     if (unlikely_log(psync_socket_writeall(sock, sdata, plen)!=plen)){
       psync_free(sdata);
+      psync_metric_inc(&metric_api_errors);
       return NULL;
     }
   }
   psync_free(sdata);
-  if (readres&1)
-    return get_result(sock);
+  if (readres&1){
+    res=get_result(sock);
+    if (likely(res))
+      psync_metric_record_since(&metric_api_roundtrip, start);
+    else
+      psync_metric_inc(&metric_api_errors);
+    return res;
+  }
   else
     return PTR_OK;
 }
@@ -29,161 +29,255 @@
 #include "psynclib.h"
 #include "pcache.h"
 #include "ptimer.h"
-#include "plist.h"
 #include "plibs.h"
 #include <string.h>
 
-#define CACHE_HASH_SIZE 2048
-#define CACHE_LOCKS 8
+/* Open addressing hash of CACHE_GROUPS groups with CACHE_GROUP_SIZE slots each. A key is looked up in the group selected by
+ * its hash and, when entries had to spill over, in up to CACHE_PROBE_GROUPS-1 following groups; cache_probe keeps per home
+ * group how many groups are in use. No locks are taken, slots are claimed with compare and swap. As an element that is not
+ * claimed may be freed by another thread at any time, the hash, a second independent hash of the key and the expiration time
+ * are kept in the slot and elements are only dereferenced after they are claimed. Insertion first reserves an empty slot
+ * (CACHE_RESERVED), fills in the hashes and expiration and then publishes the element.
+ *
+ * There are no per-element timers, expired elements are freed when they are met by a lookup or an insert and by a sweep of
+ * the whole table that runs every CACHE_SWEEP_SEC. Live elements are never evicted, if all slots in the probe range are in use
+ * the new element is not cached. So at most CACHE_PROBE_GROUPS*CACHE_GROUP_SIZE elements of one key can be cached, larger
+ * maxkeys are effectively clamped to that.
+ */
+
+#define CACHE_GROUPS 1024
+#define CACHE_GROUP_SIZE 8
+#define CACHE_PROBE_GROUPS 8
+#define CACHE_SWEEP_SEC 5
+#define CACHE_INSERT_RETRIES 16
 
-#define CACHE_WAIT_FOR_TIMER 1
-#define CACHE_TIMER_CALLED   2
+#define CACHE_RESERVED ((hash_element *)&cache_reserved)
 
 typedef struct {
-  psync_list list;
   void *value;
   psync_cache_free_callback free;
-  psync_timer_t timer;
   uint32_t hash;
-  uint32_t opts;
+  uint32_t hash2;
+  uint32_t expires;
   char key[];
 } hash_element;
 
-static psync_list cache_hash[CACHE_HASH_SIZE];
-static pthread_mutex_t cache_mutexes[CACHE_LOCKS];
-static pthread_cond_t cache_cond=PTHREAD_COND_INITIALIZER;
-
-void psync_cache_init(){
-  pthread_mutexattr_t mattr;
-  psync_uint_t i;
-  for (i=0; i<CACHE_HASH_SIZE; i++)
-    psync_list_init(&cache_hash[i]);
-  for (i=0; i<CACHE_LOCKS; i++){
-    pthread_mutexattr_init(&mattr);
-    pthread_mutexattr_settype(&mattr, PTHREAD_MUTEX_RECURSIVE);
-    pthread_mutex_init(&cache_mutexes[i], &mattr);
-    pthread_mutexattr_destroy(&mattr);
-  }
-}
+typedef struct {
+  hash_element *he;
+  uint32_t hash;
+  uint32_t hash2;
+  uint32_t expires;
+} cache_slot;
 
-static psync_uint_t hash_func(const char *key){
-  psync_uint_t c, hash;
-  hash=0;  
-  while ((c=(psync_uint_t)*key++))
-    hash=c+(hash<<5)+hash;
-  hash+=hash<<3;
-  hash-=hash>>7;
-  return hash%CACHE_HASH_SIZE;
-}
+static cache_slot cache_slots[CACHE_GROUPS*CACHE_GROUP_SIZE];
+static uint32_t cache_probe[CACHE_GROUPS];
+static char cache_reserved;
 
-static psync_uint_t hash_funcl(const char *key, size_t *len){
-  psync_uint_t c, hash;
+static uint32_t hash_funcl(const char *key, size_t *len, uint32_t *hash2){
+  uint32_t c, hash, h2;
   size_t l;
   hash=0;
+  h2=2166136261U;
   l=0;
-  while ((c=(psync_uint_t)*key++)){
+  while ((c=(unsigned char)*key++)){
     hash=c+(hash<<5)+hash;
+    h2=(h2^c)*16777619U;
     l++;
   }
   hash+=hash<<3;
-  hash-=hash>>7;
+  hash^=hash>>11;
   *len=l;
-  return hash%CACHE_HASH_SIZE;
+  *hash2=h2^(uint32_t)l;
+  return hash;
+}
+
+static cache_slot *cache_group(uint32_t hash, uint32_t probe){
+  return &cache_slots[((hash+probe)%CACHE_GROUPS)*CACHE_GROUP_SIZE];
+}
+
+static uint32_t cache_probe_groups(uint32_t hash){
+  uint32_t p;
+  p=psync_atomic_load_int(&cache_probe[hash%CACHE_GROUPS]);
+  return p?p:1;
+}
+
+static void cache_raise_probe(uint32_t hash, uint32_t groups){
+  uint32_t p;
+  while ((p=psync_atomic_load_int(&cache_probe[hash%CACHE_GROUPS]))<groups)
+    if (psync_atomic_cas_int(&cache_probe[hash%CACHE_GROUPS], p, groups))
+      break;
+}
+
+static int cache_slot_has_key(cache_slot *slot, uint32_t hash, uint32_t hash2){
+  return psync_atomic_load_int(&slot->hash)==hash && psync_atomic_load_int(&slot->hash2)==hash2;
+}
+
+static uint32_t cache_now(){
+  return (uint32_t)psync_timer_time();
+}
+
+static void cache_free_element(hash_element *he){
+  he->free(he->value);
+  psync_free(he);
+}
+
+/* returns the element that was in the slot if the caller managed to claim it, NULL otherwise */
+static hash_element *cache_claim(cache_slot *slot, hash_element *he){
+  if (psync_atomic_cas_ptr(&slot->he, he, NULL))
+    return he;
+  else
+    return NULL;
+}
+
+static int cache_fill_slot(cache_slot *slot, hash_element *he){
+  if (!psync_atomic_cas_ptr(&slot->he, NULL, CACHE_RESERVED))
+    return -1;
+  psync_atomic_store_int(&slot->hash, he->hash);
+  psync_atomic_store_int(&slot->hash2, he->hash2);
+  psync_atomic_store_int(&slot->expires, he->expires);
+  psync_atomic_store_ptr(&slot->he, he);
+  return 0;
+}
+
+/* Scans all groups in use by the home group of the element (counting elements with the same key) and continues past them
+ * only until a free slot is found. */
+static int cache_insert(hash_element *he, uint32_t maxkeys){
+  cache_slot *group, *empty;
+  hash_element *he2;
+  uint32_t now, cnt, retries, inuse, emptyprobe, j;
+  int i;
+  now=cache_now();
+  retries=0;
+  do {
+    cnt=0;
+    empty=NULL;
+    emptyprobe=0;
+    inuse=cache_probe_groups(he->hash);
+    for (j=0; j<CACHE_PROBE_GROUPS && (j<inuse || !empty); j++){
+      group=cache_group(he->hash, j);
+      for (i=0; i<CACHE_GROUP_SIZE; i++){
+        he2=(hash_element *)psync_atomic_load_ptr(&group[i].he);
+        if (he2==CACHE_RESERVED)
+          continue;
+        if (he2 && psync_atomic_load_int(&group[i].expires)<now && cache_claim(&group[i], he2)){
+          cache_free_element(he2);
+          he2=NULL;
+        }
+        if (!he2){
+          if (!empty){
+            empty=&group[i];
+            emptyprobe=j;
+          }
+          continue;
+        }
+        if (maxkeys && cache_slot_has_key(&group[i], he->hash, he->hash2) && ++cnt==maxkeys)
+          return -1;
+      }
+    }
+    if (!empty)
+      return -1;
+    if (!cache_fill_slot(empty, he)){
+      cache_raise_probe(he->hash, emptyprobe+1);
+      return 0;
+    }
+  } while (++retries<CACHE_INSERT_RETRIES);
+  return -1;
+}
+
+/* Puts a claimed element back to its slot or, if the slot was taken meanwhile, anywhere in its probe range. The element is
+ * owned by the cache, so it is never dropped here. This only happens when two keys collide on both hashes. */
+static void cache_put_back(cache_slot *slot, hash_element *he){
+  while (cache_fill_slot(slot, he) && cache_insert(he, 0))
+    psync_yield_cpu();
+}
+
+/* cache_probe is never lowered, an element of the home group may still be in any of the groups counted there */
+static void cache_sweep_timer(psync_timer_t timer, void *ptr){
+  hash_element *he;
+  uint32_t now, i;
+  now=cache_now();
+  for (i=0; i<CACHE_GROUPS*CACHE_GROUP_SIZE; i++){
+    he=(hash_element *)psync_atomic_load_ptr(&cache_slots[i].he);
+    if (he && he!=CACHE_RESERVED && psync_atomic_load_int(&cache_slots[i].expires)<now && cache_claim(&cache_slots[i], he))
+      cache_free_element(he);
+  }
+}
+
+void psync_cache_init(){
+  psync_timer_register(cache_sweep_timer, CACHE_SWEEP_SEC, NULL);
 }
 
 void *psync_cache_get(const char *key){
-  psync_uint_t h;
+  cache_slot *group;
   hash_element *he;
   void *val;
-  if (IS_DEBUG && !strcmp(psync_thread_name, "timer"))
-    debug(D_ERROR, "trying get key %s from the timer thread, this may (and eventually will) lead to a deadlock, "
-                   "please start a worker thread to do the job or don't use cache (if you are looking up sql "
-                   "query/statement, you can use _nocache version)", key);
-
-  h=hash_func(key);
-//  debug(D_NOTICE, "get %s %lu", key, h);
-  pthread_mutex_lock(&cache_mutexes[h%CACHE_LOCKS]);
-  psync_list_for_each_element (he, &cache_hash[h], hash_element, list)
-    if (!strcmp(key, he->key)){
-      psync_list_del(&he->list);
-      if (psync_timer_stop(he->timer)){
-        he->opts|=CACHE_WAIT_FOR_TIMER;
-        do {
-          pthread_cond_wait(&cache_cond, &cache_mutexes[h%CACHE_LOCKS]);
-        } while (!(he->opts&CACHE_TIMER_CALLED));
+  size_t l;
+  uint32_t h, h2, now, j, inuse;
+  int i;
+  h=hash_funcl(key, &l, &h2);
+  inuse=cache_probe_groups(h);
+  now=cache_now();
+  for (j=0; j<inuse; j++){
+    group=cache_group(h, j);
+    for (i=0; i<CACHE_GROUP_SIZE; i++){
+      he=(hash_element *)psync_atomic_load_ptr(&group[i].he);
+      if (!he || he==CACHE_RESERVED || !cache_slot_has_key(&group[i], h, h2) || !cache_claim(&group[i], he))
+        continue;
+      if (unlikely(he->expires<now)){
+        cache_free_element(he);
+        continue;
+      }
+      if (unlikely(strcmp(key, he->key))){
+        cache_put_back(&group[i], he);
+        continue;
       }
-      pthread_mutex_unlock(&cache_mutexes[h%CACHE_LOCKS]);
       val=he->value;
       psync_free(he);
       return val;
     }
-  pthread_mutex_unlock(&cache_mutexes[h%CACHE_LOCKS]);
+  }
   return NULL;
 }
 
+/* Does not claim anything, so concurrent gets never miss an element because of it. Keys are matched by their two hashes only,
+ * which is fine for a hint whether a get is worth it. */
 int psync_cache_has(const char *key){
+  cache_slot *group;
   hash_element *he;
-  psync_uint_t h;
-  int ret;
-  h=hash_func(key);
-  ret=0;
-  pthread_mutex_lock(&cache_mutexes[h%CACHE_LOCKS]);
-  psync_list_for_each_element (he, &cache_hash[h], hash_element, list)
-    if (!strcmp(key, he->key)){
-      ret=1;
-      break;
+  size_t l;
+  uint32_t h, h2, now, j, inuse;
+  int i;
+  h=hash_funcl(key, &l, &h2);
+  inuse=cache_probe_groups(h);
+  now=cache_now();
+  for (j=0; j<inuse; j++){
+    group=cache_group(h, j);
+    for (i=0; i<CACHE_GROUP_SIZE; i++){
+      he=(hash_element *)psync_atomic_load_ptr(&group[i].he);
+      if (he && he!=CACHE_RESERVED && cache_slot_has_key(&group[i], h, h2) && psync_atomic_load_int(&group[i].expires)>=now)
+        return 1;
     }
-  pthread_mutex_unlock(&cache_mutexes[h%CACHE_LOCKS]);
-  return ret;
-}
-
-static void cache_timer(psync_timer_t timer, void *ptr){
-  hash_element *he=(hash_element *)ptr;
-  pthread_mutex_lock(&cache_mutexes[he->hash%CACHE_LOCKS]);
-  if (unlikely(he->opts&CACHE_WAIT_FOR_TIMER)){
-    he->opts|=CACHE_TIMER_CALLED;
-    pthread_cond_broadcast(&cache_cond);
-    pthread_mutex_unlock(&cache_mutexes[he->hash%CACHE_LOCKS]);
-  }
-  else{
-    psync_list_del(&he->list);
-    pthread_mutex_unlock(&cache_mutexes[he->hash%CACHE_LOCKS]);
-    he->free(he->value);
-    psync_free(he);
-    psync_timer_stop(timer);
   }
+  return 0;
 }
 
 void psync_cache_add(const char *key, void *ptr, time_t freeafter, psync_cache_free_callback freefunc, uint32_t maxkeys){
-  psync_uint_t h;
+  hash_element *he;
   size_t l;
-  hash_element *he, *he2;
-  h=hash_funcl(key, &l);
+  uint32_t h, h2;
+  h=hash_funcl(key, &l, &h2);
   l++;
   he=(hash_element *)psync_malloc(offsetof(hash_element, key)+l);
   he->value=ptr;
   he->free=freefunc;
   he->hash=h;
-  he->opts=0;
+  he->hash2=h2;
+  he->expires=cache_now()+freeafter;
   memcpy(he->key, key, l);
-  pthread_mutex_lock(&cache_mutexes[h%CACHE_LOCKS]);
-  if (maxkeys){
-    l=0;
-    psync_list_for_each_element (he2, &cache_hash[h], hash_element, list)
-      if (!strcmp(key, he2->key) && ++l==maxkeys){
-        pthread_mutex_unlock(&cache_mutexes[h%CACHE_LOCKS]);
-        psync_free(he);
-        freefunc(ptr);
-        debug(D_NOTICE, "not adding key %s to cache as there already %u elements present", key, (unsigned int)maxkeys);
-        return;
-      }
+  if (cache_insert(he, maxkeys)){
+    debug(D_NOTICE, "not adding key %s to cache as there already %u elements present or no free slot was found", key, (unsigned int)maxkeys);
+    cache_free_element(he);
   }
-  /* adding to head should be better than to the tail: more recent objects are likely to be in processor cache, more recent
-   * connections are likely to be "faster" (e.g. futher from idle slowstart reset)
-   */
-  psync_list_add_head(&cache_hash[h], &he->list);
-  he->timer=psync_timer_register(cache_timer, freeafter, he);
-  pthread_mutex_unlock(&cache_mutexes[h%CACHE_LOCKS]);
 }
 
 void psync_cache_add_free(char *key, void *ptr, time_t freeafter, psync_cache_free_callback freefunc, uint32_t maxkeys){
@@ -192,19 +286,11 @@ void psync_cache_add_free(char *key, void *ptr, time_t freeafter, psync_cache_fr
 }
 
 void psync_cache_clean_all(){
-  psync_list *l1, *l2;
   hash_element *he;
-  psync_uint_t h;
-  for (h=0; h<CACHE_HASH_SIZE; h++){
-    pthread_mutex_lock(&cache_mutexes[h%CACHE_LOCKS]);
-    psync_list_for_each_safe(l1, l2, &cache_hash[h]){
-      he=psync_list_element(l1, hash_element, list);
-      if (!psync_timer_stop(he->timer)){
-        psync_list_del(l1);
-        he->free(he->value);
-        psync_free(he);
-      }
-    }
-    pthread_mutex_unlock(&cache_mutexes[h%CACHE_LOCKS]);
+  uint32_t i;
+  for (i=0; i<CACHE_GROUPS*CACHE_GROUP_SIZE; i++){
+    he=(hash_element *)psync_atomic_load_ptr(&cache_slots[i].he);
+    if (he && he!=CACHE_RESERVED && cache_claim(&cache_slots[i], he))
+      cache_free_element(he);
   }
-}
\ No newline at end of file
+}
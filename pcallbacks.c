@@ -31,29 +31,54 @@
 #include "plibs.h"
 #include "plist.h"
 #include "pfolder.h"
+#include "psettings.h"
+#include "pmem.h"
+#include "pmetrics.h"
 
 static pthread_mutex_t statusmutex=PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t statuscond=PTHREAD_COND_INITIALIZER;
 static int statuschanges=0;
 static int statusthreadrunning=0;
 
-static pthread_mutex_t eventmutex=PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t eventcond=PTHREAD_COND_INITIALIZER;
-static psync_list eventlist;
+static psync_mpsc_queue eventqueue=PSYNC_MPSC_STATIC_INIT(eventqueue);
 static int eventthreadrunning=0;
 
+PSYNC_METRIC_GAUGE(metric_event_queue, "event_queue_depth");
+
+#define EVENT_DATA_INLINE 0
+#define EVENT_DATA_FREE   1
+#define EVENT_DATA_BY_ID  2
+
 typedef struct {
-  psync_list list;
+  psync_mpsc_node node;
   psync_eventdata_t data;
   psync_eventtype_t event;
   int freedata;
 } event_list_t;
 
+/* events queued by id only carry the local path, the remote path is resolved by the event thread right before delivery so
+ * producers (usually holding the sql lock) do not pay for walking the folder tree */
+typedef struct {
+  event_list_t ev;
+  psync_fileorfolderid_t remoteid;
+  psync_syncid_t syncid;
+  char localpath[];
+} event_by_id_t;
+
+PSYNC_SLAB(event_slab, event_list_t);
+
+typedef struct {
+  pevent_callback_t callback;
+  pevent_batch_callback_t batch_callback;
+} event_callbacks_t;
+
 static void status_change_thread(void *ptr){
   pstatus_change_callback_t callback=(pstatus_change_callback_t)ptr;
+  pstatus_t last;
+  memset(&last, 0, sizeof(last));
   while (1){
-    // Maximum 10 updates/sec
-    psync_milisleep(100);
+    // Maximum 1000/PSYNC_STATUS_UPDATE_INTERVAL_MS updates/sec
+    psync_milisleep(PSYNC_STATUS_UPDATE_INTERVAL_MS);
     pthread_mutex_lock(&statusmutex);
     while (statuschanges<=0){
       statuschanges=-1;
@@ -63,7 +88,11 @@ static void status_change_thread(void *ptr){
     pthread_mutex_unlock(&statusmutex);
     if (!psync_do_run)
       break;
-    callback(&psync_status);
+    // updates that did not change anything by the time we got to them are merged into the previous one
+    if (!memcmp(&last, &psync_status, sizeof(pstatus_t)))
+      continue;
+    memcpy(&last, &psync_status, sizeof(pstatus_t));
+    callback(&last);
   }
 }
 
@@ -85,116 +114,179 @@ void psync_send_status_update(){
   }
 }
 
+static psync_eventdata_t event_build_data(psync_eventtype_t eventid, psync_syncid_t syncid, const char *localpath,
+                                          psync_fileorfolderid_t remoteid, const char *remotepath){
+  psync_eventdata_t data;
+  size_t llen, rlen, slen;
+  char *lcopy, *rcopy, *name;
+  llen=strlen(localpath)+1;
+  rlen=strlen(remotepath)+1;
+  if (eventid&PEVENT_TYPE_FOLDER)
+    slen=sizeof(psync_folder_event_t);
+  else
+    slen=sizeof(psync_file_event_t);
+  data.ptr=psync_malloc(slen+llen+rlen);
+  lcopy=(char *)data.ptr+slen;
+  rcopy=lcopy+llen;
+  memcpy(lcopy, localpath, llen);
+  memcpy(rcopy, remotepath, rlen);
+  name=strrchr(rcopy, '/')+1;
+  if (eventid&PEVENT_TYPE_FOLDER){
+    data.folder->folderid=remoteid;
+    data.folder->name=name;
+    data.folder->localpath=lcopy;
+    data.folder->remotepath=rcopy;
+    data.folder->syncid=syncid;
+  }
+  else{
+    data.file->fileid=remoteid;
+    data.file->name=name;
+    data.file->localpath=lcopy;
+    data.file->remotepath=rcopy;
+    data.file->syncid=syncid;
+  }
+  return data;
+}
+
+static int event_resolve_by_id(event_by_id_t *e){
+  char *remotepath;
+  if (e->ev.event&PEVENT_TYPE_FOLDER)
+    remotepath=psync_get_path_by_folderid(e->remoteid, NULL);
+  else
+    remotepath=psync_get_path_by_fileid(e->remoteid, NULL);
+  if (unlikely_log(!remotepath))
+    return -1;
+  e->ev.data=event_build_data(e->ev.event, e->syncid, e->localpath, e->remoteid, remotepath);
+  psync_free(remotepath);
+  return 0;
+}
+
+static void event_free(event_list_t *event){
+  if (event->freedata!=EVENT_DATA_INLINE)
+    psync_free(event->data.ptr);
+  if (event->freedata==EVENT_DATA_BY_ID)
+    psync_free(event);
+  else
+    psync_slab_free(&event_slab, event);
+}
+
+static void event_queue(event_list_t *event){
+  psync_metric_gauge_add(&metric_event_queue, 1);
+  psync_mpsc_push(&eventqueue, &event->node);
+}
+
 static void event_thread(void *ptr){
-  pevent_callback_t callback=(pevent_callback_t)ptr;
+  event_callbacks_t *callbacks=(event_callbacks_t *)ptr;
+  psync_event_t *events;
+  event_list_t **batch;
   event_list_t *event;
+  psync_mpsc_node *node;
+  uint32_t bcnt, cnt, i;
+  events=psync_new_cnt(psync_event_t, PSYNC_EVENT_MAX_BATCH);
+  batch=psync_new_cnt(event_list_t *, PSYNC_EVENT_MAX_BATCH);
   while (1){
-    pthread_mutex_lock(&eventmutex);
-    while (psync_list_isempty(&eventlist))
-      pthread_cond_wait(&eventcond, &eventmutex);
-    event=psync_list_remove_head_element(&eventlist, event_list_t, list);
-    pthread_mutex_unlock(&eventmutex);
+    node=psync_mpsc_wait(&eventqueue);
+    if (unlikely(!node))
+      continue;
+    if (callbacks->batch_callback)
+      psync_milisleep(PSYNC_EVENT_BATCH_WINDOW_MS);
+    bcnt=0;
+    do {
+      batch[bcnt++]=psync_list_element(node, event_list_t, node);
+    } while (bcnt<PSYNC_EVENT_MAX_BATCH && (node=psync_mpsc_pop(&eventqueue)));
+    psync_metric_gauge_add(&metric_event_queue, -(int64_t)bcnt);
     if (!psync_do_run)
       break;
-    callback(event->event, event->data);
-    if (event->freedata)
-      psync_free(event->data.ptr);
-    psync_free(event);
+    cnt=0;
+    for (i=0; i<bcnt; i++){
+      event=batch[i];
+      if (event->freedata==EVENT_DATA_BY_ID){
+        if (event_resolve_by_id((event_by_id_t *)event)){
+          event->data.ptr=NULL;
+          continue;
+        }
+      }
+      events[cnt].event=event->event;
+      events[cnt].data=event->data;
+      cnt++;
+    }
+    if (callbacks->batch_callback){
+      if (cnt)
+        callbacks->batch_callback(events, cnt);
+    }
+    else
+      for (i=0; i<cnt; i++)
+        callbacks->callback(events[i].event, events[i].data);
+    for (i=0; i<bcnt; i++)
+      event_free(batch[i]);
   }
 }
 
-void psync_set_event_callback(pevent_callback_t callback){
+static void start_event_thread(pevent_callback_t callback, pevent_batch_callback_t batch_callback){
+  event_callbacks_t *callbacks;
+  callbacks=psync_new(event_callbacks_t);
+  callbacks->callback=callback;
+  callbacks->batch_callback=batch_callback;
   pthread_mutex_lock(&statusmutex);
   eventthreadrunning=1;
   pthread_mutex_unlock(&statusmutex);
-  psync_list_init(&eventlist);
-  psync_run_thread1("event", event_thread, callback);
+  psync_run_thread1("event", event_thread, callbacks);
+}
+
+void psync_set_event_callback(pevent_callback_t callback){
+  start_event_thread(callback, NULL);
+}
+
+void psync_set_event_batch_callback(pevent_batch_callback_t callback){
+  start_event_thread(NULL, callback);
 }
 
 void psync_send_event_by_id(psync_eventtype_t eventid, psync_syncid_t syncid, const char *localpath, psync_fileorfolderid_t remoteid){
   if (eventthreadrunning){
-    char *remotepath;
-    if (eventid&PEVENT_TYPE_FOLDER)
-      remotepath=psync_get_path_by_folderid(remoteid, NULL);
-    else
-      remotepath=psync_get_path_by_fileid(remoteid, NULL);
-    if (unlikely_log(!remotepath))
-      return;
-    psync_send_event_by_path(eventid, syncid, localpath, remoteid, remotepath);
-    psync_free(remotepath);
+    event_by_id_t *event;
+    size_t llen;
+    llen=strlen(localpath)+1;
+    event=(event_by_id_t *)psync_malloc(offsetof(event_by_id_t, localpath)+llen);
+    event->ev.data.ptr=NULL;
+    event->ev.event=eventid;
+    event->ev.freedata=EVENT_DATA_BY_ID;
+    event->remoteid=remoteid;
+    event->syncid=syncid;
+    memcpy(event->localpath, localpath, llen);
+    event_queue(&event->ev);
   }
 }
 
 void psync_send_event_by_path(psync_eventtype_t eventid, psync_syncid_t syncid, const char *localpath, psync_fileorfolderid_t remoteid, const char *remotepath){
   if (eventthreadrunning){
     event_list_t *event;
-    size_t llen, rlen, slen;
-    char *lcopy, *rcopy, *strct, *name;
-    llen=strlen(localpath)+1;
-    rlen=strlen(remotepath)+1;
-    if (eventid&PEVENT_TYPE_FOLDER)
-      slen=sizeof(psync_file_event_t);
-    else
-      slen=sizeof(psync_folder_event_t);
-    event=(event_list_t *)psync_malloc(sizeof(event_list_t)+slen+llen+rlen);
-    strct=(char *)(event+1);
-    lcopy=strct+slen;
-    rcopy=lcopy+llen;
-    memcpy(lcopy, localpath, llen);
-    memcpy(rcopy, remotepath, rlen);
-    name=strrchr(rcopy, '/')+1;
-    if (eventid&PEVENT_TYPE_FOLDER){
-      psync_folder_event_t *f=(psync_folder_event_t *)strct;
-      f->folderid=remoteid;
-      f->name=name;
-      f->localpath=lcopy;
-      f->remotepath=rcopy;
-      f->syncid=syncid;
-      event->data.folder=f;
-    }
-    else{
-      psync_file_event_t *f=(psync_file_event_t *)strct;
-      f->fileid=remoteid;
-      f->name=name;
-      f->localpath=lcopy;
-      f->remotepath=rcopy;
-      f->syncid=syncid;
-      event->data.file=f;
-    }
+    event=(event_list_t *)psync_slab_alloc(&event_slab);
+    event->data=event_build_data(eventid, syncid, localpath, remoteid, remotepath);
     event->event=eventid;
-    event->freedata=0;
-    pthread_mutex_lock(&eventmutex);
-    psync_list_add_tail(&eventlist, &event->list);
-    pthread_cond_signal(&eventcond);
-    pthread_mutex_unlock(&eventmutex);
+    event->freedata=EVENT_DATA_FREE;
+    event_queue(event);
   }
 }
 
 void psync_send_eventid(psync_eventtype_t eventid){
   if (eventthreadrunning){
     event_list_t *event;
-    event=psync_new(event_list_t);
+    event=(event_list_t *)psync_slab_alloc(&event_slab);
     event->data.ptr=NULL;
     event->event=eventid;
-    event->freedata=0;    
-    pthread_mutex_lock(&eventmutex);
-    psync_list_add_tail(&eventlist, &event->list);
-    pthread_cond_signal(&eventcond);
-    pthread_mutex_unlock(&eventmutex);
+    event->freedata=EVENT_DATA_INLINE;
+    event_queue(event);
   }
 }
 
 void psync_send_eventdata(psync_eventtype_t eventid, void *eventdata){
   if (eventthreadrunning){
     event_list_t *event;
-    event=psync_new(event_list_t);
+    event=(event_list_t *)psync_slab_alloc(&event_slab);
     event->data.ptr=eventdata;
     event->event=eventid;
-    event->freedata=1;
-    pthread_mutex_lock(&eventmutex);
-    psync_list_add_tail(&eventlist, &event->list);
-    pthread_cond_signal(&eventcond);
-    pthread_mutex_unlock(&eventmutex);
+    event->freedata=EVENT_DATA_FREE;
+    event_queue(event);
   }
   else
     psync_free(eventdata);
@@ -36,6 +36,7 @@
 #include "psettings.h"
 #include "pssl.h"
 #include "ptimer.h"
+#include "pmetrics.h"
 
 #if defined(P_OS_LINUX)
 #include <sys/sysinfo.h>
@@ -445,6 +446,20 @@ void psync_milisleep(uint64_t millisec){
 #endif
 }
 
+uint32_t psync_get_cpu_count(){
+#if defined(P_OS_POSIX) && defined(_SC_NPROCESSORS_ONLN)
+  long cnt;
+  cnt=sysconf(_SC_NPROCESSORS_ONLN);
+  return cnt>0?cnt:1;
+#elif defined(P_OS_WINDOWS)
+  SYSTEM_INFO si;
+  GetSystemInfo(&si);
+  return si.dwNumberOfProcessors?si.dwNumberOfProcessors:1;
+#else
+  return 1;
+#endif
+}
+
 time_t psync_time(){
 #if defined(P_OS_MACOSX)
   struct timeval tv;
@@ -1104,11 +1119,17 @@ static int wait_sock_ready_for_ssl(psync_socket_t sock){
   return SOCKET_ERROR;
 }
 
+PSYNC_METRIC_HISTOGRAM(metric_connect_time, "net_connect_usec");
+PSYNC_METRIC_HISTOGRAM(metric_conn_bytes_read, "net_connection_bytes_read");
+PSYNC_METRIC_HISTOGRAM(metric_conn_bytes_written, "net_connection_bytes_written");
+
 psync_socket *psync_socket_connect(const char *host, int unsigned port, int ssl){
   psync_socket *ret;
   void *sslc;
+  uint64_t start;
   psync_socket_t sock;
   char sport[24];
+  start=psync_metric_time();
   sprintf(sport, "%d", port);
   sock=connect_socket(host, sport);
   if (unlikely_log(sock==INVALID_SOCKET))
@@ -1131,12 +1152,21 @@ psync_socket *psync_socket_connect(const char *host, int unsigned port, int ssl)
     sslc=NULL;
   ret=psync_new(psync_socket);
   ret->ssl=sslc;
+  ret->bytesread=0;
+  ret->byteswritten=0;
   ret->sock=sock;
   ret->pending=0;
+  psync_metric_record_since(&metric_connect_time, start);
   return ret;
 }
 
+static void psync_socket_record_bytes(psync_socket *sock){
+  psync_metric_record(&metric_conn_bytes_read, sock->bytesread);
+  psync_metric_record(&metric_conn_bytes_written, sock->byteswritten);
+}
+
 void psync_socket_close(psync_socket *sock){
+  psync_socket_record_bytes(sock);
   if (sock->ssl)
     while (psync_ssl_shutdown(sock->ssl)==PSYNC_SSL_NEED_FINISH)
       if (wait_sock_ready_for_ssl(sock->sock)){
@@ -1148,6 +1178,7 @@ void psync_socket_close(psync_socket *sock){
 }
 
 void psync_socket_close_bad(psync_socket *sock){
+  psync_socket_record_bytes(sock);
   if (sock->ssl)
     psync_ssl_free(sock->ssl);
   psync_close_socket(sock->sock);
@@ -1287,10 +1318,14 @@ static int psync_socket_read_plain(psync_socket *sock, void *buff, int num){
 }
 
 int psync_socket_read(psync_socket *sock, void *buff, int num){
+  int r;
   if (sock->ssl)
-    return psync_socket_read_ssl(sock, buff, num);
+    r=psync_socket_read_ssl(sock, buff, num);
   else
-    return psync_socket_read_plain(sock, buff, num);
+    r=psync_socket_read_plain(sock, buff, num);
+  if (r>0)
+    sock->bytesread+=r;
+  return r;
 }
 
 static int psync_socket_read_noblock_ssl(psync_socket *sock, void *buff, int num){
@@ -1324,10 +1359,14 @@ static int psync_socket_read_noblock_plain(psync_socket *sock, void *buff, int n
 }
 
 int psync_socket_read_noblock(psync_socket *sock, void *buff, int num){
+  int r;
   if (sock->ssl)
-    return psync_socket_read_noblock_ssl(sock, buff, num);
+    r=psync_socket_read_noblock_ssl(sock, buff, num);
   else
-    return psync_socket_read_noblock_plain(sock, buff, num);
+    r=psync_socket_read_noblock_plain(sock, buff, num);
+  if (r>0)
+    sock->bytesread+=r;
+  return r;
 }
 
 static int psync_socket_read_ssl_thread(psync_socket *sock, void *buff, int num){
@@ -1378,10 +1417,14 @@ static int psync_socket_read_plain_thread(psync_socket *sock, void *buff, int nu
 }
 
 int psync_socket_read_thread(psync_socket *sock, void *buff, int num){
+  int r;
   if (sock->ssl)
-    return psync_socket_read_ssl_thread(sock, buff, num);
+    r=psync_socket_read_ssl_thread(sock, buff, num);
   else
-    return psync_socket_read_plain_thread(sock, buff, num);
+    r=psync_socket_read_plain_thread(sock, buff, num);
+  if (r>0)
+    sock->bytesread+=r;
+  return r;
 }
 
 
@@ -1407,6 +1450,7 @@ int psync_socket_write(psync_socket *sock, const void *buff, int num){
         return -1;
     }
   }
+  sock->byteswritten+=r;
   return r;
 }
 
@@ -1460,10 +1504,14 @@ static int psync_socket_readall_plain(psync_socket *sock, void *buff, int num){
 }
 
 int psync_socket_readall(psync_socket *sock, void *buff, int num){
+  int r;
   if (sock->ssl)
-    return psync_socket_readall_ssl(sock, buff, num);
+    r=psync_socket_readall_ssl(sock, buff, num);
   else
-    return psync_socket_readall_plain(sock, buff, num);
+    r=psync_socket_readall_plain(sock, buff, num);
+  if (r>0)
+    sock->bytesread+=r;
+  return r;
 }
 
 
@@ -1512,10 +1560,14 @@ static int psync_socket_writeall_plain(psync_socket_t sock, const void *buff, in
 }
 
 int psync_socket_writeall(psync_socket *sock, const void *buff, int num){
+  int r;
   if (sock->ssl)
-    return psync_socket_writeall_ssl(sock, buff, num);
+    r=psync_socket_writeall_ssl(sock, buff, num);
   else
-    return psync_socket_writeall_plain(sock->sock, buff, num);
+    r=psync_socket_writeall_plain(sock->sock, buff, num);
+  if (r>0)
+    sock->byteswritten+=r;
+  return r;
 }
 
 static int psync_socket_readall_ssl_thread(psync_socket *sock, void *buff, int num){
@@ -1575,10 +1627,14 @@ static int psync_socket_readall_plain_thread(psync_socket *sock, void *buff, int
 }
 
 int psync_socket_readall_thread(psync_socket *sock, void *buff, int num){
+  int r;
   if (sock->ssl)
-    return psync_socket_readall_ssl_thread(sock, buff, num);
+    r=psync_socket_readall_ssl_thread(sock, buff, num);
   else
-    return psync_socket_readall_plain_thread(sock, buff, num);
+    r=psync_socket_readall_plain_thread(sock, buff, num);
+  if (r>0)
+    sock->bytesread+=r;
+  return r;
 }
 
 
@@ -1631,10 +1687,14 @@ static int psync_socket_writeall_plain_thread(psync_socket_t sock, const void *b
 }
 
 int psync_socket_writeall_thread(psync_socket *sock, const void *buff, int num){
+  int r;
   if (sock->ssl)
-    return psync_socket_writeall_ssl_thread(sock, buff, num);
+    r=psync_socket_writeall_ssl_thread(sock, buff, num);
   else
-    return psync_socket_writeall_plain_thread(sock->sock, buff, num);
+    r=psync_socket_writeall_plain_thread(sock->sock, buff, num);
+  if (r>0)
+    sock->byteswritten+=r;
+  return r;
 }
 
 psync_interface_list_t *psync_list_ip_adapters(){
@@ -2392,6 +2452,32 @@ ssize_t psync_file_pwrite(psync_file_t fd, const void *buf, size_t count, uint64
 #endif
 }
 
+ssize_t psync_file_pwritev(psync_file_t fd, const psync_iovec_t *iov, int iovcnt, uint64_t offset){
+#if defined(P_OS_LINUX)
+  ssize_t ret;
+  do {
+    ret=pwritev(fd, iov, iovcnt, offset);
+  } while (unlikely(ret==-1 && errno==EINTR));
+  if (unlikely(ret==-1))
+    debug(D_NOTICE, "got error %d", (int)errno);
+  return ret;
+#else
+  ssize_t ret, wr;
+  int i;
+  ret=0;
+  for (i=0; i<iovcnt; i++){
+    wr=psync_file_pwrite(fd, iov[i].iov_base, iov[i].iov_len, offset);
+    if (wr==-1)
+      return ret?ret:-1;
+    ret+=wr;
+    offset+=wr;
+    if (wr!=iov[i].iov_len)
+      break;
+  }
+  return ret;
+#endif
+}
+
 int64_t psync_file_seek(psync_file_t fd, uint64_t offset, int whence){
 #if defined(P_OS_POSIX)
   return lseek(fd, offset, whence);
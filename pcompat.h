@@ -131,8 +131,12 @@ typedef unsigned long psync_uint_t;
 #include <fcntl.h>
 #include <inttypes.h>
 #include <unistd.h>
+#include <sys/uio.h>
 
 #define P_PRI_U64 PRIu64
+#define P_PRI_I64 PRId64
+
+typedef struct iovec psync_iovec_t;
 
 #define psync_stat stat
 #define psync_fstat fstat
@@ -230,10 +234,12 @@ typedef int psync_file_t;
 #if defined(__GNUC__)
 #define psync_def_var_arr(name, type, size) type name[size]
 #define P_PRI_U64 "I64u"
+#define P_PRI_I64 "I64d"
 #else
 #include <malloc.h>
 #define psync_def_var_arr(name, type, size) type *name = (type *)alloca(sizeof(type)*size)
 #define P_PRI_U64 "llu"
+#define P_PRI_I64 "lld"
 
 #define atoll _atoi64
 #define snprintf _snprintf
@@ -243,6 +249,11 @@ typedef int psync_file_t;
 typedef SSIZE_T ssize_t;
 #endif
 
+typedef struct {
+  void *iov_base;
+  size_t iov_len;
+} psync_iovec_t;
+
 #define psync_filetime_to_timet(ft) ((time_t)(psync_32to64((ft)->dwHighDateTime, (ft)->dwLowDateTime)/10000000ULL-11644473600ULL))
 #define psync_filetime64_to_timet(ft) ((time_t)((ft)/10000000ULL-11644473600ULL))
 
@@ -318,6 +329,8 @@ typedef HANDLE psync_file_t;
 
 typedef struct {
   void *ssl;
+  uint64_t bytesread;
+  uint64_t byteswritten;
   psync_socket_t sock;
   int pending;
 } psync_socket;
@@ -390,6 +403,7 @@ char *psync_get_home_dir();
 void psync_run_thread(const char *name, psync_thread_start0 run);
 void psync_run_thread1(const char *name, psync_thread_start1 run, void *ptr);
 void psync_milisleep(uint64_t millisec);
+uint32_t psync_get_cpu_count();
 time_t psync_time();
 void psync_nanotime(struct timespec *tm);
 void psync_yield_cpu();
@@ -450,6 +464,7 @@ ssize_t psync_file_read(psync_file_t fd, void *buf, size_t count);
 ssize_t psync_file_pread(psync_file_t fd, void *buf, size_t count, uint64_t offset);
 ssize_t psync_file_write(psync_file_t fd, const void *buf, size_t count);
 ssize_t psync_file_pwrite(psync_file_t fd, const void *buf, size_t count, uint64_t offset);
+ssize_t psync_file_pwritev(psync_file_t fd, const psync_iovec_t *iov, int iovcnt, uint64_t offset);
 int64_t psync_file_seek(psync_file_t fd, uint64_t offset, int whence);
 int psync_file_truncate(psync_file_t fd);
 int64_t psync_file_size(psync_file_t fd) PSYNC_PURE;
@@ -126,6 +126,39 @@
 #define restrict
 #endif
 
+#if defined(__ATOMIC_SEQ_CST)
+#define psync_atomic_xchg_ptr(ptr, val) __atomic_exchange_n(ptr, val, __ATOMIC_SEQ_CST)
+#define psync_atomic_load_ptr(ptr) __atomic_load_n(ptr, __ATOMIC_SEQ_CST)
+#define psync_atomic_xchg_int(ptr, val) __atomic_exchange_n(ptr, val, __ATOMIC_SEQ_CST)
+#define psync_atomic_load_int(ptr) __atomic_load_n(ptr, __ATOMIC_SEQ_CST)
+#define psync_atomic_store_ptr(ptr, val) __atomic_store_n(ptr, val, __ATOMIC_SEQ_CST)
+#define psync_atomic_store_int(ptr, val) __atomic_store_n(ptr, val, __ATOMIC_SEQ_CST)
+#define psync_atomic_cas_int(ptr, oldval, newval) __sync_bool_compare_and_swap(ptr, oldval, newval)
+#define psync_atomic_cas_ptr(ptr, oldval, newval) __sync_bool_compare_and_swap(ptr, oldval, newval)
+#define psync_atomic_add_uint64(ptr, val) ((void)__atomic_fetch_add(ptr, val, __ATOMIC_SEQ_CST))
+#elif defined(__GNUC__)
+#define psync_atomic_xchg_ptr(ptr, val) (__sync_synchronize(), __sync_lock_test_and_set(ptr, val))
+#define psync_atomic_load_ptr(ptr) __sync_val_compare_and_swap(ptr, NULL, NULL)
+#define psync_atomic_xchg_int(ptr, val) (__sync_synchronize(), __sync_lock_test_and_set(ptr, val))
+#define psync_atomic_load_int(ptr) __sync_val_compare_and_swap(ptr, 0, 0)
+#define psync_atomic_store_ptr(ptr, val) do {__sync_synchronize(); *(ptr)=(val); __sync_synchronize();} while (0)
+#define psync_atomic_store_int(ptr, val) do {__sync_synchronize(); *(ptr)=(val); __sync_synchronize();} while (0)
+#define psync_atomic_cas_int(ptr, oldval, newval) __sync_bool_compare_and_swap(ptr, oldval, newval)
+#define psync_atomic_cas_ptr(ptr, oldval, newval) __sync_bool_compare_and_swap(ptr, oldval, newval)
+#define psync_atomic_add_uint64(ptr, val) ((void)__sync_fetch_and_add(ptr, val))
+#elif defined(_MSC_VER)
+#include <intrin.h>
+#define psync_atomic_xchg_ptr(ptr, val) _InterlockedExchangePointer((void *volatile *)(ptr), val)
+#define psync_atomic_load_ptr(ptr) _InterlockedCompareExchangePointer((void *volatile *)(ptr), NULL, NULL)
+#define psync_atomic_xchg_int(ptr, val) _InterlockedExchange((volatile long *)(ptr), val)
+#define psync_atomic_load_int(ptr) _InterlockedCompareExchange((volatile long *)(ptr), 0, 0)
+#define psync_atomic_store_ptr(ptr, val) ((void)_InterlockedExchangePointer((void *volatile *)(ptr), val))
+#define psync_atomic_store_int(ptr, val) ((void)_InterlockedExchange((volatile long *)(ptr), val))
+#define psync_atomic_cas_int(ptr, oldval, newval) (_InterlockedCompareExchange((volatile long *)(ptr), newval, oldval)==(long)(oldval))
+#define psync_atomic_cas_ptr(ptr, oldval, newval) (_InterlockedCompareExchangePointer((void *volatile *)(ptr), newval, oldval)==(void *)(oldval))
+#define psync_atomic_add_uint64(ptr, val) ((void)_InterlockedExchangeAdd64((volatile __int64 *)(ptr), val))
+#endif
+
 #if defined(__clang__) || defined(_MSC_VER)
 #define psync_alignof __alignof
 #elif defined(__GNUC__)
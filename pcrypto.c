@@ -27,36 +27,13 @@
 
 #include "plibs.h"
 #include "pcrypto.h"
+#include "psettings.h"
 #include <string.h>
 
-typedef struct {
-  psync_sha1_ctx sha1ctx;
-  unsigned char final[PSYNC_SHA1_BLOCK_LEN+PSYNC_SHA1_DIGEST_LEN];
-} psync_hmac_sha1_ctx;
-
-static void psync_hmac_sha1_init(psync_hmac_sha1_ctx *ctx, const unsigned char *key, size_t keylen){
-  unsigned char keyxor[PSYNC_SHA1_BLOCK_LEN];
-  size_t i;
-  if (keylen>PSYNC_SHA1_BLOCK_LEN)
-    keylen=PSYNC_SHA1_BLOCK_LEN;
-  memset(keyxor, 0x36, PSYNC_SHA1_BLOCK_LEN);
-  memset(ctx->final, 0x5c, PSYNC_SHA1_BLOCK_LEN);
-  for (i=0; i<keylen; i++){
-    keyxor[i]^=key[i];
-    ctx->final[i]^=key[i];
-  }
-  psync_sha1_init(&ctx->sha1ctx);
-  psync_sha1_update(&ctx->sha1ctx, keyxor, PSYNC_SHA1_BLOCK_LEN);
-}
-
-static void psync_hmac_sha1_update(psync_hmac_sha1_ctx *ctx, const void *data, size_t len){
-  psync_sha1_update(&ctx->sha1ctx, data, len);
-}
-
-static void psync_hmac_sha1_final(unsigned char *result, psync_hmac_sha1_ctx *ctx){
-  psync_sha1_final(ctx->final+PSYNC_SHA1_BLOCK_LEN, &ctx->sha1ctx);
-  psync_sha1(ctx->final, PSYNC_SHA1_BLOCK_LEN+PSYNC_SHA1_DIGEST_LEN, result);
-}
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define PSYNC_CRYPTO_USE_SSE2
+#endif
 
 static void psync_hmac_sha1(const unsigned char *msg, size_t msglen, const unsigned char *key, size_t keylen, unsigned char *result){
   psync_sha1_ctx sha1ctx;
@@ -105,20 +82,94 @@ static void xor16_aligned_inplace(unsigned char *data, const unsigned char *key)
     xor16_unaligned_inplace(data, key);
 }
 
-static void xor_cnt_inplace(unsigned char *data, const unsigned char *key, size_t count){
-  size_t i;
-  for (i=0; i<count; i++)
-    data[i]^=key[i];
+static void copy_iv_with_counter(unsigned char *dest, const unsigned char *iv, uint64_t counter){
+  uint64_t w;
+  memcpy(dest, iv, PSYNC_AES256_BLOCK_SIZE);
+  memcpy(&w, dest, sizeof(w));
+  w^=counter;
+  memcpy(dest, &w, sizeof(w));
 }
 
-static void copy_iv_and_xor_with_counter(unsigned char *dest, const unsigned char *iv, uint64_t counter){
-  if (sizeof(unsigned long)==8){
-    LONG_DEREF(dest, 0)=LONG_DEREF(iv, 0)^LONG_DEREF(&counter, 0);
+/* dst=src^keystream for len bytes, any of the pointers may be unaligned and dst may be equal to src */
+static void xor_keystream(unsigned char *dst, const unsigned char *src, const unsigned char *keystream, size_t len){
+#if defined(PSYNC_CRYPTO_USE_SSE2)
+  while (len>=PSYNC_AES256_BLOCK_SIZE*4){
+    _mm_storeu_si128((__m128i *)dst, _mm_xor_si128(_mm_loadu_si128((const __m128i *)src), _mm_loadu_si128((const __m128i *)keystream)));
+    _mm_storeu_si128((__m128i *)dst+1, _mm_xor_si128(_mm_loadu_si128((const __m128i *)src+1), _mm_loadu_si128((const __m128i *)keystream+1)));
+    _mm_storeu_si128((__m128i *)dst+2, _mm_xor_si128(_mm_loadu_si128((const __m128i *)src+2), _mm_loadu_si128((const __m128i *)keystream+2)));
+    _mm_storeu_si128((__m128i *)dst+3, _mm_xor_si128(_mm_loadu_si128((const __m128i *)src+3), _mm_loadu_si128((const __m128i *)keystream+3)));
+    dst+=PSYNC_AES256_BLOCK_SIZE*4;
+    src+=PSYNC_AES256_BLOCK_SIZE*4;
+    keystream+=PSYNC_AES256_BLOCK_SIZE*4;
+    len-=PSYNC_AES256_BLOCK_SIZE*4;
   }
-  else if (sizeof(unsigned long)==4){
-    LONG_DEREF(dest, 0)=LONG_DEREF(iv, 0)^LONG_DEREF(&counter, 0);
-    LONG_DEREF(dest, 1)=LONG_DEREF(iv, 1)^LONG_DEREF(&counter, 1);
+  while (len>=PSYNC_AES256_BLOCK_SIZE){
+    _mm_storeu_si128((__m128i *)dst, _mm_xor_si128(_mm_loadu_si128((const __m128i *)src), _mm_loadu_si128((const __m128i *)keystream)));
+    dst+=PSYNC_AES256_BLOCK_SIZE;
+    src+=PSYNC_AES256_BLOCK_SIZE;
+    keystream+=PSYNC_AES256_BLOCK_SIZE;
+    len-=PSYNC_AES256_BLOCK_SIZE;
+  }
+#else
+  uint64_t w, k;
+  while (len>=sizeof(w)){
+    memcpy(&w, src, sizeof(w));
+    memcpy(&k, keystream, sizeof(k));
+    w^=k;
+    memcpy(dst, &w, sizeof(w));
+    dst+=sizeof(w);
+    src+=sizeof(w);
+    keystream+=sizeof(w);
+    len-=sizeof(w);
+  }
+#endif
+  while (len--)
+    *dst++=*src++^*keystream++;
+}
+
+/* Encrypts or decrypts len bytes from src to dst in CTR mode with counter block i being iv with i xor-ed in its first 8 bytes,
+ * starting skip bytes into block counter. Keystream is generated PSYNC_CRYPTO_CTR_BATCH_BLOCKS blocks at a time, so the cipher
+ * can process them in parallel.
+ */
+static void aes256_ctr_xor(psync_aes256_encoder enc, const unsigned char *iv, uint64_t counter, size_t skip, const unsigned char *src,
+                           unsigned char *dst, size_t len){
+  unsigned char ctrs[PSYNC_CRYPTO_CTR_BATCH_BLOCKS*PSYNC_AES256_BLOCK_SIZE], keystream[PSYNC_CRYPTO_CTR_BATCH_BLOCKS*PSYNC_AES256_BLOCK_SIZE];
+  size_t blocks, i, clen;
+  while (len){
+    blocks=(skip+len+PSYNC_AES256_BLOCK_SIZE-1)/PSYNC_AES256_BLOCK_SIZE;
+    if (blocks>PSYNC_CRYPTO_CTR_BATCH_BLOCKS)
+      blocks=PSYNC_CRYPTO_CTR_BATCH_BLOCKS;
+    for (i=0; i<blocks; i++)
+      copy_iv_with_counter(ctrs+i*PSYNC_AES256_BLOCK_SIZE, iv, counter+i);
+    psync_aes256_encode_blocks(enc, ctrs, keystream, blocks);
+    clen=blocks*PSYNC_AES256_BLOCK_SIZE-skip;
+    if (clen>len)
+      clen=len;
+    xor_keystream(dst, src, keystream+skip, clen);
+    src+=clen;
+    dst+=clen;
+    len-=clen;
+    counter+=blocks;
+    skip=0;
+  }
+  psync_ssl_memclean(keystream, sizeof(keystream));
+}
+
+static void hmac_sha1_precompute(psync_crypto_aes256_key_struct_t *enc){
+  unsigned char ipad[PSYNC_SHA1_BLOCK_LEN], opad[PSYNC_SHA1_BLOCK_LEN];
+  size_t i;
+  memset(ipad, 0x36, PSYNC_SHA1_BLOCK_LEN);
+  memset(opad, 0x5c, PSYNC_SHA1_BLOCK_LEN);
+  for (i=0; i<PSYNC_AES256_BLOCK_SIZE; i++){
+    ipad[i]^=enc->iv[i];
+    opad[i]^=enc->iv[i];
   }
+  psync_sha1_init(&enc->hmacinner);
+  psync_sha1_update(&enc->hmacinner, ipad, PSYNC_SHA1_BLOCK_LEN);
+  psync_sha1_init(&enc->hmacouter);
+  psync_sha1_update(&enc->hmacouter, opad, PSYNC_SHA1_BLOCK_LEN);
+  psync_ssl_memclean(ipad, PSYNC_SHA1_BLOCK_LEN);
+  psync_ssl_memclean(opad, PSYNC_SHA1_BLOCK_LEN);
 }
 
 psync_symmetric_key_t psync_crypto_aes256_ctr_gen_key(){
@@ -139,61 +190,24 @@ psync_crypto_aes256_ctr_encoder_decoder_t psync_crypto_aes256_ctr_encoder_decode
     return PSYNC_CRYPTO_INVALID_ENCODER;
   ret=psync_new(psync_crypto_aes256_key_struct_t);
   ret->encoder=enc;
+  ret->key=(psync_symmetric_key_t)psync_malloc(offsetof(psync_symmetric_key_struct_t, key)+key->keylen);
+  ret->key->keylen=key->keylen;
+  memcpy(ret->key->key, key->key, key->keylen);
   memcpy(ret->iv, key->key+PSYNC_AES256_KEY_SIZE, PSYNC_AES256_BLOCK_SIZE);
+  hmac_sha1_precompute(ret);
   return ret;
 }
 
 void psync_crypto_aes256_ctr_encoder_decoder_free(psync_crypto_aes256_ctr_encoder_decoder_t enc){
   psync_ssl_aes256_free_encoder(enc->encoder);
-  psync_ssl_memclean(enc->iv, PSYNC_AES256_BLOCK_SIZE);
+  psync_ssl_free_symmetric_key(enc->key);
+  psync_ssl_memclean(enc, sizeof(psync_crypto_aes256_key_struct_t));
   psync_free(enc);
 }
 
 void psync_crypto_aes256_ctr_encode_decode_inplace(psync_crypto_aes256_ctr_encoder_decoder_t enc, void *data, size_t datalen, uint64_t dataoffset){
-  unsigned char buff[PSYNC_AES256_BLOCK_SIZE*3], *aessrc, *aesdst;
-  uint64_t counter;
-  size_t blocksrem;
-  aessrc=ALIGN_PTR_A256_BS(buff);
-  aesdst=aessrc+PSYNC_AES256_BLOCK_SIZE;
-  counter=dataoffset/PSYNC_AES256_BLOCK_SIZE;
-  memcpy(aessrc+sizeof(uint64_t), enc->iv+sizeof(uint64_t), PSYNC_AES256_BLOCK_SIZE-sizeof(uint64_t));
-  dataoffset%=PSYNC_AES256_BLOCK_SIZE;
-  if (dataoffset){
-    copy_iv_and_xor_with_counter(aessrc, enc->iv, counter);
-    psync_aes256_encode_block(enc->encoder, aessrc, aesdst);
-    blocksrem=PSYNC_AES256_BLOCK_SIZE-dataoffset;
-    xor_cnt_inplace(data, aesdst+dataoffset, blocksrem);
-    datalen-=blocksrem;
-    counter++;
-    data=(char *)data+blocksrem;
-  }
-  blocksrem=datalen/PSYNC_AES256_BLOCK_SIZE;
-  datalen-=blocksrem*PSYNC_AES256_BLOCK_SIZE;
-  if (IS_WORD_ALIGNED(data)){
-    while (blocksrem){
-      copy_iv_and_xor_with_counter(aessrc, enc->iv, counter);
-      psync_aes256_encode_block(enc->encoder, aessrc, aesdst);
-      xor16_aligned_inplace(data, aesdst);
-      blocksrem--;
-      counter++;
-      data=(char *)data+PSYNC_AES256_BLOCK_SIZE;
-    }
-  }
-  else{
-    while (blocksrem){
-      copy_iv_and_xor_with_counter(aessrc, enc->iv, counter);
-      psync_aes256_encode_block(enc->encoder, aessrc, aesdst);
-      xor16_unaligned_inplace(data, aesdst);
-      blocksrem--;
-      counter++;
-      data=(char *)data+PSYNC_AES256_BLOCK_SIZE;
-    }
-  }
-  if (datalen){
-    copy_iv_and_xor_with_counter(aessrc, enc->iv, counter);
-    psync_aes256_encode_block(enc->encoder, aessrc, aesdst);
-    xor_cnt_inplace(data, aesdst, datalen);
-  }
+  aes256_ctr_xor(enc->encoder, enc->iv, dataoffset/PSYNC_AES256_BLOCK_SIZE, dataoffset%PSYNC_AES256_BLOCK_SIZE,
+                 (const unsigned char *)data, (unsigned char *)data, datalen);
 }
 
 static void copy_unaligned(unsigned char *dst, const unsigned char *src){
@@ -346,6 +360,7 @@ psync_crypto_aes256_text_encoder_t psync_crypto_aes256_text_encoder_create(psync
     return PSYNC_CRYPTO_INVALID_ENCODER;
   ret=psync_new(psync_crypto_aes256_key_struct_t);
   ret->encoder=enc;
+  ret->key=NULL;
   memcpy(ret->iv, key->key+PSYNC_AES256_KEY_SIZE, PSYNC_AES256_BLOCK_SIZE);
   return ret;
 }
@@ -366,6 +381,7 @@ psync_crypto_aes256_text_decoder_t psync_crypto_aes256_text_decoder_create(psync
     return PSYNC_CRYPTO_INVALID_ENCODER;
   ret=psync_new(psync_crypto_aes256_key_struct_t);
   ret->encoder=enc;
+  ret->key=NULL;
   memcpy(ret->iv, key->key+PSYNC_AES256_KEY_SIZE, PSYNC_AES256_BLOCK_SIZE);
   return ret;
 }
@@ -394,13 +410,33 @@ static int memcmp_const(const unsigned char *s1, const unsigned char *s2, size_t
   return (((r-1)>>8)&1)^1;
 }
 
-void psync_crypto_aes256_encode_sector(psync_crypto_aes256_sector_encoder_decoder_t enc, const unsigned char *data, size_t datalen, 
-                                       unsigned char *out, uint64_t sectorid, uint32_t revisionid){
-  psync_hmac_sha1_ctx ctx;
-  unsigned char buff[PSYNC_AES256_BLOCK_SIZE*4], hmacsha1bin[PSYNC_SHA1_DIGEST_LEN];
-  unsigned char *aessrc, *aesdst, *hmac;
-  uint64_t i;
-  uint32_t revsize, b, last;
+static void sector_hmac(const psync_crypto_aes256_key_struct_t *enc, const unsigned char *data, size_t datalen, uint64_t sectorid,
+                        uint32_t revisionid, unsigned char *result){
+  psync_sha1_ctx ctx;
+  unsigned char inner[PSYNC_SHA1_DIGEST_LEN];
+  ctx=enc->hmacinner;
+  psync_sha1_update(&ctx, data, datalen);
+  psync_sha1_update(&ctx, &sectorid, sizeof(sectorid));
+  psync_sha1_update(&ctx, &revisionid, sizeof(revisionid));
+  psync_sha1_final(inner, &ctx);
+  ctx=enc->hmacouter;
+  psync_sha1_update(&ctx, inner, PSYNC_SHA1_DIGEST_LEN);
+  psync_sha1_final(result, &ctx);
+}
+
+/* pads are the encrypted iv^sectorid blocks the header of each sector is xor-ed with, cnt<=PSYNC_CRYPTO_CTR_BATCH_BLOCKS */
+static void sector_pads(const psync_crypto_aes256_key_struct_t *enc, uint64_t firstsectorid, size_t cnt, unsigned char *pads){
+  unsigned char ctrs[PSYNC_CRYPTO_CTR_BATCH_BLOCKS*PSYNC_AES256_BLOCK_SIZE];
+  size_t i;
+  for (i=0; i<cnt; i++)
+    copy_iv_with_counter(ctrs+i*PSYNC_AES256_BLOCK_SIZE, enc->iv, firstsectorid+i);
+  psync_aes256_encode_blocks(enc->encoder, ctrs, pads, cnt);
+}
+
+static void encode_sector_with_pad(const psync_crypto_aes256_key_struct_t *enc, const unsigned char *data, size_t datalen,
+                                   unsigned char *out, uint64_t sectorid, uint32_t revisionid, const unsigned char *pad){
+  unsigned char hmacsha1bin[PSYNC_SHA1_DIGEST_LEN];
+  uint32_t revsize, b, last, i;
   revisionid&=0xffffff;
   if (datalen)
     last=1;
@@ -408,11 +444,7 @@ void psync_crypto_aes256_encode_sector(psync_crypto_aes256_sector_encoder_decode
     last=0;
     datalen=PSYNC_AES256_SECTOR_SIZE;
   }
-  psync_hmac_sha1_init(&ctx, enc->iv, PSYNC_AES256_BLOCK_SIZE);
-  psync_hmac_sha1_update(&ctx, data, datalen);
-  psync_hmac_sha1_update(&ctx, &sectorid, sizeof(sectorid));
-  psync_hmac_sha1_update(&ctx, &revisionid, sizeof(revisionid));
-  psync_hmac_sha1_final(hmacsha1bin, &ctx);
+  sector_hmac(enc, data, datalen, sectorid, revisionid, hmacsha1bin);
   if (last)
     hmacsha1bin[0]=(hmacsha1bin[0]&0xf8)|0x1;
   else
@@ -424,73 +456,16 @@ void psync_crypto_aes256_encode_sector(psync_crypto_aes256_sector_encoder_decode
   }
   hmacsha1bin[0]|=(unsigned char)(revsize<<1);
   memcpy_const(hmacsha1bin+1, (unsigned char *)&revisionid, revsize, 3);
-  aessrc=ALIGN_PTR_A256_BS(buff);
-  aesdst=aessrc+PSYNC_AES256_BLOCK_SIZE;
-  hmac=aessrc+PSYNC_AES256_BLOCK_SIZE*2;
-  memcpy(hmac, hmacsha1bin, PSYNC_AES256_BLOCK_SIZE);
-  copy_iv_and_xor_with_counter(aessrc, enc->iv, sectorid);
-  memcpy(aessrc+sizeof(uint64_t), enc->iv+sizeof(uint64_t), PSYNC_AES256_BLOCK_SIZE-sizeof(uint64_t));
-  psync_aes256_encode_block(enc->encoder, aessrc, aesdst);
-  xor16_aligned_inplace(aesdst, hmac);
-  i=0;
-  memcpy(aessrc+sizeof(uint64_t), hmac+sizeof(uint64_t), PSYNC_AES256_BLOCK_SIZE-sizeof(uint64_t));
-  if (IS_WORD_ALIGNED(data) && IS_WORD_ALIGNED(out)){
-    copy_aligned(out, aesdst);
-    out+=PSYNC_AES256_BLOCK_SIZE;
-    while (datalen>=PSYNC_AES256_BLOCK_SIZE){
-      copy_iv_and_xor_with_counter(aessrc, hmac, i++);
-      psync_aes256_encode_block(enc->encoder, aessrc, aesdst);
-      xor16_aligned_inplace(aesdst, data);
-      data+=PSYNC_AES256_BLOCK_SIZE;
-      datalen-=PSYNC_AES256_BLOCK_SIZE;
-      copy_aligned(out, aesdst);
-      out+=PSYNC_AES256_BLOCK_SIZE;
-    }
-    if (datalen){
-      copy_iv_and_xor_with_counter(aessrc, hmac, i);
-      psync_aes256_encode_block(enc->encoder, aessrc, aesdst);
-      xor_cnt_inplace(aesdst, data, datalen);
-      memcpy(out, aesdst, datalen);
-    }
-  }
-  else{
-    copy_unaligned(out, aesdst);
-    out+=PSYNC_AES256_BLOCK_SIZE;
-    while (datalen>=PSYNC_AES256_BLOCK_SIZE){
-      copy_iv_and_xor_with_counter(aessrc, hmac, i++);
-      psync_aes256_encode_block(enc->encoder, aessrc, aesdst);
-      xor16_unaligned_inplace(aesdst, data);
-      data+=PSYNC_AES256_BLOCK_SIZE;
-      datalen-=PSYNC_AES256_BLOCK_SIZE;
-      copy_unaligned(out, aesdst);
-      out+=PSYNC_AES256_BLOCK_SIZE;
-    }
-    if (datalen){
-      copy_iv_and_xor_with_counter(aessrc, hmac, i);
-      psync_aes256_encode_block(enc->encoder, aessrc, aesdst);
-      xor_cnt_inplace(aesdst, data, datalen);
-      memcpy(out, aesdst, datalen);
-    }
-  }
+  xor_keystream(out, hmacsha1bin, pad, PSYNC_AES256_BLOCK_SIZE);
+  aes256_ctr_xor(enc->encoder, hmacsha1bin, 0, 0, data, out+PSYNC_AES256_BLOCK_SIZE, datalen);
 }
 
-int psync_crypto_aes256_decode_sector(psync_crypto_aes256_sector_encoder_decoder_t enc, const unsigned char *data, size_t datalen, 
-                                       unsigned char *out, uint64_t sectorid, uint32_t *revisionid){
-  psync_hmac_sha1_ctx ctx;
-  unsigned char buff[PSYNC_AES256_BLOCK_SIZE*4], hmacsha1bin[PSYNC_SHA1_DIGEST_LEN];
-  unsigned char *aessrc, *aesdst, *hmac, *oout;
-  uint64_t i;
-  size_t odatalen;
+static int decode_sector_with_pad(const psync_crypto_aes256_key_struct_t *enc, const unsigned char *data, size_t datalen,
+                                  unsigned char *out, uint64_t sectorid, uint32_t *revisionid, const unsigned char *pad){
+  unsigned char hmac[PSYNC_AES256_BLOCK_SIZE], hmacsha1bin[PSYNC_SHA1_DIGEST_LEN];
   uint32_t revsize, last;
-  aessrc=ALIGN_PTR_A256_BS(buff);
-  aesdst=aessrc+PSYNC_AES256_BLOCK_SIZE;
-  hmac=aessrc+PSYNC_AES256_BLOCK_SIZE*2;
-  memcpy(hmac, data, PSYNC_AES256_BLOCK_SIZE);
+  xor_keystream(hmac, data, pad, PSYNC_AES256_BLOCK_SIZE);
   data+=PSYNC_AES256_BLOCK_SIZE;
-  copy_iv_and_xor_with_counter(aessrc, enc->iv, sectorid);
-  memcpy(aessrc+sizeof(uint64_t), enc->iv+sizeof(uint64_t), PSYNC_AES256_BLOCK_SIZE-sizeof(uint64_t));
-  psync_aes256_encode_block(enc->encoder, aessrc, aesdst);
-  xor16_aligned_inplace(hmac, aesdst);
   if (datalen){
     last=1;
     datalen-=PSYNC_AES256_BLOCK_SIZE;
@@ -502,50 +477,201 @@ int psync_crypto_aes256_decode_sector(psync_crypto_aes256_sector_encoder_decoder
   *revisionid=0;
   revsize=(hmac[0]>>1)&3;
   memcpy_const((unsigned char *)revisionid, hmac+1, revsize, 3);
-  i=0;
-  oout=out;
-  odatalen=datalen;
-  memcpy(aessrc+sizeof(uint64_t), hmac+sizeof(uint64_t), PSYNC_AES256_BLOCK_SIZE-sizeof(uint64_t));
-  if (IS_WORD_ALIGNED(data) && IS_WORD_ALIGNED(out)){
-    while (datalen>=PSYNC_AES256_BLOCK_SIZE){
-      copy_iv_and_xor_with_counter(aessrc, hmac, i++);
-      psync_aes256_encode_block(enc->encoder, aessrc, aesdst);
-      xor16_aligned_inplace(aesdst, data);
-      data+=PSYNC_AES256_BLOCK_SIZE;
-      datalen-=PSYNC_AES256_BLOCK_SIZE;
-      copy_aligned(out, aesdst);
-      out+=PSYNC_AES256_BLOCK_SIZE;
+  aes256_ctr_xor(enc->encoder, hmac, 0, 0, data, out, datalen);
+  sector_hmac(enc, out, datalen, sectorid, *revisionid, hmacsha1bin);
+  hmacsha1bin[0]=(hmacsha1bin[0]&0xf8)|last|(revsize<<1);
+  memcpy_const(hmacsha1bin+1, (unsigned char *)revisionid, revsize, 3);
+  return -memcmp_const(hmacsha1bin, hmac, PSYNC_AES256_BLOCK_SIZE);
+}
+
+void psync_crypto_aes256_encode_sector(psync_crypto_aes256_sector_encoder_decoder_t enc, const unsigned char *data, size_t datalen,
+                                       unsigned char *out, uint64_t sectorid, uint32_t revisionid){
+  unsigned char pad[PSYNC_AES256_BLOCK_SIZE];
+  sector_pads(enc, sectorid, 1, pad);
+  encode_sector_with_pad(enc, data, datalen, out, sectorid, revisionid, pad);
+}
+
+int psync_crypto_aes256_decode_sector(psync_crypto_aes256_sector_encoder_decoder_t enc, const unsigned char *data, size_t datalen,
+                                       unsigned char *out, uint64_t sectorid, uint32_t *revisionid){
+  unsigned char pad[PSYNC_AES256_BLOCK_SIZE];
+  sector_pads(enc, sectorid, 1, pad);
+  return decode_sector_with_pad(enc, data, datalen, out, sectorid, revisionid, pad);
+}
+
+void psync_crypto_aes256_encode_sectors(psync_crypto_aes256_sector_encoder_decoder_t enc, const unsigned char *data, size_t datalen,
+                                        unsigned char *out, uint64_t firstsectorid, const uint32_t *revisionids, int last){
+  unsigned char pads[PSYNC_CRYPTO_CTR_BATCH_BLOCKS*PSYNC_AES256_BLOCK_SIZE];
+  size_t cnt, i, slen;
+  while (datalen){
+    cnt=(datalen+PSYNC_AES256_SECTOR_SIZE-1)/PSYNC_AES256_SECTOR_SIZE;
+    if (cnt>PSYNC_CRYPTO_CTR_BATCH_BLOCKS)
+      cnt=PSYNC_CRYPTO_CTR_BATCH_BLOCKS;
+    sector_pads(enc, firstsectorid, cnt, pads);
+    for (i=0; i<cnt; i++){
+      slen=datalen<PSYNC_AES256_SECTOR_SIZE?datalen:PSYNC_AES256_SECTOR_SIZE;
+      encode_sector_with_pad(enc, data, (slen<PSYNC_AES256_SECTOR_SIZE || (last && slen==datalen))?slen:0, out, firstsectorid,
+                             revisionids?*revisionids++:0, pads+i*PSYNC_AES256_BLOCK_SIZE);
+      data+=slen;
+      out+=slen+PSYNC_AES256_BLOCK_SIZE;
+      datalen-=slen;
+      firstsectorid++;
     }
-    if (datalen){
-      copy_iv_and_xor_with_counter(aessrc, hmac, i);
-      psync_aes256_encode_block(enc->encoder, aessrc, aesdst);
-      xor_cnt_inplace(aesdst, data, datalen);
-      memcpy(out, aesdst, datalen);
+  }
+}
+
+int psync_crypto_aes256_decode_sectors(psync_crypto_aes256_sector_encoder_decoder_t enc, const unsigned char *data, size_t datalen,
+                                       unsigned char *out, uint64_t firstsectorid, uint32_t *revisionids, int last){
+  unsigned char pads[PSYNC_CRYPTO_CTR_BATCH_BLOCKS*PSYNC_AES256_BLOCK_SIZE];
+  size_t cnt, i, slen;
+  uint32_t rev;
+  while (datalen){
+    cnt=(datalen+PSYNC_AES256_ENC_SECTOR_SIZE-1)/PSYNC_AES256_ENC_SECTOR_SIZE;
+    if (cnt>PSYNC_CRYPTO_CTR_BATCH_BLOCKS)
+      cnt=PSYNC_CRYPTO_CTR_BATCH_BLOCKS;
+    sector_pads(enc, firstsectorid, cnt, pads);
+    for (i=0; i<cnt; i++){
+      slen=datalen<PSYNC_AES256_ENC_SECTOR_SIZE?datalen:PSYNC_AES256_ENC_SECTOR_SIZE;
+      if (unlikely_log(slen<=PSYNC_AES256_BLOCK_SIZE))
+        return -1;
+      if (decode_sector_with_pad(enc, data, (slen<PSYNC_AES256_ENC_SECTOR_SIZE || (last && slen==datalen))?slen:0, out,
+                                 firstsectorid, &rev, pads+i*PSYNC_AES256_BLOCK_SIZE))
+        return -1;
+      if (revisionids)
+        *revisionids++=rev;
+      data+=slen;
+      out+=slen-PSYNC_AES256_BLOCK_SIZE;
+      datalen-=slen;
+      firstsectorid++;
     }
   }
+  return 0;
+}
+
+typedef struct {
+  psync_crypto_aes256_key_struct_t enc;
+  const unsigned char *data;
+  unsigned char *out;
+  const uint32_t *inrevisionids;
+  uint32_t *outrevisionids;
+  size_t datalen;
+  uint64_t firstsectorid;
+  pthread_mutex_t *mutex;
+  pthread_cond_t *cond;
+  uint32_t *running;
+  int last;
+  int decode;
+  int ret;
+} sector_job_t;
+
+static void run_sector_job(sector_job_t *job){
+  if (job->decode)
+    job->ret=psync_crypto_aes256_decode_sectors(&job->enc, job->data, job->datalen, job->out, job->firstsectorid, job->outrevisionids, job->last);
+  else
+    psync_crypto_aes256_encode_sectors(&job->enc, job->data, job->datalen, job->out, job->firstsectorid, job->inrevisionids, job->last);
+}
+
+static void sector_job_thread(void *ptr){
+  sector_job_t *job;
+  job=(sector_job_t *)ptr;
+  run_sector_job(job);
+  pthread_mutex_lock(job->mutex);
+  if (--*job->running==0)
+    pthread_cond_signal(job->cond);
+  pthread_mutex_unlock(job->mutex);
+}
+
+/* AES encoders can not be shared between threads, so every job but the first one gets its own, created from the key copy that
+ * the sector encoder keeps. The iv and the precomputed HMAC states are only read and are copied as they are.
+ */
+static int run_sectors_parallel(psync_crypto_aes256_sector_encoder_decoder_t enc, const unsigned char *data, size_t datalen, unsigned char *out,
+                                uint64_t firstsectorid, const uint32_t *inrevisionids, uint32_t *outrevisionids, int last, int decode){
+  sector_job_t jobs[PSYNC_CRYPTO_PARALLEL_THREADS];
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  size_t insize, outsize, sectors, perjob, first;
+  uint32_t threads, running, i;
+  int ret;
+  if (decode){
+    insize=PSYNC_AES256_ENC_SECTOR_SIZE;
+    outsize=PSYNC_AES256_SECTOR_SIZE;
+  }
   else{
-    while (datalen>=PSYNC_AES256_BLOCK_SIZE){
-      copy_iv_and_xor_with_counter(aessrc, hmac, i++);
-      psync_aes256_encode_block(enc->encoder, aessrc, aesdst);
-      xor16_unaligned_inplace(aesdst, data);
-      data+=PSYNC_AES256_BLOCK_SIZE;
-      datalen-=PSYNC_AES256_BLOCK_SIZE;
-      copy_unaligned(out, aesdst);
-      out+=PSYNC_AES256_BLOCK_SIZE;
-    }
-    if (datalen){
-      copy_iv_and_xor_with_counter(aessrc, hmac, i);
-      psync_aes256_encode_block(enc->encoder, aessrc, aesdst);
-      xor_cnt_inplace(aesdst, data, datalen);
-      memcpy(out, aesdst, datalen);
+    insize=PSYNC_AES256_SECTOR_SIZE;
+    outsize=PSYNC_AES256_ENC_SECTOR_SIZE;
+  }
+  sectors=(datalen+insize-1)/insize;
+  threads=sectors/PSYNC_CRYPTO_PARALLEL_MIN_SECTORS;
+  if (threads>PSYNC_CRYPTO_PARALLEL_THREADS)
+    threads=PSYNC_CRYPTO_PARALLEL_THREADS;
+  i=psync_get_cpu_count();
+  if (threads>i)
+    threads=i;
+  if (threads<2 || !enc->key)
+    goto serial;
+  for (i=0; i<threads; i++){
+    jobs[i].enc=*enc;
+    if (i){
+      jobs[i].enc.encoder=psync_ssl_aes256_create_encoder(enc->key);
+      if (unlikely_log(jobs[i].enc.encoder==PSYNC_INVALID_ENCODER)){
+        while (--i)
+          psync_ssl_aes256_free_encoder(jobs[i].enc.encoder);
+        goto serial;
+      }
     }
   }
-  psync_hmac_sha1_init(&ctx, enc->iv, PSYNC_AES256_BLOCK_SIZE);
-  psync_hmac_sha1_update(&ctx, oout, odatalen);
-  psync_hmac_sha1_update(&ctx, &sectorid, sizeof(sectorid));
-  psync_hmac_sha1_update(&ctx, revisionid, sizeof(*revisionid));
-  psync_hmac_sha1_final(hmacsha1bin, &ctx);
-  hmacsha1bin[0]=(hmacsha1bin[0]&0xf8)|last|(revsize<<1);
-  memcpy_const(hmacsha1bin+1, (unsigned char *)revisionid, revsize, 3);
-  return -memcmp_const(hmacsha1bin, hmac, PSYNC_AES256_BLOCK_SIZE);
-}
\ No newline at end of file
+  pthread_mutex_init(&mutex, NULL);
+  pthread_cond_init(&cond, NULL);
+  running=threads-1;
+  perjob=(sectors+threads-1)/threads;
+  for (i=0; i<threads; i++){
+    first=perjob*i;
+    jobs[i].data=data+first*insize;
+    jobs[i].out=out+first*outsize;
+    jobs[i].inrevisionids=inrevisionids?inrevisionids+first:NULL;
+    jobs[i].outrevisionids=outrevisionids?outrevisionids+first:NULL;
+    if (i==threads-1)
+      jobs[i].datalen=datalen-first*insize;
+    else
+      jobs[i].datalen=perjob*insize;
+    jobs[i].firstsectorid=firstsectorid+first;
+    jobs[i].mutex=&mutex;
+    jobs[i].cond=&cond;
+    jobs[i].running=&running;
+    jobs[i].last=last && i==threads-1;
+    jobs[i].decode=decode;
+    jobs[i].ret=0;
+    if (i)
+      psync_run_thread1("crypto sectors", sector_job_thread, &jobs[i]);
+  }
+  run_sector_job(&jobs[0]);
+  pthread_mutex_lock(&mutex);
+  while (running)
+    pthread_cond_wait(&cond, &mutex);
+  pthread_mutex_unlock(&mutex);
+  pthread_cond_destroy(&cond);
+  pthread_mutex_destroy(&mutex);
+  ret=0;
+  for (i=0; i<threads; i++){
+    if (jobs[i].ret)
+      ret=-1;
+    if (i)
+      psync_ssl_aes256_free_encoder(jobs[i].enc.encoder);
+  }
+  psync_ssl_memclean(jobs, sizeof(jobs));
+  return ret;
+serial:
+  if (decode)
+    return psync_crypto_aes256_decode_sectors(enc, data, datalen, out, firstsectorid, outrevisionids, last);
+  psync_crypto_aes256_encode_sectors(enc, data, datalen, out, firstsectorid, inrevisionids, last);
+  return 0;
+}
+
+void psync_crypto_aes256_encode_sectors_parallel(psync_crypto_aes256_sector_encoder_decoder_t enc, const unsigned char *data, size_t datalen,
+                                                 unsigned char *out, uint64_t firstsectorid, const uint32_t *revisionids, int last){
+  run_sectors_parallel(enc, data, datalen, out, firstsectorid, revisionids, NULL, last, 0);
+}
+
+int psync_crypto_aes256_decode_sectors_parallel(psync_crypto_aes256_sector_encoder_decoder_t enc, const unsigned char *data, size_t datalen,
+                                                unsigned char *out, uint64_t firstsectorid, uint32_t *revisionids, int last){
+  return run_sectors_parallel(enc, data, datalen, out, firstsectorid, NULL, revisionids, last, 1);
+}
@@ -33,8 +33,14 @@
 #define PSYNC_AES256_SECTOR_SIZE 4096
 #define PSYNC_AES256_ENC_SECTOR_SIZE (PSYNC_AES256_SECTOR_SIZE+PSYNC_AES256_BLOCK_SIZE)
 
+/* key is only kept by ctr/sector encoders, so that the parallel sector functions can create an encoder per thread, hmacinner and
+ * hmacouter are sha1 states with the HMAC ipad/opad (keyed with iv) already absorbed
+ */
 typedef struct {
   psync_aes256_encoder encoder;
+  psync_symmetric_key_t key;
+  psync_sha1_ctx hmacinner;
+  psync_sha1_ctx hmacouter;
   union {
     long unsigned __aligner;
     unsigned char iv[PSYNC_AES256_BLOCK_SIZE];
@@ -71,4 +77,20 @@ void psync_crypto_aes256_encode_sector(psync_crypto_aes256_sector_encoder_decode
 int psync_crypto_aes256_decode_sector(psync_crypto_aes256_sector_encoder_decoder_t enc, const unsigned char *data, size_t datalen, 
                                        unsigned char *out, uint64_t sectorid, uint32_t *revisionid);
 
+/* Batch versions of the above for consecutive sectors starting at firstsectorid. data is datalen bytes of plain (for encode) or
+ * encoded (for decode) sectors back to back, every sector but the last one must be full. If last is set, the final sector is
+ * encoded as the last one of the file, same as passing non-zero datalen to psync_crypto_aes256_encode_sector. revisionids has one
+ * entry per sector and may be NULL (all zero on encode). Encoded size of each sector is its size plus PSYNC_AES256_BLOCK_SIZE.
+ * Decode returns 0 if all sectors are authentic and -1 otherwise. The _parallel versions split large batches between up to
+ * PSYNC_CRYPTO_PARALLEL_THREADS threads, but never more than the number of CPUs.
+ */
+void psync_crypto_aes256_encode_sectors(psync_crypto_aes256_sector_encoder_decoder_t enc, const unsigned char *data, size_t datalen,
+                                        unsigned char *out, uint64_t firstsectorid, const uint32_t *revisionids, int last);
+int psync_crypto_aes256_decode_sectors(psync_crypto_aes256_sector_encoder_decoder_t enc, const unsigned char *data, size_t datalen,
+                                       unsigned char *out, uint64_t firstsectorid, uint32_t *revisionids, int last);
+void psync_crypto_aes256_encode_sectors_parallel(psync_crypto_aes256_sector_encoder_decoder_t enc, const unsigned char *data, size_t datalen,
+                                                 unsigned char *out, uint64_t firstsectorid, const uint32_t *revisionids, int last);
+int psync_crypto_aes256_decode_sectors_parallel(psync_crypto_aes256_sector_encoder_decoder_t enc, const unsigned char *data, size_t datalen,
+                                                unsigned char *out, uint64_t firstsectorid, uint32_t *revisionids, int last);
+
 #endif
@@ -43,7 +43,7 @@
 #define PSYNC_TEXT_COL "COLLATE NOCASE"
 #endif
 
-#define PSYNC_DATABASE_VERSION 8
+#define PSYNC_DATABASE_VERSION 10
 
 #define PSYNC_DATABASE_CONFIG \
 "\
@@ -109,6 +109,11 @@ CREATE TABLE IF NOT EXISTS pagecache (id INTEGER PRIMARY KEY, hash INTEGER, page
   lastuse INTEGER, usecnt INTEGER, size INTEGER);\
 CREATE UNIQUE INDEX IF NOT EXISTS kpagecachehashpageid ON pagecache(hash, pageid);\
 CREATE INDEX IF NOT EXISTS kpagecachetype ON pagecache(type);\
+CREATE TABLE IF NOT EXISTS pagecacheprofile (hash INTEGER, frompage INTEGER, topage INTEGER, hits INTEGER, lastuse INTEGER,\
+  PRIMARY KEY (hash, frompage)) " P_SQL_WOWROWID ";\
+CREATE TABLE IF NOT EXISTS pagecachesecondary (id INTEGER PRIMARY KEY, hash INTEGER, pageid INTEGER, lastuse INTEGER, usecnt INTEGER,\
+  size INTEGER);\
+CREATE UNIQUE INDEX IF NOT EXISTS kpagecachesecondaryhashpageid ON pagecachesecondary(hash, pageid);\
 CREATE TABLE IF NOT EXISTS fstask (id INTEGER PRIMARY KEY, type INTEGER, status INTEGER, folderid INTEGER, sfolderid INTEGER, fileid INTEGER,\
   text1 TEXT, text2 TEXT, int1 INTEGER, int2 INTEGER);\
 CREATE INDEX IF NOT EXISTS kfstaskfolderid ON fstask(folderid);\
@@ -187,6 +192,17 @@ COMMIT;",
 INSERT OR IGNORE INTO folder (id, name) VALUES (0, '');\
 INSERT OR IGNORE INTO localfolder (id) VALUES (0);\
 UPDATE setting SET value=8 WHERE id='dbversion';\
+COMMIT;",
+  "BEGIN;\
+CREATE TABLE IF NOT EXISTS pagecacheprofile (hash INTEGER, frompage INTEGER, topage INTEGER, hits INTEGER, lastuse INTEGER,\
+  PRIMARY KEY (hash, frompage)) " P_SQL_WOWROWID ";\
+UPDATE setting SET value=9 WHERE id='dbversion';\
+COMMIT;",
+  "BEGIN;\
+CREATE TABLE IF NOT EXISTS pagecachesecondary (id INTEGER PRIMARY KEY, hash INTEGER, pageid INTEGER, lastuse INTEGER, usecnt INTEGER,\
+  size INTEGER);\
+CREATE UNIQUE INDEX IF NOT EXISTS kpagecachesecondaryhashpageid ON pagecachesecondary(hash, pageid);\
+UPDATE setting SET value=10 WHERE id='dbversion';\
 COMMIT;"
 };
 
@@ -373,6 +373,7 @@ static void process_createfolder(const binresult *entry){
     psync_sql_bind_uint(res, 7, flags);
     psync_sql_bind_uint(res, 8, folderid);
     psync_sql_run_free(res);
+    psync_path_cache_invalidate_folder(folderid);
   }
   psync_sql_bind_uint(st2, 1, mtime);
   psync_sql_bind_uint(st2, 2, parentfolderid);
@@ -511,6 +512,7 @@ static void process_modifyfolder(const binresult *entry){
   psync_sql_bind_uint(st, 7, flags);
   psync_sql_bind_uint(st, 8, folderid);
   psync_sql_run(st);
+  psync_path_cache_invalidate_folder(folderid);
   if (oldparentfolderid!=parentfolderid){
     res=psync_sql_prep_statement("UPDATE folder SET subdircnt=subdircnt-1, mtime=? WHERE id=?");
     psync_sql_bind_uint(res, 1, mtime);
@@ -653,6 +655,7 @@ static void process_deletefolder(const binresult *entry){
   }
   psync_sql_bind_uint(st, 1, folderid);
   psync_sql_run(st);
+  psync_path_cache_invalidate_folder(folderid);
   if (psync_sql_affected_rows()){
     psync_sql_bind_uint(st2, 1, psync_find_result(meta, "modified", PARAM_NUM)->num);
     psync_sql_bind_uint(st2, 2, psync_find_result(meta, "parentfolderid", PARAM_NUM)->num);
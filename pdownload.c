@@ -58,9 +58,7 @@ typedef struct {
   char filename[];
 } download_task_t;
 
-static pthread_mutex_t download_mutex=PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t download_cond=PTHREAD_COND_INITIALIZER;
-static psync_uint_t download_wakes=0;
+static psync_mpsc_queue download_queue=PSYNC_MPSC_STATIC_INIT(download_queue);
 static const uint32_t requiredstatuses[]={
   PSTATUS_COMBINE(PSTATUS_TYPE_AUTH, PSTATUS_AUTH_PROVIDED),
   PSTATUS_COMBINE(PSTATUS_TYPE_RUN, PSTATUS_RUN_RUN),
@@ -279,6 +277,7 @@ static void delete_local_folder_from_db(psync_folderid_t localfolderid){
     res=psync_sql_prep_statement("DELETE FROM localfolder WHERE id=?");
     psync_sql_bind_uint(res, 1, localfolderid);
     psync_sql_run_free(res);
+    psync_path_cache_invalidate_local_folder(localfolderid);
   }
 }
 
@@ -319,16 +318,20 @@ static int task_renamefolder(psync_syncid_t newsyncid, psync_folderid_t folderid
   psync_sql_bind_string(res, 3, newname);
   psync_sql_bind_uint(res, 4, localfolderid);
   psync_sql_run_free(res);
+  psync_path_cache_invalidate_local_folder(localfolderid);
   newpath=psync_local_path_for_local_folder(localfolderid, newsyncid, NULL);
   if (unlikely(!newpath)){
     psync_sql_rollback_transaction();
+    psync_path_cache_invalidate_local_folder(localfolderid);
     psync_free(oldpath);
     debug(D_ERROR, "could not get local path for folder id %lu", (unsigned long)localfolderid);
     return 0;
   }
   ret=task_renamedir(oldpath, newpath);
-  if (ret)
+  if (ret){
     psync_sql_rollback_transaction();
+    psync_path_cache_invalidate_local_folder(localfolderid);
+  }
   else{
     psync_decrease_local_folder_taskcnt(localfolderid);
     psync_sql_commit_transaction();
@@ -920,6 +923,20 @@ static int task_rename_file(psync_syncid_t oldsyncid, psync_syncid_t newsyncid,
   return ret;
 }
 
+static uint64_t get_file_size(psync_fileid_t fileid){
+  psync_sql_res *res;
+  psync_uint_row row;
+  uint64_t size;
+  res=psync_sql_query("SELECT size FROM file WHERE id=?");
+  psync_sql_bind_uint(res, 1, fileid);
+  if ((row=psync_sql_fetch_rowint(res)))
+    size=row[0];
+  else
+    size=0;
+  psync_sql_free_result(res);
+  return size;
+}
+
 static void task_run_download_file_thread(void *ptr){
   download_task_t *dt;
   psync_sql_res *res;
@@ -935,7 +952,8 @@ static void task_run_download_file_thread(void *ptr){
     res=psync_sql_prep_statement("DELETE FROM task WHERE id=?");
     psync_sql_bind_uint(res, 1, dt->taskid);
     psync_sql_run_free(res);
-    psync_status_recalc_to_download();
+    psync_status_add_to_download(-1, -(int64_t)get_file_size(dt->dwllist.fileid));
+    psync_status_recalc_to_download_async();
     psync_send_status_update();
   }
   pthread_mutex_lock(&current_downloads_mutex);
@@ -1007,6 +1025,7 @@ static void task_del_folder_rec_do(const char *localpath, psync_folderid_t local
   while ((vrow=psync_sql_fetch_row(res))){
     nm=psync_strcat(localpath, PSYNC_DIRECTORY_SEPARATOR, psync_get_string(vrow[1]), NULL);
     task_del_folder_rec_do(nm, psync_get_number(vrow[0]), syncid);
+    psync_path_cache_invalidate_local_folder(psync_get_number(vrow[0]));
     psync_free(nm);
   }
   psync_sql_free_result(res);
@@ -1038,6 +1057,7 @@ static int task_del_folder_rec(psync_folderid_t localfolderid, psync_folderid_t
   psync_sql_bind_uint(res, 2, syncid);
   psync_sql_run_free(res);
   psync_sql_commit_transaction();
+  psync_path_cache_invalidate_local_folder(localfolderid);
   psync_rmdir_with_trashes(localpath);
   psync_resume_localscan();
   return 0;
@@ -1112,19 +1132,14 @@ static void download_thread(){
       continue;
     }
 
-    pthread_mutex_lock(&download_mutex);
-    if (!download_wakes)
-      pthread_cond_wait(&download_cond, &download_mutex);
-    download_wakes=0;
-    pthread_mutex_unlock(&download_mutex);
+    psync_mpsc_wait(&download_queue);
   }
 }
 
+/* Only a wakeup is posted, the thread takes the next task from the task table. Tasks are inserted by transactions that may
+ * still be rolled back when this is called and have to run in id order, so the table is what the thread has to trust. */
 void psync_wake_download(){
-  pthread_mutex_lock(&download_mutex);
-  if (!download_wakes++)
-    pthread_cond_signal(&download_cond);
-  pthread_mutex_unlock(&download_mutex);  
+  psync_mpsc_wake(&download_queue);
 }
 
 void psync_download_init(){
@@ -1135,12 +1150,14 @@ void psync_download_init(){
 void psync_delete_download_tasks_for_file(psync_fileid_t fileid){
   psync_sql_res *res;
   download_list_t *dwl;
+  uint32_t aff;
   res=psync_sql_prep_statement("DELETE FROM task WHERE type=? AND itemid=?");
   psync_sql_bind_uint(res, 1, PSYNC_DOWNLOAD_FILE);
   psync_sql_bind_uint(res, 2, fileid);
   psync_sql_run(res);
-  if (psync_sql_affected_rows()){
-    psync_status_recalc_to_download();
+  if ((aff=psync_sql_affected_rows())){
+    psync_status_add_to_download(-(int32_t)aff, -(int64_t)(get_file_size(fileid)*aff));
+    psync_status_recalc_to_download_async();
     psync_send_status_update();
   }
   psync_sql_free_result(res);
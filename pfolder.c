@@ -37,6 +37,12 @@
 #define INITIAL_NAME_BUFF 2000
 #define INITIAL_ENTRY_CNT 128
 
+#define PATH_CACHE_HASH_SIZE 1024
+
+#define PATH_CACHE_REMOTE 0
+#define PATH_CACHE_LOCAL  1
+#define PATH_CACHE_SYNC   2
+
 typedef struct {
   pentry_t *entries;
   char *namebuff;
@@ -57,6 +63,22 @@ typedef struct _string_list {
   size_t len;
 } string_list;
 
+typedef struct {
+  psync_list list;
+  psync_list lru;
+  psync_folderid_t id;
+  psync_folderid_t parentid;
+  size_t len;
+  uint32_t type;
+  char name[];
+} path_cache_element;
+
+static psync_list path_cache_hash[PATH_CACHE_HASH_SIZE];
+static psync_list path_cache_lru=PSYNC_LIST_STATIC_INIT(path_cache_lru);
+static pthread_mutex_t path_cache_mutex=PTHREAD_MUTEX_INITIALIZER;
+static uint32_t path_cache_cnt=0;
+static int path_cache_inited=0;
+
 psync_folderid_t psync_get_folderid_by_path(const char *path){
   psync_folderid_t cfolderid;
   const char *sl;
@@ -196,10 +218,123 @@ static string_list *str_to_list_element(const char *str, size_t len){
   return le;
 }
 
+/* The path cache keeps (parent, name) pairs of remote and local folders as well as the local root paths of syncs, so
+ * building a path for a deep tree is a few hash lookups instead of a query per ancestor. Entries are filled in while
+ * holding the sql lock, therefore any code that changes the parent or the name of a (local)folder row has to call the
+ * corresponding psync_path_cache_invalidate_* function after the change is done (or rolled back).
+ */
+
+static psync_uint_t path_cache_hash_func(uint32_t type, psync_folderid_t id){
+  return ((psync_uint_t)id*3+type)%PATH_CACHE_HASH_SIZE;
+}
+
+static void path_cache_init_locked(){
+  psync_uint_t i;
+  for (i=0; i<PATH_CACHE_HASH_SIZE; i++)
+    psync_list_init(&path_cache_hash[i]);
+  path_cache_inited=1;
+}
+
+static path_cache_element *path_cache_find_locked(uint32_t type, psync_folderid_t id){
+  path_cache_element *pe;
+  if (unlikely(!path_cache_inited))
+    return NULL;
+  psync_list_for_each_element(pe, &path_cache_hash[path_cache_hash_func(type, id)], path_cache_element, list)
+    if (pe->id==id && pe->type==type)
+      return pe;
+  return NULL;
+}
+
+static void path_cache_free_locked(path_cache_element *pe){
+  psync_list_del(&pe->list);
+  psync_list_del(&pe->lru);
+  path_cache_cnt--;
+  psync_free(pe);
+}
+
+/* on hit adds the name of the folder to the head of lst and replaces *id with the parent id */
+static int path_cache_get(uint32_t type, psync_folderid_t *id, psync_list *lst){
+  path_cache_element *pe;
+  string_list *e;
+  pthread_mutex_lock(&path_cache_mutex);
+  pe=path_cache_find_locked(type, *id);
+  if (pe){
+    psync_list_del(&pe->lru);
+    psync_list_add_tail(&path_cache_lru, &pe->lru);
+    e=str_to_list_element(pe->name, pe->len);
+    psync_list_add_head(lst, &e->list);
+    *id=pe->parentid;
+  }
+  pthread_mutex_unlock(&path_cache_mutex);
+  return pe?0:-1;
+}
+
+static void path_cache_add(uint32_t type, psync_folderid_t id, psync_folderid_t parentid, const char *name, size_t len){
+  path_cache_element *pe;
+  pe=(path_cache_element *)psync_malloc(offsetof(path_cache_element, name)+len+1);
+  pe->id=id;
+  pe->parentid=parentid;
+  pe->len=len;
+  pe->type=type;
+  memcpy(pe->name, name, len);
+  pe->name[len]=0;
+  pthread_mutex_lock(&path_cache_mutex);
+  if (unlikely(!path_cache_inited))
+    path_cache_init_locked();
+  else if (unlikely(path_cache_find_locked(type, id))){
+    pthread_mutex_unlock(&path_cache_mutex);
+    psync_free(pe);
+    return;
+  }
+  while (path_cache_cnt>=PSYNC_FOLDER_PATH_CACHE_ENTRIES)
+    path_cache_free_locked(psync_list_element(path_cache_lru.next, path_cache_element, lru));
+  psync_list_add_tail(&path_cache_hash[path_cache_hash_func(type, id)], &pe->list);
+  psync_list_add_tail(&path_cache_lru, &pe->lru);
+  path_cache_cnt++;
+  pthread_mutex_unlock(&path_cache_mutex);
+}
+
+static void path_cache_invalidate(uint32_t type, psync_folderid_t id){
+  path_cache_element *pe;
+  pthread_mutex_lock(&path_cache_mutex);
+  pe=path_cache_find_locked(type, id);
+  if (pe)
+    path_cache_free_locked(pe);
+  pthread_mutex_unlock(&path_cache_mutex);
+}
+
+void psync_path_cache_invalidate_folder(psync_folderid_t folderid){
+  path_cache_invalidate(PATH_CACHE_REMOTE, folderid);
+}
+
+void psync_path_cache_invalidate_local_folder(psync_folderid_t localfolderid){
+  path_cache_invalidate(PATH_CACHE_LOCAL, localfolderid);
+}
+
+void psync_path_cache_invalidate_sync(psync_syncid_t syncid){
+  path_cache_element *pe;
+  psync_list *l1, *l2;
+  pthread_mutex_lock(&path_cache_mutex);
+  psync_list_for_each_safe(l1, l2, &path_cache_lru){
+    pe=psync_list_element(l1, path_cache_element, lru);
+    if (pe->type==PATH_CACHE_LOCAL || (pe->type==PATH_CACHE_SYNC && pe->id==syncid))
+      path_cache_free_locked(pe);
+  }
+  pthread_mutex_unlock(&path_cache_mutex);
+}
+
+void psync_path_cache_clean(){
+  pthread_mutex_lock(&path_cache_mutex);
+  while (!psync_list_isempty(&path_cache_lru))
+    path_cache_free_locked(psync_list_element(path_cache_lru.next, path_cache_element, lru));
+  pthread_mutex_unlock(&path_cache_mutex);
+}
+
 static int psync_add_path_to_list(psync_list *lst, psync_folderid_t folderid){
   string_list *e;
   psync_sql_res *res;
   psync_variant_row row;
+  psync_folderid_t parentid;
   const char *str;
   size_t len;
   while (1){
@@ -210,15 +345,19 @@ static int psync_add_path_to_list(psync_list *lst, psync_folderid_t folderid){
       psync_list_add_head(lst, &e->list);
       return 0;
     }
+    if (!path_cache_get(PATH_CACHE_REMOTE, &folderid, lst))
+      continue;
     res=psync_sql_query("SELECT parentfolderid, name FROM folder WHERE id=?");
     psync_sql_bind_uint(res, 1, folderid);
     row=psync_sql_fetch_row(res);
     if (unlikely(!row))
       break;
-    folderid=psync_get_number(row[0]);
+    parentid=psync_get_number(row[0]);
     str=psync_get_lstring(row[1], &len);
     e=str_to_list_element(str, len);
     psync_list_add_head(lst, &e->list);
+    path_cache_add(PATH_CACHE_REMOTE, folderid, parentid, str, len);
+    folderid=parentid;
     psync_sql_free_result(res);
   }
   psync_sql_free_result(res);
@@ -334,36 +473,49 @@ char *psync_get_path_by_fileid(psync_fileid_t fileid, size_t *retlen){
 }
 
 static int psync_add_local_path_to_list_by_localfolderid(psync_list *lst, psync_folderid_t localfolderid, psync_syncid_t syncid){
+  psync_list rootlist;
   string_list *e, *le;
   psync_sql_res *res;
   psync_variant_row row;
+  psync_folderid_t parentid;
   const char *str;
   size_t len;
-  res=psync_sql_query("SELECT localpath FROM syncfolder WHERE id=?");
-  psync_sql_bind_uint(res, 1, syncid);
-  row=psync_sql_fetch_row(res);
-  if (unlikely(!row)){
-    debug(D_ERROR, "could not find sync id %lu", (long unsigned)syncid);
+  psync_list_init(&rootlist);
+  parentid=syncid;
+  if (path_cache_get(PATH_CACHE_SYNC, &parentid, &rootlist)){
+    res=psync_sql_query("SELECT localpath FROM syncfolder WHERE id=?");
+    psync_sql_bind_uint(res, 1, syncid);
+    row=psync_sql_fetch_row(res);
+    if (unlikely(!row)){
+      debug(D_ERROR, "could not find sync id %lu", (long unsigned)syncid);
+      psync_sql_free_result(res);
+      return -1;
+    }
+    str=psync_get_lstring(row[0], &len);
+    le=str_to_list_element(str, len);
+    path_cache_add(PATH_CACHE_SYNC, syncid, 0, str, len);
     psync_sql_free_result(res);
-    return -1;
   }
-  str=psync_get_lstring(row[0], &len);
-  le=str_to_list_element(str, len);
-  psync_sql_free_result(res);
+  else
+    le=psync_list_element(rootlist.next, string_list, list);
   while (1){
     if (localfolderid==0){
       psync_list_add_head(lst, &le->list);
       return 0;
     }
+    if (!path_cache_get(PATH_CACHE_LOCAL, &localfolderid, lst))
+      continue;
     res=psync_sql_query("SELECT localparentfolderid, name FROM localfolder WHERE id=?");
     psync_sql_bind_uint(res, 1, localfolderid);
     row=psync_sql_fetch_row(res);
     if (unlikely(!row))
       break;
-    localfolderid=psync_get_number(row[0]);
+    parentid=psync_get_number(row[0]);
     str=psync_get_lstring(row[1], &len);
     e=str_to_list_element(str, len);
     psync_list_add_head(lst, &e->list);
+    path_cache_add(PATH_CACHE_LOCAL, localfolderid, parentid, str, len);
+    localfolderid=parentid;
     psync_sql_free_result(res);
   }
   psync_sql_free_result(res);
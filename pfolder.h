@@ -50,6 +50,11 @@ pfolder_list_t *psync_list_remote_folder(psync_folderid_t folderid, psync_listty
 pfolder_list_t *psync_list_local_folder(const char *path, psync_listtype_t listtype) PSYNC_NONNULL(1);
 pentry_t *psync_folder_stat_path(const char *remotepath);
 
+void psync_path_cache_invalidate_folder(psync_folderid_t folderid);
+void psync_path_cache_invalidate_local_folder(psync_folderid_t localfolderid);
+void psync_path_cache_invalidate_sync(psync_syncid_t syncid);
+void psync_path_cache_clean();
+
 psync_folder_list_t *psync_list_get_list();
 
 #endif
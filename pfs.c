@@ -49,6 +49,7 @@
 #include "pssl.h"
 #include "pfolder.h"
 #include "pnetlibs.h"
+#include "pmetrics.h"
 
 #ifndef FUSE_STAT
 #define FUSE_STAT stat
@@ -62,6 +63,11 @@ typedef off_t fuse_off_t;
 #include <signal.h>
 #endif
 
+#if defined(P_OS_LINUX)
+#define PSYNC_FS_HAS_LOWLEVEL
+#include <fuse_lowlevel.h>
+#endif
+
 #if defined(P_OS_MACOSX)
 #include <sys/mount.h>
 #include <sys/mount.h>
@@ -83,15 +89,6 @@ typedef off_t fuse_off_t;
 #define FS_MAX_ACCEPTABLE_FILENAME_LEN 255
 #endif
 
-typedef struct {
-  uint64_t offset;
-  uint64_t length;
-} index_record;
-
-typedef struct {
-  uint64_t copyfromoriginal;
-} index_header;
-
 static struct fuse_chan *psync_fuse_channel=NULL;
 static struct fuse *psync_fuse=NULL;
 static char *psync_current_mountpoint=NULL;
@@ -109,6 +106,7 @@ static uid_t myuid=0;
 static gid_t mygid=0;
 
 static psync_tree *openfiles=PSYNC_TREE_EMPTY;
+static int64_t fsfreespace=-1;
 
 int psync_fs_update_openfile(uint64_t taskid, uint64_t writeid, psync_fileid_t newfileid, uint64_t hash, uint64_t size){
   psync_sql_res *res;
@@ -148,6 +146,8 @@ int psync_fs_update_openfile(uint64_t taskid, uint64_t writeid, psync_fileid_t n
           psync_file_close(fl->indexfile);
           fl->indexfile=INVALID_HANDLE_VALUE;
         }
+        fl->indexpendingcnt=0;
+        fl->profilecnt=0;
         psync_tree_del(&openfiles, &fl->tree);
         tr=openfiles;
         d=-1;
@@ -278,6 +278,32 @@ static int psync_fs_relock_fileid(psync_fsfileid_t fileid){
   return 0;
 }
 
+/* returns the size of the file if it is open, writes can still sit in the write-back buffer and are not in the data file yet */
+static int psync_fs_get_open_file_size(psync_fsfileid_t fileid, uint64_t *size){
+  psync_openfile_t *fl;
+  psync_tree *tr;
+  int64_t d;
+  psync_sql_lock();
+  tr=openfiles;
+  while (tr){
+    d=fileid-psync_tree_element(tr, psync_openfile_t, tree)->fileid;
+    if (d<0)
+      tr=tr->left;
+    else if (d>0)
+      tr=tr->right;
+    else{
+      fl=psync_tree_element(tr, psync_openfile_t, tree);
+      pthread_mutex_lock(&fl->mutex);
+      *size=fl->currentsize;
+      pthread_mutex_unlock(&fl->mutex);
+      psync_sql_unlock();
+      return 1;
+    }
+  }
+  psync_sql_unlock();
+  return 0;
+}
+
 void psync_fs_mark_openfile_deleted(uint64_t taskid){
   psync_sql_res *res;
   psync_openfile_t *fl;
@@ -406,9 +432,9 @@ static void psync_row_to_folder_stat(psync_variant_row row, struct FUSE_STAT *st
 
 static void psync_row_to_file_stat(psync_variant_row row, struct FUSE_STAT *stbuf){
   uint64_t size;
-  stbuf->st_ino=fileid_to_inode(psync_get_number(row[4]));
   size=psync_get_number(row[1]);
   memset(stbuf, 0, sizeof(struct FUSE_STAT));
+  stbuf->st_ino=fileid_to_inode(psync_get_number(row[4]));
 #ifdef _DARWIN_FEATURE_64_BIT_INODE
   stbuf->st_birthtime=psync_get_number(row[2]);
   stbuf->st_ctime=psync_get_number(row[3]);
@@ -493,7 +519,7 @@ static int psync_creat_stat_fake_file(struct FUSE_STAT *stbuf){
 static int psync_creat_local_to_file_stat(psync_fstask_creat_t *cr, struct FUSE_STAT *stbuf){
   psync_stat_t st;
   psync_fsfileid_t fileid;
-  uint64_t size;
+  uint64_t size, osize;
   const char *cachepath;
   char *filename;
 //  psync_file_t fd;
@@ -547,8 +573,8 @@ static int psync_creat_local_to_file_stat(psync_fstask_creat_t *cr, struct FUSE_
   stbuf->st_mode=S_IFREG | 0644;
   stbuf->st_nlink=1;
   size=psync_stat_size(&st);
-//  if (osize>size)
-//    size=osize;
+  if (psync_fs_get_open_file_size(cr->fileid, &osize) && osize>size)
+    size=osize;
   stbuf->st_size=size;
 #if defined(P_OS_POSIX)
   stbuf->st_blocks=(size+511)/512;
@@ -585,62 +611,45 @@ static int psync_fs_getrootattr(struct FUSE_STAT *stbuf){
   }\
 } while (0)
 
-static int psync_fs_getattr(const char *path, struct FUSE_STAT *stbuf){
+static int psync_fs_getattr_by_name_locked(psync_fsfolderid_t folderid, const char *name, struct FUSE_STAT *stbuf){
   psync_sql_res *res;
   psync_variant_row row;
-  psync_fspath_t *fpath;
   psync_fstask_folder_t *folder;
   psync_fstask_creat_t *cr;
   int crr;
-  psync_fs_set_thread_name();
-//  debug(D_NOTICE, "getattr %s", path);
-  if (path[0]=='/' && path[1]==0)
-    return psync_fs_getrootattr(stbuf);
-  psync_sql_lock();
-  CHECK_LOGIN_LOCKED();
-  fpath=psync_fsfolder_resolve_path(path);
-  if (!fpath){
-    psync_sql_unlock();
-    debug(D_NOTICE, "could not find path component of %s, returning ENOENT", path);
-    return -ENOENT;
-  }
-  folder=psync_fstask_get_folder_tasks_locked(fpath->folderid);
-  if (!folder || !psync_fstask_find_rmdir(folder, fpath->name, 0)){
+  folder=psync_fstask_get_folder_tasks_locked(folderid);
+  if (!folder || !psync_fstask_find_rmdir(folder, name, 0)){
     res=psync_sql_query("SELECT id, permissions, ctime, mtime, subdircnt FROM folder WHERE parentfolderid=? AND name=?");
-    psync_sql_bind_uint(res, 1, fpath->folderid);
-    psync_sql_bind_string(res, 2, fpath->name);
+    psync_sql_bind_uint(res, 1, folderid);
+    psync_sql_bind_string(res, 2, name);
     if ((row=psync_sql_fetch_row(res)))
       psync_row_to_folder_stat(row, stbuf);
     psync_sql_free_result(res);
     if (row){
       if (folder)
         psync_fstask_release_folder_tasks_locked(folder);
-      psync_sql_unlock();
-      psync_free(fpath);
       return 0;
     }
   }
   if (folder){
     psync_fstask_mkdir_t *mk;
-    mk=psync_fstask_find_mkdir(folder, fpath->name, 0);
+    mk=psync_fstask_find_mkdir(folder, name, 0);
     if (mk){
       psync_mkdir_to_folder_stat(mk, stbuf);
       psync_fstask_release_folder_tasks_locked(folder);
-      psync_sql_unlock();
-      psync_free(fpath);
       return 0;
     }
   }
   res=psync_sql_query("SELECT name, size, ctime, mtime, id FROM file WHERE parentfolderid=? AND name=?");
-  psync_sql_bind_uint(res, 1, fpath->folderid);
-  psync_sql_bind_string(res, 2, fpath->name);
+  psync_sql_bind_uint(res, 1, folderid);
+  psync_sql_bind_string(res, 2, name);
   if ((row=psync_sql_fetch_row(res)))
     psync_row_to_file_stat(row, stbuf);
   psync_sql_free_result(res);
   if (folder){
-    if (psync_fstask_find_unlink(folder, fpath->name, 0))
+    if (psync_fstask_find_unlink(folder, name, 0))
       row=NULL;
-    if (!row && (cr=psync_fstask_find_creat(folder, fpath->name, 0)))
+    if (!row && (cr=psync_fstask_find_creat(folder, name, 0)))
       crr=psync_creat_to_file_stat(cr, stbuf);
     else
       crr=-1;
@@ -648,32 +657,42 @@ static int psync_fs_getattr(const char *path, struct FUSE_STAT *stbuf){
   }
   else
     crr=-1;
-  psync_sql_unlock();
-  psync_free(fpath);
   if (row || !crr)
     return 0;
-  debug(D_NOTICE, "returning ENOENT for %s", path);
   return -ENOENT;
 }
 
-static int psync_fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, fuse_off_t offset, struct fuse_file_info *fi){
+static int psync_fs_getattr(const char *path, struct FUSE_STAT *stbuf){
+  psync_fspath_t *fpath;
+  int ret;
+  psync_fs_set_thread_name();
+//  debug(D_NOTICE, "getattr %s", path);
+  if (path[0]=='/' && path[1]==0)
+    return psync_fs_getrootattr(stbuf);
+  psync_sql_lock();
+  CHECK_LOGIN_LOCKED();
+  fpath=psync_fsfolder_resolve_path(path);
+  if (!fpath){
+    psync_sql_unlock();
+    debug(D_NOTICE, "could not find path component of %s, returning ENOENT", path);
+    return -ENOENT;
+  }
+  ret=psync_fs_getattr_by_name_locked(fpath->folderid, fpath->name, stbuf);
+  psync_sql_unlock();
+  psync_fsfolder_free_path(fpath);
+  if (ret)
+    debug(D_NOTICE, "returning ENOENT for %s", path);
+  return ret;
+}
+
+static void psync_fs_readdir_by_folderid_locked(psync_fsfolderid_t folderid, void *buf, fuse_fill_dir_t filler){
   psync_sql_res *res;
   psync_variant_row row;
-  psync_fsfolderid_t folderid;
   psync_fstask_folder_t *folder;
   psync_tree *trel;
   const char *name;
   size_t namelen;
   struct FUSE_STAT st;
-  psync_fs_set_thread_name();
-  debug(D_NOTICE, "readdir %s", path);
-  psync_sql_lock();
-  CHECK_LOGIN_LOCKED();
-  folderid=psync_fsfolderid_by_path(path);
-  if (unlikely_log(folderid==PSYNC_INVALID_FSFOLDERID)){
-    psync_sql_unlock();
-    return -ENOENT;
-  }
   filler(buf, ".", NULL, 0);
   if (folderid!=0)
     filler(buf, "..", NULL, 0);
@@ -731,6 +750,20 @@ static int psync_fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler,
     }
     psync_fstask_release_folder_tasks_locked(folder);
   }
+}
+
+static int psync_fs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, fuse_off_t offset, struct fuse_file_info *fi){
+  psync_fsfolderid_t folderid;
+  psync_fs_set_thread_name();
+  debug(D_NOTICE, "readdir %s", path);
+  psync_sql_lock();
+  CHECK_LOGIN_LOCKED();
+  folderid=psync_fsfolderid_by_path(path);
+  if (unlikely_log(folderid==PSYNC_INVALID_FSFOLDERID)){
+    psync_sql_unlock();
+    return -ENOENT;
+  }
+  psync_fs_readdir_by_folderid_locked(folderid, buf, filler);
   psync_sql_unlock();
   return 0;
 }
@@ -800,6 +833,7 @@ static psync_openfile_t *psync_fs_create_file(psync_fsfileid_t fileid, psync_fsf
 
 int64_t psync_fs_load_interval_tree(psync_file_t fd, uint64_t size, psync_interval_tree_t **tree){
   index_record records[512];
+  psync_interval_t intervals[512];
   uint64_t cnt;
   uint64_t i;
   ssize_t rrd, rd, j;
@@ -814,23 +848,160 @@ int64_t psync_fs_load_interval_tree(psync_file_t fd, uint64_t size, psync_interv
     rrd=psync_file_pread(fd, records, rd*sizeof(index_record), i*sizeof(index_record)+sizeof(index_header));
     if (unlikely_log(rrd!=rd*sizeof(index_record)))
       return -1;
-    for (j=0; j<rd; j++)
-      psync_interval_tree_add(tree, records[j].offset, records[j].offset+records[j].length);
+    for (j=0; j<rd; j++){
+      intervals[j].from=records[j].offset;
+      intervals[j].to=records[j].offset+records[j].length;
+    }
+    psync_interval_tree_add_many(tree, intervals, rd);
   }
   if (IS_DEBUG && *tree){
-    psync_interval_tree_t *tr;
-    tr=*tree;
-    debug(D_NOTICE, "loaded approx %lu intervals", (unsigned long)1<<(tr->tree.height-1));
-    tr=psync_interval_tree_get_first(*tree);
+    psync_interval_tree_iter_t it;
+    const psync_interval_t *tr;
+    debug(D_NOTICE, "loaded %lu intervals", (unsigned long)psync_interval_tree_count(*tree));
+    tr=psync_interval_tree_get_first(*tree, &it);
     debug(D_NOTICE, "first interval from %lu to %lu", (unsigned long)tr->from, (unsigned long)tr->to);
-//    while ((tr=psync_interval_tree_get_next(tr)))
-//      debug(D_NOTICE, "next interval from %lu to %lu", (unsigned long)tr->from, (unsigned long)tr->to);
     tr=psync_interval_tree_get_last(*tree);
     debug(D_NOTICE, "last interval from %lu to %lu", (unsigned long)tr->from, (unsigned long)tr->to);
   }
   return cnt;
 }
 
+static char *psync_fs_get_cache_file_name(psync_fsfileid_t fileid, char type, const char *suffix){
+  char fileidhex[sizeof(psync_fsfileid_t)*2+2];
+  fileid=-fileid;
+  psync_binhex(fileidhex, &fileid, sizeof(psync_fsfileid_t));
+  fileidhex[sizeof(psync_fsfileid_t)]=type;
+  fileidhex[sizeof(psync_fsfileid_t)+1]=0;
+  return psync_strcat(psync_setting_get_string(_PS(fscachepath)), PSYNC_DIRECTORY_SEPARATOR, fileidhex, suffix, NULL);
+}
+
+/* Rewrites the index of a modified file as the merged set of intervals from writeintervals. The new index is written to a temporary
+ * file that replaces the old one only once it is synced, so a crash in the middle leaves the old (longer but correct) log in place.
+ */
+static void psync_fs_compact_index_locked(psync_openfile_t *of){
+  index_record records[512];
+  index_header hdr;
+  psync_interval_tree_iter_t it;
+  const psync_interval_t *tr;
+  char *filename, *tmpname;
+  psync_file_t fd;
+  uint64_t cnt, off;
+  psync_uint_t i;
+  cnt=psync_interval_tree_count(of->writeintervals);
+  if (cnt*PSYNC_FS_INDEX_COMPACT_RATIO>of->indexoff){
+    of->indexcompactat=of->indexoff*2;
+    return;
+  }
+  debug(D_NOTICE, "compacting index of file %s from %lu to %lu records", of->currentname, (unsigned long)of->indexoff, (unsigned long)cnt);
+  if (unlikely_log(psync_file_pread(of->indexfile, &hdr, sizeof(hdr), 0)!=sizeof(hdr))){
+    of->indexcompactat=of->indexoff*2;
+    return;
+  }
+  filename=psync_fs_get_cache_file_name(of->fileid, 'i', NULL);
+  tmpname=psync_strcat(filename, ".tmp", NULL);
+  fd=psync_file_open(tmpname, P_O_RDWR, P_O_CREAT|P_O_TRUNC);
+  if (unlikely_log(fd==INVALID_HANDLE_VALUE))
+    goto err0;
+  if (unlikely_log(psync_file_pwrite(fd, &hdr, sizeof(hdr), 0)!=sizeof(hdr)))
+    goto err1;
+  off=sizeof(hdr);
+  i=0;
+  for (tr=psync_interval_tree_get_first(of->writeintervals, &it); tr; tr=psync_interval_tree_get_next(&it)){
+    records[i].offset=tr->from;
+    records[i].length=tr->to-tr->from;
+    if (++i==ARRAY_SIZE(records)){
+      if (unlikely_log(psync_file_pwrite(fd, records, sizeof(records), off)!=sizeof(records)))
+        goto err1;
+      off+=sizeof(records);
+      i=0;
+    }
+  }
+  if (i && unlikely_log(psync_file_pwrite(fd, records, i*sizeof(index_record), off)!=i*sizeof(index_record)))
+    goto err1;
+  if (unlikely_log(psync_file_sync(fd)) || unlikely_log(psync_file_rename_overwrite(tmpname, filename)))
+    goto err1;
+  psync_file_close(of->indexfile);
+  of->indexfile=fd;
+  of->indexoff=cnt;
+  of->indexcompactat=cnt*PSYNC_FS_INDEX_COMPACT_RATIO;
+  if (of->indexcompactat<PSYNC_FS_INDEX_COMPACT_MIN)
+    of->indexcompactat=PSYNC_FS_INDEX_COMPACT_MIN;
+  psync_free(tmpname);
+  psync_free(filename);
+  return;
+err1:
+  psync_file_close(fd);
+  psync_file_delete(tmpname);
+err0:
+  psync_free(tmpname);
+  psync_free(filename);
+  of->indexcompactat=of->indexoff*2;
+}
+
+static int psync_fs_flush_index_locked(psync_openfile_t *of){
+  size_t len;
+  if (!of->indexpendingcnt)
+    return 0;
+  len=sizeof(index_record)*of->indexpendingcnt;
+  if (unlikely_log(psync_file_pwrite(of->indexfile, of->indexpending, len, sizeof(index_record)*of->indexoff+sizeof(index_header))!=len))
+    return -1;
+  of->indexoff+=of->indexpendingcnt;
+  of->indexpendingcnt=0;
+  if (of->indexoff>=of->indexcompactat)
+    psync_fs_compact_index_locked(of);
+  return 0;
+}
+
+static int psync_fs_add_index_record_locked(psync_openfile_t *of, uint64_t offset, uint64_t length){
+  index_record *rec;
+  if (of->indexpendingcnt){
+    rec=&of->indexpending[of->indexpendingcnt-1];
+    if (rec->offset+rec->length==offset){
+      rec->length+=length;
+      return 0;
+    }
+  }
+  else if (!of->indexpending)
+    of->indexpending=psync_new_cnt(index_record, PSYNC_FS_INDEX_PENDING_RECORDS);
+  rec=&of->indexpending[of->indexpendingcnt++];
+  rec->offset=offset;
+  rec->length=length;
+  if (of->indexpendingcnt==PSYNC_FS_INDEX_PENDING_RECORDS)
+    return psync_fs_flush_index_locked(of);
+  else
+    return 0;
+}
+
+static ssize_t psync_fs_write_direct_locked(psync_openfile_t *of, const char *buf, size_t size, uint64_t offset){
+  ssize_t bw;
+  bw=psync_file_pwrite(of->datafile, buf, size, offset);
+  if (unlikely_log(bw==-1) || of->newfile)
+    return bw;
+  if (unlikely_log(psync_fs_add_index_record_locked(of, offset, bw)))
+    return -1;
+  psync_interval_tree_add(&of->writeintervals, offset, offset+bw);
+  return bw;
+}
+
+/* Writes out the coalesced small writes of the file. On failure the data stays in the buffer, so the error is returned again by the
+ * next flush or fsync instead of being lost.
+ */
+static int psync_fs_writeback_flush_locked(psync_openfile_t *of){
+  if (!of->writebuflen)
+    return 0;
+  if (unlikely_log(psync_fs_write_direct_locked(of, of->writebuf, of->writebuflen, of->writebufoff)!=of->writebuflen))
+    return -1;
+  of->writebuflen=0;
+  return 0;
+}
+
+static int psync_fs_writeback_flush_range_locked(psync_openfile_t *of, uint64_t size, uint64_t offset){
+  if (of->writebuflen && offset<of->writebufoff+of->writebuflen && offset+size>of->writebufoff)
+    return psync_fs_writeback_flush_locked(of);
+  else
+    return 0;
+}
+
 static int load_interval_tree(psync_openfile_t *of){
   index_header hdr;
   int64_t ifs;
@@ -850,70 +1021,54 @@ static int load_interval_tree(psync_openfile_t *of){
     return -1;
   else{
     of->indexoff=ifs;
+    of->indexcompactat=PSYNC_FS_INDEX_COMPACT_MIN;
     return 0;
   }
 }
 
 static int open_write_files(psync_openfile_t *of, int trunc){
-  psync_fsfileid_t fileid;
-  const char *cachepath;
   char *filename;
-  char fileidhex[sizeof(psync_fsfileid_t)*2+2];
-  fileid=-of->fileid;
-  psync_binhex(fileidhex, &fileid, sizeof(psync_fsfileid_t));
-  fileidhex[sizeof(psync_fsfileid_t)]='d';
-  fileidhex[sizeof(psync_fsfileid_t)+1]=0;
-  cachepath=psync_setting_get_string(_PS(fscachepath));
   if (of->datafile==INVALID_HANDLE_VALUE){
-    filename=psync_strcat(cachepath, PSYNC_DIRECTORY_SEPARATOR, fileidhex, NULL);
+    filename=psync_fs_get_cache_file_name(of->fileid, 'd', NULL);
     of->datafile=psync_file_open(filename, P_O_RDWR, P_O_CREAT|(trunc?P_O_TRUNC:0));
-    psync_free(filename);
     if (of->datafile==INVALID_HANDLE_VALUE){
       debug(D_ERROR, "could not open cache file %s", filename);
+      psync_free(filename);
       return -EIO;
     }
+    psync_free(filename);
   }
   if (!of->newfile && of->indexfile==INVALID_HANDLE_VALUE){
-    fileidhex[sizeof(psync_fsfileid_t)]='i';
-    filename=psync_strcat(cachepath, PSYNC_DIRECTORY_SEPARATOR, fileidhex, NULL);
+    filename=psync_fs_get_cache_file_name(of->fileid, 'i', NULL);
     of->indexfile=psync_file_open(filename, P_O_RDWR, P_O_CREAT|(trunc?P_O_TRUNC:0));
-    psync_free(filename);
     if (of->indexfile==INVALID_HANDLE_VALUE){
       debug(D_ERROR, "could not open cache file %s", filename);
+      psync_free(filename);
       return -EIO;
     }
     if (load_interval_tree(of)){
       debug(D_ERROR, "could not load cache file %s to interval tree", filename);
+      psync_free(filename);
       return -EIO;
     }
+    psync_free(filename);
   }
   return 0;
 }
 
-static int psync_fs_open(const char *path, struct fuse_file_info *fi){
+/* Called with the sql lock held, releases it. fpath is not freed. */
+static int psync_fs_open_fpath_locked(psync_fspath_t *fpath, struct fuse_file_info *fi){
   psync_sql_res *res;
   psync_uint_row row;
   psync_fsfileid_t fileid;
   uint64_t size, hash, writeid;
-  psync_fspath_t *fpath;
   psync_fstask_creat_t *cr;
   psync_fstask_folder_t *folder;
   psync_openfile_t *of;
   int ret, status, type;
-  psync_fs_set_thread_name();
-  debug(D_NOTICE, "open %s", path);
   fileid=writeid=hash=size=0;
-  psync_sql_lock();
-  CHECK_LOGIN_LOCKED();
-  fpath=psync_fsfolder_resolve_path(path);
-  if (!fpath){
-    debug(D_NOTICE, "returning ENOENT for %s, folder not found", path);
-    psync_sql_unlock();
-    return -ENOENT;
-  }
   if ((fi->flags&3)!=O_RDONLY && !(fpath->permissions&PSYNC_PERM_MODIFY)){
     psync_sql_unlock();
-    psync_free(fpath);
     return -EACCES;
   }
   folder=psync_fstask_get_or_create_folder_tasks_locked(fpath->folderid);
@@ -954,7 +1109,6 @@ static int psync_fs_open(const char *path, struct fuse_file_info *fi){
         psync_fstask_release_folder_tasks_locked(folder);
         psync_sql_unlock();
         debug(D_NOTICE, "opening new file %ld %s", (long)fileid, fpath->name);
-        psync_free(fpath);
         of->newfile=1;
         of->releasedforupload=status!=1;
         ret=open_write_files(of, fi->flags&O_TRUNC);
@@ -996,7 +1150,6 @@ static int psync_fs_open(const char *path, struct fuse_file_info *fi){
       of=psync_fs_create_file(cr->fileid, fileid, size, hash, 1, writeid, psync_fstask_get_ref_locked(folder), fpath->name);
       psync_fstask_release_folder_tasks_locked(folder);
       psync_sql_unlock();
-      psync_free(fpath);
       of->newfile=0;
       of->releasedforupload=status!=1;
       ret=open_write_files(of, fi->flags&O_TRUNC);
@@ -1027,7 +1180,7 @@ static int psync_fs_open(const char *path, struct fuse_file_info *fi){
     psync_sql_free_result(res);
   }
   if (fi->flags&O_TRUNC || (fi->flags&O_CREAT && !row)){
-    debug(D_NOTICE, "truncating file %s", path);
+    debug(D_NOTICE, "truncating file %s", fpath->name);
     cr=psync_fstask_add_creat(folder, fpath->name);
     if (unlikely_log(!cr)){
       ret=-EIO;
@@ -1046,6 +1199,7 @@ static int psync_fs_open(const char *path, struct fuse_file_info *fi){
   else if (row){
     of=psync_fs_create_file(fileid, fileid, size, hash, 0, 0, psync_fstask_get_ref_locked(folder), fpath->name);
     fi->fh=openfile_to_fh(of);
+    psync_pagecache_prefetch_access_profile(of);
     ret=0;
   }
   else
@@ -1053,7 +1207,24 @@ static int psync_fs_open(const char *path, struct fuse_file_info *fi){
 ex0:
   psync_fstask_release_folder_tasks_locked(folder);
   psync_sql_unlock();
-  psync_free(fpath);
+  return ret;
+}
+
+static int psync_fs_open(const char *path, struct fuse_file_info *fi){
+  psync_fspath_t *fpath;
+  int ret;
+  psync_fs_set_thread_name();
+  debug(D_NOTICE, "open %s", path);
+  psync_sql_lock();
+  CHECK_LOGIN_LOCKED();
+  fpath=psync_fsfolder_resolve_path(path);
+  if (!fpath){
+    debug(D_NOTICE, "returning ENOENT for %s, folder not found", path);
+    psync_sql_unlock();
+    return -ENOENT;
+  }
+  ret=psync_fs_open_fpath_locked(fpath, fi);
+  psync_fsfolder_free_path(fpath);
   return ret;
 }
 
@@ -1095,48 +1266,32 @@ static int psync_fs_creat_fake_locked(psync_fspath_t *fpath, struct fuse_file_in
   of->newfile=0;
   of->modified=0;
   psync_sql_unlock();
-  psync_free(fpath);
   fi->fh=openfile_to_fh(of);
   return 0;
 }
 
-static int psync_fs_creat(const char *path, mode_t mode, struct fuse_file_info *fi){
-  psync_fspath_t *fpath;
+/* Called with the sql lock held, releases it. fpath is not freed. */
+static int psync_fs_creat_fpath_locked(psync_fspath_t *fpath, struct fuse_file_info *fi){
   psync_fstask_folder_t *folder;
   psync_fstask_creat_t *cr;
   psync_openfile_t *of;
   int ret;
-  psync_fs_set_thread_name();
-  debug(D_NOTICE, "creat %s", path);
-  psync_sql_lock();
-  CHECK_LOGIN_LOCKED();
-  fpath=psync_fsfolder_resolve_path(path);
-  if (!fpath){
-    debug(D_NOTICE, "returning ENOENT for %s, folder not found", path);
-    psync_sql_unlock();
-    return -ENOENT;
-  }
   if (unlikely(psync_fs_need_per_folder_refresh_const() && !memcmp(psync_fake_prefix, fpath->name, psync_fake_prefix_len)))
     return psync_fs_creat_fake_locked(fpath, fi);
   if (!(fpath->permissions&PSYNC_PERM_CREATE)){
     psync_sql_unlock();
-    psync_free(fpath);
     return -EACCES;
   }
   folder=psync_fstask_get_or_create_folder_tasks_locked(fpath->folderid);
   if (psync_fs_file_exists_in_folder(folder, fpath->name)){
     psync_fstask_release_folder_tasks_locked(folder);
-    debug(D_NOTICE, "file %s already exists, processing as open", path);
-    ret=psync_fs_open(path, fi);
-    psync_sql_unlock();
-    psync_free(fpath);
-    return ret;
+    debug(D_NOTICE, "file %s already exists, processing as open", fpath->name);
+    return psync_fs_open_fpath_locked(fpath, fi);
   }
   cr=psync_fstask_add_creat(folder, fpath->name);
   if (unlikely_log(!cr)){
     psync_fstask_release_folder_tasks_locked(folder);
     psync_sql_unlock();
-    psync_free(fpath);
     return -EIO;
   }
   of=psync_fs_create_file(cr->fileid, 0, 0, 0, 1, 0, psync_fstask_get_ref_locked(folder), fpath->name);
@@ -1151,21 +1306,37 @@ static int psync_fs_creat(const char *path, mode_t mode, struct fuse_file_info *
     folder=psync_fstask_get_or_create_folder_tasks_locked(fpath->folderid);
     if (folder){
       if ((cr=psync_fstask_find_creat(folder, fpath->name, 0))){
-        psync_tree_del(&folder->creats, &cr->tree);
+        psync_fstask_del_creat(folder, cr);
         psync_free(cr);
       }
       psync_fstask_release_folder_tasks_locked(folder);
     }
     psync_fs_dec_of_refcnt(of);
     psync_sql_unlock();
-    psync_free(fpath);
     return ret;
   }
-  psync_free(fpath);
   fi->fh=openfile_to_fh(of);
   return 0;
 }
 
+static int psync_fs_creat(const char *path, mode_t mode, struct fuse_file_info *fi){
+  psync_fspath_t *fpath;
+  int ret;
+  psync_fs_set_thread_name();
+  debug(D_NOTICE, "creat %s", path);
+  psync_sql_lock();
+  CHECK_LOGIN_LOCKED();
+  fpath=psync_fsfolder_resolve_path(path);
+  if (!fpath){
+    debug(D_NOTICE, "returning ENOENT for %s, folder not found", path);
+    psync_sql_unlock();
+    return -ENOENT;
+  }
+  ret=psync_fs_creat_fpath_locked(fpath, fi);
+  psync_fsfolder_free_path(fpath);
+  return ret;
+}
+
 void psync_fs_inc_of_refcnt_locked(psync_openfile_t *of){
   of->refcnt++;
 }
@@ -1178,6 +1349,8 @@ void psync_fs_inc_of_refcnt(psync_openfile_t *of){
 
 static void psync_fs_free_openfile(psync_openfile_t *of){
   debug(D_NOTICE, "releasing file %s", of->currentname);
+  if (of->profilecnt && !of->modified)
+    psync_pagecache_save_access_profile(of);
   if (of->deleted && of->fileid<0){
     psync_sql_res *res;
     debug(D_NOTICE, "file %s marked for deletion, releasing cancel tasks", of->currentname);
@@ -1187,10 +1360,16 @@ static void psync_fs_free_openfile(psync_openfile_t *of){
     psync_fsupload_wake();
   }
   pthread_mutex_destroy(&of->mutex);
-  if (of->datafile!=INVALID_HANDLE_VALUE)
+  if (of->datafile!=INVALID_HANDLE_VALUE){
+    psync_fs_writeback_flush_locked(of);
     psync_file_close(of->datafile);
-  if (of->indexfile!=INVALID_HANDLE_VALUE)
+  }
+  psync_free(of->writebuf);
+  if (of->indexfile!=INVALID_HANDLE_VALUE){
+    psync_fs_flush_index_locked(of);
     psync_file_close(of->indexfile);
+  }
+  psync_free(of->indexpending);
   if (of->writeintervals)
     psync_interval_tree_free(of->writeintervals);
   if (unlikely(psync_fs_need_per_folder_refresh_const() && of->fileid<psync_fake_fileid)){
@@ -1198,7 +1377,7 @@ static void psync_fs_free_openfile(psync_openfile_t *of){
     psync_sql_lock();
     cr=psync_fstask_find_creat(of->currentfolder, of->currentname, 0);
     if (cr){
-      psync_tree_del(&of->currentfolder->creats, &cr->tree);
+      psync_fstask_del_creat(of->currentfolder, cr);
       of->currentfolder->taskscnt--;
       psync_free(cr);
     }
@@ -1258,28 +1437,38 @@ static int psync_fs_flush(const char *path, struct fuse_file_info *fi){
   pthread_mutex_lock(&of->mutex);
   if (of->modified){
     psync_sql_res *res;
-    uint64_t writeid;
+    uint64_t writeid, size;
+    psync_fsfileid_t fileid;
     uint32_t aff;
+    if (unlikely_log(psync_fs_writeback_flush_locked(of)) || (!of->newfile && unlikely_log(psync_fs_flush_index_locked(of)))){
+      pthread_mutex_unlock(&of->mutex);
+      return -EIO;
+    }
     writeid=of->writeid;
+    size=of->currentsize;
+    fileid=of->fileid;
     of->releasedforupload=1;
     pthread_mutex_unlock(&of->mutex);
-    debug(D_NOTICE, "releasing file %s for upload, size=%lu, writeid=%u", path, (unsigned long)of->currentsize, (unsigned)of->writeid);
+    debug(D_NOTICE, "releasing file %s for upload, size=%lu, writeid=%u", path, (unsigned long)size, (unsigned)writeid);
     res=psync_sql_prep_statement("UPDATE fstask SET status=0, int1=? WHERE id=? AND status=1");
     psync_sql_bind_uint(res, 1, writeid);
-    psync_sql_bind_uint(res, 2, -of->fileid);
+    psync_sql_bind_uint(res, 2, -fileid);
     psync_sql_run(res);
     aff=psync_sql_affected_rows();
     psync_sql_free_result(res);
-    if (aff)
+    if (aff){
       psync_fsupload_wake();
+      psync_status_add_to_upload(1, size);
+      psync_status_send_update();
+    }
     else{
       res=psync_sql_prep_statement("UPDATE fstask SET int1=? WHERE id=? AND int1<?");
       psync_sql_bind_uint(res, 1, writeid);
-      psync_sql_bind_uint(res, 2, -of->fileid);
+      psync_sql_bind_uint(res, 2, -fileid);
       psync_sql_bind_uint(res, 3, writeid);
       psync_sql_run_free(res);
+      psync_status_recalc_to_upload_async();
     }
-    psync_status_recalc_to_upload_async();
     return 0;
   }
   pthread_mutex_unlock(&of->mutex);
@@ -1296,7 +1485,8 @@ static int psync_fs_fsync(const char *path, int datasync, struct fuse_file_info
     pthread_mutex_unlock(&of->mutex);
     return 0;
   }
-  if (unlikely_log(psync_file_sync(of->datafile)) || unlikely_log(!of->newfile && psync_file_sync(of->indexfile))){
+  if (unlikely_log(psync_fs_writeback_flush_locked(of)) || unlikely_log(psync_file_sync(of->datafile)) ||
+      unlikely_log(!of->newfile && (psync_fs_flush_index_locked(of) || psync_file_sync(of->indexfile)))){
     pthread_mutex_unlock(&of->mutex);
     return -EIO;
   }
@@ -1325,13 +1515,9 @@ static int psync_read_newfile(psync_openfile_t *of, char *buf, uint64_t size, ui
     return br;
 }
 
-static int psync_fs_read(const char *path, char *buf, size_t size, fuse_off_t offset, struct fuse_file_info *fi){
-  psync_openfile_t *of;
+static void psync_fs_account_read_locked(psync_openfile_t *of, size_t size, fuse_off_t offset){
   time_t currenttime;
-  psync_fs_set_thread_name();
-  of=fh_to_openfile(fi->fh);
   currenttime=psync_timer_time();
-  pthread_mutex_lock(&of->mutex);
   if (of->currentsec==currenttime){
     of->bytesthissec+=size;
     if (of->currentspeed<of->bytesthissec)
@@ -1347,6 +1533,16 @@ static int psync_fs_read(const char *path, char *buf, size_t size, fuse_off_t of
     of->currentsec=currenttime;
     of->bytesthissec=size;
   }
+  // with kernel readahead enabled async reads of a sequential stream can arrive slightly out of order
+  if (offset+PSYNC_FS_KERNEL_READAHEAD>=of->seqreadend && offset<=of->seqreadend+PSYNC_FS_KERNEL_READAHEAD)
+    of->seqreadbytes+=size;
+  else
+    of->seqreadbytes=size;
+  if (offset+size>of->seqreadend || of->seqreadbytes==size)
+    of->seqreadend=offset+size;
+}
+
+static int psync_fs_read_locked(psync_openfile_t *of, char *buf, size_t size, fuse_off_t offset){
   if (of->newfile){
     int ret=psync_read_newfile(of, buf, size, offset);
     pthread_mutex_unlock(&of->mutex);
@@ -1358,6 +1554,19 @@ static int psync_fs_read(const char *path, char *buf, size_t size, fuse_off_t of
     return psync_pagecache_read_unmodified_locked(of, buf, size, offset);
 }
 
+static int psync_fs_read(const char *path, char *buf, size_t size, fuse_off_t offset, struct fuse_file_info *fi){
+  psync_openfile_t *of;
+  psync_fs_set_thread_name();
+  of=fh_to_openfile(fi->fh);
+  pthread_mutex_lock(&of->mutex);
+  if (unlikely_log(psync_fs_writeback_flush_range_locked(of, size, offset))){
+    pthread_mutex_unlock(&of->mutex);
+    return -EIO;
+  }
+  psync_fs_account_read_locked(of, size, offset);
+  return psync_fs_read_locked(of, buf, size, offset);
+}
+
 static void psync_fs_inc_writeid_locked(psync_openfile_t *of){
   if (unlikely(of->releasedforupload)){
     if (unlikely(psync_sql_trylock())){
@@ -1384,13 +1593,8 @@ static int psync_fs_modfile_check_size_ok(psync_openfile_t *of, uint64_t size){
     if (of->newfile)
       return 0;
     else{
-      index_record rec;
-      uint64_t ioff;
       assertw(of->modified);
-      ioff=of->indexoff++;
-      rec.offset=of->currentsize;
-      rec.length=size-of->currentsize;
-      if (unlikely_log(psync_file_pwrite(of->indexfile, &rec, sizeof(rec), sizeof(rec)*ioff+sizeof(index_header))!=sizeof(rec)))
+      if (unlikely_log(psync_fs_add_index_record_locked(of, of->currentsize, size-of->currentsize)))
         return -1;
       psync_interval_tree_add(&of->writeintervals, of->currentsize, size);
       of->currentsize=size;
@@ -1399,44 +1603,70 @@ static int psync_fs_modfile_check_size_ok(psync_openfile_t *of, uint64_t size){
   return 0;
 }
 
-static int psync_fs_write(const char *path, const char *buf, size_t size, fuse_off_t offset, struct fuse_file_info *fi){
-  psync_openfile_t *of;
+/* Small writes that start inside or right after the pending write-back extent are copied to it, so a stream of small sequential writes
+ * turns into a few large pwrites (and index records). Writes never start past the current end of file, so everything outside of the
+ * pending extent is already in the data file and reads only need to flush it when they overlap.
+ */
+static int psync_fs_write_buffered_locked(psync_openfile_t *of, const char *buf, size_t size, fuse_off_t offset){
   ssize_t bw;
-  uint64_t ioff;
-  index_record rec;
+  if (size<PSYNC_FS_WRITEBACK_MAX_WRITE && offset<=of->currentsize){
+    if (of->writebuflen && (offset<of->writebufoff || offset>of->writebufoff+of->writebuflen ||
+                            offset+size>of->writebufoff+PSYNC_FS_WRITEBACK_BUFFER) && unlikely_log(psync_fs_writeback_flush_locked(of))){
+      pthread_mutex_unlock(&of->mutex);
+      return -EIO;
+    }
+    if (!of->writebuflen){
+      if (!of->writebuf)
+        of->writebuf=psync_new_cnt(char, PSYNC_FS_WRITEBACK_BUFFER);
+      of->writebufoff=offset;
+      of->writebuftime=psync_timer_time_ms();
+    }
+    memcpy(of->writebuf+(offset-of->writebufoff), buf, size);
+    if (offset+size-of->writebufoff>of->writebuflen)
+      of->writebuflen=offset+size-of->writebufoff;
+    bw=size;
+  }
+  else{
+    if (unlikely_log(psync_fs_writeback_flush_locked(of))){
+      pthread_mutex_unlock(&of->mutex);
+      return -EIO;
+    }
+    bw=psync_fs_write_direct_locked(of, buf, size, offset);
+    if (unlikely(bw==-1)){
+      pthread_mutex_unlock(&of->mutex);
+      return -EIO;
+    }
+  }
+  if (of->currentsize<offset+bw)
+    of->currentsize=offset+bw;
+  pthread_mutex_unlock(&of->mutex);
+  return bw;
+}
+
+static int psync_fs_write(const char *path, const char *buf, size_t size, fuse_off_t offset, struct fuse_file_info *fi){
+  psync_openfile_t *of;
+  int64_t freespc;
   int ret;
   psync_fs_set_thread_name();
   of=fh_to_openfile(fi->fh);
   debug(D_NOTICE, "write %s off=%lu size=%lu", of->currentname, (unsigned long)offset, (unsigned long)size);
   pthread_mutex_lock(&of->mutex);
-  if (of->writeid%256==0 && of->currentsize<=offset){
-    int64_t freespc=psync_get_free_space_by_path(psync_setting_get_string(_PS(fscachepath)));
-    if (likely_log(freespc!=-1)){
+  if (of->currentsize<offset+size){
+    freespc=fsfreespace;
+    if (freespc!=-1){
       if (freespc>=psync_setting_get_uint(_PS(minlocalfreespace)))
         psync_set_local_full(0);
       else{
         pthread_mutex_unlock(&of->mutex);
         psync_set_local_full(1);
-//        while (psync_get_free_space_by_path(psync_setting_get_string(_PS(fscachepath)))<psync_setting_get_uint(_PS(minlocalfreespace)))
-//          psync_milisleep(1000);
-//        psync_set_local_full(0);
-//        pthread_mutex_lock(&of->mutex);
         return -ENOSPC;
       }
     }
   }
   psync_fs_inc_writeid_locked(of);
 retry:
-  if (of->newfile){
-    bw=psync_file_pwrite(of->datafile, buf, size, offset);
-    if (of->currentsize<offset+size && bw!=-1)
-      of->currentsize=offset+size;
-    pthread_mutex_unlock(&of->mutex);
-    if (unlikely_log(bw==-1))
-      return -EIO;
-    else
-      return bw;
-  }
+  if (of->newfile)
+    return psync_fs_write_buffered_locked(of, buf, size, offset);
   else{
     if (unlikely(!of->modified)){
       psync_fstask_creat_t *cr;
@@ -1499,25 +1729,11 @@ retry:
       of->modified=1;
       of->indexoff=0;
     }
-    if (unlikely_log(psync_fs_modfile_check_size_ok(of, offset)))
-      return -1;
-    ioff=of->indexoff++;
-    bw=psync_file_pwrite(of->datafile, buf, size, offset);
-    if (unlikely_log(bw==-1)){
-      pthread_mutex_unlock(&of->mutex);
-      return -EIO;
-    }
-    rec.offset=offset;
-    rec.length=bw;
-    if (unlikely_log(psync_file_pwrite(of->indexfile, &rec, sizeof(rec), sizeof(rec)*ioff+sizeof(index_header))!=sizeof(rec))){
+    if (unlikely_log(psync_fs_modfile_check_size_ok(of, offset))){
       pthread_mutex_unlock(&of->mutex);
       return -EIO;
     }
-    psync_interval_tree_add(&of->writeintervals, offset, offset+bw);
-    if (of->currentsize<offset+size)
-      of->currentsize=offset+size;
-    pthread_mutex_unlock(&of->mutex);
-    return bw;
+    return psync_fs_write_buffered_locked(of, buf, size, offset);
   }
 }
 
@@ -1536,7 +1752,7 @@ static int psync_fs_mkdir(const char *path, mode_t mode){
   else
     ret=psync_fstask_mkdir(fpath->folderid, fpath->name);
   psync_sql_unlock();
-  psync_free(fpath);
+  psync_fsfolder_free_path(fpath);
   debug(D_NOTICE, "mkdir %s=%d", path, ret);
   return ret;
 }
@@ -1556,7 +1772,7 @@ static int psync_fs_can_rmdir(const char *path){
   else
     ret=psync_fstask_can_rmdir(fpath->folderid, fpath->name);
   psync_sql_unlock();
-  psync_free(fpath);
+  psync_fsfolder_free_path(fpath);
   debug(D_NOTICE, "can_rmdir %s=%d", path, ret);
   return ret;
 }
@@ -1577,7 +1793,7 @@ static int psync_fs_rmdir(const char *path){
   else
     ret=psync_fstask_rmdir(fpath->folderid, fpath->name);
   psync_sql_unlock();
-  psync_free(fpath);
+  psync_fsfolder_free_path(fpath);
   debug(D_NOTICE, "rmdir %s=%d", path, ret);
   return ret;
 }
@@ -1597,7 +1813,7 @@ static int psync_fs_can_unlink(const char *path){
   else
     ret=psync_fstask_can_unlink(fpath->folderid, fpath->name);
   psync_sql_unlock();
-  psync_free(fpath);
+  psync_fsfolder_free_path(fpath);
   debug(D_NOTICE, "can_unlink %s=%d", path, ret);
   return ret;
 }
@@ -1618,7 +1834,7 @@ static int psync_fs_unlink(const char *path){
   else
     ret=psync_fstask_unlink(fpath->folderid, fpath->name);
   psync_sql_unlock();
-  psync_free(fpath);
+  psync_fsfolder_free_path(fpath);
   debug(D_NOTICE, "unlink %s=%d", path, ret);
   return ret;
 }
@@ -1770,8 +1986,8 @@ static int psync_fs_is_nonempty_folder(psync_fsfolderid_t folderid, const char *
   return ret;
 }
 
-static int psync_fs_rename(const char *old_path, const char *new_path){
-  psync_fspath_t *fold_path, *fnew_path;
+/* Called with the sql lock held, fold_path and fnew_path are not freed. */
+static int psync_fs_rename_fpath_locked(psync_fspath_t *fold_path, psync_fspath_t *fnew_path){
   psync_sql_res *res;
   psync_fstask_folder_t *folder;
   psync_fstask_mkdir_t *mkdir;
@@ -1779,15 +1995,6 @@ static int psync_fs_rename(const char *old_path, const char *new_path){
   psync_uint_row row;
   psync_fileorfolderid_t fid;
   int ret;
-  psync_fs_set_thread_name();
-  debug(D_NOTICE, "rename %s to %s", old_path, new_path);
-  folder=NULL;
-  psync_sql_lock();
-  CHECK_LOGIN_LOCKED();
-  fold_path=psync_fsfolder_resolve_path(old_path);
-  fnew_path=psync_fsfolder_resolve_path(new_path);
-  if (!fold_path || !fnew_path)
-    goto err_enoent;
   folder=psync_fstask_get_folder_tasks_locked(fold_path->folderid);
   if (folder){
     if ((mkdir=psync_fstask_find_mkdir(folder, fold_path->name, 0))){
@@ -1839,23 +2046,35 @@ static int psync_fs_rename(const char *old_path, const char *new_path){
     }
     psync_sql_free_result(res);
   }
-  goto err_enoent;
+  ret=-ENOENT;
 finish:
   if (folder)
     psync_fstask_release_folder_tasks_locked(folder);
+  return ret;
+}
+
+static int psync_fs_rename(const char *old_path, const char *new_path){
+  psync_fspath_t *fold_path, *fnew_path;
+  int ret;
+  psync_fs_set_thread_name();
+  debug(D_NOTICE, "rename %s to %s", old_path, new_path);
+  psync_sql_lock();
+  CHECK_LOGIN_LOCKED();
+  fold_path=psync_fsfolder_resolve_path(old_path);
+  fnew_path=psync_fsfolder_resolve_path(new_path);
+  if (!fold_path || !fnew_path){
+    psync_sql_unlock();
+    psync_fsfolder_free_path(fold_path);
+    psync_fsfolder_free_path(fnew_path);
+    debug(D_NOTICE, "returning ENOENT, folder not found");
+    return -ENOENT;
+  }
+  ret=psync_fs_rename_fpath_locked(fold_path, fnew_path);
   psync_sql_unlock();
-  psync_free(fold_path);
-  psync_free(fnew_path);
+  psync_fsfolder_free_path(fold_path);
+  psync_fsfolder_free_path(fnew_path);
   debug(D_NOTICE, "rename %s to %s=%d", old_path, new_path, ret);
   return ret;
-err_enoent:
-  if (folder)
-    psync_fstask_release_folder_tasks_locked(folder);
-  psync_sql_unlock();
-  psync_free(fold_path);
-  psync_free(fnew_path);
-  debug(D_NOTICE, "returning ENOENT, folder not found");
-  return -ENOENT;
 }
 
 static int psync_fs_statfs(const char *path, struct statvfs *stbuf){
@@ -1908,6 +2127,10 @@ static int psync_fs_ftruncate(const char *path, fuse_off_t size, struct fuse_fil
   of=fh_to_openfile(fi->fh);
   pthread_mutex_lock(&of->mutex);
   psync_fs_inc_writeid_locked(of);
+  if (unlikely_log(psync_fs_writeback_flush_locked(of))){
+    pthread_mutex_unlock(&of->mutex);
+    return -EIO;
+  }
 retry:
   if (unlikely(!of->newfile && !of->modified)){
     psync_fstask_creat_t *cr;
@@ -1982,15 +2205,1028 @@ static void *psync_fs_init(struct fuse_conn_info *conn){
 #if defined(FUSE_CAP_BIG_WRITES)
   conn->want|=FUSE_CAP_BIG_WRITES;
 #endif
-  conn->max_readahead=0;
+  conn->max_readahead=PSYNC_FS_KERNEL_READAHEAD;
   conn->max_write=FS_MAX_WRITE;
   return 0;
 }
 
+/* Latency of the operations as seen by fuse, both interfaces record to the same histogram. The wrappers are only what is
+ * registered with fuse, operations that call each other internally are not counted twice.
+ */
+PSYNC_METRIC_HISTOGRAM(metric_fs_lookup, "fs_lookup_usec");
+PSYNC_METRIC_HISTOGRAM(metric_fs_getattr, "fs_getattr_usec");
+PSYNC_METRIC_HISTOGRAM(metric_fs_setattr, "fs_setattr_usec");
+PSYNC_METRIC_HISTOGRAM(metric_fs_readdir, "fs_readdir_usec");
+PSYNC_METRIC_HISTOGRAM(metric_fs_open, "fs_open_usec");
+PSYNC_METRIC_HISTOGRAM(metric_fs_create, "fs_create_usec");
+PSYNC_METRIC_HISTOGRAM(metric_fs_read, "fs_read_usec");
+PSYNC_METRIC_HISTOGRAM(metric_fs_write, "fs_write_usec");
+PSYNC_METRIC_HISTOGRAM(metric_fs_flush, "fs_flush_usec");
+PSYNC_METRIC_HISTOGRAM(metric_fs_release, "fs_release_usec");
+PSYNC_METRIC_HISTOGRAM(metric_fs_fsync, "fs_fsync_usec");
+PSYNC_METRIC_HISTOGRAM(metric_fs_mkdir, "fs_mkdir_usec");
+PSYNC_METRIC_HISTOGRAM(metric_fs_rmdir, "fs_rmdir_usec");
+PSYNC_METRIC_HISTOGRAM(metric_fs_unlink, "fs_unlink_usec");
+PSYNC_METRIC_HISTOGRAM(metric_fs_rename, "fs_rename_usec");
+
+#define PSYNC_FS_TIMED_OP(func, metric, params, args)\
+  static int func##_timed params{\
+    uint64_t start;\
+    int ret;\
+    start=psync_metric_time();\
+    ret=func args;\
+    psync_metric_record_since(&metric_fs_##metric, start);\
+    return ret;\
+  }
+
+#define PSYNC_FS_TIMED_LL_OP(func, metric, params, args)\
+  static void func##_timed params{\
+    uint64_t start;\
+    start=psync_metric_time();\
+    func args;\
+    psync_metric_record_since(&metric_fs_##metric, start);\
+  }
+
+PSYNC_FS_TIMED_OP(psync_fs_getattr, getattr, (const char *path, struct FUSE_STAT *stbuf), (path, stbuf))
+PSYNC_FS_TIMED_OP(psync_fs_readdir, readdir, (const char *path, void *buf, fuse_fill_dir_t filler, fuse_off_t offset, struct fuse_file_info *fi),
+                  (path, buf, filler, offset, fi))
+PSYNC_FS_TIMED_OP(psync_fs_open, open, (const char *path, struct fuse_file_info *fi), (path, fi))
+PSYNC_FS_TIMED_OP(psync_fs_creat, create, (const char *path, mode_t mode, struct fuse_file_info *fi), (path, mode, fi))
+PSYNC_FS_TIMED_OP(psync_fs_read, read, (const char *path, char *buf, size_t size, fuse_off_t offset, struct fuse_file_info *fi),
+                  (path, buf, size, offset, fi))
+PSYNC_FS_TIMED_OP(psync_fs_write, write, (const char *path, const char *buf, size_t size, fuse_off_t offset, struct fuse_file_info *fi),
+                  (path, buf, size, offset, fi))
+PSYNC_FS_TIMED_OP(psync_fs_flush, flush, (const char *path, struct fuse_file_info *fi), (path, fi))
+PSYNC_FS_TIMED_OP(psync_fs_release, release, (const char *path, struct fuse_file_info *fi), (path, fi))
+PSYNC_FS_TIMED_OP(psync_fs_fsync, fsync, (const char *path, int datasync, struct fuse_file_info *fi), (path, datasync, fi))
+PSYNC_FS_TIMED_OP(psync_fs_mkdir, mkdir, (const char *path, mode_t mode), (path, mode))
+PSYNC_FS_TIMED_OP(psync_fs_rmdir, rmdir, (const char *path), (path))
+PSYNC_FS_TIMED_OP(psync_fs_unlink, unlink, (const char *path), (path))
+PSYNC_FS_TIMED_OP(psync_fs_rename, rename, (const char *old_path, const char *new_path), (old_path, new_path))
+PSYNC_FS_TIMED_OP(psync_fs_ftruncate, setattr, (const char *path, fuse_off_t size, struct fuse_file_info *fi), (path, size, fi))
+PSYNC_FS_TIMED_OP(psync_fs_truncate, setattr, (const char *path, fuse_off_t size), (path, size))
+
+#if defined(PSYNC_FS_HAS_LOWLEVEL)
+
+/* Low-level (inode based) interface. Inode numbers are derived from st_ino (and therefore from folderid, fileid or taskid), the
+ * kernel references them by lookup count. Every node remembers its parent and name, so operations that are implemented on top of
+ * paths can rebuild the path without walking the folder table. Lock order is sql_lock -> llmutex.
+ */
+
+#define LL_HASH_SIZE 4096
+
+typedef struct _psync_fs_ll_node_t {
+  psync_list list;
+  psync_list siblings;
+  psync_list children;
+  struct _psync_fs_ll_node_t *parent;
+  fuse_ino_t ino;
+  uint64_t nlookup;
+  psync_fsfolderid_t folderid;
+  char *name;
+  unsigned char isdir;
+} psync_fs_ll_node_t;
+
+typedef struct {
+  fuse_req_t req;
+  char *buf;
+  size_t len;
+  size_t alloc;
+} psync_fs_ll_dir_t;
+
+static struct fuse_session *psync_fuse_session=NULL;
+static int psync_fuse_lowlevel=0;
+static pthread_mutex_t llmutex=PTHREAD_MUTEX_INITIALIZER;
+static psync_list llhash[LL_HASH_SIZE];
+static psync_fs_ll_node_t llroot;
+
+#define stat_to_ll_ino(st) ((fuse_ino_t)((st)->st_ino+1))
+
+static void psync_fs_ll_init_table(){
+  psync_uint_t i;
+  for (i=0; i<LL_HASH_SIZE; i++)
+    psync_list_init(&llhash[i]);
+  memset(&llroot, 0, sizeof(llroot));
+  psync_list_init(&llroot.siblings);
+  psync_list_init(&llroot.children);
+  llroot.ino=FUSE_ROOT_ID;
+  llroot.nlookup=1;
+  llroot.folderid=0;
+  llroot.name="";
+  llroot.isdir=1;
+}
+
+static void psync_fs_ll_free_node_locked(psync_fs_ll_node_t *node){
+  psync_fs_ll_node_t *parent;
+  while (node && node!=&llroot && !node->nlookup && psync_list_isempty(&node->children)){
+    parent=node->parent;
+    psync_list_del(&node->list);
+    psync_list_del(&node->siblings);
+    psync_free(node->name);
+    psync_free(node);
+    node=parent;
+  }
+}
+
+static void psync_fs_ll_clean_table(){
+  psync_fs_ll_node_t *node;
+  psync_list *l1, *l2;
+  psync_uint_t i;
+  pthread_mutex_lock(&llmutex);
+  for (i=0; i<LL_HASH_SIZE; i++)
+    psync_list_for_each_safe(l1, l2, &llhash[i]){
+      node=psync_list_element(l1, psync_fs_ll_node_t, list);
+      psync_free(node->name);
+      psync_free(node);
+    }
+  psync_fs_ll_init_table();
+  pthread_mutex_unlock(&llmutex);
+}
+
+static psync_fs_ll_node_t *psync_fs_ll_find_locked(fuse_ino_t ino){
+  psync_fs_ll_node_t *node;
+  if (ino==FUSE_ROOT_ID)
+    return &llroot;
+  psync_list_for_each_element(node, &llhash[ino%LL_HASH_SIZE], psync_fs_ll_node_t, list)
+    if (node->ino==ino)
+      return node;
+  return NULL;
+}
+
+static psync_fs_ll_node_t *psync_fs_ll_find_child_locked(psync_fs_ll_node_t *parent, const char *name){
+  psync_fs_ll_node_t *node;
+  psync_list_for_each_element(node, &parent->children, psync_fs_ll_node_t, siblings)
+    if (!strcmp(node->name, name))
+      return node;
+  return NULL;
+}
+
+static void psync_fs_ll_move_node_locked(psync_fs_ll_node_t *node, psync_fs_ll_node_t *parent, const char *name){
+  psync_fs_ll_node_t *oldparent;
+  if (node->parent!=parent){
+    oldparent=node->parent;
+    psync_list_del(&node->siblings);
+    psync_list_add_tail(&parent->children, &node->siblings);
+    node->parent=parent;
+    psync_fs_ll_free_node_locked(oldparent);
+  }
+  if (strcmp(node->name, name)){
+    psync_free(node->name);
+    node->name=psync_strdup(name);
+  }
+}
+
+/* The entry is gone (unlinked or replaced by a rename) but the kernel may still hold references to the inode, so the node is only
+ * taken out of the tree. Paths of detached nodes can not be built and it is freed once forgotten. */
+static void psync_fs_ll_detach_child_locked(psync_fs_ll_node_t *parent, const char *name){
+  psync_fs_ll_node_t *node;
+  node=psync_fs_ll_find_child_locked(parent, name);
+  if (!node)
+    return;
+  psync_list_del(&node->siblings);
+  psync_list_init(&node->siblings);
+  node->parent=NULL;
+  psync_fs_ll_free_node_locked(node);
+}
+
+static void psync_fs_ll_detach_entry(fuse_ino_t parentino, const char *name){
+  psync_fs_ll_node_t *parent;
+  pthread_mutex_lock(&llmutex);
+  parent=psync_fs_ll_find_locked(parentino);
+  if (parent)
+    psync_fs_ll_detach_child_locked(parent, name);
+  pthread_mutex_unlock(&llmutex);
+}
+
+static int psync_fs_ll_add_entry(fuse_ino_t parentino, const char *name, const struct FUSE_STAT *st){
+  psync_fs_ll_node_t *parent, *node;
+  fuse_ino_t ino;
+  ino=stat_to_ll_ino(st);
+  if (unlikely_log(ino==FUSE_ROOT_ID))
+    return -EIO;
+  pthread_mutex_lock(&llmutex);
+  parent=psync_fs_ll_find_locked(parentino);
+  if (unlikely_log(!parent)){
+    pthread_mutex_unlock(&llmutex);
+    return -ENOENT;
+  }
+  node=psync_fs_ll_find_locked(ino);
+  if (node){
+    node->nlookup++;
+    psync_fs_ll_move_node_locked(node, parent, name);
+  }
+  else{
+    node=psync_new(psync_fs_ll_node_t);
+    psync_list_add_tail(&llhash[ino%LL_HASH_SIZE], &node->list);
+    psync_list_add_tail(&parent->children, &node->siblings);
+    psync_list_init(&node->children);
+    node->parent=parent;
+    node->ino=ino;
+    node->nlookup=1;
+    if (S_ISDIR(st->st_mode) && st->st_ino%3==0)
+      node->folderid=st->st_ino/3;
+    else
+      node->folderid=PSYNC_INVALID_FSFOLDERID;
+    node->name=psync_strdup(name);
+    node->isdir=S_ISDIR(st->st_mode)?1:0;
+  }
+  pthread_mutex_unlock(&llmutex);
+  return 0;
+}
+
+static void psync_fs_ll_forget_locked(fuse_ino_t ino, uint64_t nlookup){
+  psync_fs_ll_node_t *node;
+  node=psync_fs_ll_find_locked(ino);
+  if (unlikely_log(!node) || node==&llroot)
+    return;
+  if (unlikely_log(node->nlookup<nlookup))
+    node->nlookup=0;
+  else
+    node->nlookup-=nlookup;
+  psync_fs_ll_free_node_locked(node);
+}
+
+static char *psync_fs_ll_path_locked(psync_fs_ll_node_t *node, const char *name){
+  psync_fs_ll_node_t *n;
+  char *ret, *end;
+  size_t len, nlen;
+  len=name?strlen(name)+1:0;
+  for (n=node; n!=&llroot; n=n->parent){
+    if (unlikely_log(!n))
+      return NULL;
+    len+=strlen(n->name)+1;
+  }
+  if (!len)
+    return psync_strdup("/");
+  ret=psync_new_cnt(char, len+1);
+  end=ret+len;
+  *end=0;
+  if (name){
+    nlen=strlen(name);
+    end-=nlen;
+    memcpy(end, name, nlen);
+    *--end='/';
+  }
+  for (n=node; n!=&llroot; n=n->parent){
+    nlen=strlen(n->name);
+    end-=nlen;
+    memcpy(end, n->name, nlen);
+    *--end='/';
+  }
+  return ret;
+}
+
+static char *psync_fs_ll_path(fuse_ino_t ino, const char *name){
+  psync_fs_ll_node_t *node;
+  char *ret;
+  pthread_mutex_lock(&llmutex);
+  node=psync_fs_ll_find_locked(ino);
+  if (likely_log(node))
+    ret=psync_fs_ll_path_locked(node, name);
+  else
+    ret=NULL;
+  pthread_mutex_unlock(&llmutex);
+  return ret;
+}
+
+static psync_fsfolderid_t psync_fs_ll_folderid_locked(fuse_ino_t ino){
+  psync_fs_ll_node_t *node;
+  psync_fsfolderid_t folderid;
+  char *path;
+  pthread_mutex_lock(&llmutex);
+  node=psync_fs_ll_find_locked(ino);
+  if (!node){
+    pthread_mutex_unlock(&llmutex);
+    return PSYNC_INVALID_FSFOLDERID;
+  }
+  folderid=node->folderid;
+  if (folderid!=PSYNC_INVALID_FSFOLDERID){
+    pthread_mutex_unlock(&llmutex);
+    return folderid;
+  }
+  path=psync_fs_ll_path_locked(node, NULL);
+  pthread_mutex_unlock(&llmutex);
+  if (!path)
+    return PSYNC_INVALID_FSFOLDERID;
+  folderid=psync_fsfolderid_by_path(path);
+  psync_free(path);
+  return folderid;
+}
+
+static int psync_fs_ll_getattr_by_name(fuse_ino_t parent, const char *name, struct FUSE_STAT *st){
+  psync_fsfolderid_t folderid;
+  int ret;
+  psync_sql_lock();
+  CHECK_LOGIN_LOCKED();
+  folderid=psync_fs_ll_folderid_locked(parent);
+  if (folderid==PSYNC_INVALID_FSFOLDERID)
+    ret=-ENOENT;
+  else
+    ret=psync_fs_getattr_by_name_locked(folderid, name, st);
+  psync_sql_unlock();
+  return ret;
+}
+
+static void psync_fs_ll_reply_entry(fuse_req_t req, fuse_ino_t parent, const char *name, struct fuse_file_info *fi){
+  struct fuse_entry_param e;
+  int ret;
+  memset(&e, 0, sizeof(e));
+  ret=psync_fs_ll_getattr_by_name(parent, name, &e.attr);
+  if (!ret)
+    ret=psync_fs_ll_add_entry(parent, name, &e.attr);
+  if (ret){
+    if (fi)
+      psync_fs_release("", fi);
+    fuse_reply_err(req, -ret);
+    return;
+  }
+  e.ino=stat_to_ll_ino(&e.attr);
+  e.attr.st_ino=e.ino;
+  e.attr_timeout=PSYNC_FS_ATTR_TIMEOUT;
+  e.entry_timeout=PSYNC_FS_ENTRY_TIMEOUT;
+  if (fi){
+    if (fuse_reply_create(req, &e, fi)==-ENOENT){
+      pthread_mutex_lock(&llmutex);
+      psync_fs_ll_forget_locked(e.ino, 1);
+      pthread_mutex_unlock(&llmutex);
+      psync_fs_release("", fi);
+    }
+  }
+  else if (fuse_reply_entry(req, &e)==-ENOENT){
+    pthread_mutex_lock(&llmutex);
+    psync_fs_ll_forget_locked(e.ino, 1);
+    pthread_mutex_unlock(&llmutex);
+  }
+}
+
+static void psync_fs_ll_init(void *userdata, struct fuse_conn_info *conn){
+  psync_fs_init(conn);
+#if defined(FUSE_CAP_SPLICE_WRITE)
+  conn->want|=FUSE_CAP_SPLICE_WRITE;
+#endif
+#if defined(FUSE_CAP_SPLICE_MOVE)
+  conn->want|=FUSE_CAP_SPLICE_MOVE;
+#endif
+}
+
+static void psync_fs_ll_lookup(fuse_req_t req, fuse_ino_t parent, const char *name){
+  psync_fs_set_thread_name();
+  psync_fs_ll_reply_entry(req, parent, name, NULL);
+}
+
+static void psync_fs_ll_forget(fuse_req_t req, fuse_ino_t ino, unsigned long nlookup){
+  pthread_mutex_lock(&llmutex);
+  psync_fs_ll_forget_locked(ino, nlookup);
+  pthread_mutex_unlock(&llmutex);
+  fuse_reply_none(req);
+}
+
+static void psync_fs_ll_forget_multi(fuse_req_t req, size_t count, struct fuse_forget_data *forgets){
+  size_t i;
+  pthread_mutex_lock(&llmutex);
+  for (i=0; i<count; i++)
+    psync_fs_ll_forget_locked(forgets[i].ino, forgets[i].nlookup);
+  pthread_mutex_unlock(&llmutex);
+  fuse_reply_none(req);
+}
+
+/* Returns the name of ino and sets *parent, NULL if the node is not known or is detached. *isdir is always set for known nodes. */
+static char *psync_fs_ll_parent_and_name(fuse_ino_t ino, fuse_ino_t *parent, int *isdir){
+  psync_fs_ll_node_t *node;
+  char *name;
+  pthread_mutex_lock(&llmutex);
+  node=psync_fs_ll_find_locked(ino);
+  if (likely_log(node)){
+    *isdir=node->isdir;
+    if (node->parent){
+      *parent=node->parent->ino;
+      name=psync_strdup(node->name);
+    }
+    else
+      name=NULL;
+  }
+  else{
+    *isdir=0;
+    name=NULL;
+  }
+  pthread_mutex_unlock(&llmutex);
+  return name;
+}
+
+/* An open file that was unlinked or replaced by a rename has no name to be looked up by, only its size is known. */
+static void psync_fs_ll_openfile_stat(psync_openfile_t *of, struct FUSE_STAT *st){
+  uint64_t size;
+  pthread_mutex_lock(&of->mutex);
+  size=of->currentsize;
+  pthread_mutex_unlock(&of->mutex);
+  psync_creat_stat_fake_file(st);
+  st->st_nlink=0;
+  st->st_size=size;
+#if defined(P_OS_POSIX)
+  st->st_blocks=(size+511)/512;
+#endif
+}
+
+static int psync_fs_ll_stat(fuse_ino_t ino, struct fuse_file_info *fi, struct FUSE_STAT *st){
+  psync_openfile_t *of;
+  fuse_ino_t parent;
+  char *name;
+  int ret, isdir;
+  if (ino==FUSE_ROOT_ID)
+    ret=psync_fs_getrootattr(st);
+  else{
+    name=psync_fs_ll_parent_and_name(ino, &parent, &isdir);
+    /* fi of directories carries the opendir buffer, not an open file */
+    of=fi && !isdir?fh_to_openfile(fi->fh):NULL;
+    if (name){
+      ret=psync_fs_ll_getattr_by_name(parent, name, st);
+      psync_free(name);
+    }
+    else
+      ret=-ENOENT;
+    if (of){
+      if (ret==-ENOENT){
+        psync_fs_ll_openfile_stat(of, st);
+        ret=0;
+      }
+      else if (!ret){
+        pthread_mutex_lock(&of->mutex);
+        st->st_size=of->currentsize;
+        pthread_mutex_unlock(&of->mutex);
+#if defined(P_OS_POSIX)
+        st->st_blocks=(st->st_size+511)/512;
+#endif
+      }
+    }
+  }
+  st->st_ino=ino;
+  return ret;
+}
+
+static void psync_fs_ll_getattr(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi){
+  struct FUSE_STAT st;
+  int ret;
+  psync_fs_set_thread_name();
+  ret=psync_fs_ll_stat(ino, fi, &st);
+  if (ret)
+    fuse_reply_err(req, -ret);
+  else
+    fuse_reply_attr(req, &st, PSYNC_FS_ATTR_TIMEOUT);
+}
+
+/* Called with the sql lock held, the result refers to name and is freed with psync_fsfolder_free_path(). */
+static psync_fspath_t *psync_fs_ll_fspath_locked(fuse_ino_t parent, const char *name){
+  psync_fsfolderid_t folderid;
+  folderid=psync_fs_ll_folderid_locked(parent);
+  if (folderid==PSYNC_INVALID_FSFOLDERID)
+    return NULL;
+  return psync_fsfolder_path_by_folderid(folderid, name);
+}
+
+static int psync_fs_ll_open_by_name(fuse_ino_t parent, const char *name, struct fuse_file_info *fi, int creat){
+  psync_fspath_t *fpath;
+  int ret;
+  psync_sql_lock();
+  CHECK_LOGIN_LOCKED();
+  fpath=psync_fs_ll_fspath_locked(parent, name);
+  if (!fpath){
+    psync_sql_unlock();
+    debug(D_NOTICE, "returning ENOENT for %s, folder not found", name);
+    return -ENOENT;
+  }
+  if (creat)
+    ret=psync_fs_creat_fpath_locked(fpath, fi);
+  else
+    ret=psync_fs_open_fpath_locked(fpath, fi);
+  psync_fsfolder_free_path(fpath);
+  return ret;
+}
+
+static int psync_fs_ll_open_ino(fuse_ino_t ino, struct fuse_file_info *fi){
+  fuse_ino_t parent;
+  char *name;
+  int ret, isdir;
+  name=psync_fs_ll_parent_and_name(ino, &parent, &isdir);
+  if (!name)
+    return -ENOENT;
+  debug(D_NOTICE, "open %s", name);
+  ret=psync_fs_ll_open_by_name(parent, name, fi, 0);
+  psync_free(name);
+  return ret;
+}
+
+static int psync_fs_ll_truncate(fuse_ino_t ino, fuse_off_t size){
+  struct fuse_file_info fi;
+  int ret;
+  memset(&fi, 0, sizeof(fi));
+  ret=psync_fs_ll_open_ino(ino, &fi);
+  if (ret)
+    return ret;
+  ret=psync_fs_ftruncate("", size, &fi);
+  psync_fs_flush("", &fi);
+  psync_fs_release("", &fi);
+  return ret;
+}
+
+static void psync_fs_ll_setattr(fuse_req_t req, fuse_ino_t ino, struct FUSE_STAT *attr, int to_set, struct fuse_file_info *fi){
+  struct FUSE_STAT st;
+  int ret;
+  psync_fs_set_thread_name();
+  if (to_set&FUSE_SET_ATTR_SIZE){
+    if (fi)
+      ret=psync_fs_ftruncate("", attr->st_size, fi);
+    else
+      ret=psync_fs_ll_truncate(ino, attr->st_size);
+  }
+  else
+    ret=0;
+  if (!ret)
+    ret=psync_fs_ll_stat(ino, fi, &st);
+  if (ret)
+    fuse_reply_err(req, -ret);
+  else
+    fuse_reply_attr(req, &st, PSYNC_FS_ATTR_TIMEOUT);
+}
+
+static int psync_fs_ll_dir_filler(void *buf, const char *name, const struct FUSE_STAT *stbuf, fuse_off_t off){
+  psync_fs_ll_dir_t *dir;
+  struct FUSE_STAT st;
+  size_t sz;
+  dir=(psync_fs_ll_dir_t *)buf;
+  memset(&st, 0, sizeof(st));
+  if (stbuf){
+    st.st_ino=stat_to_ll_ino(stbuf);
+    st.st_mode=stbuf->st_mode;
+  }
+  else{
+    st.st_ino=FUSE_ROOT_ID;
+    st.st_mode=S_IFDIR;
+  }
+  sz=fuse_add_direntry(dir->req, NULL, 0, name, NULL, 0);
+  if (dir->len+sz>dir->alloc){
+    do {
+      dir->alloc*=2;
+    } while (dir->len+sz>dir->alloc);
+    dir->buf=(char *)psync_realloc(dir->buf, dir->alloc);
+  }
+  fuse_add_direntry(dir->req, dir->buf+dir->len, dir->alloc-dir->len, name, &st, dir->len+sz);
+  dir->len+=sz;
+  return 0;
+}
+
+static int psync_fs_ll_readdir_to_buf(fuse_ino_t ino, psync_fs_ll_dir_t *dir){
+  psync_fsfolderid_t folderid;
+  psync_sql_lock();
+  CHECK_LOGIN_LOCKED();
+  folderid=psync_fs_ll_folderid_locked(ino);
+  if (unlikely_log(folderid==PSYNC_INVALID_FSFOLDERID)){
+    psync_sql_unlock();
+    return -ENOENT;
+  }
+  psync_fs_readdir_by_folderid_locked(folderid, dir, psync_fs_ll_dir_filler);
+  psync_sql_unlock();
+  return 0;
+}
+
+static void psync_fs_ll_opendir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi){
+  psync_fs_ll_dir_t *dir;
+  int ret;
+  psync_fs_set_thread_name();
+  dir=psync_new(psync_fs_ll_dir_t);
+  dir->req=req;
+  dir->len=0;
+  dir->alloc=4096;
+  dir->buf=psync_new_cnt(char, dir->alloc);
+  ret=psync_fs_ll_readdir_to_buf(ino, dir);
+  if (ret){
+    psync_free(dir->buf);
+    psync_free(dir);
+    fuse_reply_err(req, -ret);
+    return;
+  }
+  fi->fh=(uintptr_t)dir;
+  if (fuse_reply_open(req, fi)==-ENOENT){
+    psync_free(dir->buf);
+    psync_free(dir);
+  }
+}
+
+static void psync_fs_ll_readdir(fuse_req_t req, fuse_ino_t ino, size_t size, fuse_off_t off, struct fuse_file_info *fi){
+  psync_fs_ll_dir_t *dir;
+  dir=(psync_fs_ll_dir_t *)(uintptr_t)fi->fh;
+  if (off<dir->len)
+    fuse_reply_buf(req, dir->buf+off, off+size>dir->len?dir->len-off:size);
+  else
+    fuse_reply_buf(req, NULL, 0);
+}
+
+static void psync_fs_ll_releasedir(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi){
+  psync_fs_ll_dir_t *dir;
+  dir=(psync_fs_ll_dir_t *)(uintptr_t)fi->fh;
+  psync_free(dir->buf);
+  psync_free(dir);
+  fuse_reply_err(req, 0);
+}
+
+static void psync_fs_ll_open(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi){
+  int ret;
+  psync_fs_set_thread_name();
+  ret=psync_fs_ll_open_ino(ino, fi);
+  if (ret)
+    fuse_reply_err(req, -ret);
+  else if (fuse_reply_open(req, fi)==-ENOENT)
+    psync_fs_release("", fi);
+}
+
+static void psync_fs_ll_create(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi){
+  int ret;
+  psync_fs_set_thread_name();
+  debug(D_NOTICE, "creat %s", name);
+  ret=psync_fs_ll_open_by_name(parent, name, fi, 1);
+  if (ret)
+    fuse_reply_err(req, -ret);
+  else
+    psync_fs_ll_reply_entry(req, parent, name, fi);
+}
+
+/* Data of new files and pages that are already in the disk cache is returned as file descriptor/offset pairs, so libfuse can splice it
+ * to the kernel without copying. Unlike the high-level read_buf, here the reply is sent before we return, so the open file can stay
+ * locked (new files) or the cache pages pinned against cleaning for exactly as long as they are needed.
+ */
+static int psync_fs_ll_read_zero_copy(fuse_req_t req, psync_openfile_t *of, size_t size, fuse_off_t off){
+  psync_pagecache_range_t ranges[PSYNC_FS_MAX_SPLICE_RANGES];
+  struct fuse_bufvec *bufv;
+  int cnt, i;
+  if (of->newfile){
+    struct fuse_bufvec nbufv=FUSE_BUFVEC_INIT(size);
+    nbufv.buf[0].flags=(enum fuse_buf_flags)(FUSE_BUF_IS_FD|FUSE_BUF_FD_SEEK);
+    nbufv.buf[0].fd=of->datafile;
+    nbufv.buf[0].pos=off;
+    fuse_reply_data(req, &nbufv, FUSE_BUF_SPLICE_MOVE);
+    pthread_mutex_unlock(&of->mutex);
+    return 0;
+  }
+  if (of->modified || psync_pagecache_lock_pages_in_cache())
+    return -1;
+  cnt=psync_pagecache_read_unmodified_ranges_locked(of, ranges, PSYNC_FS_MAX_SPLICE_RANGES, size, off);
+  if (cnt<0){
+    psync_pagecache_unlock_pages_from_cache();
+    pthread_mutex_lock(&of->mutex);
+    return -1;
+  }
+  bufv=(struct fuse_bufvec *)psync_malloc(offsetof(struct fuse_bufvec, buf)+sizeof(struct fuse_buf)*(cnt?cnt:1));
+  memset(bufv, 0, offsetof(struct fuse_bufvec, buf)+sizeof(struct fuse_buf)*(cnt?cnt:1));
+  bufv->count=cnt;
+  for (i=0; i<cnt; i++){
+    bufv->buf[i].size=ranges[i].length;
+    bufv->buf[i].flags=(enum fuse_buf_flags)(FUSE_BUF_IS_FD|FUSE_BUF_FD_SEEK);
+    bufv->buf[i].fd=ranges[i].fd;
+    bufv->buf[i].pos=ranges[i].offset;
+  }
+  fuse_reply_data(req, bufv, FUSE_BUF_SPLICE_MOVE);
+  psync_pagecache_unlock_pages_from_cache();
+  psync_free(bufv);
+  return 0;
+}
+
+static void psync_fs_ll_read(fuse_req_t req, fuse_ino_t ino, size_t size, fuse_off_t off, struct fuse_file_info *fi){
+  psync_openfile_t *of;
+  char *buf;
+  int ret;
+  psync_fs_set_thread_name();
+  of=fh_to_openfile(fi->fh);
+  pthread_mutex_lock(&of->mutex);
+  if (unlikely_log(psync_fs_writeback_flush_range_locked(of, size, off))){
+    pthread_mutex_unlock(&of->mutex);
+    fuse_reply_err(req, EIO);
+    return;
+  }
+  psync_fs_account_read_locked(of, size, off);
+  if (!psync_fs_ll_read_zero_copy(req, of, size, off))
+    return;
+  buf=psync_new_cnt(char, size);
+  ret=psync_fs_read_locked(of, buf, size, off);
+  if (ret<0)
+    fuse_reply_err(req, -ret);
+  else
+    fuse_reply_buf(req, buf, ret);
+  psync_free(buf);
+}
+
+static void psync_fs_ll_write(fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, fuse_off_t off, struct fuse_file_info *fi){
+  int ret;
+  ret=psync_fs_write("", buf, size, off, fi);
+  if (ret<0)
+    fuse_reply_err(req, -ret);
+  else
+    fuse_reply_write(req, ret);
+}
+
+static void psync_fs_ll_flush(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi){
+  fuse_reply_err(req, -psync_fs_flush("", fi));
+}
+
+static void psync_fs_ll_release(fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi){
+  fuse_reply_err(req, -psync_fs_release("", fi));
+}
+
+static void psync_fs_ll_fsync(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi){
+  fuse_reply_err(req, -psync_fs_fsync("", datasync, fi));
+}
+
+static void psync_fs_ll_fsyncdir(fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi){
+  fuse_reply_err(req, -psync_fs_fsyncdir("", datasync, fi));
+}
+
+/* Runs one of psync_fstask_mkdir/rmdir/unlink on name in parent if the folder grants perm. */
+static int psync_fs_ll_fstask_op(fuse_ino_t parent, const char *name, uint32_t perm, int (*op)(psync_fsfolderid_t, const char *)){
+  psync_fspath_t *fpath;
+  int ret;
+  psync_sql_lock();
+  CHECK_LOGIN_LOCKED();
+  fpath=psync_fs_ll_fspath_locked(parent, name);
+  if (!fpath)
+    ret=-ENOENT;
+  else if (!(fpath->permissions&perm))
+    ret=-EACCES;
+  else
+    ret=op(fpath->folderid, fpath->name);
+  psync_sql_unlock();
+  psync_fsfolder_free_path(fpath);
+  return ret;
+}
+
+static void psync_fs_ll_mkdir(fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode){
+  int ret;
+  psync_fs_set_thread_name();
+  ret=psync_fs_ll_fstask_op(parent, name, PSYNC_PERM_CREATE, psync_fstask_mkdir);
+  debug(D_NOTICE, "mkdir %s=%d", name, ret);
+  if (ret)
+    fuse_reply_err(req, -ret);
+  else
+    psync_fs_ll_reply_entry(req, parent, name, NULL);
+}
+
+static void psync_fs_ll_rmdir(fuse_req_t req, fuse_ino_t parent, const char *name){
+  int ret;
+  psync_fs_set_thread_name();
+  ret=psync_fs_ll_fstask_op(parent, name, PSYNC_PERM_DELETE, psync_fstask_rmdir);
+  debug(D_NOTICE, "rmdir %s=%d", name, ret);
+  if (!ret)
+    psync_fs_ll_detach_entry(parent, name);
+  fuse_reply_err(req, -ret);
+}
+
+static void psync_fs_ll_unlink(fuse_req_t req, fuse_ino_t parent, const char *name){
+  int ret;
+  psync_fs_set_thread_name();
+  ret=psync_fs_ll_fstask_op(parent, name, PSYNC_PERM_DELETE, psync_fstask_unlink);
+  debug(D_NOTICE, "unlink %s=%d", name, ret);
+  if (!ret)
+    psync_fs_ll_detach_entry(parent, name);
+  fuse_reply_err(req, -ret);
+}
+
+static int psync_fs_ll_rename_by_name(fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname){
+  psync_fspath_t *fold_path, *fnew_path;
+  int ret;
+  psync_sql_lock();
+  CHECK_LOGIN_LOCKED();
+  fold_path=psync_fs_ll_fspath_locked(parent, name);
+  fnew_path=psync_fs_ll_fspath_locked(newparent, newname);
+  if (!fold_path || !fnew_path)
+    ret=-ENOENT;
+  else
+    ret=psync_fs_rename_fpath_locked(fold_path, fnew_path);
+  psync_sql_unlock();
+  psync_fsfolder_free_path(fold_path);
+  psync_fsfolder_free_path(fnew_path);
+  return ret;
+}
+
+static void psync_fs_ll_rename(fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname){
+  psync_fs_ll_node_t *node, *np;
+  int ret;
+  psync_fs_set_thread_name();
+  ret=psync_fs_ll_rename_by_name(parent, name, newparent, newname);
+  debug(D_NOTICE, "rename %s to %s=%d", name, newname, ret);
+  if (!ret){
+    pthread_mutex_lock(&llmutex);
+    node=psync_fs_ll_find_locked(parent);
+    np=psync_fs_ll_find_locked(newparent);
+    if (node && np && (node=psync_fs_ll_find_child_locked(node, name))){
+      if (psync_fs_ll_find_child_locked(np, newname)!=node)
+        psync_fs_ll_detach_child_locked(np, newname);
+      psync_fs_ll_move_node_locked(node, np, newname);
+    }
+    pthread_mutex_unlock(&llmutex);
+  }
+  fuse_reply_err(req, -ret);
+}
+
+static void psync_fs_ll_statfs(fuse_req_t req, fuse_ino_t ino){
+  struct statvfs st;
+  int ret;
+  ret=psync_fs_statfs("/", &st);
+  if (ret)
+    fuse_reply_err(req, -ret);
+  else
+    fuse_reply_statfs(req, &st);
+}
+
+static void psync_fs_ll_setxattr(fuse_req_t req, fuse_ino_t ino, const char *name, const char *value, size_t size, int flags){
+  char *path;
+  int ret;
+  path=psync_fs_ll_path(ino, NULL);
+  if (path){
+    ret=psync_fs_setxattr(path, name, value, size, flags);
+    psync_free(path);
+  }
+  else
+    ret=-ENOENT;
+  fuse_reply_err(req, -ret);
+}
+
+static void psync_fs_ll_getxattr(fuse_req_t req, fuse_ino_t ino, const char *name, size_t size){
+  char *path, *buf;
+  int ret;
+  path=psync_fs_ll_path(ino, NULL);
+  if (!path){
+    fuse_reply_err(req, ENOENT);
+    return;
+  }
+  buf=size?psync_new_cnt(char, size):NULL;
+  ret=psync_fs_getxattr(path, name, buf, size);
+  psync_free(path);
+  if (ret<0)
+    fuse_reply_err(req, -ret);
+  else if (size)
+    fuse_reply_buf(req, buf, ret);
+  else
+    fuse_reply_xattr(req, ret);
+  psync_free(buf);
+}
+
+static void psync_fs_ll_listxattr(fuse_req_t req, fuse_ino_t ino, size_t size){
+  char *path, *buf;
+  int ret;
+  path=psync_fs_ll_path(ino, NULL);
+  if (!path){
+    fuse_reply_err(req, ENOENT);
+    return;
+  }
+  buf=size?psync_new_cnt(char, size):NULL;
+  ret=psync_fs_listxattr(path, buf, size);
+  psync_free(path);
+  if (ret<0)
+    fuse_reply_err(req, -ret);
+  else if (size)
+    fuse_reply_buf(req, buf, ret);
+  else
+    fuse_reply_xattr(req, ret);
+  psync_free(buf);
+}
+
+static void psync_fs_ll_removexattr(fuse_req_t req, fuse_ino_t ino, const char *name){
+  char *path;
+  int ret;
+  path=psync_fs_ll_path(ino, NULL);
+  if (path){
+    ret=psync_fs_removexattr(path, name);
+    psync_free(path);
+  }
+  else
+    ret=-ENOENT;
+  fuse_reply_err(req, -ret);
+}
+
+PSYNC_FS_TIMED_LL_OP(psync_fs_ll_lookup, lookup, (fuse_req_t req, fuse_ino_t parent, const char *name), (req, parent, name))
+PSYNC_FS_TIMED_LL_OP(psync_fs_ll_getattr, getattr, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi), (req, ino, fi))
+PSYNC_FS_TIMED_LL_OP(psync_fs_ll_setattr, setattr, (fuse_req_t req, fuse_ino_t ino, struct FUSE_STAT *attr, int to_set, struct fuse_file_info *fi),
+                     (req, ino, attr, to_set, fi))
+PSYNC_FS_TIMED_LL_OP(psync_fs_ll_readdir, readdir, (fuse_req_t req, fuse_ino_t ino, size_t size, fuse_off_t off, struct fuse_file_info *fi),
+                     (req, ino, size, off, fi))
+PSYNC_FS_TIMED_LL_OP(psync_fs_ll_open, open, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi), (req, ino, fi))
+PSYNC_FS_TIMED_LL_OP(psync_fs_ll_create, create, (fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode, struct fuse_file_info *fi),
+                     (req, parent, name, mode, fi))
+PSYNC_FS_TIMED_LL_OP(psync_fs_ll_read, read, (fuse_req_t req, fuse_ino_t ino, size_t size, fuse_off_t off, struct fuse_file_info *fi),
+                     (req, ino, size, off, fi))
+PSYNC_FS_TIMED_LL_OP(psync_fs_ll_write, write, (fuse_req_t req, fuse_ino_t ino, const char *buf, size_t size, fuse_off_t off, struct fuse_file_info *fi),
+                     (req, ino, buf, size, off, fi))
+PSYNC_FS_TIMED_LL_OP(psync_fs_ll_flush, flush, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi), (req, ino, fi))
+PSYNC_FS_TIMED_LL_OP(psync_fs_ll_release, release, (fuse_req_t req, fuse_ino_t ino, struct fuse_file_info *fi), (req, ino, fi))
+PSYNC_FS_TIMED_LL_OP(psync_fs_ll_fsync, fsync, (fuse_req_t req, fuse_ino_t ino, int datasync, struct fuse_file_info *fi), (req, ino, datasync, fi))
+PSYNC_FS_TIMED_LL_OP(psync_fs_ll_mkdir, mkdir, (fuse_req_t req, fuse_ino_t parent, const char *name, mode_t mode), (req, parent, name, mode))
+PSYNC_FS_TIMED_LL_OP(psync_fs_ll_rmdir, rmdir, (fuse_req_t req, fuse_ino_t parent, const char *name), (req, parent, name))
+PSYNC_FS_TIMED_LL_OP(psync_fs_ll_unlink, unlink, (fuse_req_t req, fuse_ino_t parent, const char *name), (req, parent, name))
+PSYNC_FS_TIMED_LL_OP(psync_fs_ll_rename, rename, (fuse_req_t req, fuse_ino_t parent, const char *name, fuse_ino_t newparent, const char *newname),
+                     (req, parent, name, newparent, newname))
+
+static void psync_fs_ll_set_ops(struct fuse_lowlevel_ops *ops){
+  memset(ops, 0, sizeof(struct fuse_lowlevel_ops));
+  ops->init        = psync_fs_ll_init;
+  ops->lookup      = psync_fs_ll_lookup_timed;
+  ops->forget      = psync_fs_ll_forget;
+  ops->forget_multi= psync_fs_ll_forget_multi;
+  ops->getattr     = psync_fs_ll_getattr_timed;
+  ops->setattr     = psync_fs_ll_setattr_timed;
+  ops->opendir     = psync_fs_ll_opendir;
+  ops->readdir     = psync_fs_ll_readdir_timed;
+  ops->releasedir  = psync_fs_ll_releasedir;
+  ops->open        = psync_fs_ll_open_timed;
+  ops->create      = psync_fs_ll_create_timed;
+  ops->read        = psync_fs_ll_read_timed;
+  ops->write       = psync_fs_ll_write_timed;
+  ops->flush       = psync_fs_ll_flush_timed;
+  ops->release     = psync_fs_ll_release_timed;
+  ops->fsync       = psync_fs_ll_fsync_timed;
+  ops->fsyncdir    = psync_fs_ll_fsyncdir;
+  ops->mkdir       = psync_fs_ll_mkdir_timed;
+  ops->rmdir       = psync_fs_ll_rmdir_timed;
+  ops->unlink      = psync_fs_ll_unlink_timed;
+  ops->rename      = psync_fs_ll_rename_timed;
+  ops->statfs      = psync_fs_ll_statfs;
+  ops->setxattr    = psync_fs_ll_setxattr;
+  ops->getxattr    = psync_fs_ll_getxattr;
+  ops->listxattr   = psync_fs_ll_listxattr;
+  ops->removexattr = psync_fs_ll_removexattr;
+}
+
+typedef struct {
+  psync_mpsc_node node;
+  fuse_ino_t ino;
+  size_t namecnt;
+  char *names[];
+} psync_fs_ll_inval_t;
+
+static psync_mpsc_queue inval_queue=PSYNC_MPSC_STATIC_INIT(inval_queue);
+static int inval_thread_started=0;
+static int inval_notifying=0;
+
+/* Notifications can block on kernel locks held by requests that wait for sql_lock, so they are sent by a single thread. start_mutex
+ * is only held to check that the session is up, inval_notifying keeps psync_fuse_thread() from destroying it meanwhile.
+ */
+static void psync_fs_ll_inval_thread(){
+  psync_mpsc_node *node;
+  psync_fs_ll_inval_t *inv;
+  size_t i;
+  int run;
+  while (1){
+    node=psync_mpsc_wait(&inval_queue);
+    if (!node)
+      continue;
+    inv=psync_list_element(node, psync_fs_ll_inval_t, node);
+    pthread_mutex_lock(&start_mutex);
+    run=started==1 && psync_fuse_lowlevel;
+    if (run)
+      inval_notifying++;
+    pthread_mutex_unlock(&start_mutex);
+    if (run){
+      debug(D_NOTICE, "invalidating inode %lu and %lu entries", (unsigned long)inv->ino, (unsigned long)inv->namecnt);
+      fuse_lowlevel_notify_inval_inode(psync_fuse_channel, inv->ino, 0, 0);
+      for (i=0; i<inv->namecnt; i++)
+        fuse_lowlevel_notify_inval_entry(psync_fuse_channel, inv->ino, inv->names[i], strlen(inv->names[i]));
+      pthread_mutex_lock(&start_mutex);
+      if (!--inval_notifying)
+        pthread_cond_broadcast(&start_cond);
+      pthread_mutex_unlock(&start_mutex);
+    }
+    for (i=0; i<inv->namecnt; i++)
+      psync_free(inv->names[i]);
+    psync_free(inv);
+  }
+}
+
+static void psync_fs_ll_refresh_folder(psync_folderid_t folderid){
+  psync_fs_ll_node_t *node, *child;
+  psync_fs_ll_inval_t *inv;
+  size_t cnt;
+  pthread_mutex_lock(&llmutex);
+  node=psync_fs_ll_find_locked(folderid_to_inode(folderid)+1);
+  if (!node){
+    pthread_mutex_unlock(&llmutex);
+    return;
+  }
+  cnt=0;
+  psync_list_for_each_element(child, &node->children, psync_fs_ll_node_t, siblings)
+    cnt++;
+  inv=(psync_fs_ll_inval_t *)psync_malloc(offsetof(psync_fs_ll_inval_t, names)+sizeof(char *)*cnt);
+  inv->ino=node->ino;
+  inv->namecnt=0;
+  psync_list_for_each_element(child, &node->children, psync_fs_ll_node_t, siblings)
+    inv->names[inv->namecnt++]=psync_strdup(child->name);
+  pthread_mutex_unlock(&llmutex);
+  if (!psync_atomic_xchg_int(&inval_thread_started, 1))
+    psync_run_thread("fs invalidate", psync_fs_ll_inval_thread);
+  psync_mpsc_push(&inval_queue, &inv->node);
+}
+
+#endif
+
 static pthread_mutex_t fsrefreshmutex=PTHREAD_MUTEX_INITIALIZER;
-static time_t lastfsrefresh=0;
+static uint64_t lastfsrefresh=0;
 static int fsrefreshtimerscheduled=0;
-#define REFRESH_SEC 3
+#define REFRESH_MS 3000
 
 static void psync_invalidate_os_cache_noret(){
   char *path;
@@ -2007,8 +3243,8 @@ static void psync_invalidate_os_cache_noret(){
 }
 
 static void psync_fs_refresh_timer(psync_timer_t timer, void *ptr){
-  time_t ct;
-  ct=psync_timer_time();
+  uint64_t ct;
+  ct=psync_timer_time_ms();
   psync_timer_stop(timer);
   pthread_mutex_lock(&fsrefreshmutex);
   fsrefreshtimerscheduled=0;
@@ -2017,17 +3253,18 @@ static void psync_fs_refresh_timer(psync_timer_t timer, void *ptr){
   psync_run_thread("os cache invalidate timer", psync_invalidate_os_cache_noret);
 }
 
+/* At most one invalidation per REFRESH_MS, a refresh that comes earlier is delayed until exactly the end of the window. */
 void psync_fs_refresh(){
-  time_t ct;
+  uint64_t ct;
   int todo;
   if (!psync_invalidate_os_cache_needed())
     return;
-  ct=psync_timer_time();
+  ct=psync_timer_time_ms();
   todo=0;
   pthread_mutex_lock(&fsrefreshmutex);
   if (fsrefreshtimerscheduled)
     todo=2;
-  else if (lastfsrefresh+REFRESH_SEC<ct)
+  else if (lastfsrefresh+REFRESH_MS<=ct)
     lastfsrefresh=ct;
   else{
     todo=1;
@@ -2040,7 +3277,7 @@ void psync_fs_refresh(){
   }
   else if (todo==1){
     debug(D_NOTICE, "setting timer to invalidate cache");
-    psync_timer_register(psync_fs_refresh_timer, REFRESH_SEC, NULL);
+    psync_timer_register_ms(psync_fs_refresh_timer, lastfsrefresh+REFRESH_MS-ct, NULL);
   }
 }
 
@@ -2057,6 +3294,12 @@ void psync_fs_refresh_folder(psync_folderid_t folderid){
   unsigned char rndbuff[20];
   char rndhex[42];
   psync_file_t fd;
+#if defined(PSYNC_FS_HAS_LOWLEVEL)
+  if (psync_fuse_lowlevel){
+    psync_fs_ll_refresh_folder(folderid);
+    return;
+  }
+#endif
   path=psync_get_path_by_folderid_sep(folderid, PSYNC_DIRECTORY_SEPARATOR, NULL);
   if (path==PSYNC_INVALID_PATH)
     return;
@@ -2172,6 +3415,10 @@ char *psync_fs_get_path_by_folderid(psync_folderid_t folderid){
   return ret;
 }
 
+void psync_fs_get_cache_stats(pcache_stats_t *stats){
+  psync_pagecache_get_stats(stats);
+}
+
 static void psync_fs_do_stop(void){
   struct timespec ts;
   debug(D_NOTICE, "stopping");
@@ -2183,6 +3430,11 @@ static void psync_fs_do_stop(void){
     debug(D_NOTICE, "unmount exited");
 #endif
     debug(D_NOTICE, "running fuse_exit");
+#if defined(PSYNC_FS_HAS_LOWLEVEL)
+    if (psync_fuse_lowlevel)
+      fuse_session_exit(psync_fuse_session);
+    else
+#endif
     fuse_exit(psync_fuse);
     started=2;
     debug(D_NOTICE, "fuse_exit exited, flushing cache");
@@ -2233,6 +3485,40 @@ static void psync_setup_signals(){
 
 #endif
 
+static void psync_fs_update_free_space(){
+  fsfreespace=psync_get_free_space_by_path(psync_setting_get_string(_PS(fscachepath)));
+}
+
+/* Refreshes the cached free space of the cache directory so that writes do not have to statvfs and writes out write-back buffers that
+ * were not touched for a while. Timer callbacks run on the timer worker pool and a slow run may overlap with the next one, so a run
+ * that finds another one in progress just skips its turn. Locks are only tried, a run never blocks a worker behind a busy file.
+ */
+static void psync_fs_writeback_timer(psync_timer_t timer, void *ptr){
+  static pthread_mutex_t writeback_timer_mutex=PTHREAD_MUTEX_INITIALIZER;
+  static time_t lastfreespacecheck=0;
+  psync_openfile_t *of;
+  uint64_t olderthan;
+  if (pthread_mutex_trylock(&writeback_timer_mutex))
+    return;
+  if (psync_timer_time()>=lastfreespacecheck+PSYNC_FS_FREE_SPACE_CHECK_SEC){
+    lastfreespacecheck=psync_timer_time();
+    psync_fs_update_free_space();
+  }
+  if (psync_sql_trylock()){
+    pthread_mutex_unlock(&writeback_timer_mutex);
+    return;
+  }
+  olderthan=psync_timer_time_ms()-PSYNC_FS_WRITEBACK_MAX_AGE_MS;
+  psync_tree_for_each_element(of, openfiles, psync_openfile_t, tree)
+    if (!pthread_mutex_trylock(&of->mutex)){
+      if (of->writebuflen && of->writebuftime<=olderthan)
+        psync_fs_writeback_flush_locked(of);
+      pthread_mutex_unlock(&of->mutex);
+    }
+  psync_sql_unlock();
+  pthread_mutex_unlock(&writeback_timer_mutex);
+}
+
 static void psync_fs_init_once(){
 #if psync_fs_need_per_folder_refresh_const()
   unsigned char rndbuff[16];
@@ -2245,6 +3531,11 @@ static void psync_fs_init_once(){
 #endif
   psync_fstask_init();
   psync_pagecache_init();
+  psync_fs_update_free_space();
+  psync_timer_register_ms(psync_fs_writeback_timer, PSYNC_FS_WRITEBACK_CHECK_MS, NULL);
+#if defined(PSYNC_FS_HAS_LOWLEVEL)
+  psync_fs_ll_init_table();
+#endif
   atexit(psync_fs_do_stop);
 #if defined(P_OS_POSIX)
   psync_setup_signals();
@@ -2258,12 +3549,31 @@ static void psync_fuse_thread(){
     initonce=1;
   }
   pthread_mutex_unlock(&start_mutex);
+#if defined(PSYNC_FS_HAS_LOWLEVEL)
+  if (psync_fuse_lowlevel){
+    debug(D_NOTICE, "running fuse_session_loop_mt");
+    fuse_session_loop_mt(psync_fuse_session);
+    pthread_mutex_lock(&start_mutex);
+    while (inval_notifying)
+      pthread_cond_wait(&start_cond, &start_mutex);
+    debug(D_NOTICE, "fuse_session_loop_mt exited, running fuse_session_destroy");
+    fuse_session_destroy(psync_fuse_session);
+    psync_fuse_session=NULL;
+    psync_fuse_lowlevel=0;
+    psync_fs_ll_clean_table();
+    debug(D_NOTICE, "fuse_session_destroy exited");
+  }
+  else{
+#endif
   debug(D_NOTICE, "running fuse_loop_mt");
   fuse_loop_mt(psync_fuse);
   pthread_mutex_lock(&start_mutex);
   debug(D_NOTICE, "fuse_loop_mt exited, running fuse_destroy");
   fuse_destroy(psync_fuse);
   debug(D_NOTICE, "fuse_destroy exited");
+#if defined(PSYNC_FS_HAS_LOWLEVEL)
+  }
+#endif
 /*#if defined(P_OS_MACOSX)
   debug(D_NOTICE, "calling unmount");
   unmount(psync_current_mountpoint, MNT_FORCE);
@@ -2278,6 +3588,9 @@ static void psync_fuse_thread(){
 static int psync_fs_do_start(){
   char *mp;
   struct fuse_operations psync_oper;
+#if defined(PSYNC_FS_HAS_LOWLEVEL)
+  struct fuse_lowlevel_ops psync_ll_oper;
+#endif
   struct fuse_args args=FUSE_ARGS_INIT(0, NULL);
 
 // it seems that fuse option parser ignores the first argument
@@ -2301,26 +3614,26 @@ static int psync_fs_do_start(){
   memset(&psync_oper, 0, sizeof(psync_oper));
   
   psync_oper.init     = psync_fs_init;
-  psync_oper.getattr  = psync_fs_getattr;
-  psync_oper.readdir  = psync_fs_readdir;
-  psync_oper.open     = psync_fs_open;
-  psync_oper.create   = psync_fs_creat;
-  psync_oper.release  = psync_fs_release;
-  psync_oper.flush    = psync_fs_flush;
-  psync_oper.fsync    = psync_fs_fsync;
+  psync_oper.getattr  = psync_fs_getattr_timed;
+  psync_oper.readdir  = psync_fs_readdir_timed;
+  psync_oper.open     = psync_fs_open_timed;
+  psync_oper.create   = psync_fs_creat_timed;
+  psync_oper.release  = psync_fs_release_timed;
+  psync_oper.flush    = psync_fs_flush_timed;
+  psync_oper.fsync    = psync_fs_fsync_timed;
   psync_oper.fsyncdir = psync_fs_fsyncdir;
-  psync_oper.read     = psync_fs_read;
-  psync_oper.write    = psync_fs_write;
-  psync_oper.mkdir    = psync_fs_mkdir;
-  psync_oper.rmdir    = psync_fs_rmdir;
-  psync_oper.unlink   = psync_fs_unlink;
-  psync_oper.rename   = psync_fs_rename;
+  psync_oper.read     = psync_fs_read_timed;
+  psync_oper.write    = psync_fs_write_timed;
+  psync_oper.mkdir    = psync_fs_mkdir_timed;
+  psync_oper.rmdir    = psync_fs_rmdir_timed;
+  psync_oper.unlink   = psync_fs_unlink_timed;
+  psync_oper.rename   = psync_fs_rename_timed;
   psync_oper.statfs   = psync_fs_statfs;
   psync_oper.chmod    = psync_fs_chmod;
   psync_oper.chown    = psync_fs_chown;
   psync_oper.utimens  = psync_fs_utimens;
-  psync_oper.ftruncate= psync_fs_ftruncate;
-  psync_oper.truncate = psync_fs_truncate;
+  psync_oper.ftruncate= psync_fs_ftruncate_timed;
+  psync_oper.truncate = psync_fs_truncate_timed;
   
   psync_oper.setxattr = psync_fs_setxattr;
   psync_oper.getxattr = psync_fs_getxattr;
@@ -2348,9 +3661,23 @@ static int psync_fs_do_start(){
   psync_fuse_channel=fuse_mount(mp, &args);
   if (unlikely_log(!psync_fuse_channel))
     goto err0;
+#if defined(PSYNC_FS_HAS_LOWLEVEL)
+  if (psync_setting_get_bool(_PS(fslowlevel))){
+    psync_fs_ll_set_ops(&psync_ll_oper);
+    psync_fuse_session=fuse_lowlevel_new(&args, &psync_ll_oper, sizeof(psync_ll_oper), NULL);
+    if (unlikely_log(!psync_fuse_session))
+      goto err1;
+    fuse_session_add_chan(psync_fuse_session, psync_fuse_channel);
+    psync_fuse_lowlevel=1;
+  }
+  else{
+#endif
   psync_fuse=fuse_new(psync_fuse_channel, &args, &psync_oper, sizeof(psync_oper), NULL);
   if (unlikely_log(!psync_fuse))
     goto err1;
+#if defined(PSYNC_FS_HAS_LOWLEVEL)
+  }
+#endif
   psync_current_mountpoint=mp;
   started=1;
   pthread_mutex_unlock(&start_mutex);
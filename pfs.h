@@ -46,6 +46,15 @@
 #define psync_fs_need_per_folder_refresh_const() 1
 #endif
 
+typedef struct {
+  uint64_t offset;
+  uint64_t length;
+} index_record;
+
+typedef struct {
+  uint64_t copyfromoriginal;
+} index_header;
+
 typedef struct {
   uint64_t frompage;
   uint64_t topage;
@@ -55,11 +64,19 @@ typedef struct {
   time_t lastuse;
 } psync_file_stream_t;
 
+typedef struct {
+  uint64_t frompage;
+  uint64_t topage;
+} psync_file_profile_range_t;
+
 typedef struct {
   psync_tree tree;
   psync_file_stream_t streams[PSYNC_FS_FILESTREAMS_CNT];
+  psync_file_profile_range_t profile[PSYNC_FS_PROFILE_RANGES];
   pthread_mutex_t mutex;
   psync_interval_tree_t *writeintervals;
+  index_record *indexpending;
+  char *writebuf;
   psync_fstask_folder_t *currentfolder;
   char *currentname;
   psync_fsfileid_t fileid;
@@ -68,9 +85,14 @@ typedef struct {
   uint64_t initialsize;
   uint64_t currentsize;
   uint64_t laststreamid;
+  uint64_t seqreadend;
+  uint64_t seqreadbytes;
   uint64_t indexoff;
+  uint64_t indexcompactat;
   uint64_t writeid;
+  uint64_t writebufoff;
   time_t currentsec;
+  uint64_t writebuftime;
   psync_file_t datafile;
   psync_file_t indexfile;
   uint32_t refcnt;
@@ -78,10 +100,14 @@ typedef struct {
   uint32_t runningreads;
   uint32_t currentspeed;
   uint32_t bytesthissec;
+  uint32_t indexpendingcnt;
+  uint32_t writebuflen;
+  uint32_t profilecnt;
   unsigned char modified;
   unsigned char newfile;
   unsigned char releasedforupload;
   unsigned char deleted;
+  unsigned char profileprefetched;
 } psync_openfile_t;
 
 int psync_fs_update_openfile(uint64_t taskid, uint64_t writeid, psync_fileid_t newfileid, uint64_t hash, uint64_t size);
@@ -26,6 +26,7 @@
  */
 
 #include "psynclib.h"
+#include <string.h>
 
 int psync_fs_remount(){
   return 0;
@@ -72,6 +73,13 @@ void psync_fs_refresh_folder(psync_folderid_t folderid){
 void psync_pagecache_resize_cache(){
 }
 
+void psync_pagecache_resize_secondary_cache(){
+}
+
+void psync_fs_get_cache_stats(pcache_stats_t *stats){
+  memset(stats, 0, sizeof(pcache_stats_t));
+}
+
 void psync_pagecache_clean_cache(){
 }
 
@@ -29,8 +29,16 @@
 #include "plibs.h"
 #include "psettings.h"
 #include "pfstasks.h"
+#include "pmem.h"
 #include <string.h>
 
+PSYNC_SLAB(fspath_slab, psync_fspath_t);
+
+PSYNC_SQL_STMT(stmt_folder_id_perm_by_name, "SELECT id, permissions FROM folder WHERE parentfolderid=? AND name=?");
+PSYNC_SQL_STMT(stmt_folder_id_by_name, "SELECT id FROM folder WHERE parentfolderid=? AND name=?");
+PSYNC_SQL_STMT(stmt_folder_perm_by_id, "SELECT permissions FROM folder WHERE id=?");
+PSYNC_SQL_STMT(stmt_mkdir_parent_by_taskid, "SELECT folderid FROM fstask WHERE id=? AND type="NTO_STR(PSYNC_FS_TASK_MKDIR));
+
 psync_fspath_t *psync_fsfolder_resolve_path(const char *path){
   psync_fsfolderid_t cfolderid;
   psync_fspath_t *ret;
@@ -61,14 +69,14 @@ psync_fspath_t *psync_fsfolder_resolve_path(const char *path){
     else{
       if (res)
         psync_sql_free_result(res);
-      ret=psync_new(psync_fspath_t);
+      ret=(psync_fspath_t *)psync_slab_alloc(&fspath_slab);
       ret->folderid=cfolderid;
       ret->name=path;
       ret->permissions=permissions;
       return ret;
     }
     if (!res)
-      res=psync_sql_query("SELECT id, permissions FROM folder WHERE parentfolderid=? AND name=?");
+      res=psync_sql_query_stmt(&stmt_folder_id_perm_by_name);
     else
       psync_sql_reset(res);
     psync_sql_bind_int(res, 1, cfolderid);
@@ -109,6 +117,46 @@ psync_fspath_t *psync_fsfolder_resolve_path(const char *path){
   return NULL;
 }
 
+/* Same as psync_fsfolder_resolve_path() for name in an already known folder, ret->name points to name. The permissions are the
+ * ones of the closest folder that exists on the server, folders created locally get the ones of their parent. */
+psync_fspath_t *psync_fsfolder_path_by_folderid(psync_fsfolderid_t folderid, const char *name){
+  psync_fsfolderid_t cfolderid;
+  psync_fspath_t *ret;
+  psync_sql_res *res;
+  psync_uint_row row;
+  uint32_t permissions;
+  cfolderid=folderid;
+  while (cfolderid<0){
+    res=psync_sql_query_stmt(&stmt_mkdir_parent_by_taskid);
+    psync_sql_bind_uint(res, 1, -cfolderid);
+    if ((row=psync_sql_fetch_rowint(res)))
+      cfolderid=row[0];
+    psync_sql_free_result(res);
+    if (!row)
+      return NULL;
+  }
+  if (cfolderid==0)
+    permissions=PSYNC_PERM_ALL;
+  else{
+    res=psync_sql_query_stmt(&stmt_folder_perm_by_id);
+    psync_sql_bind_uint(res, 1, cfolderid);
+    if ((row=psync_sql_fetch_rowint(res)))
+      permissions=row[0];
+    psync_sql_free_result(res);
+    if (!row)
+      return NULL;
+  }
+  ret=(psync_fspath_t *)psync_slab_alloc(&fspath_slab);
+  ret->folderid=folderid;
+  ret->name=name;
+  ret->permissions=permissions;
+  return ret;
+}
+
+void psync_fsfolder_free_path(psync_fspath_t *path){
+  psync_slab_free(&fspath_slab, path);
+}
+
 psync_fsfolderid_t psync_fsfolderid_by_path(const char *path){
   psync_fsfolderid_t cfolderid;
   const char *sl;
@@ -136,7 +184,7 @@ psync_fsfolderid_t psync_fsfolderid_by_path(const char *path){
     else
       len=strlen(path);
     if (!res)
-      res=psync_sql_query("SELECT id FROM folder WHERE parentfolderid=? AND name=?");
+      res=psync_sql_query_stmt(&stmt_folder_id_by_name);
     else
       psync_sql_reset(res);
     psync_sql_bind_int(res, 1, cfolderid);
@@ -43,7 +43,9 @@ typedef struct {
 } psync_fspath_t;
 
 psync_fspath_t *psync_fsfolder_resolve_path(const char *path);
+void psync_fsfolder_free_path(psync_fspath_t *path);
 psync_fsfolderid_t psync_fsfolderid_by_path(const char *path);
+psync_fspath_t *psync_fsfolder_path_by_folderid(psync_fsfolderid_t folderid, const char *name);
 
 
 #endif
\ No newline at end of file
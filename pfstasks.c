@@ -36,8 +36,10 @@
 #include <string.h>
 #include <stddef.h>
 #include <stdio.h>
+#include <ctype.h>
 
 #define FOLDER_HASH 256
+#define FSTASK_NAMES_MIN_SIZE 16
 
 typedef struct {
   psync_folderid_t folderid;
@@ -46,6 +48,28 @@ typedef struct {
 
 static psync_tree *folders=PSYNC_TREE_EMPTY;
 
+/* Tasks that are pending at startup are not replayed by psync_fstask_init, the tasks of a folder are loaded from the
+ * database when the folder is first looked up. While tasks with id up to fstask_lazy_maxid exist, a folder in the tree
+ * means that its tasks are loaded, so folders are not freed when they run out of tasks.
+ */
+static uint64_t fstask_lazy_maxid=0;
+
+static psync_fstask_folder_t *psync_fstask_load_folder_locked(psync_fsfolderid_t folderid);
+
+PSYNC_SQL_STMT(stmt_folder_id_by_name, "SELECT id FROM folder WHERE parentfolderid=? AND name=?");
+PSYNC_SQL_STMT(stmt_file_id_by_name, "SELECT id FROM file WHERE parentfolderid=? AND name=?");
+PSYNC_SQL_STMT(stmt_insert_mkdir, "INSERT INTO fstask (type, status, folderid, sfolderid, text1, int1) VALUES ("NTO_STR(PSYNC_FS_TASK_MKDIR)", 0, ?, ?, ?, ?)");
+PSYNC_SQL_STMT(stmt_insert_rmdir, "INSERT INTO fstask (type, status, folderid, sfolderid, text1) VALUES ("NTO_STR(PSYNC_FS_TASK_RMDIR)", 0, ?, ?, ?)");
+PSYNC_SQL_STMT(stmt_insert_creat, "INSERT INTO fstask (type, status, folderid, fileid, sfolderid, text1, int1) VALUES ("NTO_STR(PSYNC_FS_TASK_CREAT)", 1, ?, 0, ?, ?, 0)");
+PSYNC_SQL_STMT(stmt_insert_modify, "INSERT INTO fstask (type, status, folderid, fileid, sfolderid, text1, int1, int2) VALUES ("NTO_STR(PSYNC_FS_TASK_MODIFY)", 1, ?, ?, ?, ?, 0, ?)");
+PSYNC_SQL_STMT(stmt_insert_unsetrev, "INSERT INTO fstask (type, status, folderid, fileid, int1, text1) VALUES ("NTO_STR(PSYNC_FS_TASK_UN_SET_REV)", 0, ?, ?, ?, ?)");
+PSYNC_SQL_STMT(stmt_insert_unlink, "INSERT INTO fstask (type, status, folderid, fileid, text1) VALUES ("NTO_STR(PSYNC_FS_TASK_UNLINK)", 0, ?, ?, ?)");
+PSYNC_SQL_STMT(stmt_insert_renfile_from, "INSERT INTO fstask (type, status, folderid, fileid, text1) VALUES ("NTO_STR(PSYNC_FS_TASK_RENFILE_FROM)", 10, ?, ?, ?)");
+PSYNC_SQL_STMT(stmt_insert_renfile_to, "INSERT INTO fstask (type, status, folderid, fileid, text1, int1) VALUES ("NTO_STR(PSYNC_FS_TASK_RENFILE_TO)", 0, ?, ?, ?, ?)");
+PSYNC_SQL_STMT(stmt_insert_renfolder_from, "INSERT INTO fstask (type, status, folderid, sfolderid, text1) VALUES ("NTO_STR(PSYNC_FS_TASK_RENFOLDER_FROM)", 10, ?, ?, ?)");
+PSYNC_SQL_STMT(stmt_insert_renfolder_to, "INSERT INTO fstask (type, status, folderid, sfolderid, text1, int1) VALUES ("NTO_STR(PSYNC_FS_TASK_RENFOLDER_TO)", 0, ?, ?, ?, ?)");
+PSYNC_SQL_STMT(stmt_insert_depend, "INSERT OR IGNORE INTO fstaskdepend (fstaskid, dependfstaskid) VALUES (?, ?)");
+
 psync_uint_t folder_hash(psync_fsfolderid_t folderid){
   return ((uint64_t)folderid)%FOLDER_HASH;
 }
@@ -102,6 +126,8 @@ psync_fstask_folder_t *psync_fstask_get_or_create_folder_tasks_locked(psync_fsfo
       return folder;
     }
   }
+  if (unlikely(fstask_lazy_maxid))
+    return psync_fstask_load_folder_locked(folderid);
   folder=psync_new(psync_fstask_folder_t);
   memset(folder, 0, sizeof(psync_fstask_folder_t));
   if (d<0)
@@ -123,11 +149,20 @@ psync_fstask_folder_t *psync_fstask_get_folder_tasks_locked(psync_fsfolderid_t f
       tr=tr->left;
     else if (folderid>folder->folderid)
       tr=tr->right;
+    else if (unlikely(!folder->refcnt && !folder->taskscnt))
+      return NULL;
     else{
       folder->refcnt++;
       return folder;
     }
   }
+  if (unlikely(fstask_lazy_maxid)){
+    folder=psync_fstask_load_folder_locked(folderid);
+    if (folder->taskscnt)
+      return folder;
+    /* loading may have processed the last task pending at startup, in which case the empty folder has to go now */
+    psync_fstask_release_folder_tasks_locked(folder);
+  }
   return NULL;
 }
 
@@ -136,48 +171,14 @@ void psync_fstask_release_folder_tasks_locked(psync_fstask_folder_t *folder){
   if ((!!folder->taskscnt)!=(folder->creats || folder->mkdirs || folder->rmdirs || folder->unlinks))
     debug(D_ERROR, "taskcnt=%u, c=%p, m=%p, r=%p, u=%p", (unsigned)folder->taskscnt, folder->creats, folder->mkdirs, folder->rmdirs, folder->unlinks);
 #endif
-  if (--folder->refcnt==0 && !folder->taskscnt){
+  if (--folder->refcnt==0 && !folder->taskscnt && !fstask_lazy_maxid){
     debug(D_NOTICE, "releasing folder id %ld", (long int)folder->folderid);
     psync_tree_del(&folders, &folder->tree);
+    psync_free(folder->names);
     psync_free(folder);
   }
 }
 
-static psync_tree *psync_fstask_search_tree(psync_tree *tree, size_t nameoff, const char *name, uint64_t taskid, size_t taskidoff){
-  int c;
-  while (tree){
-    c=psync_filename_cmp(name, ((char *)tree)+nameoff);
-    if (c<0)
-      tree=tree->left;
-    else if (c>0)
-      tree=tree->right;
-    else
-      break;
-  }
-  if (!tree || !taskid || *((uint64_t *)(((char *)tree)+taskidoff))==taskid)
-    return tree;
-  else{
-    psync_tree *tn;
-    tn=psync_tree_get_prev(tree);
-    while (tn){
-      if (psync_filename_cmp(name, ((char *)tn)+nameoff))
-        break;
-      if (*((uint64_t *)(((char *)tn)+taskidoff))==taskid)
-        return tn;
-      tn=psync_tree_get_prev(tn);
-    }
-    tn=psync_tree_get_next(tree);
-    while (tn){
-      if (psync_filename_cmp(name, ((char *)tn)+nameoff))
-        break;
-      if (*((uint64_t *)(((char *)tn)+taskidoff))==taskid)
-        return tn;
-      tn=psync_tree_get_next(tn);
-    }
-    return NULL;
-  }
-}
-
 static psync_tree *psync_fstask_walk_tree(psync_tree *tree, uint64_t taskid, size_t taskidoff){
   tree=psync_tree_get_first(tree);
   while (tree){
@@ -221,30 +222,143 @@ static void psync_fstask_insert_into_tree(psync_tree **tree, size_t nameoff, psy
   }
 }
 
+/* Offsets of the task fields by task type, only the PSYNC_FS_TASK_MKDIR..PSYNC_FS_TASK_UNLINK entries are used. */
+static const size_t fstask_tree_off[]={0, offsetof(psync_fstask_folder_t, mkdirs), offsetof(psync_fstask_folder_t, rmdirs),
+                                       offsetof(psync_fstask_folder_t, creats), offsetof(psync_fstask_folder_t, unlinks)};
+static const size_t fstask_name_off[]={0, offsetof(psync_fstask_mkdir_t, name), offsetof(psync_fstask_rmdir_t, name),
+                                       offsetof(psync_fstask_creat_t, name), offsetof(psync_fstask_unlink_t, name)};
+static const size_t fstask_taskid_off[]={0, offsetof(psync_fstask_mkdir_t, taskid), offsetof(psync_fstask_rmdir_t, taskid),
+                                         offsetof(psync_fstask_creat_t, taskid), offsetof(psync_fstask_unlink_t, taskid)};
+static const size_t fstask_hash_off[]={0, offsetof(psync_fstask_mkdir_t, namehash), offsetof(psync_fstask_rmdir_t, namehash),
+                                       offsetof(psync_fstask_creat_t, namehash), offsetof(psync_fstask_unlink_t, namehash)};
+
+#define fstask_field(task, off, type) (*((type *)(((char *)(task))+(off))))
+
+/* FNV-1a, names that psync_filename_cmp considers equal have to hash to the same value */
+static uint32_t psync_fstask_name_hash(const char *name){
+  uint32_t h;
+  h=2166136261U;
+  while (*name){
+#if defined(P_OS_WINDOWS)
+    h^=(unsigned char)tolower((unsigned char)*name++);
+#else
+    h^=(unsigned char)*name++;
+#endif
+    h*=16777619U;
+  }
+  return h;
+}
+
+static void psync_fstask_names_put(psync_fstask_name_entry_t *names, uint32_t mask, psync_tree *task, uint32_t hash, uint32_t type){
+  uint32_t i;
+  i=hash&mask;
+  while (names[i].task)
+    i=(i+1)&mask;
+  names[i].task=task;
+  names[i].hash=hash;
+  names[i].type=type;
+}
+
+static void psync_fstask_names_grow(psync_fstask_folder_t *folder){
+  psync_fstask_name_entry_t *names;
+  uint32_t i, mask;
+  if (folder->names)
+    mask=folder->namesmask*2+1;
+  else
+    mask=FSTASK_NAMES_MIN_SIZE-1;
+  names=psync_new_cnt(psync_fstask_name_entry_t, mask+1);
+  memset(names, 0, sizeof(psync_fstask_name_entry_t)*(mask+1));
+  if (folder->names){
+    for (i=0; i<=folder->namesmask; i++)
+      if (folder->names[i].task)
+        psync_fstask_names_put(names, mask, folder->names[i].task, folder->names[i].hash, folder->names[i].type);
+    psync_free(folder->names);
+  }
+  folder->names=names;
+  folder->namesmask=mask;
+}
+
+static void psync_fstask_insert_task(psync_fstask_folder_t *folder, uint32_t type, psync_tree *task){
+  uint32_t hash;
+  hash=psync_fstask_name_hash(((char *)task)+fstask_name_off[type]);
+  fstask_field(task, fstask_hash_off[type], uint32_t)=hash;
+  psync_fstask_insert_into_tree(&fstask_field(folder, fstask_tree_off[type], psync_tree *), fstask_name_off[type], task);
+  if (!folder->names || (folder->namescnt+1)*4>(folder->namesmask+1)*3)
+    psync_fstask_names_grow(folder);
+  psync_fstask_names_put(folder->names, folder->namesmask, task, hash, type);
+  folder->namescnt++;
+}
+
+/* linear probing, so deleted entries are not marked but the following entries of the cluster are shifted back */
+static void psync_fstask_remove_task(psync_fstask_folder_t *folder, uint32_t type, psync_tree *task){
+  psync_fstask_name_entry_t *names;
+  uint32_t i, j, k, mask;
+  psync_tree_del(&fstask_field(folder, fstask_tree_off[type], psync_tree *), task);
+  names=folder->names;
+  mask=folder->namesmask;
+  if (unlikely_log(!names))
+    return;
+  i=fstask_field(task, fstask_hash_off[type], uint32_t)&mask;
+  while (names[i].task!=task){
+    if (unlikely_log(!names[i].task))
+      return;
+    i=(i+1)&mask;
+  }
+  j=i;
+  while (1){
+    j=(j+1)&mask;
+    if (!names[j].task)
+      break;
+    k=names[j].hash&mask;
+    if (i<=j ? (k<=i || k>j) : (k<=i && k>j)){
+      names[i]=names[j];
+      i=j;
+    }
+  }
+  names[i].task=NULL;
+  if (--folder->namescnt==0){
+    psync_free(folder->names);
+    folder->names=NULL;
+    folder->namesmask=0;
+  }
+}
+
+static psync_tree *psync_fstask_find_task(psync_fstask_folder_t *folder, uint32_t type, const char *name, uint64_t taskid){
+  psync_fstask_name_entry_t *names;
+  psync_tree *task;
+  uint32_t i, hash, mask;
+  names=folder->names;
+  if (!names)
+    return NULL;
+  mask=folder->namesmask;
+  hash=psync_fstask_name_hash(name);
+  i=hash&mask;
+  while ((task=names[i].task)){
+    if (names[i].hash==hash && names[i].type==type && !psync_filename_cmp(name, ((char *)task)+fstask_name_off[type]) &&
+        (!taskid || fstask_field(task, fstask_taskid_off[type], uint64_t)==taskid))
+      return task;
+    i=(i+1)&mask;
+  }
+  return NULL;
+}
+
 psync_fstask_mkdir_t *psync_fstask_find_mkdir(psync_fstask_folder_t *folder, const char *name, uint64_t taskid){
-  return psync_tree_element(
-    psync_fstask_search_tree(folder->mkdirs, offsetof(psync_fstask_mkdir_t, name), name, taskid, offsetof(psync_fstask_mkdir_t, taskid)), 
-    psync_fstask_mkdir_t, tree);
+  return psync_tree_element(psync_fstask_find_task(folder, PSYNC_FS_TASK_MKDIR, name, taskid), psync_fstask_mkdir_t, tree);
 }
 
 psync_fstask_rmdir_t *psync_fstask_find_rmdir(psync_fstask_folder_t *folder, const char *name, uint64_t taskid){
-  return psync_tree_element(
-    psync_fstask_search_tree(folder->rmdirs, offsetof(psync_fstask_rmdir_t, name), name, taskid, offsetof(psync_fstask_rmdir_t, taskid)), 
-    psync_fstask_rmdir_t, tree);
+  return psync_tree_element(psync_fstask_find_task(folder, PSYNC_FS_TASK_RMDIR, name, taskid), psync_fstask_rmdir_t, tree);
 }
 
 psync_fstask_creat_t *psync_fstask_find_creat(psync_fstask_folder_t *folder, const char *name, uint64_t taskid){
-  return psync_tree_element(
-    psync_fstask_search_tree(folder->creats, offsetof(psync_fstask_creat_t, name), name, taskid, offsetof(psync_fstask_creat_t, taskid)), 
-    psync_fstask_creat_t, tree);
+  return psync_tree_element(psync_fstask_find_task(folder, PSYNC_FS_TASK_CREAT, name, taskid), psync_fstask_creat_t, tree);
 }
 
 psync_fstask_unlink_t *psync_fstask_find_unlink(psync_fstask_folder_t *folder, const char *name, uint64_t taskid){
-  return psync_tree_element(
-    psync_fstask_search_tree(folder->unlinks, offsetof(psync_fstask_unlink_t, name), name, taskid, offsetof(psync_fstask_unlink_t, taskid)), 
-    psync_fstask_unlink_t, tree);
+  return psync_tree_element(psync_fstask_find_task(folder, PSYNC_FS_TASK_UNLINK, name, taskid), psync_fstask_unlink_t, tree);
 }
 
+
 psync_fstask_mkdir_t *psync_fstask_find_mkdir_by_folderid(psync_fstask_folder_t *folder, psync_fsfolderid_t folderid){
   return psync_tree_element(
     psync_fstask_walk_tree(folder->mkdirs, folderid, offsetof(psync_fstask_mkdir_t, folderid)), 
@@ -259,7 +373,7 @@ psync_fstask_creat_t *psync_fstask_find_creat_by_fileid(psync_fstask_folder_t *f
 
 static void psync_fstask_depend(uint64_t taskid, uint64_t dependontaskid){
   psync_sql_res *res;
-  res=psync_sql_prep_statement("INSERT OR IGNORE INTO fstaskdepend (fstaskid, dependfstaskid) VALUES (?, ?)");
+  res=psync_sql_prep_stmt(&stmt_insert_depend);
   psync_sql_bind_uint(res, 1, taskid);
   psync_sql_bind_uint(res, 2, dependontaskid);
   psync_sql_run_free(res);
@@ -300,7 +414,7 @@ int psync_fstask_mkdir(psync_fsfolderid_t folderid, const char *name){
   folder=psync_fstask_get_or_create_folder_tasks_locked(folderid);
   len=strlen(name);
   if (folderid>=0){
-    res=psync_sql_query("SELECT id FROM folder WHERE parentfolderid=? AND name=?");
+    res=psync_sql_query_stmt(&stmt_folder_id_by_name);
     psync_sql_bind_uint(res, 1, folderid);
     psync_sql_bind_lstring(res, 2, name, len);
     row=psync_sql_fetch_rowint(res);
@@ -316,7 +430,7 @@ int psync_fstask_mkdir(psync_fsfolderid_t folderid, const char *name){
   }
   ctime=psync_timer_time();
   psync_sql_start_transaction();
-  res=psync_sql_prep_statement("INSERT INTO fstask (type, status, folderid, sfolderid, text1, int1) VALUES ("NTO_STR(PSYNC_FS_TASK_MKDIR)", 0, ?, ?, ?, ?)");
+  res=psync_sql_prep_stmt(&stmt_insert_mkdir);
   psync_sql_bind_int(res, 1, folderid);
   psync_sql_bind_int(res, 2, folderid);
   psync_sql_bind_lstring(res, 3, name, len);
@@ -341,7 +455,7 @@ int psync_fstask_mkdir(psync_fsfolderid_t folderid, const char *name){
   task->folderid=-taskid;
   task->subdircnt=0;
   memcpy(task->name, name, len);
-  psync_fstask_insert_into_tree(&folder->mkdirs, offsetof(psync_fstask_mkdir_t, name), &task->tree);
+  psync_fstask_insert_task(folder, PSYNC_FS_TASK_MKDIR, &task->tree);
   folder->taskscnt++;
   psync_fstask_release_folder_tasks_locked(folder);
   if (!depend)
@@ -362,7 +476,7 @@ int psync_fstask_can_rmdir(psync_fsfolderid_t folderid, const char *name){
   if (folder && (mk=psync_fstask_find_mkdir(folder, name, 0)))
     cfolderid=mk->folderid;
   else{
-    res=psync_sql_query("SELECT id FROM folder WHERE parentfolderid=? AND name=?");
+    res=psync_sql_query_stmt(&stmt_folder_id_by_name);
     psync_sql_bind_uint(res, 1, folderid);
     psync_sql_bind_lstring(res, 2, name, len);
     row=psync_sql_fetch_rowint(res);
@@ -431,7 +545,7 @@ int psync_fstask_rmdir(psync_fsfolderid_t folderid, const char *name){
   folder=psync_fstask_get_or_create_folder_tasks_locked(folderid);
   mk=psync_fstask_find_mkdir(folder, name, 0);
   if (mk==NULL){
-    res=psync_sql_query("SELECT id FROM folder WHERE parentfolderid=? AND name=?");
+    res=psync_sql_query_stmt(&stmt_folder_id_by_name);
     psync_sql_bind_uint(res, 1, folderid);
     psync_sql_bind_lstring(res, 2, name, len);
     row=psync_sql_fetch_rowint(res);
@@ -447,7 +561,7 @@ int psync_fstask_rmdir(psync_fsfolderid_t folderid, const char *name){
   else{
     depend=mk->taskid;
     cfolderid=mk->folderid;
-    psync_tree_del(&folder->mkdirs, &mk->tree);
+    psync_fstask_remove_task(folder, PSYNC_FS_TASK_MKDIR, &mk->tree);
     psync_free(mk);
     folder->taskscnt--;
   }
@@ -487,7 +601,7 @@ int psync_fstask_rmdir(psync_fsfolderid_t folderid, const char *name){
   if (cfolder)
     psync_fstask_release_folder_tasks_locked(cfolder);
   psync_sql_start_transaction();
-  res=psync_sql_prep_statement("INSERT INTO fstask (type, status, folderid, sfolderid, text1) VALUES ("NTO_STR(PSYNC_FS_TASK_RMDIR)", 0, ?, ?, ?)");
+  res=psync_sql_prep_stmt(&stmt_insert_rmdir);
   psync_sql_bind_int(res, 1, folderid);
   psync_sql_bind_int(res, 2, cfolderid);
   psync_sql_bind_lstring(res, 3, name, len);
@@ -512,7 +626,7 @@ int psync_fstask_rmdir(psync_fsfolderid_t folderid, const char *name){
   task->taskid=taskid;
   task->folderid=cfolderid;
   memcpy(task->name, name, len);
-  psync_fstask_insert_into_tree(&folder->rmdirs, offsetof(psync_fstask_rmdir_t, name), &task->tree);
+  psync_fstask_insert_task(folder, PSYNC_FS_TASK_RMDIR, &task->tree);
   folder->taskscnt++;
   psync_fstask_release_folder_tasks_locked(folder);
   if (depend==0)
@@ -528,7 +642,7 @@ psync_fstask_creat_t *psync_fstask_add_creat(psync_fstask_folder_t *folder, cons
   size_t len;
   len=strlen(name);
   psync_sql_start_transaction();
-  res=psync_sql_prep_statement("INSERT INTO fstask (type, status, folderid, fileid, sfolderid, text1, int1) VALUES ("NTO_STR(PSYNC_FS_TASK_CREAT)", 1, ?, 0, ?, ?, 0)");
+  res=psync_sql_prep_stmt(&stmt_insert_creat);
   psync_sql_bind_int(res, 1, folder->folderid);
   psync_sql_bind_int(res, 2, folder->folderid);
   psync_sql_bind_lstring(res, 3, name, len);
@@ -544,21 +658,25 @@ psync_fstask_creat_t *psync_fstask_add_creat(psync_fstask_folder_t *folder, cons
   un->taskid=taskid;
   un->fileid=-taskid;
   memcpy(un->name, name, len);
-  psync_fstask_insert_into_tree(&folder->unlinks, offsetof(psync_fstask_unlink_t, name), &un->tree);
+  psync_fstask_insert_task(folder, PSYNC_FS_TASK_UNLINK, &un->tree);
   task=(psync_fstask_creat_t *)psync_malloc(offsetof(psync_fstask_creat_t, name)+len);
   task->taskid=taskid;
   task->fileid=-taskid;
   memcpy(task->name, name, len);
-  psync_fstask_insert_into_tree(&folder->creats, offsetof(psync_fstask_creat_t, name), &task->tree);
+  psync_fstask_insert_task(folder, PSYNC_FS_TASK_CREAT, &task->tree);
   folder->taskscnt+=2;
   return task;
 }
 
 void psync_fstask_inject_creat(psync_fstask_folder_t *folder, psync_fstask_creat_t *cr){
-  psync_fstask_insert_into_tree(&folder->creats, offsetof(psync_fstask_creat_t, name), &cr->tree);
+  psync_fstask_insert_task(folder, PSYNC_FS_TASK_CREAT, &cr->tree);
   folder->taskscnt++;
 }
 
+void psync_fstask_del_creat(psync_fstask_folder_t *folder, psync_fstask_creat_t *cr){
+  psync_fstask_remove_task(folder, PSYNC_FS_TASK_CREAT, &cr->tree);
+}
+
 psync_fstask_creat_t *psync_fstask_add_modified_file(psync_fstask_folder_t *folder, const char *name, psync_fsfileid_t fileid, uint64_t hash){
   psync_sql_res *res;
   psync_fstask_unlink_t *un;
@@ -567,7 +685,7 @@ psync_fstask_creat_t *psync_fstask_add_modified_file(psync_fstask_folder_t *fold
   size_t len;
   len=strlen(name);
   psync_sql_start_transaction();
-  res=psync_sql_prep_statement("INSERT INTO fstask (type, status, folderid, fileid, sfolderid, text1, int1, int2) VALUES ("NTO_STR(PSYNC_FS_TASK_MODIFY)", 1, ?, ?, ?, ?, 0, ?)");
+  res=psync_sql_prep_stmt(&stmt_insert_modify);
   psync_sql_bind_int(res, 1, folder->folderid);
   psync_sql_bind_int(res, 2, fileid);
   psync_sql_bind_int(res, 3, folder->folderid);
@@ -581,7 +699,7 @@ psync_fstask_creat_t *psync_fstask_add_modified_file(psync_fstask_folder_t *fold
   task=psync_fstask_find_creat(folder, name, 0);
   if (task){
     psync_fstask_depend(taskid, task->taskid);
-    psync_tree_del(&folder->creats, &task->tree);
+    psync_fstask_remove_task(folder, PSYNC_FS_TASK_CREAT, &task->tree);
     psync_free(task);
     folder->taskscnt--;
   }
@@ -592,12 +710,12 @@ psync_fstask_creat_t *psync_fstask_add_modified_file(psync_fstask_folder_t *fold
   un->taskid=taskid;
   un->fileid=fileid;
   memcpy(un->name, name, len);
-  psync_fstask_insert_into_tree(&folder->unlinks, offsetof(psync_fstask_unlink_t, name), &un->tree);
+  psync_fstask_insert_task(folder, PSYNC_FS_TASK_UNLINK, &un->tree);
   task=(psync_fstask_creat_t *)psync_malloc(offsetof(psync_fstask_creat_t, name)+len);
   task->taskid=taskid;
   task->fileid=-taskid;
   memcpy(task->name, name, len);
-  psync_fstask_insert_into_tree(&folder->creats, offsetof(psync_fstask_creat_t, name), &task->tree);
+  psync_fstask_insert_task(folder, PSYNC_FS_TASK_CREAT, &task->tree);
   folder->taskscnt+=2;
   return task;
 }
@@ -631,7 +749,7 @@ static psync_fsfileid_t get_file_at_old_location(psync_fsfileid_t fileid){
     }
     psync_fstask_release_folder_tasks_locked(folder);
   }
-  res=psync_sql_query("SELECT id FROM file WHERE parentfolderid=? AND name=?");
+  res=psync_sql_query_stmt(&stmt_file_id_by_name);
   psync_sql_bind_uint(res, 1, rec->folderid);
   psync_sql_bind_string(res, 2, rec->name);
   if ((row=psync_sql_fetch_rowint(res)))
@@ -671,7 +789,7 @@ int psync_fstask_can_unlink(psync_fsfolderid_t folderid, const char *name){
   if (folder && (cr=psync_fstask_find_creat(folder, name, 0)))
     psync_fstask_release_folder_tasks_locked(folder);
   else{
-    res=psync_sql_query("SELECT id FROM file WHERE parentfolderid=? AND name=?");
+    res=psync_sql_query_stmt(&stmt_file_id_by_name);
     psync_sql_bind_uint(res, 1, folderid);
     psync_sql_bind_lstring(res, 2, name, len);
     row=psync_sql_fetch_rowint(res);
@@ -701,7 +819,7 @@ int psync_fstask_unlink(psync_fsfolderid_t folderid, const char *name){
   folder=psync_fstask_get_or_create_folder_tasks_locked(folderid);
   cr=psync_fstask_find_creat(folder, name, 0);
   if (cr==NULL){
-    res=psync_sql_query("SELECT id FROM file WHERE parentfolderid=? AND name=?");
+    res=psync_sql_query_stmt(&stmt_file_id_by_name);
     psync_sql_bind_uint(res, 1, folderid);
     psync_sql_bind_lstring(res, 2, name, len);
     row=psync_sql_fetch_rowint(res);
@@ -717,7 +835,7 @@ int psync_fstask_unlink(psync_fsfolderid_t folderid, const char *name){
   else{
     depend=cr->taskid;
     fileid=cr->fileid;
-    psync_tree_del(&folder->creats, &cr->tree);
+    psync_fstask_remove_task(folder, PSYNC_FS_TASK_CREAT, &cr->tree);
     psync_free(cr);
     folder->taskscnt--;
   }
@@ -726,7 +844,7 @@ int psync_fstask_unlink(psync_fsfolderid_t folderid, const char *name){
   if (fileid<0)
     psync_fstask_stop_and_delete_file(fileid);
   if (revoffileid){
-    res=psync_sql_prep_statement("INSERT INTO fstask (type, status, folderid, fileid, int1, text1) VALUES ("NTO_STR(PSYNC_FS_TASK_UN_SET_REV)", 0, ?, ?, ?, ?)");
+    res=psync_sql_prep_stmt(&stmt_insert_unsetrev);
     psync_sql_bind_int(res, 1, folderid);
     psync_sql_bind_int(res, 2, revoffileid);
     psync_sql_bind_int(res, 3, fileid);
@@ -734,7 +852,7 @@ int psync_fstask_unlink(psync_fsfolderid_t folderid, const char *name){
     psync_sql_run_free(res);
   }
   else{
-    res=psync_sql_prep_statement("INSERT INTO fstask (type, status, folderid, fileid, text1) VALUES ("NTO_STR(PSYNC_FS_TASK_UNLINK)", 0, ?, ?, ?)");
+    res=psync_sql_prep_stmt(&stmt_insert_unlink);
     psync_sql_bind_int(res, 1, folderid);
     psync_sql_bind_int(res, 2, fileid);
     psync_sql_bind_lstring(res, 3, name, len);
@@ -757,7 +875,7 @@ int psync_fstask_unlink(psync_fsfolderid_t folderid, const char *name){
   task->taskid=taskid;
   task->fileid=fileid;
   memcpy(task->name, name, len);
-  psync_fstask_insert_into_tree(&folder->unlinks, offsetof(psync_fstask_unlink_t, name), &task->tree);
+  psync_fstask_insert_task(folder, PSYNC_FS_TASK_UNLINK, &task->tree);
   folder->taskscnt++;
   psync_fstask_release_folder_tasks_locked(folder);
   if (depend==0 || fileid<0)
@@ -795,13 +913,13 @@ int psync_fstask_rename_file(psync_fsfileid_t fileid, psync_fsfolderid_t parentf
   }
   debug(D_NOTICE, "renaming file %ld from %ld/%s to %ld/%s", (long)fileid, (long)parentfolderid, name, (long)to_folderid, new_name);
   psync_sql_start_transaction();
-  res=psync_sql_prep_statement("INSERT INTO fstask (type, status, folderid, fileid, text1) VALUES ("NTO_STR(PSYNC_FS_TASK_RENFILE_FROM)", 10, ?, ?, ?)");
+  res=psync_sql_prep_stmt(&stmt_insert_renfile_from);
   psync_sql_bind_int(res, 1, parentfolderid);
   psync_sql_bind_int(res, 2, fileid);
   psync_sql_bind_lstring(res, 3, name, nlen);
   psync_sql_run_free(res);
   ftaskid=psync_sql_insertid();
-  res=psync_sql_prep_statement("INSERT INTO fstask (type, status, folderid, fileid, text1, int1) VALUES ("NTO_STR(PSYNC_FS_TASK_RENFILE_TO)", 0, ?, ?, ?, ?)");
+  res=psync_sql_prep_stmt(&stmt_insert_renfile_to);
   psync_sql_bind_int(res, 1, to_folderid);
   psync_sql_bind_int(res, 2, fileid);
   psync_sql_bind_lstring(res, 3, new_name, nnlen);
@@ -830,7 +948,7 @@ int psync_fstask_rename_file(psync_fsfileid_t fileid, psync_fsfolderid_t parentf
     return -EIO;
   }
   if (cr){
-    psync_tree_del(&folder->creats, &cr->tree);
+    psync_fstask_remove_task(folder, PSYNC_FS_TASK_CREAT, &cr->tree);
     psync_free(cr);
     folder->taskscnt--;
   }
@@ -840,7 +958,7 @@ int psync_fstask_rename_file(psync_fsfileid_t fileid, psync_fsfolderid_t parentf
   rm->taskid=ftaskid;
   rm->fileid=fileid;
   memcpy(rm->name, name, nlen);
-  psync_fstask_insert_into_tree(&folder->unlinks, offsetof(psync_fstask_unlink_t, name), &rm->tree);
+  psync_fstask_insert_task(folder, PSYNC_FS_TASK_UNLINK, &rm->tree);
   folder->taskscnt++;
   psync_fstask_release_folder_tasks_locked(folder);
 
@@ -849,7 +967,7 @@ int psync_fstask_rename_file(psync_fsfileid_t fileid, psync_fsfolderid_t parentf
   cr=psync_fstask_find_creat(folder, new_name, 0);
   if (cr){
     debug(D_NOTICE, "renaming over creat of file %s(%ld) in folder %lu", new_name, (long)cr->fileid, (unsigned long)to_folderid);
-    psync_tree_del(&folder->creats, &cr->tree);
+    psync_fstask_remove_task(folder, PSYNC_FS_TASK_CREAT, &cr->tree);
     psync_free(cr);
     folder->taskscnt--;
   }
@@ -857,12 +975,12 @@ int psync_fstask_rename_file(psync_fsfileid_t fileid, psync_fsfolderid_t parentf
   rm->taskid=ttaskid;
   rm->fileid=fileid;
   memcpy(rm->name, new_name, nnlen);
-  psync_fstask_insert_into_tree(&folder->unlinks, offsetof(psync_fstask_unlink_t, name), &rm->tree);
+  psync_fstask_insert_task(folder, PSYNC_FS_TASK_UNLINK, &rm->tree);
   cr=(psync_fstask_creat_t *)psync_malloc(offsetof(psync_fstask_creat_t, name)+nnlen);
   cr->taskid=ttaskid;
   cr->fileid=fileid;
   memcpy(cr->name, new_name, nnlen);
-  psync_fstask_insert_into_tree(&folder->creats, offsetof(psync_fstask_creat_t, name), &cr->tree);
+  psync_fstask_insert_task(folder, PSYNC_FS_TASK_CREAT, &cr->tree);
   folder->taskscnt+=2;
   psync_fstask_release_folder_tasks_locked(folder);
   psync_fsupload_wake();
@@ -921,7 +1039,7 @@ static uint64_t psync_fstask_delete_folder_if_ex(psync_fsfolderid_t folderid, co
   if (cfolderid==0){
     if (folderid<0)
       return 0;
-    res=psync_sql_query("SELECT id FROM folder WHERE parentfolderid=? AND name=?");
+    res=psync_sql_query_stmt(&stmt_folder_id_by_name);
     psync_sql_bind_uint(res, 1, folderid);
     psync_sql_bind_lstring(res, 2, name, len);
     if ((row=psync_sql_fetch_rowint(res)))
@@ -930,7 +1048,7 @@ static uint64_t psync_fstask_delete_folder_if_ex(psync_fsfolderid_t folderid, co
     if (cfolderid==0)
       return 0;
   }
-  res=psync_sql_prep_statement("INSERT INTO fstask (type, status, folderid, sfolderid, text1) VALUES ("NTO_STR(PSYNC_FS_TASK_RMDIR)", 0, ?, ?, ?)");
+  res=psync_sql_prep_stmt(&stmt_insert_rmdir);
   psync_sql_bind_int(res, 1, folderid);
   psync_sql_bind_int(res, 2, cfolderid);
   psync_sql_bind_lstring(res, 3, name, len);
@@ -959,13 +1077,13 @@ int psync_fstask_rename_folder(psync_fsfolderid_t folderid, psync_fsfolderid_t p
   }
   psync_sql_start_transaction();
   rmtask=psync_fstask_delete_folder_if_ex(to_folderid, new_name);
-  res=psync_sql_prep_statement("INSERT INTO fstask (type, status, folderid, sfolderid, text1) VALUES ("NTO_STR(PSYNC_FS_TASK_RENFOLDER_FROM)", 10, ?, ?, ?)");
+  res=psync_sql_prep_stmt(&stmt_insert_renfolder_from);
   psync_sql_bind_int(res, 1, parentfolderid);
   psync_sql_bind_int(res, 2, folderid);
   psync_sql_bind_lstring(res, 3, name, nlen);
   psync_sql_run_free(res);
   ftaskid=psync_sql_insertid();
-  res=psync_sql_prep_statement("INSERT INTO fstask (type, status, folderid, sfolderid, text1, int1) VALUES ("NTO_STR(PSYNC_FS_TASK_RENFOLDER_TO)", 0, ?, ?, ?, ?)");
+  res=psync_sql_prep_stmt(&stmt_insert_renfolder_to);
   psync_sql_bind_int(res, 1, to_folderid);
   psync_sql_bind_int(res, 2, folderid);
   psync_sql_bind_lstring(res, 3, new_name, nnlen);
@@ -996,7 +1114,7 @@ int psync_fstask_rename_folder(psync_fsfolderid_t folderid, psync_fsfolderid_t p
     return -EIO;
   }
   if (mk){
-    psync_tree_del(&folder->mkdirs, &mk->tree);
+    psync_fstask_remove_task(folder, PSYNC_FS_TASK_MKDIR, &mk->tree);
     psync_free(mk);
     folder->taskscnt--;
   }
@@ -1005,14 +1123,14 @@ int psync_fstask_rename_folder(psync_fsfolderid_t folderid, psync_fsfolderid_t p
   rm->taskid=ftaskid;
   rm->folderid=folderid;
   memcpy(rm->name, name, nlen);
-  psync_fstask_insert_into_tree(&folder->rmdirs, offsetof(psync_fstask_rmdir_t, name), &rm->tree);
+  psync_fstask_insert_task(folder, PSYNC_FS_TASK_RMDIR, &rm->tree);
   folder->taskscnt++;
   psync_fstask_release_folder_tasks_locked(folder);
   folder=psync_fstask_get_or_create_folder_tasks_locked(to_folderid);
   mk=psync_fstask_find_mkdir(folder, name, 0);
   if (mk){
     debug(D_NOTICE, "renaming over mkdir %s", name);
-    psync_tree_del(&folder->mkdirs, &mk->tree);
+    psync_fstask_remove_task(folder, PSYNC_FS_TASK_MKDIR, &mk->tree);
     psync_free(mk);
     folder->taskscnt--;
   }
@@ -1021,13 +1139,13 @@ int psync_fstask_rename_folder(psync_fsfolderid_t folderid, psync_fsfolderid_t p
   rm->taskid=ttaskid;
   rm->folderid=folderid;
   memcpy(rm->name, new_name, nnlen);
-  psync_fstask_insert_into_tree(&folder->rmdirs, offsetof(psync_fstask_rmdir_t, name), &rm->tree);
+  psync_fstask_insert_task(folder, PSYNC_FS_TASK_RMDIR, &rm->tree);
   mk=(psync_fstask_mkdir_t *)psync_malloc(offsetof(psync_fstask_mkdir_t, name)+nnlen);
   mk->taskid=ttaskid;
   mk->folderid=folderid;
   memcpy(mk->name, new_name, nnlen);
   fill_mkdir_data(folderid, mk);
-  psync_fstask_insert_into_tree(&folder->mkdirs, offsetof(psync_fstask_mkdir_t, name), &mk->tree);
+  psync_fstask_insert_task(folder, PSYNC_FS_TASK_MKDIR, &mk->tree);
   folder->taskscnt+=2;
   psync_fstask_release_folder_tasks_locked(folder);
   psync_fsupload_wake();
@@ -1051,7 +1169,7 @@ void psync_fstask_folder_created(psync_folderid_t parentfolderid, uint64_t taski
   if (folder){
     mk=psync_fstask_find_mkdir(folder, name, taskid);
     if (mk){
-      psync_tree_del(&folder->mkdirs, &mk->tree);
+      psync_fstask_remove_task(folder, PSYNC_FS_TASK_MKDIR, &mk->tree);
       psync_free(mk);
       folder->taskscnt--;
     }
@@ -1098,7 +1216,7 @@ void psync_fstask_folder_deleted(psync_folderid_t parentfolderid, uint64_t taski
   if (folder){
     rm=psync_fstask_find_rmdir(folder, name, taskid);
     if (rm){
-      psync_tree_del(&folder->rmdirs, &rm->tree);
+      psync_fstask_remove_task(folder, PSYNC_FS_TASK_RMDIR, &rm->tree);
       psync_free(rm);
       folder->taskscnt--;
     }
@@ -1143,13 +1261,13 @@ void psync_fstask_file_created(psync_folderid_t parentfolderid, uint64_t taskid,
   if (folder){
     cr=psync_fstask_find_creat(folder, name, taskid);
     if (cr){
-      psync_tree_del(&folder->creats, &cr->tree);
+      psync_fstask_remove_task(folder, PSYNC_FS_TASK_CREAT, &cr->tree);
       psync_free(cr);
       folder->taskscnt--;
     }
     un=psync_fstask_find_unlink(folder, name, taskid);
     if (un){
-      psync_tree_del(&folder->unlinks, &un->tree);
+      psync_fstask_remove_task(folder, PSYNC_FS_TASK_UNLINK, &un->tree);
       psync_free(un);
       folder->taskscnt--;
     }
@@ -1171,13 +1289,13 @@ void psync_fstask_file_modified(psync_folderid_t parentfolderid, uint64_t taskid
   if (folder){
     cr=psync_fstask_find_creat(folder, name, taskid);
     if (cr){
-      psync_tree_del(&folder->creats, &cr->tree);
+      psync_fstask_remove_task(folder, PSYNC_FS_TASK_CREAT, &cr->tree);
       psync_free(cr);
       folder->taskscnt--;
     }
     un=psync_fstask_find_unlink(folder, name, taskid);
     if (un){
-      psync_tree_del(&folder->unlinks, &un->tree);
+      psync_fstask_remove_task(folder, PSYNC_FS_TASK_UNLINK, &un->tree);
       psync_free(un);
       folder->taskscnt--;
     }
@@ -1194,7 +1312,7 @@ void psync_fstask_file_deleted(psync_folderid_t parentfolderid, uint64_t taskid,
   if (folder){
     un=psync_fstask_find_unlink(folder, name, taskid);
     if (un){
-      psync_tree_del(&folder->unlinks, &un->tree);
+      psync_fstask_remove_task(folder, PSYNC_FS_TASK_UNLINK, &un->tree);
       psync_free(un);
       folder->taskscnt--;
     }
@@ -1212,13 +1330,13 @@ void psync_fstask_file_renamed(psync_folderid_t folderid, uint64_t taskid, const
   if (folder){
     un=psync_fstask_find_unlink(folder, name, taskid);
     if (un){
-      psync_tree_del(&folder->unlinks, &un->tree);
+      psync_fstask_remove_task(folder, PSYNC_FS_TASK_UNLINK, &un->tree);
       psync_free(un);
       folder->taskscnt--;
     }
     cr=psync_fstask_find_creat(folder, name, taskid);
     if (cr){
-      psync_tree_del(&folder->creats, &cr->tree);
+      psync_fstask_remove_task(folder, PSYNC_FS_TASK_CREAT, &cr->tree);
       psync_free(cr);
       folder->taskscnt--;
     }
@@ -1231,7 +1349,7 @@ void psync_fstask_file_renamed(psync_folderid_t folderid, uint64_t taskid, const
     if (folder){
       un=psync_fstask_find_unlink(folder, psync_get_string(row[2]), psync_get_number(row[0]));
       if (un){
-        psync_tree_del(&folder->unlinks, &un->tree);
+        psync_fstask_remove_task(folder, PSYNC_FS_TASK_UNLINK, &un->tree);
         psync_free(un);
         folder->taskscnt--;
       }
@@ -1259,13 +1377,13 @@ void psync_fstask_folder_renamed(psync_folderid_t parentfolderid, uint64_t taski
   if (folder){
     mk=psync_fstask_find_mkdir(folder, name, taskid);
     if (mk){
-      psync_tree_del(&folder->mkdirs, &mk->tree);
+      psync_fstask_remove_task(folder, PSYNC_FS_TASK_MKDIR, &mk->tree);
       psync_free(mk);
       folder->taskscnt--;
     }
     rm=psync_fstask_find_rmdir(folder, name, taskid);
     if (rm){
-      psync_tree_del(&folder->rmdirs, &rm->tree);
+      psync_fstask_remove_task(folder, PSYNC_FS_TASK_RMDIR, &rm->tree);
       psync_free(rm);
       folder->taskscnt--;
     }
@@ -1278,7 +1396,7 @@ void psync_fstask_folder_renamed(psync_folderid_t parentfolderid, uint64_t taski
     if (folder){
       rm=psync_fstask_find_rmdir(folder, psync_get_string(row[2]), psync_get_number(row[0]));
       if (rm){
-        psync_tree_del(&folder->rmdirs, &rm->tree);
+        psync_fstask_remove_task(folder, PSYNC_FS_TASK_RMDIR, &rm->tree);
         psync_free(rm);
         folder->taskscnt--;
       }
@@ -1316,7 +1434,7 @@ static void psync_init_task_mkdir(psync_variant_row row){
   task->folderid=-taskid;
   task->subdircnt=0;
   memcpy(task->name, name, len);
-  psync_fstask_insert_into_tree(&folder->mkdirs, offsetof(psync_fstask_mkdir_t, name), &task->tree);
+  psync_fstask_insert_task(folder, PSYNC_FS_TASK_MKDIR, &task->tree);
   folder->taskscnt++;
   psync_fstask_release_folder_tasks_locked(folder);
 }
@@ -1336,7 +1454,7 @@ static void psync_init_task_rmdir(psync_variant_row row){
   folder=psync_fstask_get_or_create_folder_tasks_locked(folderid);
   mk=psync_fstask_find_mkdir(folder, name, 0);
   if (mk){
-    psync_tree_del(&folder->mkdirs, &mk->tree);
+    psync_fstask_remove_task(folder, PSYNC_FS_TASK_MKDIR, &mk->tree);
     psync_free(mk);
     folder->taskscnt--;
   }
@@ -1345,7 +1463,7 @@ static void psync_init_task_rmdir(psync_variant_row row){
   task->taskid=taskid;
   task->folderid=cfolderid;
   memcpy(task->name, name, len);
-  psync_fstask_insert_into_tree(&folder->rmdirs, offsetof(psync_fstask_rmdir_t, name), &task->tree);
+  psync_fstask_insert_task(folder, PSYNC_FS_TASK_RMDIR, &task->tree);
   folder->taskscnt++;
   psync_fstask_release_folder_tasks_locked(folder);
 }
@@ -1367,12 +1485,12 @@ static void psync_init_task_creat(psync_variant_row row){
   un->taskid=taskid;
   un->fileid=-taskid;
   memcpy(un->name, name, len);
-  psync_fstask_insert_into_tree(&folder->unlinks, offsetof(psync_fstask_unlink_t, name), &un->tree);
+  psync_fstask_insert_task(folder, PSYNC_FS_TASK_UNLINK, &un->tree);
   task=(psync_fstask_creat_t *)psync_malloc(offsetof(psync_fstask_creat_t, name)+len);
   task->taskid=taskid;
   task->fileid=-taskid;
   memcpy(task->name, name, len);
-  psync_fstask_insert_into_tree(&folder->creats, offsetof(psync_fstask_creat_t, name), &task->tree);
+  psync_fstask_insert_task(folder, PSYNC_FS_TASK_CREAT, &task->tree);
   folder->taskscnt+=2;
   psync_fstask_release_folder_tasks_locked(folder);
 }
@@ -1385,7 +1503,7 @@ static void psync_init_do_task_unlink(uint64_t taskid, psync_fsfolderid_t folder
   folder=psync_fstask_get_or_create_folder_tasks_locked(folderid);
   cr=psync_fstask_find_creat(folder, name, 0);
   if (cr){
-    psync_tree_del(&folder->creats, &cr->tree);
+    psync_fstask_remove_task(folder, PSYNC_FS_TASK_CREAT, &cr->tree);
     psync_free(cr);
     folder->taskscnt--;
   }
@@ -1394,7 +1512,7 @@ static void psync_init_do_task_unlink(uint64_t taskid, psync_fsfolderid_t folder
   task->taskid=taskid;
   task->fileid=fileid;
   memcpy(task->name, name, namelen);
-  psync_fstask_insert_into_tree(&folder->unlinks, offsetof(psync_fstask_unlink_t, name), &task->tree);
+  psync_fstask_insert_task(folder, PSYNC_FS_TASK_UNLINK, &task->tree);
   folder->taskscnt++;
   psync_fstask_release_folder_tasks_locked(folder);
 }
@@ -1422,7 +1540,7 @@ static void psync_init_task_renfile_from(psync_variant_row row){
   name=psync_get_lstring(row[4], &len);
   folder=psync_fstask_get_or_create_folder_tasks_locked(psync_get_number(row[2]));
   if ((cr=psync_fstask_find_creat(folder, name, 0))){
-    psync_tree_del(&folder->creats, &cr->tree);
+    psync_fstask_remove_task(folder, PSYNC_FS_TASK_CREAT, &cr->tree);
     psync_free(cr);
     folder->taskscnt--;
   }
@@ -1431,7 +1549,7 @@ static void psync_init_task_renfile_from(psync_variant_row row){
   rm->taskid=psync_get_number(row[0]);
   rm->fileid=psync_get_snumber(row[3]);
   memcpy(rm->name, name, len);
-  psync_fstask_insert_into_tree(&folder->unlinks, offsetof(psync_fstask_unlink_t, name), &rm->tree);
+  psync_fstask_insert_task(folder, PSYNC_FS_TASK_UNLINK, &rm->tree);
   folder->taskscnt++;
   psync_fstask_release_folder_tasks_locked(folder);
 }
@@ -1450,7 +1568,7 @@ static void psync_init_task_renfile_to(psync_variant_row row){
   folder=psync_fstask_get_or_create_folder_tasks_locked(folderid);
   cr=psync_fstask_find_creat(folder, name, 0);
   if (cr){
-    psync_tree_del(&folder->creats, &cr->tree);
+    psync_fstask_remove_task(folder, PSYNC_FS_TASK_CREAT, &cr->tree);
     folder->taskscnt--;
     psync_free(cr);
   }
@@ -1461,12 +1579,12 @@ static void psync_init_task_renfile_to(psync_variant_row row){
   un->taskid=taskid;
   un->fileid=fileid;
   memcpy(un->name, name, len);
-  psync_fstask_insert_into_tree(&folder->unlinks, offsetof(psync_fstask_creat_t, name), &un->tree);
+  psync_fstask_insert_task(folder, PSYNC_FS_TASK_UNLINK, &un->tree);
   cr=(psync_fstask_creat_t *)psync_malloc(offsetof(psync_fstask_creat_t, name)+len);
   cr->taskid=taskid;
   cr->fileid=fileid;
   memcpy(cr->name, name, len);
-  psync_fstask_insert_into_tree(&folder->creats, offsetof(psync_fstask_creat_t, name), &cr->tree);
+  psync_fstask_insert_task(folder, PSYNC_FS_TASK_CREAT, &cr->tree);
   folder->taskscnt+=2;
   psync_fstask_release_folder_tasks_locked(folder);
   psync_fs_rename_openfile_locked(cr->fileid, folderid, name);
@@ -1481,7 +1599,7 @@ static void psync_init_task_renfolder_from(psync_variant_row row){
   name=psync_get_lstring(row[4], &len);
   folder=psync_fstask_get_or_create_folder_tasks_locked(psync_get_number(row[2]));
   if ((mk=psync_fstask_find_mkdir(folder, name, 0))){
-    psync_tree_del(&folder->mkdirs, &mk->tree);
+    psync_fstask_remove_task(folder, PSYNC_FS_TASK_MKDIR, &mk->tree);
     psync_free(mk);
     folder->taskscnt--;
   }
@@ -1490,7 +1608,7 @@ static void psync_init_task_renfolder_from(psync_variant_row row){
   rm->taskid=psync_get_number(row[0]);
   rm->folderid=psync_get_snumber(row[8]);
   memcpy(rm->name, name, len);
-  psync_fstask_insert_into_tree(&folder->rmdirs, offsetof(psync_fstask_rmdir_t, name), &rm->tree);
+  psync_fstask_insert_task(folder, PSYNC_FS_TASK_RMDIR, &rm->tree);
   folder->taskscnt++;
   psync_fstask_release_folder_tasks_locked(folder);
 }
@@ -1512,13 +1630,13 @@ static void psync_init_task_renfolder_to(psync_variant_row row){
   rm->taskid=taskid;
   rm->folderid=folderid;
   memcpy(rm->name, name, len);
-  psync_fstask_insert_into_tree(&folder->rmdirs, offsetof(psync_fstask_rmdir_t, name), &rm->tree);
+  psync_fstask_insert_task(folder, PSYNC_FS_TASK_RMDIR, &rm->tree);
   mk=(psync_fstask_mkdir_t *)psync_malloc(offsetof(psync_fstask_mkdir_t, name)+len);
   mk->taskid=taskid;
   mk->folderid=folderid;
   memcpy(mk->name, name, len);
   fill_mkdir_data(mk->folderid, mk);
-  psync_fstask_insert_into_tree(&folder->mkdirs, offsetof(psync_fstask_mkdir_t, name), &mk->tree);
+  psync_fstask_insert_task(folder, PSYNC_FS_TASK_MKDIR, &mk->tree);
   folder->taskscnt+=2;
   psync_fstask_release_folder_tasks_locked(folder);
 }
@@ -1535,7 +1653,7 @@ static void psync_init_task_modify(psync_variant_row row){
   taskid=psync_get_number(row[0]);
   cr=psync_fstask_find_creat(folder, name, 0);
   if (cr){
-    psync_tree_del(&folder->creats, &cr->tree);
+    psync_fstask_remove_task(folder, PSYNC_FS_TASK_CREAT, &cr->tree);
     psync_free(cr);
     folder->taskscnt--;
   }
@@ -1544,12 +1662,12 @@ static void psync_init_task_modify(psync_variant_row row){
   un->taskid=taskid;
   un->fileid=psync_get_snumber(row[3]);
   memcpy(un->name, name, len);
-  psync_fstask_insert_into_tree(&folder->unlinks, offsetof(psync_fstask_unlink_t, name), &un->tree);
+  psync_fstask_insert_task(folder, PSYNC_FS_TASK_UNLINK, &un->tree);
   cr=(psync_fstask_creat_t *)psync_malloc(offsetof(psync_fstask_creat_t, name)+len);
   cr->taskid=taskid;
   cr->fileid=-cr->taskid;
   memcpy(cr->name, name, len);
-  psync_fstask_insert_into_tree(&folder->creats, offsetof(psync_fstask_creat_t, name), &cr->tree);
+  psync_fstask_insert_task(folder, PSYNC_FS_TASK_CREAT, &cr->tree);
   folder->taskscnt+=2;
   psync_fstask_release_folder_tasks_locked(folder);
 }
@@ -1570,23 +1688,77 @@ static psync_init_task_ptr psync_init_task_func[]={
   psync_init_task_unlink_set_rev
 };
 
-void psync_fstask_init(){
+static void psync_fstask_replay_row(psync_variant_row row){
   psync_uint_t tp;
+  tp=psync_get_number(row[1]);
+  if (!tp || tp>=ARRAY_SIZE(psync_init_task_func)){
+    debug(D_BUG, "invalid fstask type %lu", (long unsigned)tp);
+    return;
+  }
+  psync_init_task_func[tp](row);
+}
+
+static psync_fstask_folder_t *psync_fstask_load_folder_locked(psync_fsfolderid_t folderid){
+  psync_fstask_folder_t *folder;
   psync_sql_res *res;
   psync_variant_row row;
+  folder=psync_new(psync_fstask_folder_t);
+  memset(folder, 0, sizeof(psync_fstask_folder_t));
+  folder->folderid=folderid;
+  folder->refcnt=1;
+  psync_tree_add(&folders, &folder->tree, folder_cmp);
+  res=psync_sql_query("SELECT id, type, folderid, fileid, text1, text2, int1, int2, sfolderid FROM fstask WHERE folderid=? AND id<=? ORDER BY id");
+  psync_sql_bind_int(res, 1, folderid);
+  psync_sql_bind_uint(res, 2, fstask_lazy_maxid);
+  while ((row=psync_sql_fetch_row(res)))
+    psync_fstask_replay_row(row);
+  psync_sql_free_result(res);
+  if (folder->taskscnt)
+    debug(D_NOTICE, "loaded %u tasks of folder %ld", (unsigned)folder->taskscnt, (long)folderid);
+  psync_fstask_check_lazy_done_locked();
+  return folder;
+}
+
+/* Once no task pending at startup is left, the empty folders that were only kept as "loaded" markers are freed. */
+void psync_fstask_check_lazy_done_locked(){
+  psync_fstask_folder_t *folder;
+  psync_sql_res *res;
+  psync_tree *tr, *next;
+  uint32_t cnt;
+  if (likely(!fstask_lazy_maxid))
+    return;
+  res=psync_sql_query("SELECT id FROM fstask WHERE id<=? LIMIT 1");
+  psync_sql_bind_uint(res, 1, fstask_lazy_maxid);
+  if (psync_sql_fetch_rowint(res)){
+    psync_sql_free_result(res);
+    return;
+  }
+  psync_sql_free_result(res);
+  fstask_lazy_maxid=0;
+  cnt=0;
+  tr=psync_tree_get_first(folders);
+  while (tr){
+    next=psync_tree_get_next(tr);
+    folder=psync_tree_element(tr, psync_fstask_folder_t, tree);
+    if (!folder->refcnt && !folder->taskscnt){
+      psync_tree_del(&folders, &folder->tree);
+      psync_free(folder->names);
+      psync_free(folder);
+      cnt++;
+    }
+    tr=next;
+  }
+  debug(D_NOTICE, "all tasks pending at startup are processed, freed %u empty folders", (unsigned)cnt);
+}
+
+void psync_fstask_init(){
+  psync_sql_res *res;
   res=psync_sql_prep_statement("UPDATE fstask SET status=0 WHERE status IN (1, 2)");
   psync_sql_run_free(res);
   res=psync_sql_prep_statement("UPDATE fstask SET status=11 WHERE status=12");
   psync_sql_run_free(res);
-  res=psync_sql_query("SELECT id, type, folderid, fileid, text1, text2, int1, int2, sfolderid FROM fstask ORDER BY id");
-  while ((row=psync_sql_fetch_row(res))){
-    tp=psync_get_number(row[1]);
-    if (!tp || tp>=ARRAY_SIZE(psync_init_task_func)){
-      debug(D_BUG, "invalid fstask type %lu", (long unsigned)tp);
-      continue;
-    }
-    psync_init_task_func[tp](row);
-  }
-  psync_sql_free_result(res);
+  fstask_lazy_maxid=psync_sql_cellint("SELECT MAX(id) FROM fstask", 0);
+  if (fstask_lazy_maxid)
+    debug(D_NOTICE, "tasks up to id %lu will be loaded on folder access", (unsigned long)fstask_lazy_maxid);
   psync_fsupload_init();
 }
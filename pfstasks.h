@@ -46,6 +46,7 @@
 
 typedef struct {
   psync_tree tree;
+  uint32_t namehash;
   psync_fsfolderid_t folderid;
   uint64_t taskid;
   time_t ctime;
@@ -56,6 +57,7 @@ typedef struct {
 
 typedef struct {
   psync_tree tree;
+  uint32_t namehash;
   psync_fsfolderid_t folderid;
   uint64_t taskid;
   char name[];
@@ -63,6 +65,7 @@ typedef struct {
 
 typedef struct {
   psync_tree tree;
+  uint32_t namehash;
   psync_fsfileid_t fileid;
   uint64_t taskid;
   char name[];
@@ -70,23 +73,37 @@ typedef struct {
 
 typedef struct {
   psync_tree tree;
+  uint32_t namehash;
   psync_fsfileid_t fileid;
   uint64_t taskid;
   char name[];
 } psync_fstask_unlink_t;
 
+/* Entry of the per-folder name index, task points to the tree member of a task of the given type. The trees are kept
+ * for ordered iteration, lookups by name go to the index.
+ */
+typedef struct {
+  psync_tree *task;
+  uint32_t hash;
+  uint32_t type;
+} psync_fstask_name_entry_t;
+
 typedef struct {
   psync_tree tree;
   psync_fsfolderid_t folderid;
+  psync_fstask_name_entry_t *names;
   psync_tree *mkdirs;
   psync_tree *rmdirs;
   psync_tree *creats;
   psync_tree *unlinks;
+  uint32_t namesmask;
+  uint32_t namescnt;
   uint32_t taskscnt;
   uint32_t refcnt;
 } psync_fstask_folder_t;
 
 void psync_fstask_init();
+void psync_fstask_check_lazy_done_locked();
 
 psync_fstask_folder_t *psync_fstask_get_or_create_folder_tasks(psync_fsfolderid_t folderid);
 psync_fstask_folder_t *psync_fstask_get_folder_tasks(psync_fsfolderid_t folderid);
@@ -112,6 +129,8 @@ psync_fstask_unlink_t *psync_fstask_find_unlink(psync_fstask_folder_t *folder, c
 psync_fstask_mkdir_t *psync_fstask_find_mkdir_by_folderid(psync_fstask_folder_t *folder, psync_fsfolderid_t folderid);
 psync_fstask_creat_t *psync_fstask_find_creat_by_fileid(psync_fstask_folder_t *folder, psync_fsfileid_t fileid);
 
+void psync_fstask_del_creat(psync_fstask_folder_t *folder, psync_fstask_creat_t *cr);
+
 int psync_fstask_mkdir(psync_fsfolderid_t folderid, const char *name);
 int psync_fstask_can_rmdir(psync_fsfolderid_t folderid, const char *name);
 int psync_fstask_rmdir(psync_fsfolderid_t folderid, const char *name);
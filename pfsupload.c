@@ -52,15 +52,14 @@ typedef struct {
   const char *text2;
   int64_t int1;
   int64_t int2;
+  uint64_t csize;
   unsigned char ccreat;
   unsigned char needprocessing;
   unsigned char status;
 } fsupload_task_t;
 
-static pthread_mutex_t upload_mutex=PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t upload_cond=PTHREAD_COND_INITIALIZER;
+static psync_mpsc_queue upload_queue=PSYNC_MPSC_STATIC_INIT(upload_queue);
 static uint64_t current_upload_taskid=0;
-static uint32_t upload_wakes=0;
 static int large_upload_running=0;
 static int stop_current_upload=0;
 static psync_list *current_upload_batch=NULL;
@@ -314,7 +313,8 @@ static int save_meta(const binresult *meta, psync_folderid_t folderid, const cha
   }
   psync_sql_commit_transaction(); 
   debug(D_NOTICE, "file %lu/%s uploaded", (unsigned long)folderid, name);
-  psync_status_recalc_to_upload_async();
+  psync_status_add_to_upload(-1, -(int64_t)size);
+  psync_status_send_update();
   return 0;
 }
 
@@ -652,7 +652,9 @@ static int upload_modify_read_req(psync_socket *api){
 int upload_modify(uint64_t taskid, psync_folderid_t folderid, const char *name, const char *filename, const char *indexname, psync_fileid_t fileid, 
               uint64_t hash, uint64_t writeid){
   binparam aparams[]={P_STR("auth", psync_my_auth)};
-  psync_interval_tree_t *tree, *cinterval;
+  psync_interval_tree_t *tree;
+  psync_interval_tree_iter_t it;
+  const psync_interval_t *cinterval;
   psync_socket *api;
   binresult *res;
   psync_sql_res *sql;
@@ -726,7 +728,7 @@ int upload_modify(uint64_t taskid, psync_folderid_t folderid, const char *name,
     goto err3;
   coff=0;
   reqs=0;
-  cinterval=psync_interval_tree_get_first(tree);
+  cinterval=psync_interval_tree_get_first(tree, &it);
   while (coff<fsize){
     if (reqs && (psync_socket_pendingdata(api) || psync_select_in(&api->sock, 1, 0)!=SOCKET_ERROR)){
       if ((ret=upload_modify_read_req(api))){
@@ -748,7 +750,7 @@ int upload_modify(uint64_t taskid, psync_folderid_t folderid, const char *name,
         ret=upload_modify_send_local(api, uploadid, coff, i64min(cinterval->to, fsize)-coff, fd, &asize);
         reqs++;
         coff=cinterval->to;
-        cinterval=psync_interval_tree_get_next(cinterval);
+        cinterval=psync_interval_tree_get_next(&it);
       }
       else{
         debug(D_BUG, "broken interval tree");
@@ -953,6 +955,7 @@ static int psync_send_task_creat(psync_socket *api, fsupload_task_t *task){
       psync_file_close(fd);
       if (!ret){
         psync_upload_inc_uploads();
+        task->csize=size;
         task->ccreat=1;
       }
       return ret;
@@ -1266,8 +1269,10 @@ static psync_cancel_task_ptr psync_cancel_task_func[]={
 static void psync_fsupload_process_tasks(psync_list *tasks){
   fsupload_task_t *task;
   psync_sql_res *del, *dep, *fol, *sfol, *fil;
+  uint64_t creatbytes;
   uint32_t creats, cancels;
   creats=0;
+  creatbytes=0;
   cancels=0;
   psync_sql_start_transaction();
   del=psync_sql_prep_statement("DELETE FROM fstask WHERE id=?");
@@ -1276,15 +1281,17 @@ static void psync_fsupload_process_tasks(psync_list *tasks){
   sfol=psync_sql_prep_statement("UPDATE fstask SET sfolderid=? WHERE sfolderid=?");
   fil=psync_sql_prep_statement("UPDATE fstask SET fileid=? WHERE fileid=?");
   psync_list_for_each_element (task, tasks, fsupload_task_t, list){
-    if (task->ccreat)
+    if (task->ccreat){
       creats++;
+      creatbytes+=task->csize;
+    }
     if (task->status==11){
       if (psync_cancel_task_func[task->type] && psync_cancel_task_func[task->type](task))
         continue;
       psync_sql_bind_uint(dep, 1, task->id);
       psync_sql_run(dep);
       if (psync_sql_affected_rows())
-        upload_wakes++;
+        psync_mpsc_wake(&upload_queue);
       psync_sql_bind_uint(del, 1, task->id);
       psync_sql_run(del);
       cancels++;
@@ -1309,7 +1316,7 @@ static void psync_fsupload_process_tasks(psync_list *tasks){
         psync_sql_bind_uint(dep, 1, task->id);
         psync_sql_run(dep);
         if (psync_sql_affected_rows())
-          upload_wakes++;
+          psync_mpsc_wake(&upload_queue);
         psync_sql_bind_uint(del, 1, task->id);
         psync_sql_run(del);
       }
@@ -1324,7 +1331,9 @@ static void psync_fsupload_process_tasks(psync_list *tasks){
   psync_sql_commit_transaction();
   if (creats){
     psync_upload_dec_uploads_cnt(creats);
+    psync_status_add_to_upload(-(int32_t)creats, -(int64_t)creatbytes);
     psync_status_recalc_to_upload_async();
+    psync_status_send_update();
   }
   else if (cancels)
     psync_status_recalc_to_upload_async();
@@ -1396,7 +1405,7 @@ err0:
 err:
   async_result_reader_destroy(&reader);
   psync_timer_notify_exception();
-  upload_wakes++;
+  psync_mpsc_wake(&upload_queue);
   psync_milisleep(PSYNC_SLEEP_ON_FAILED_UPLOAD);
 }
 
@@ -1449,17 +1458,19 @@ static void psync_fsupload_check_tasks(){
       task->text2=NULL;
     task->int1=psync_get_snumber_or_null(row[6]);
     task->int2=psync_get_snumber_or_null(row[7]);
+    task->csize=0;
     task->ccreat=0;
     psync_list_add_tail(&tasks, &task->list);
   }
   current_upload_batch=&tasks;
   psync_sql_free_result(res);
   if (cnt==PSYNC_FSUPLOAD_NUM_TASKS_PER_RUN)
-    upload_wakes++;
+    psync_mpsc_wake(&upload_queue);
   if (!psync_list_isempty(&tasks))
     psync_fsupload_run_tasks(&tasks);
   psync_sql_lock();
   current_upload_batch=NULL;
+  psync_fstask_check_lazy_done_locked();
   psync_sql_unlock();
   psync_list_for_each_element_call(&tasks, fsupload_task_t, list, psync_free);
 }
@@ -1470,11 +1481,7 @@ static void psync_fsupload_thread(){
     // it is better to sleep a bit to give a chance to events to accumulate
     psync_milisleep(10);
     psync_fsupload_check_tasks();
-    pthread_mutex_lock(&upload_mutex);
-    while (!upload_wakes)
-      pthread_cond_wait(&upload_cond, &upload_mutex);
-    upload_wakes=0;
-    pthread_mutex_unlock(&upload_mutex);
+    psync_mpsc_wait(&upload_queue);
   }
 }
 
@@ -1483,9 +1490,8 @@ void psync_fsupload_init(){
   psync_run_thread("fsupload main", psync_fsupload_thread);
 }
 
+/* Wakeup only. Which fstasks are ready depends on fstaskdepend, so psync_fsupload_check_tasks() always selects them from the
+ * database. */
 void psync_fsupload_wake(){
-  pthread_mutex_lock(&upload_mutex);
-  if (!upload_wakes++)
-    pthread_cond_signal(&upload_cond);
-  pthread_mutex_unlock(&upload_mutex); 
+  psync_mpsc_wake(&upload_queue);
 }
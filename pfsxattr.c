@@ -98,7 +98,7 @@ static int64_t xattr_get_object_id_locked(const char *path){
   if (folder){
     mk=psync_fstask_find_mkdir(folder, fspath->name, 0);
     if (mk){
-      psync_free(fspath);
+      psync_fsfolder_free_path(fspath);
       assertw(mk->folderid!=0);
       if (mk->folderid>0)
         return folderid_to_objid(mk->folderid);
@@ -107,7 +107,7 @@ static int64_t xattr_get_object_id_locked(const char *path){
     }
     cr=psync_fstask_find_creat(folder, fspath->name, 0);
     if (cr){
-      psync_free(fspath);
+      psync_fsfolder_free_path(fspath);
       if (cr->fileid>0)
         return fileid_to_objid(cr->fileid);
       else{
@@ -134,7 +134,7 @@ static int64_t xattr_get_object_id_locked(const char *path){
     psync_fstask_release_folder_tasks_locked(folder);
   }
   if (fspath->folderid<0){
-    psync_free(fspath);
+    psync_fsfolder_free_path(fspath);
     debug(D_NOTICE, "path %s not found in temporary folder", path);
     return -1;
   }
@@ -148,7 +148,7 @@ static int64_t xattr_get_object_id_locked(const char *path){
       ret=-1;
     psync_sql_free_result(res);
     if (ret!=-1){
-      psync_free(fspath);
+      psync_fsfolder_free_path(fspath);
       return ret;
     }
   }
@@ -162,11 +162,11 @@ static int64_t xattr_get_object_id_locked(const char *path){
       ret=-1;
     psync_sql_free_result(res);
     if (ret!=-1){
-      psync_free(fspath);
+      psync_fsfolder_free_path(fspath);
       return ret;
     }
   }
-  psync_free(fspath);
+  psync_fsfolder_free_path(fspath);
   debug(D_NOTICE, "path %s not found", path);
   return -1;
 }
@@ -25,88 +25,287 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
 #include "pintervaltree.h"
 #include "plibs.h"
 
-static psync_interval_tree_t *psync_interval_tree_new(uint64_t from, uint64_t to){
-  psync_interval_tree_t *tree=psync_new(psync_interval_tree_t);
-  tree->from=from;
-  tree->to=to;
-  return psync_interval_tree_element(psync_tree_get_add_after(PSYNC_TREE_EMPTY, NULL, &tree->tree));
+#define PSYNC_INTERVAL_POOL_CHUNKS 256
+
+static pthread_mutex_t pool_mutex=PTHREAD_MUTEX_INITIALIZER;
+static psync_interval_chunk_t *chunk_pool[PSYNC_INTERVAL_POOL_CHUNKS];
+static uint32_t chunk_pool_cnt=0;
+
+static psync_interval_chunk_t *psync_interval_chunk_alloc(){
+  psync_interval_chunk_t *chunk;
+  pthread_mutex_lock(&pool_mutex);
+  if (chunk_pool_cnt)
+    chunk=chunk_pool[--chunk_pool_cnt];
+  else
+    chunk=NULL;
+  pthread_mutex_unlock(&pool_mutex);
+  if (!chunk)
+    chunk=psync_new(psync_interval_chunk_t);
+  chunk->cnt=0;
+  return chunk;
 }
 
-static psync_interval_tree_t *psync_interval_new(uint64_t from, uint64_t to){
-  psync_interval_tree_t *tree=psync_new(psync_interval_tree_t);
-  tree->from=from;
-  tree->to=to;
+static void psync_interval_chunk_free(psync_interval_chunk_t *chunk){
+  pthread_mutex_lock(&pool_mutex);
+  if (chunk_pool_cnt<PSYNC_INTERVAL_POOL_CHUNKS){
+    chunk_pool[chunk_pool_cnt++]=chunk;
+    chunk=NULL;
+  }
+  pthread_mutex_unlock(&pool_mutex);
+  if (chunk)
+    psync_free(chunk);
+}
+
+static psync_interval_tree_t *psync_interval_tree_new(){
+  psync_interval_tree_t *tree;
+  tree=psync_new(psync_interval_tree_t);
+  tree->chunkalloc=8;
+  tree->chunks=psync_new_cnt(psync_interval_chunk_t *, tree->chunkalloc);
+  tree->chunkto=psync_new_cnt(uint64_t, tree->chunkalloc);
+  tree->chunkcnt=0;
+  tree->cnt=0;
   return tree;
 }
 
-static psync_interval_tree_t *psync_interval_tree_consume_intervals(psync_interval_tree_t *tree, psync_interval_tree_t *e){
-  psync_interval_tree_t *next;
-  while ((next=psync_interval_tree_get_next(e))){
-    if (next->from>e->to)
-      break;
-    psync_interval_tree_del(&tree, next);
-    if (next->to>=e->to){
-      e->to=next->to;
-      psync_free(next);
-      break;
-    }
-    psync_free(next);
+static void psync_interval_tree_insert_chunk(psync_interval_tree_t *tree, uint32_t pos, psync_interval_chunk_t *chunk){
+  if (tree->chunkcnt==tree->chunkalloc){
+    tree->chunkalloc*=2;
+    tree->chunks=(psync_interval_chunk_t **)psync_realloc(tree->chunks, sizeof(psync_interval_chunk_t *)*tree->chunkalloc);
+    tree->chunkto=(uint64_t *)psync_realloc(tree->chunkto, sizeof(uint64_t)*tree->chunkalloc);
   }
-  return tree;
+  memmove(tree->chunks+pos+1, tree->chunks+pos, sizeof(psync_interval_chunk_t *)*(tree->chunkcnt-pos));
+  memmove(tree->chunkto+pos+1, tree->chunkto+pos, sizeof(uint64_t)*(tree->chunkcnt-pos));
+  tree->chunks[pos]=chunk;
+  tree->chunkto[pos]=chunk->cnt?chunk->intervals[chunk->cnt-1].to:0;
+  tree->chunkcnt++;
 }
 
-static psync_interval_tree_t *psync_interval_tree_get_add(psync_interval_tree_t *tree, uint64_t from, uint64_t to){
-//  debug(D_NOTICE, "adding interval %lu %lu", from, to);
-  assert(to>=from);
-  if (unlikely(!tree))
-    return psync_interval_tree_new(from, to);
-  else{
-    psync_interval_tree_t *e, *e2;
-    e=tree;
-    while (1){
-      assert(from<=to);
-      if (e->from<=from && e->to>=from){
-        if (e->to>=to)
-          return tree;
-        e->to=to;
-        return psync_interval_tree_consume_intervals(tree, e);
-      }
-      else if (e->from>from){
-        if (e->tree.left)
-          e=psync_interval_tree_element(e->tree.left);
-        else if (e->from<=to && e->to>=to){
-          e->from=from;
-          return tree;
-        }
-        else{
-          e2=psync_interval_new(from, to);
-          return psync_interval_tree_consume_intervals(psync_interval_tree_element(psync_tree_get_add_before(&tree->tree, &e->tree, &e2->tree)), e2);
-        }
+static void psync_interval_tree_remove_chunk(psync_interval_tree_t *tree, uint32_t pos){
+  psync_interval_chunk_free(tree->chunks[pos]);
+  tree->chunkcnt--;
+  memmove(tree->chunks+pos, tree->chunks+pos+1, sizeof(psync_interval_chunk_t *)*(tree->chunkcnt-pos));
+  memmove(tree->chunkto+pos, tree->chunkto+pos+1, sizeof(uint64_t)*(tree->chunkcnt-pos));
+}
+
+/* returns the first chunk whose last interval ends at or after point, tree->chunkcnt if none */
+static uint32_t psync_interval_tree_find_chunk(const psync_interval_tree_t *tree, uint64_t point){
+  uint32_t lo, hi, mid;
+  lo=0;
+  hi=tree->chunkcnt;
+  while (lo<hi){
+    mid=(lo+hi)/2;
+    if (tree->chunkto[mid]<point)
+      lo=mid+1;
+    else
+      hi=mid;
+  }
+  return lo;
+}
+
+/* returns the first interval in the chunk that ends at or after point, the chunk must have one */
+static uint32_t psync_interval_chunk_find(const psync_interval_chunk_t *chunk, uint64_t point){
+  uint32_t lo, hi, mid;
+  lo=0;
+  hi=chunk->cnt;
+  while (lo<hi){
+    mid=(lo+hi)/2;
+    if (chunk->intervals[mid].to<point)
+      lo=mid+1;
+    else
+      hi=mid;
+  }
+  return lo;
+}
+
+static void psync_interval_tree_append(psync_interval_tree_t *tree, uint64_t from, uint64_t to){
+  psync_interval_chunk_t *chunk;
+  if (tree->chunkcnt){
+    chunk=tree->chunks[tree->chunkcnt-1];
+    if (chunk->intervals[chunk->cnt-1].to>=from){
+      if (chunk->intervals[chunk->cnt-1].to<to){
+        chunk->intervals[chunk->cnt-1].to=to;
+        tree->chunkto[tree->chunkcnt-1]=to;
       }
-      else{
-        assert(e->to<from);
-        if (e->tree.right)
-          e=psync_interval_tree_element(e->tree.right);
-        else{
-          e2=psync_interval_new(from, to);
-          return psync_interval_tree_consume_intervals(psync_interval_tree_element(psync_tree_get_add_after(&tree->tree, &e->tree, &e2->tree)), e2);
-        }
+      return;
+    }
+  }
+  if (!tree->chunkcnt || tree->chunks[tree->chunkcnt-1]->cnt==PSYNC_INTERVAL_CHUNK_SIZE)
+    psync_interval_tree_insert_chunk(tree, tree->chunkcnt, psync_interval_chunk_alloc());
+  chunk=tree->chunks[tree->chunkcnt-1];
+  chunk->intervals[chunk->cnt].from=from;
+  chunk->intervals[chunk->cnt].to=to;
+  chunk->cnt++;
+  tree->chunkto[tree->chunkcnt-1]=to;
+  tree->cnt++;
+}
+
+static void psync_interval_tree_insert_at(psync_interval_tree_t *tree, uint32_t c, uint32_t i, uint64_t from, uint64_t to){
+  psync_interval_chunk_t *chunk, *nchunk;
+  chunk=tree->chunks[c];
+  if (chunk->cnt==PSYNC_INTERVAL_CHUNK_SIZE){
+    nchunk=psync_interval_chunk_alloc();
+    nchunk->cnt=PSYNC_INTERVAL_CHUNK_SIZE-PSYNC_INTERVAL_CHUNK_SIZE/2;
+    memcpy(nchunk->intervals, chunk->intervals+PSYNC_INTERVAL_CHUNK_SIZE/2, sizeof(psync_interval_t)*nchunk->cnt);
+    chunk->cnt=PSYNC_INTERVAL_CHUNK_SIZE/2;
+    tree->chunkto[c]=chunk->intervals[chunk->cnt-1].to;
+    psync_interval_tree_insert_chunk(tree, c+1, nchunk);
+    if (i>chunk->cnt){
+      i-=chunk->cnt;
+      c++;
+      chunk=nchunk;
+    }
+  }
+  memmove(chunk->intervals+i+1, chunk->intervals+i, sizeof(psync_interval_t)*(chunk->cnt-i));
+  chunk->intervals[i].from=from;
+  chunk->intervals[i].to=to;
+  chunk->cnt++;
+  if (i==chunk->cnt-1)
+    tree->chunkto[c]=to;
+  tree->cnt++;
+}
+
+/* merges into the interval at position (c, i) all following intervals that it now overlaps or touches */
+static void psync_interval_tree_consume(psync_interval_tree_t *tree, uint32_t c, uint32_t i){
+  psync_interval_chunk_t *chunk;
+  psync_interval_t *cur;
+  uint32_t j, cnt;
+  chunk=tree->chunks[c];
+  cur=&chunk->intervals[i];
+  cnt=chunk->cnt;
+  for (j=i+1; j<cnt && chunk->intervals[j].from<=cur->to; j++)
+    if (chunk->intervals[j].to>cur->to)
+      cur->to=chunk->intervals[j].to;
+  if (j>i+1){
+    memmove(cur+1, chunk->intervals+j, sizeof(psync_interval_t)*(cnt-j));
+    chunk->cnt-=j-i-1;
+    tree->cnt-=j-i-1;
+  }
+  tree->chunkto[c]=chunk->intervals[chunk->cnt-1].to;
+  if (j<cnt)
+    return;
+  while (c+1<tree->chunkcnt){
+    chunk=tree->chunks[c+1];
+    cnt=chunk->cnt;
+    for (j=0; j<cnt && chunk->intervals[j].from<=cur->to; j++)
+      if (chunk->intervals[j].to>cur->to)
+        cur->to=chunk->intervals[j].to;
+    tree->chunkto[c]=cur->to;
+    tree->cnt-=j;
+    if (j==cnt)
+      psync_interval_tree_remove_chunk(tree, c+1);
+    else{
+      if (j){
+        memmove(chunk->intervals, chunk->intervals+j, sizeof(psync_interval_t)*(cnt-j));
+        chunk->cnt-=j;
       }
+      break;
     }
   }
 }
 
+static void psync_interval_tree_add_to(psync_interval_tree_t *tree, uint64_t from, uint64_t to){
+  psync_interval_chunk_t *chunk;
+  psync_interval_t *iv;
+  uint32_t c, i;
+  assert(to>=from);
+  c=psync_interval_tree_find_chunk(tree, from);
+  if (c==tree->chunkcnt){
+    psync_interval_tree_append(tree, from, to);
+    return;
+  }
+  chunk=tree->chunks[c];
+  i=psync_interval_chunk_find(chunk, from);
+  iv=&chunk->intervals[i];
+  if (iv->from<=to){
+    if (iv->from>from)
+      iv->from=from;
+    if (iv->to>=to)
+      return;
+    iv->to=to;
+    psync_interval_tree_consume(tree, c, i);
+  }
+  else
+    psync_interval_tree_insert_at(tree, c, i, from, to);
+}
+
 void psync_interval_tree_add(psync_interval_tree_t **tree, uint64_t from, uint64_t to){
-  *tree=psync_interval_tree_get_add(*tree, from, to);
+  if (unlikely(!*tree))
+    *tree=psync_interval_tree_new();
+  psync_interval_tree_add_to(*tree, from, to);
+}
+
+static int psync_interval_cmp(const void *p1, const void *p2){
+  const psync_interval_t *i1, *i2;
+  i1=(const psync_interval_t *)p1;
+  i2=(const psync_interval_t *)p2;
+  if (i1->from<i2->from)
+    return -1;
+  else if (i1->from>i2->from)
+    return 1;
+  else
+    return 0;
+}
+
+/* Adds cnt intervals at once, the array is sorted in place. Big batches (compared to the size of the set) are merged with the existing
+ * intervals in a single pass that builds densely packed chunks, small ones are inserted one by one.
+ */
+void psync_interval_tree_add_many(psync_interval_tree_t **tree, psync_interval_t *intervals, size_t cnt){
+  psync_interval_tree_t *ntree;
+  psync_interval_tree_iter_t it;
+  const psync_interval_t *iv;
+  size_t i;
+  if (!cnt)
+    return;
+  qsort(intervals, cnt, sizeof(psync_interval_t), psync_interval_cmp);
+  if (*tree && (*tree)->cnt>cnt*8){
+    for (i=0; i<cnt; i++)
+      psync_interval_tree_add_to(*tree, intervals[i].from, intervals[i].to);
+    return;
+  }
+  ntree=psync_interval_tree_new();
+  iv=psync_interval_tree_get_first(*tree, &it);
+  i=0;
+  while (iv || i<cnt){
+    if (iv && (i==cnt || iv->from<=intervals[i].from)){
+      psync_interval_tree_append(ntree, iv->from, iv->to);
+      iv=psync_interval_tree_get_next(&it);
+    }
+    else{
+      psync_interval_tree_append(ntree, intervals[i].from, intervals[i].to);
+      i++;
+    }
+  }
+  psync_interval_tree_free(*tree);
+  *tree=ntree;
+}
+
+const psync_interval_t *psync_interval_tree_first_interval_containing_or_after(psync_interval_tree_t *tree, uint64_t point,
+                                                                              psync_interval_tree_iter_t *it){
+  uint32_t c;
+  if (!tree)
+    return NULL;
+  c=psync_interval_tree_find_chunk(tree, point+1);
+  if (c==tree->chunkcnt)
+    return NULL;
+  it->tree=tree;
+  it->chunk=c;
+  it->idx=psync_interval_chunk_find(tree->chunks[c], point+1);
+  return &tree->chunks[c]->intervals[it->idx];
 }
 
 void psync_interval_tree_free(psync_interval_tree_t *tree){
+  uint32_t i;
   if (!tree)
     return;
-  psync_interval_tree_free(psync_interval_tree_element(tree->tree.left));
-  psync_interval_tree_free(psync_interval_tree_element(tree->tree.right));
+  for (i=0; i<tree->chunkcnt; i++)
+    psync_interval_chunk_free(tree->chunks[i]);
+  psync_free(tree->chunks);
+  psync_free(tree->chunkto);
   psync_free(tree);
 }
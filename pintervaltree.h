@@ -25,55 +25,79 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+
 #ifndef _PSYNC_INTERVALTREE_H
 #define _PSYNC_INTERVALTREE_H
 
-#include "ptree.h"
 #include <stdint.h>
+#include <stddef.h>
+
+/* Set of non-overlapping, non-adjacent intervals [from, to) kept as a two level structure: a sorted array of chunks, each of them a
+ * sorted array of up to PSYNC_INTERVAL_CHUNK_SIZE intervals. Lookups are two binary searches over contiguous memory and iteration is
+ * sequential within a chunk. An empty set is represented by a NULL pointer, psync_interval_tree_add allocates it on first use.
+ */
+
+#define PSYNC_INTERVAL_CHUNK_SIZE 64
 
 typedef struct {
-  psync_tree tree;
   uint64_t from;
   uint64_t to;
-} psync_interval_tree_t;
+} psync_interval_t;
 
-#define psync_interval_tree_element(a) psync_tree_element(a, psync_interval_tree_t, tree)
+typedef struct {
+  uint32_t cnt;
+  psync_interval_t intervals[PSYNC_INTERVAL_CHUNK_SIZE];
+} psync_interval_chunk_t;
 
-static inline psync_interval_tree_t *psync_interval_tree_get_first(psync_interval_tree_t *tree){
-  return psync_interval_tree_element(psync_tree_get_first(&tree->tree));
-}
+typedef struct {
+  psync_interval_chunk_t **chunks;
+  /* chunkto[i] is the end of the last interval in chunks[i], kept separately so that searching does not touch the chunks */
+  uint64_t *chunkto;
+  uint64_t cnt;
+  uint32_t chunkcnt;
+  uint32_t chunkalloc;
+} psync_interval_tree_t;
 
-static inline psync_interval_tree_t *psync_interval_tree_get_last(psync_interval_tree_t *tree){
-  return psync_interval_tree_element(psync_tree_get_last(&tree->tree));
-}
+typedef struct {
+  psync_interval_tree_t *tree;
+  uint32_t chunk;
+  uint32_t idx;
+} psync_interval_tree_iter_t;
 
-static inline psync_interval_tree_t *psync_interval_tree_get_next(psync_interval_tree_t *tree){
-  return psync_interval_tree_element(psync_tree_get_next(&tree->tree));
+static inline const psync_interval_t *psync_interval_tree_get_first(psync_interval_tree_t *tree, psync_interval_tree_iter_t *it){
+  it->tree=tree;
+  it->chunk=0;
+  it->idx=0;
+  if (!tree || !tree->chunkcnt)
+    return NULL;
+  return &tree->chunks[0]->intervals[0];
 }
 
-static inline void psync_interval_tree_del(psync_interval_tree_t **tree, psync_interval_tree_t *node){
-  *tree=psync_interval_tree_element(psync_tree_get_del(&(*tree)->tree, &node->tree));
+static inline const psync_interval_t *psync_interval_tree_get_last(psync_interval_tree_t *tree){
+  psync_interval_chunk_t *c;
+  if (!tree || !tree->chunkcnt)
+    return NULL;
+  c=tree->chunks[tree->chunkcnt-1];
+  return &c->intervals[c->cnt-1];
 }
 
-static inline psync_interval_tree_t *psync_interval_tree_first_interval_containing_or_after(psync_interval_tree_t *tree, uint64_t point){
-  while (tree){
-    if (point>=tree->to){
-      if (tree->tree.right)
-        tree=psync_interval_tree_element(tree->tree.right);
-      else{
-        tree=psync_interval_tree_get_next(tree);
-        break;
-      }
-    }
-    else if (point>=tree->from || !tree->tree.left)
-      break;
-    else
-      tree=psync_interval_tree_element(tree->tree.left);
+static inline const psync_interval_t *psync_interval_tree_get_next(psync_interval_tree_iter_t *it){
+  if (++it->idx>=it->tree->chunks[it->chunk]->cnt){
+    if (++it->chunk>=it->tree->chunkcnt)
+      return NULL;
+    it->idx=0;
   }
-  return tree;
+  return &it->tree->chunks[it->chunk]->intervals[it->idx];
+}
+
+static inline uint64_t psync_interval_tree_count(psync_interval_tree_t *tree){
+  return tree?tree->cnt:0;
 }
 
+const psync_interval_t *psync_interval_tree_first_interval_containing_or_after(psync_interval_tree_t *tree, uint64_t point,
+                                                                              psync_interval_tree_iter_t *it);
 void psync_interval_tree_add(psync_interval_tree_t **tree, uint64_t from, uint64_t to);
+void psync_interval_tree_add_many(psync_interval_tree_t **tree, psync_interval_t *intervals, size_t cnt);
 void psync_interval_tree_free(psync_interval_tree_t *tree);
 
 #endif
@@ -31,6 +31,7 @@
 #include "pcache.h"
 #include "ptree.h"
 #include "pdatabase.h"
+#include "pmetrics.h"
 #include <string.h>
 #include <stdarg.h>
 #include <stdio.h>
@@ -107,6 +108,8 @@ PSYNC_THREAD uint32_t psync_error=0;
 
 static pthread_mutex_t psync_db_checkpoint_mutex;
 
+static void sql_clean_thread_caches();
+
 
 char *psync_strdup(const char *str){
   size_t len;
@@ -394,10 +397,13 @@ int psync_sql_connect(const char *db){
 
 int psync_sql_close(){
   int code, tries;
+  if (IS_DEBUG)
+    psync_sql_dump_stmt_stats();
   tries=0;
   while (1){
     code=sqlite3_close(psync_db);
     if (code==SQLITE_BUSY){
+      sql_clean_thread_caches();
       psync_cache_clean_all();
       tries++;
       if (tries>100){
@@ -453,69 +459,64 @@ void psync_sql_checkpoint_unlock(){
   pthread_mutex_unlock(&psync_db_checkpoint_mutex);
 }
 
-#if IS_DEBUG
-unsigned long sqllockcnt=0;
-struct timespec sqllockstart;
-#endif
+/* protected by psync_db_mutex */
+static unsigned long sqllockcnt=0;
+static uint64_t sqllockstart;
+
+PSYNC_METRIC_HISTOGRAM(metric_sql_lock_wait, "sql_lock_wait_usec");
+PSYNC_METRIC_HISTOGRAM(metric_sql_lock_hold, "sql_lock_hold_usec");
+PSYNC_METRIC_COUNTER(metric_sql_lock_uncontended, "sql_lock_uncontended");
 
 int psync_sql_trylock(){
-#if IS_DEBUG
   if (pthread_mutex_trylock(&psync_db_mutex))
     return -1;
   if (++sqllockcnt==1)
-    psync_nanotime(&sqllockstart);
+    sqllockstart=psync_metric_time();
   return 0;
-#else
-  return pthread_mutex_trylock(&psync_db_mutex);
-#endif
 }
 
+/* only waits that were contended are recorded, the rest are just counted */
 void psync_sql_lock(){
-#if IS_DEBUG
   if (pthread_mutex_trylock(&psync_db_mutex)){
-    struct timespec start, end;
-    unsigned long msec;
-    psync_nanotime(&start);
-#if defined(P_OS_LINUX)
-    memcpy(&end, &start, sizeof(end));
+    uint64_t start, waited;
+#if IS_DEBUG && defined(P_OS_LINUX)
+    struct timespec end;
+    start=psync_metric_time();
+    psync_nanotime(&end);
     end.tv_sec+=30;
     if (pthread_mutex_timedlock(&psync_db_mutex, &end)){
       debug(D_BUG, "sql mutex timed out");
       abort();
     }
 #else
+    start=psync_metric_time();
     pthread_mutex_lock(&psync_db_mutex);
 #endif
-    psync_nanotime(&end);
-    msec=(end.tv_sec-start.tv_sec)*1000+end.tv_nsec/1000000-start.tv_nsec/1000000;
-    if (msec>=5)
-      debug(D_WARNING, "waited %lu milliseconds for database mutex", msec);
     sqllockcnt++;
-    memcpy(&sqllockstart, &end, sizeof(struct timespec));
+    sqllockstart=psync_metric_time();
+    waited=sqllockstart-start;
+    psync_metric_record(&metric_sql_lock_wait, waited);
+    if (IS_DEBUG && waited>=5000)
+      debug(D_WARNING, "waited %lu milliseconds for database mutex", (unsigned long)(waited/1000));
+  }
+  else{
+    if (++sqllockcnt==1)
+      sqllockstart=psync_metric_time();
+    psync_metric_inc(&metric_sql_lock_uncontended);
   }
-  else if (++sqllockcnt==1)
-    psync_nanotime(&sqllockstart);
-#else
-  pthread_mutex_lock(&psync_db_mutex);
-#endif
 }
 
 void psync_sql_unlock(){
-#if IS_DEBUG
   if (--sqllockcnt==0){
-    struct timespec end;
-    unsigned long msec;
+    uint64_t held;
+    held=psync_metric_time()-sqllockstart;
     pthread_mutex_unlock(&psync_db_mutex);
-    psync_nanotime(&end);
-    msec=(end.tv_sec-sqllockstart.tv_sec)*1000+end.tv_nsec/1000000-sqllockstart.tv_nsec/1000000;
-    if (msec>=10)
-      debug(D_WARNING, "held database mutex for %lu milliseconds", msec);
+    psync_metric_record(&metric_sql_lock_hold, held);
+    if (IS_DEBUG && held>=10000)
+      debug(D_WARNING, "held database mutex for %lu milliseconds", (unsigned long)(held/1000));
   }
   else
     pthread_mutex_unlock(&psync_db_mutex);
-#else
-  pthread_mutex_unlock(&psync_db_mutex);
-#endif
 }
 
 int psync_sql_sync(){
@@ -823,6 +824,201 @@ psync_variant *psync_sql_row(const char *sql){
   }
 }
 
+/* Prepared statements are cached per thread in a small direct mapped table indexed by the address of the sql text, so
+ * getting a cached statement does not take any lock. Slots are only accessed with atomic exchanges, as
+ * psync_sql_close may empty the caches of all threads while they are alive. When a thread exits its statements are moved to
+ * the shared psync_cache, keyed by the sql text, where the per thread cache looks on a miss. That way short lived threads,
+ * like the ones started for page requests, still reuse prepared statements.
+ */
+typedef struct {
+  psync_list list;
+  psync_sql_res *stmts[PSYNC_QUERY_THREAD_CACHE_SIZE];
+  psync_sql_res *handles[PSYNC_QUERY_MAX_STMT_HANDLES];
+} sql_thread_cache_t;
+
+static PSYNC_THREAD sql_thread_cache_t *sql_thread_cache=NULL;
+static psync_list sql_thread_caches=PSYNC_LIST_STATIC_INIT(sql_thread_caches);
+static pthread_mutex_t sql_thread_caches_mutex=PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t sql_thread_cache_once=PTHREAD_ONCE_INIT;
+static pthread_key_t sql_thread_cache_key;
+static psync_sql_stmt_t *sql_stmt_handles=NULL;
+static pthread_mutex_t sql_stmt_handles_mutex=PTHREAD_MUTEX_INITIALIZER;
+static uint32_t sql_stmt_handles_cnt=0;
+
+static void psync_sql_free_cache(void *ptr){
+  psync_sql_res *res=(psync_sql_res *)ptr;
+  sqlite3_finalize(res->stmt);
+  psync_free(res);
+}
+
+static void sql_thread_cache_clean(sql_thread_cache_t *cache){
+  psync_sql_res *res;
+  psync_uint_t i;
+  for (i=0; i<PSYNC_QUERY_THREAD_CACHE_SIZE; i++)
+    if ((res=(psync_sql_res *)psync_atomic_xchg_ptr(&cache->stmts[i], NULL)))
+      psync_sql_free_cache(res);
+  for (i=0; i<PSYNC_QUERY_MAX_STMT_HANDLES; i++)
+    if ((res=(psync_sql_res *)psync_atomic_xchg_ptr(&cache->handles[i], NULL)))
+      psync_sql_free_cache(res);
+}
+
+static void sql_shared_cache_put(psync_sql_res *res){
+  psync_cache_add(res->sql, res, PSYNC_QUERY_CACHE_SEC, psync_sql_free_cache, PSYNC_QUERY_MAX_CNT);
+}
+
+static psync_sql_res *sql_shared_cache_get(const char *sql){
+  psync_sql_res *res;
+  res=(psync_sql_res *)psync_cache_get(sql);
+  if (res){
+    res->sql=sql;
+    res->handle=NULL;
+  }
+  return res;
+}
+
+static void sql_thread_cache_destroy(void *ptr){
+  sql_thread_cache_t *cache=(sql_thread_cache_t *)ptr;
+  psync_sql_res *res;
+  psync_uint_t i;
+  pthread_mutex_lock(&sql_thread_caches_mutex);
+  psync_list_del(&cache->list);
+  pthread_mutex_unlock(&sql_thread_caches_mutex);
+  for (i=0; i<PSYNC_QUERY_THREAD_CACHE_SIZE; i++)
+    if ((res=(psync_sql_res *)psync_atomic_xchg_ptr(&cache->stmts[i], NULL)))
+      sql_shared_cache_put(res);
+  for (i=0; i<PSYNC_QUERY_MAX_STMT_HANDLES; i++)
+    if ((res=(psync_sql_res *)psync_atomic_xchg_ptr(&cache->handles[i], NULL)))
+      sql_shared_cache_put(res);
+  psync_free(cache);
+}
+
+static void sql_thread_cache_key_create(){
+  pthread_key_create(&sql_thread_cache_key, sql_thread_cache_destroy);
+}
+
+static sql_thread_cache_t *sql_get_thread_cache(){
+  sql_thread_cache_t *cache;
+  if (likely(sql_thread_cache))
+    return sql_thread_cache;
+  pthread_once(&sql_thread_cache_once, sql_thread_cache_key_create);
+  cache=psync_new(sql_thread_cache_t);
+  memset(cache->stmts, 0, sizeof(cache->stmts));
+  memset(cache->handles, 0, sizeof(cache->handles));
+  pthread_mutex_lock(&sql_thread_caches_mutex);
+  psync_list_add_tail(&sql_thread_caches, &cache->list);
+  pthread_mutex_unlock(&sql_thread_caches_mutex);
+  pthread_setspecific(sql_thread_cache_key, cache);
+  sql_thread_cache=cache;
+  return cache;
+}
+
+static void sql_clean_thread_caches(){
+  sql_thread_cache_t *cache;
+  pthread_mutex_lock(&sql_thread_caches_mutex);
+  psync_list_for_each_element(cache, &sql_thread_caches, sql_thread_cache_t, list)
+    sql_thread_cache_clean(cache);
+  pthread_mutex_unlock(&sql_thread_caches_mutex);
+}
+
+static psync_sql_res **sql_thread_cache_slot(const char *sql){
+  return &sql_get_thread_cache()->stmts[(((uintptr_t)sql)>>3)%PSYNC_QUERY_THREAD_CACHE_SIZE];
+}
+
+/* handles past PSYNC_QUERY_MAX_STMT_HANDLES still get counted, but are cached by their text */
+static psync_sql_res **sql_thread_cache_handle_slot(psync_sql_stmt_t *handle){
+  uint32_t id;
+  id=psync_atomic_load_int(&handle->id);
+  if (likely(id && id<=PSYNC_QUERY_MAX_STMT_HANDLES))
+    return &sql_get_thread_cache()->handles[id-1];
+  else
+    return NULL;
+}
+
+static psync_sql_res *sql_thread_cache_get(const char *sql){
+  psync_sql_res **slot, *res, *old;
+  slot=sql_thread_cache_slot(sql);
+  res=(psync_sql_res *)psync_atomic_xchg_ptr(slot, NULL);
+  if (!res)
+    return sql_shared_cache_get(sql);
+  if (likely(!strcmp(sqlite3_sql(res->stmt), sql))){
+    res->sql=sql;
+    res->handle=NULL;
+    return res;
+  }
+  old=(psync_sql_res *)psync_atomic_xchg_ptr(slot, res);
+  if (unlikely(old))
+    psync_sql_free_cache(old);
+  return sql_shared_cache_get(sql);
+}
+
+static void sql_thread_cache_put(psync_sql_res *res){
+  psync_sql_res **slot, *old;
+  if (!res->handle || !(slot=sql_thread_cache_handle_slot(res->handle)))
+    slot=sql_thread_cache_slot(res->sql);
+  old=(psync_sql_res *)psync_atomic_xchg_ptr(slot, res);
+  if (old)
+    psync_sql_free_cache(old);
+}
+
+static uint64_t sql_time_usec(){
+  struct timespec tm;
+  psync_nanotime(&tm);
+  return (uint64_t)tm.tv_sec*1000000+tm.tv_nsec/1000;
+}
+
+/* called with the sql lock held, which also protects the counters */
+static void sql_account_result(psync_sql_res *res){
+  if (res->handle){
+    res->handle->runcnt++;
+    res->handle->runtime+=sql_time_usec()-res->started;
+  }
+}
+
+static void sql_register_stmt(psync_sql_stmt_t *handle){
+  pthread_mutex_lock(&sql_stmt_handles_mutex);
+  if (!handle->id){
+    handle->next=sql_stmt_handles;
+    sql_stmt_handles=handle;
+    psync_atomic_store_int(&handle->id, ++sql_stmt_handles_cnt);
+  }
+  pthread_mutex_unlock(&sql_stmt_handles_mutex);
+}
+
+psync_sql_res *psync_sql_query_stmt(psync_sql_stmt_t *handle){
+  psync_sql_res **slot, *res;
+  if (unlikely(!psync_atomic_load_int(&handle->id)))
+    sql_register_stmt(handle);
+  slot=sql_thread_cache_handle_slot(handle);
+  if ((likely(slot) && (res=(psync_sql_res *)psync_atomic_xchg_ptr(slot, NULL))) || (res=sql_shared_cache_get(handle->sql))){
+    psync_sql_lock();
+  }
+  else{
+    res=psync_sql_query_nocache(handle->sql);
+    if (unlikely(!res))
+      return NULL;
+  }
+  res->handle=handle;
+  res->started=sql_time_usec();
+  return res;
+}
+
+/* handle results are always allocated with space for a row, so a handle works with both */
+psync_sql_res *psync_sql_prep_stmt(psync_sql_stmt_t *handle){
+  return psync_sql_query_stmt(handle);
+}
+
+void psync_sql_dump_stmt_stats(){
+  psync_sql_stmt_t *handle;
+  psync_sql_lock();
+  pthread_mutex_lock(&sql_stmt_handles_mutex);
+  for (handle=sql_stmt_handles; handle; handle=handle->next)
+    if (handle->runcnt)
+      debug(D_NOTICE, "%lu runs, %lu ms total, %lu us avg: %s", (unsigned long)handle->runcnt, (unsigned long)(handle->runtime/1000),
+            (unsigned long)(handle->runtime/handle->runcnt), handle->sql);
+  pthread_mutex_unlock(&sql_stmt_handles_mutex);
+  psync_sql_unlock();
+}
+
 psync_sql_res *psync_sql_query_nocache(const char *sql){
   sqlite3_stmt *stmt;
   psync_sql_res *res;
@@ -839,13 +1035,14 @@ psync_sql_res *psync_sql_query_nocache(const char *sql){
   res=(psync_sql_res *)psync_malloc(sizeof(psync_sql_res)+cnt*sizeof(psync_variant));
   res->stmt=stmt;
   res->sql=sql;
+  res->handle=NULL;
   res->column_count=cnt;
   return res;
 }
 
 psync_sql_res *psync_sql_query(const char *sql){
   psync_sql_res *ret;
-  ret=(psync_sql_res *)psync_cache_get(sql);
+  ret=sql_thread_cache_get(sql);
   if (ret){
 //    debug(D_NOTICE, "got query %s from cache", sql);
     psync_sql_lock();
@@ -855,23 +1052,19 @@ psync_sql_res *psync_sql_query(const char *sql){
     return psync_sql_query_nocache(sql);
 }
 
-static void psync_sql_free_cache(void *ptr){
-  psync_sql_res *res=(psync_sql_res *)ptr;
-  sqlite3_finalize(res->stmt);
-  psync_free(res);
-}
-
 void psync_sql_free_result(psync_sql_res *res){
   int code=sqlite3_reset(res->stmt);
+  sql_account_result(res);
   psync_sql_unlock();
   if (code==SQLITE_OK)
-    psync_cache_add(res->sql, res, PSYNC_QUERY_CACHE_SEC, psync_sql_free_cache, PSYNC_QUERY_MAX_CNT);
+    sql_thread_cache_put(res);
   else
     psync_sql_free_cache(res);
 }
 
 void psync_sql_free_result_nocache(psync_sql_res *res){
   sqlite3_finalize(res->stmt);
+  sql_account_result(res);
   psync_sql_unlock();
   psync_free(res);
 }
@@ -891,12 +1084,13 @@ psync_sql_res *psync_sql_prep_statement_nocache(const char *sql){
   res=psync_new(psync_sql_res);
   res->stmt=stmt;
   res->sql=sql;
+  res->handle=NULL;
   return res;
 }
 
 psync_sql_res *psync_sql_prep_statement(const char *sql){
   psync_sql_res *ret;
-  ret=psync_cache_get(sql);
+  ret=sql_thread_cache_get(sql);
   if (ret){
 //    debug(D_NOTICE, "got statement %s from cache", sql);
     psync_sql_lock();
@@ -926,6 +1120,7 @@ void psync_sql_run_free_nocache(psync_sql_res *res){
   if (unlikely(code!=SQLITE_DONE))
     debug(D_ERROR, "sqlite3_step returned error: %s: %s", sqlite3_errmsg(psync_db), res->sql);
   sqlite3_finalize(res->stmt);
+  sql_account_result(res);
   psync_sql_unlock();
   psync_free(res);
 }
@@ -935,12 +1130,14 @@ void psync_sql_run_free(psync_sql_res *res){
   if (unlikely(code!=SQLITE_DONE || (code=sqlite3_reset(res->stmt))!=SQLITE_OK)){
     debug(D_ERROR, "sqlite3_step returned error: %s: %s", sqlite3_errmsg(psync_db), res->sql);
     sqlite3_finalize(res->stmt);
+    sql_account_result(res);
     psync_sql_unlock();
     psync_free(res);
   }
   else{
+    sql_account_result(res);
     psync_sql_unlock();
-    psync_cache_add(res->sql, res, PSYNC_QUERY_CACHE_SEC, psync_sql_free_cache, PSYNC_QUERY_MAX_CNT);
+    sql_thread_cache_put(res);
   }
 }
 
@@ -1515,6 +1712,82 @@ int psync_task_complete(void *h, void *data){
   return ret;
 }
 
+static void mpsc_link(psync_mpsc_queue *q, psync_mpsc_node *node){
+  psync_mpsc_node *prev;
+  node->next=NULL;
+  prev=psync_atomic_xchg_ptr(&q->head, node);
+  psync_atomic_store_ptr(&prev->next, node);
+}
+
+static void mpsc_notify(psync_mpsc_queue *q){
+  if (psync_atomic_load_int(&q->sleeping)){
+    pthread_mutex_lock(&q->mutex);
+    if (psync_atomic_xchg_int(&q->sleeping, 0))
+      pthread_cond_signal(&q->cond);
+    pthread_mutex_unlock(&q->mutex);
+  }
+}
+
+void psync_mpsc_push(psync_mpsc_queue *q, psync_mpsc_node *node){
+  mpsc_link(q, node);
+  mpsc_notify(q);
+}
+
+void psync_mpsc_wake(psync_mpsc_queue *q){
+  psync_atomic_store_int(&q->wakes, 1);
+  mpsc_notify(q);
+}
+
+/* Consumer only. May return NULL while a producer is in the middle of a push, in that case the producer will notify
+ * the consumer once the node is linked.
+ */
+psync_mpsc_node *psync_mpsc_pop(psync_mpsc_queue *q){
+  psync_mpsc_node *tail, *next;
+  tail=q->tail;
+  next=psync_atomic_load_ptr(&tail->next);
+  if (tail==&q->stub){
+    if (!next)
+      return NULL;
+    q->tail=next;
+    tail=next;
+    next=psync_atomic_load_ptr(&next->next);
+  }
+  if (next){
+    q->tail=next;
+    return tail;
+  }
+  if (tail!=psync_atomic_load_ptr(&q->head))
+    return NULL;
+  mpsc_link(q, &q->stub);
+  next=psync_atomic_load_ptr(&tail->next);
+  if (next){
+    q->tail=next;
+    return tail;
+  }
+  return NULL;
+}
+
+/* Consumer only. Blocks until there is a node in the queue or a wakeup was posted, returns NULL on the latter. */
+psync_mpsc_node *psync_mpsc_wait(psync_mpsc_queue *q){
+  psync_mpsc_node *node;
+  while (1){
+    if ((node=psync_mpsc_pop(q)))
+      return node;
+    if (psync_atomic_xchg_int(&q->wakes, 0))
+      return NULL;
+    pthread_mutex_lock(&q->mutex);
+    psync_atomic_store_int(&q->sleeping, 1);
+    if ((node=psync_mpsc_pop(q)) || psync_atomic_xchg_int(&q->wakes, 0)){
+      psync_atomic_store_int(&q->sleeping, 0);
+      pthread_mutex_unlock(&q->mutex);
+      return node;
+    }
+    while (psync_atomic_load_int(&q->sleeping))
+      pthread_cond_wait(&q->cond, &q->mutex);
+    pthread_mutex_unlock(&q->mutex);
+  }
+}
+
 static void time_format(time_t tm, unsigned long ns, char *result){
   static const char month_names[12][4]={"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
   static const char day_names[7][4] ={"Sun", "Mon", "Tue", "Wed", "Thu", "Fri", "Sat"};
@@ -119,9 +119,25 @@ typedef struct {
   };
 } psync_variant;
 
+/* Statement handle for a hot query, declared once with PSYNC_SQL_STMT in the file that uses it. A handle gets an id on
+ * first use and resolves to the prepared statement of the current thread without looking at the sql text. Number of
+ * executions and the total time (in microseconds) between getting and freeing the result are counted per handle.
+ */
+typedef struct _psync_sql_stmt_t {
+  const char *sql;
+  struct _psync_sql_stmt_t *next;
+  uint32_t id;
+  uint64_t runcnt;
+  uint64_t runtime;
+} psync_sql_stmt_t;
+
+#define PSYNC_SQL_STMT(name, sqltext) static psync_sql_stmt_t name={sqltext, NULL, 0, 0, 0}
+
 typedef struct {
   sqlite3_stmt *stmt;
   const char *sql;
+  psync_sql_stmt_t *handle;
+  uint64_t started;
   int column_count;
   psync_variant row[];
 } psync_sql_res;
@@ -149,6 +165,26 @@ typedef int (*psync_list_builder_sql_callback)(psync_list_builder_t *, void *, p
 
 typedef void (*psync_task_callback_t)(void *, void *);
 
+typedef struct _psync_mpsc_node {
+  struct _psync_mpsc_node *next;
+} psync_mpsc_node;
+
+/* Multiple producers single consumer queue. Pushes are lock-free, the mutex is only taken to wake a sleeping
+ * consumer. Besides nodes, producers can post a bare wakeup that makes the next psync_mpsc_wait return NULL. Consumers
+ * that find their work elsewhere (e.g. in a table) can use a queue for wakeups only.
+ */
+typedef struct {
+  psync_mpsc_node *head;
+  psync_mpsc_node *tail;
+  psync_mpsc_node stub;
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  int sleeping;
+  int wakes;
+} psync_mpsc_queue;
+
+#define PSYNC_MPSC_STATIC_INIT(q) {&q.stub, &q.stub, {NULL}, PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, 0, 0}
+
 extern int psync_do_run;
 extern pstatus_t psync_status;
 extern char psync_my_auth[64], *psync_my_user, *psync_my_pass;
@@ -190,6 +226,9 @@ psync_sql_res *psync_sql_query(const char *sql) PSYNC_NONNULL(1);
 psync_sql_res *psync_sql_query_nocache(const char *sql) PSYNC_NONNULL(1);
 psync_sql_res *psync_sql_prep_statement(const char *sql) PSYNC_NONNULL(1);
 psync_sql_res *psync_sql_prep_statement_nocache(const char *sql) PSYNC_NONNULL(1);
+psync_sql_res *psync_sql_query_stmt(psync_sql_stmt_t *handle) PSYNC_NONNULL(1);
+psync_sql_res *psync_sql_prep_stmt(psync_sql_stmt_t *handle) PSYNC_NONNULL(1);
+void psync_sql_dump_stmt_stats();
 void psync_sql_reset(psync_sql_res *res) PSYNC_NONNULL(1);
 void psync_sql_run(psync_sql_res *res) PSYNC_NONNULL(1);
 void psync_sql_run_free(psync_sql_res *res) PSYNC_NONNULL(1);
@@ -232,6 +271,11 @@ void *psync_task_get_result(psync_task_manager_t tm, int id);
 void psync_task_free(psync_task_manager_t tm);
 int psync_task_complete(void *h, void *data);
 
+void psync_mpsc_push(psync_mpsc_queue *q, psync_mpsc_node *node) PSYNC_NONNULL(1, 2);
+void psync_mpsc_wake(psync_mpsc_queue *q) PSYNC_NONNULL(1);
+psync_mpsc_node *psync_mpsc_pop(psync_mpsc_queue *q) PSYNC_NONNULL(1);
+psync_mpsc_node *psync_mpsc_wait(psync_mpsc_queue *q) PSYNC_NONNULL(1);
+
 int psync_debug(const char *file, const char *function, int unsigned line, int unsigned level, const char *fmt, ...) PSYNC_COLD PSYNC_FORMAT(printf, 5, 6)  PSYNC_NONNULL(5);
 
 uint64_t psync_err_number_expected(const char *file, const char *function, int unsigned line, const psync_variant *v) PSYNC_COLD;
@@ -25,6 +25,10 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE
+#endif
+
 #include "pcompat.h"
 #include "plocalnotify.h"
 #include "plocalscan.h"
@@ -42,18 +46,64 @@ typedef struct{
 #if defined(P_OS_LINUX)
 
 #include <sys/inotify.h>
+#include <sys/fanotify.h>
 #include <sys/epoll.h>
 #include <sys/types.h>
+#include <sys/vfs.h>
 #include <dirent.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <string.h>
 #include <stddef.h>
+#include <stdio.h>
+
+#if defined(FAN_REPORT_DFID_NAME) && defined(FAN_MARK_FILESYSTEM) && defined(FAN_EVENT_INFO_TYPE_DFID_NAME)
+#define P_LOCALNOTIFY_FANOTIFY
+#endif
 
 static int pipe_read, pipe_write, epoll_fd;
 static psync_list dirs=PSYNC_LIST_STATIC_INIT(dirs);
 
 #define WATCH_HASH 512
 
+#if defined(P_LOCALNOTIFY_FANOTIFY)
+
+/* One fanotify group marks whole filesystems, so the setup cost does not depend on the size of the synced trees. Events
+ * carry the handle of the parent directory plus the name, which we resolve back to a path only to decide whether the
+ * change is inside one of the syncs. Verdicts for directory handles are cached, the cache is dropped whenever a directory
+ * is moved as that may change the answer for everything below it, and when a sync is added or removed.
+ */
+
+#define FANOTIFY_MASK (FAN_CREATE|FAN_DELETE|FAN_MOVED_FROM|FAN_MOVED_TO|FAN_CLOSE_WRITE|FAN_DELETE_SELF|FAN_ONDIR)
+#define FANOTIFY_VERDICT_HASH 256
+#define FANOTIFY_MAX_HANDLE 64
+
+typedef struct{
+  psync_list list;
+  fsid_t fsid;
+  int mountfd;
+  uint32_t refcnt;
+} localnotify_fs;
+
+/* verdicts: in a sync, outside of all syncs, or outside but a sync root is somewhere below (the name has to be checked) */
+#define FANOTIFY_NOT_IN_SYNC  0
+#define FANOTIFY_IN_SYNC      1
+#define FANOTIFY_SYNC_PARENT  2
+
+typedef struct{
+  localnotify_fs *fs;
+  uint32_t handlelen;
+  int insync;
+  unsigned char handle[FANOTIFY_MAX_HANDLE];
+} localnotify_verdict;
+
+static int fanotify_fd=-1;
+static char fanotify_tag;
+static psync_list filesystems=PSYNC_LIST_STATIC_INIT(filesystems);
+static localnotify_verdict verdicts[FANOTIFY_VERDICT_HASH];
+
+#endif
+
 typedef struct _localnotify_watch{
   struct _localnotify_watch *next;
   int watchid;
@@ -65,10 +115,209 @@ typedef struct{
   psync_list list;
   psync_syncid_t syncid;
   int inotifyfd;
+#if defined(P_LOCALNOTIFY_FANOTIFY)
+  localnotify_fs *fs;
+  char *canonpath;
+  size_t canonlen;
+#endif
+  size_t pathlen;
   localnotify_watch *watches[WATCH_HASH];
   char path[];
 } localnotify_dir;
 
+#if defined(P_LOCALNOTIFY_FANOTIFY)
+
+static void fanotify_clear_verdicts(){
+  memset(verdicts, 0, sizeof(verdicts));
+}
+
+static localnotify_fs *fanotify_add_fs(const char *path){
+  localnotify_fs *fs;
+  struct statfs sfs;
+  int fd;
+  if (fanotify_fd==-1)
+    return NULL;
+  fd=open(path, O_RDONLY|O_DIRECTORY|O_CLOEXEC);
+  if (unlikely_log(fd==-1))
+    return NULL;
+  if (unlikely_log(fstatfs(fd, &sfs))){
+    close(fd);
+    return NULL;
+  }
+  psync_list_for_each_element(fs, &filesystems, localnotify_fs, list)
+    if (!memcmp(&fs->fsid, &sfs.f_fsid, sizeof(fsid_t))){
+      close(fd);
+      fs->refcnt++;
+      return fs;
+    }
+  if (fanotify_mark(fanotify_fd, FAN_MARK_ADD|FAN_MARK_FILESYSTEM, FANOTIFY_MASK, fd, NULL)){
+    debug(D_NOTICE, "fanotify_mark failed for %s errno %d, falling back to inotify", path, (int)errno);
+    close(fd);
+    return NULL;
+  }
+  fs=psync_new(localnotify_fs);
+  fs->fsid=sfs.f_fsid;
+  fs->mountfd=fd;
+  fs->refcnt=1;
+  psync_list_add_tail(&filesystems, &fs->list);
+  debug(D_NOTICE, "watching filesystem of %s with fanotify", path);
+  return fs;
+}
+
+static void fanotify_release_fs(localnotify_fs *fs){
+  if (--fs->refcnt)
+    return;
+  fanotify_mark(fanotify_fd, FAN_MARK_REMOVE|FAN_MARK_FILESYSTEM, FANOTIFY_MASK, fs->mountfd, NULL);
+  close(fs->mountfd);
+  psync_list_del(&fs->list);
+  psync_free(fs);
+  fanotify_clear_verdicts();
+}
+
+/* paths returned by readlink() of /proc/self/fd are canonical, so they are compared to the canonical sync roots */
+static int fanotify_path_in_sync(localnotify_fs *fs, const char *path, size_t len){
+  localnotify_dir *dir;
+  psync_list_for_each_element(dir, &dirs, localnotify_dir, list)
+    if (dir->fs==fs && len>=dir->canonlen && !memcmp(path, dir->canonpath, dir->canonlen) &&
+        (len==dir->canonlen || path[dir->canonlen]=='/' || dir->canonpath[dir->canonlen-1]=='/'))
+      return 1;
+  return 0;
+}
+
+static int fanotify_path_is_sync_parent(localnotify_fs *fs, const char *path, size_t len){
+  localnotify_dir *dir;
+  psync_list_for_each_element(dir, &dirs, localnotify_dir, list)
+    if (dir->fs==fs && dir->canonlen>len && !memcmp(path, dir->canonpath, len) && (dir->canonpath[len]=='/' || path[len-1]=='/'))
+      return 1;
+  return 0;
+}
+
+static int fanotify_handle_in_sync(localnotify_fs *fs, struct file_handle *handle, const char *name){
+  localnotify_verdict *v;
+  char fdpath[40], path[PATH_MAX];
+  size_t hlen, nlen;
+  ssize_t len;
+  uint32_t h, i;
+  int fd, ret;
+  hlen=sizeof(struct file_handle)+handle->handle_bytes;
+  if (hlen<=FANOTIFY_MAX_HANDLE){
+    h=(uint32_t)(uintptr_t)fs;
+    for (i=0; i<hlen; i++)
+      h=h*31+((const unsigned char *)handle)[i];
+    v=&verdicts[h%FANOTIFY_VERDICT_HASH];
+    if (v->fs==fs && v->handlelen==hlen && !memcmp(v->handle, handle, hlen)){
+      if (v->insync!=FANOTIFY_SYNC_PARENT)
+        return v->insync;
+      else if (!name)
+        return 0;
+    }
+  }
+  else
+    v=NULL;
+  fd=open_by_handle_at(fs->mountfd, handle, O_PATH|O_CLOEXEC);
+  if (fd==-1)
+    /* the directory is already gone (or we lack CAP_DAC_READ_SEARCH), let the scanner decide */
+    return 1;
+  snprintf(fdpath, sizeof(fdpath), "/proc/self/fd/%d", fd);
+  len=readlink(fdpath, path, sizeof(path)-1);
+  close(fd);
+  if (len<=0)
+    return 1;
+  if (fanotify_path_in_sync(fs, path, len))
+    ret=FANOTIFY_IN_SYNC;
+  else if (fanotify_path_is_sync_parent(fs, path, len))
+    ret=FANOTIFY_SYNC_PARENT;
+  else
+    ret=FANOTIFY_NOT_IN_SYNC;
+  if (v){
+    v->fs=fs;
+    v->handlelen=hlen;
+    v->insync=ret;
+    memcpy(v->handle, handle, hlen);
+  }
+  if (ret!=FANOTIFY_SYNC_PARENT)
+    return ret;
+  if (name){
+    nlen=strlen(name);
+    if (len+1+nlen<sizeof(path)){
+      path[len]='/';
+      memcpy(path+len+1, name, nlen);
+      return fanotify_path_in_sync(fs, path, len+1+nlen);
+    }
+  }
+  return 0;
+}
+
+static int fanotify_event_in_sync(const struct fanotify_event_metadata *md){
+  const struct fanotify_event_info_fid *fid;
+  struct file_handle *handle;
+  localnotify_fs *fs;
+  const char *name, *end, *ptr;
+  ptr=(const char *)md+md->metadata_len;
+  end=(const char *)md+md->event_len;
+  while (ptr+sizeof(struct fanotify_event_info_header)<=end){
+    fid=(const struct fanotify_event_info_fid *)ptr;
+    if (unlikely(fid->hdr.len==0))
+      break;
+    ptr+=fid->hdr.len;
+    if (fid->hdr.info_type!=FAN_EVENT_INFO_TYPE_DFID_NAME && fid->hdr.info_type!=FAN_EVENT_INFO_TYPE_DFID &&
+        fid->hdr.info_type!=FAN_EVENT_INFO_TYPE_FID)
+      continue;
+    handle=(struct file_handle *)fid->handle;
+    if (fid->hdr.info_type==FAN_EVENT_INFO_TYPE_DFID_NAME)
+      name=(const char *)handle->f_handle+handle->handle_bytes;
+    else
+      name=NULL;
+    psync_list_for_each_element(fs, &filesystems, localnotify_fs, list)
+      if (!memcmp(&fs->fsid, &fid->fsid, sizeof(fsid_t)))
+        return fanotify_handle_in_sync(fs, handle, name);
+    return 0;
+  }
+  return 1;
+}
+
+static void process_fanotify(){
+  const struct fanotify_event_metadata *md;
+  ssize_t rd;
+  int wake;
+  char buff[16*1024] __attribute__((aligned(__alignof__(struct fanotify_event_metadata))));
+  wake=0;
+  while ((rd=read(fanotify_fd, buff, sizeof(buff)))>0){
+    for (md=(const struct fanotify_event_metadata *)buff; FAN_EVENT_OK(md, rd); md=FAN_EVENT_NEXT(md, rd)){
+      if (unlikely(md->vers!=FANOTIFY_METADATA_VERSION)){
+        debug(D_ERROR, "unexpected fanotify metadata version %u", (unsigned int)md->vers);
+        wake=1;
+        break;
+      }
+      if ((md->mask&FAN_ONDIR) && (md->mask&(FAN_MOVED_FROM|FAN_MOVED_TO|FAN_DELETE_SELF)))
+        fanotify_clear_verdicts();
+      if (md->mask&FAN_Q_OVERFLOW)
+        wake=1;
+      else if (!wake && fanotify_event_in_sync(md))
+        wake=1;
+    }
+  }
+  if (wake)
+    psync_wake_localscan();
+}
+
+static void fanotify_init_group(){
+  struct epoll_event e;
+  fanotify_fd=fanotify_init(FAN_CLASS_NOTIF|FAN_REPORT_DFID_NAME|FAN_CLOEXEC|FAN_NONBLOCK, O_RDONLY|O_LARGEFILE);
+  if (fanotify_fd==-1){
+    debug(D_NOTICE, "fanotify_init failed errno %d, using inotify", (int)errno);
+    return;
+  }
+  e.events=EPOLLIN;
+  e.data.ptr=&fanotify_tag;
+  if (unlikely_log(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fanotify_fd, &e))){
+    close(fanotify_fd);
+    fanotify_fd=-1;
+  }
+}
+
+#endif
+
 static void add_dir_scan(localnotify_dir *dir, const char *path){
   DIR *dh;
   char *cpath;
@@ -116,15 +365,18 @@ static void add_syncid(psync_syncid_t syncid){
   psync_variant_row row;
   localnotify_dir *dir;
   const char *str;
+#if defined(P_LOCALNOTIFY_FANOTIFY)
+  char *rpath;
+#endif
   size_t len;
   struct epoll_event e;
   res=psync_sql_query("SELECT localpath FROM syncfolder WHERE id=?");
   psync_sql_bind_uint(res, 1, syncid);
   if (likely(row=psync_sql_fetch_row(res))){
     str=psync_get_lstring(row[0], &len);
-    len++;
-    dir=(localnotify_dir *)psync_malloc(offsetof(localnotify_dir, path)+len);
-    memcpy(dir->path, str, len);
+    dir=(localnotify_dir *)psync_malloc(offsetof(localnotify_dir, path)+len+1);
+    memcpy(dir->path, str, len+1);
+    dir->pathlen=len;
     psync_sql_free_result(res);
   }
   else{
@@ -133,6 +385,27 @@ static void add_syncid(psync_syncid_t syncid){
     return;
   }
   dir->syncid=syncid;
+#if defined(P_LOCALNOTIFY_FANOTIFY)
+  dir->fs=fanotify_add_fs(dir->path);
+  if (dir->fs){
+    rpath=realpath(dir->path, NULL);
+    if (rpath){
+      dir->canonpath=psync_strdup(rpath);
+      dir->canonlen=strlen(rpath);
+      free(rpath);
+    }
+    else{
+      dir->canonpath=psync_strndup(dir->path, dir->pathlen);
+      dir->canonlen=dir->pathlen;
+    }
+    fanotify_clear_verdicts();
+    dir->inotifyfd=-1;
+    memset(dir->watches, 0, sizeof(dir->watches));
+    psync_list_add_tail(&dirs, &dir->list);
+    psync_wake_localscan();
+    return;
+  }
+#endif
   dir->inotifyfd=inotify_init();
   if (unlikely_log(dir->inotifyfd==-1))
     goto err;
@@ -157,6 +430,15 @@ static void del_syncid(psync_syncid_t syncid){
   psync_list_for_each_element(dir, &dirs, localnotify_dir, list)
     if (dir->syncid==syncid){
       psync_list_del(&dir->list);
+#if defined(P_LOCALNOTIFY_FANOTIFY)
+      if (dir->fs){
+        fanotify_release_fs(dir->fs);
+        fanotify_clear_verdicts();
+        psync_free(dir->canonpath);
+        psync_free(dir);
+        return;
+      }
+#endif
       for (i=0; i<WATCH_HASH; i++){
         wch=dir->watches[i];
         while (wch){
@@ -242,6 +524,11 @@ static void psync_localnotify_thread(){
         debug(D_WARNING, "epoll_wait failed errno %d", errno);
       continue;
     }
+#if defined(P_LOCALNOTIFY_FANOTIFY)
+    if (ev.data.ptr==&fanotify_tag)
+      process_fanotify();
+    else
+#endif
     if (ev.data.ptr)
       process_notification((localnotify_dir *)ev.data.ptr);
     else
@@ -263,6 +550,9 @@ int psync_localnotify_init(){
   e.data.ptr=NULL;
   if (unlikely_log(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, pipe_read, &e)))
     goto err2;
+#if defined(P_LOCALNOTIFY_FANOTIFY)
+  fanotify_init_group();
+#endif
   psync_run_thread("localnotify", psync_localnotify_thread);
   return 0;
 err2:
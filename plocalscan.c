@@ -36,6 +36,7 @@
 #include "pupload.h"
 #include "pfolder.h"
 #include "pcallbacks.h"
+#include "pmem.h"
 #include <string.h>
 
 typedef struct {
@@ -134,13 +135,18 @@ static void scanner_set_syncs_to_list(psync_list *lst){
   psync_free(syncmp);
 }
 
-static void scanner_local_entry_to_list(void *ptr, psync_pstat *st){
+typedef struct {
   psync_list *lst;
+  psync_arena_t *arena;
+} scanner_list_builder_t;
+
+static void scanner_local_entry_to_list(void *ptr, psync_pstat *st){
+  scanner_list_builder_t *bld;
   sync_folderlist *e;
   size_t l;
-  lst=(psync_list *)ptr;
+  bld=(scanner_list_builder_t *)ptr;
   l=strlen(st->name)+1;
-  e=(sync_folderlist *)psync_malloc(offsetof(sync_folderlist, name)+l);
+  e=(sync_folderlist *)psync_arena_alloc(bld->arena, offsetof(sync_folderlist, name)+l);
   e->localid=0;
   e->remoteid=0;
   e->inode=psync_stat_inode(&st->stat);
@@ -149,15 +155,18 @@ static void scanner_local_entry_to_list(void *ptr, psync_pstat *st){
   e->size=psync_stat_size(&st->stat);
   e->isfolder=psync_stat_isfolder(&st->stat);
   memcpy(e->name, st->name, l);
-  psync_list_add_tail(lst, &e->list);
+  psync_list_add_tail(bld->lst, &e->list);
 }
 
-static int scanner_local_folder_to_list(const char *localpath, psync_list *lst){
+static int scanner_local_folder_to_list(const char *localpath, psync_list *lst, psync_arena_t *arena){
+  scanner_list_builder_t bld;
   psync_list_init(lst);
-  return psync_list_dir(localpath, scanner_local_entry_to_list, lst);
+  bld.lst=lst;
+  bld.arena=arena;
+  return psync_list_dir(localpath, scanner_local_entry_to_list, &bld);
 }
 
-static void scanner_db_folder_to_list(psync_syncid_t syncid, psync_folderid_t localfolderid, psync_list *lst){
+static void scanner_db_folder_to_list(psync_syncid_t syncid, psync_folderid_t localfolderid, psync_list *lst, psync_arena_t *arena){
   psync_sql_res *res;
   psync_variant_row row;
   sync_folderlist *e;
@@ -170,7 +179,7 @@ static void scanner_db_folder_to_list(psync_syncid_t syncid, psync_folderid_t lo
   while ((row=psync_sql_fetch_row(res))){
     name=psync_get_lstring(row[5], &namelen);
     namelen++;
-    e=(sync_folderlist *)psync_malloc(offsetof(sync_folderlist, name)+namelen);
+    e=(sync_folderlist *)psync_arena_alloc(arena, offsetof(sync_folderlist, name)+namelen);
     e->localid=psync_get_number(row[0]);
     e->remoteid=psync_get_number_or_null(row[1]);
     e->inode=psync_get_number(row[2]);
@@ -188,7 +197,7 @@ static void scanner_db_folder_to_list(psync_syncid_t syncid, psync_folderid_t lo
   while ((row=psync_sql_fetch_row(res))){
     name=psync_get_lstring(row[5], &namelen);
     namelen++;
-    e=(sync_folderlist *)psync_malloc(offsetof(sync_folderlist, name)+namelen);
+    e=(sync_folderlist *)psync_arena_alloc(arena, offsetof(sync_folderlist, name)+namelen);
     e->localid=psync_get_number(row[0]);
     e->remoteid=psync_get_number_or_null(row[1]);
     e->inode=psync_get_number(row[2]);
@@ -255,13 +264,17 @@ static void add_modified_file(const sync_folderlist *e, psync_folderid_t folderi
 static void scanner_scan_folder(const char *localpath, psync_folderid_t folderid, psync_folderid_t localfolderid, 
                                 psync_syncid_t syncid, psync_synctype_t synctype, psync_deviceid_t deviceid){
   psync_list disklist, dblist, *ldisk, *ldb;
+  psync_arena_t arena;
   sync_folderlist *l, *fdisk, *fdb;
   char *subpath;
   int cmp;
 //  debug(D_NOTICE, "scanning folder %s", localpath);
-  if (unlikely_log(scanner_local_folder_to_list(localpath, &disklist)))
+  psync_arena_init(&arena);
+  if (unlikely_log(scanner_local_folder_to_list(localpath, &disklist, &arena))){
+    psync_arena_destroy(&arena);
     return;
-  scanner_db_folder_to_list(syncid, localfolderid, &dblist);
+  }
+  scanner_db_folder_to_list(syncid, localfolderid, &dblist, &arena);
   psync_list_sort(&dblist, folderlist_cmp);
   psync_list_sort(&disklist, folderlist_cmp);
   ldisk=disklist.next;
@@ -317,7 +330,6 @@ static void scanner_scan_folder(const char *localpath, psync_folderid_t folderid
     add_deleted_element(fdb, folderid, localfolderid, syncid, synctype);
     ldb=ldb->next;
   }
-  psync_list_for_each_element_call(&dblist, sync_folderlist, list, psync_free);
   if (localsleepperfolder){
     psync_milisleep(localsleepperfolder);
     if (psync_current_time-starttime>=PSYNC_LOCALSCAN_SLEEPSEC_PER_SCAN*2 && localsleepperfolder>=2)
@@ -331,7 +343,7 @@ static void scanner_scan_folder(const char *localpath, psync_folderid_t folderid
       scanner_scan_folder(subpath, l->remoteid, l->localid, syncid, synctype, l->deviceid);
       psync_free(subpath);
     }
-  psync_list_for_each_element_call(&disklist, sync_folderlist, list, psync_free);
+  psync_arena_destroy(&arena);
 }
 
 static int compare_sizeinodemtime(const psync_list *l1, const psync_list *l2){
@@ -520,6 +532,7 @@ static void scan_rename_folder(sync_folderlist *rnfr, sync_folderlist *rnto){
   psync_sql_bind_string(res, 3, rnto->name);
   psync_sql_bind_uint(res, 4, rnfr->localid);
   psync_sql_run_free(res);
+  psync_path_cache_invalidate_local_folder(rnfr->localid);
   res=psync_sql_prep_statement("UPDATE syncedfolder SET syncid=?, synctype=? WHERE localfolderid=? AND syncid=?");
   psync_sql_bind_uint(res, 1, rnto->syncid);
   psync_sql_bind_uint(res, 2, rnto->synctype);
@@ -554,6 +567,7 @@ static void delete_local_folder_rec(psync_folderid_t localfolderid){
   res=psync_sql_prep_statement("DELETE FROM localfolder WHERE id=?");
   psync_sql_bind_uint(res, 1, localfolderid);
   psync_sql_run_free(res);
+  psync_path_cache_invalidate_local_folder(localfolderid);
   res=psync_sql_prep_statement("DELETE FROM syncedfolder WHERE localfolderid=?");
   psync_sql_bind_uint(res, 1, localfolderid);
   psync_sql_run_free(res);
@@ -0,0 +1,379 @@
+/* Copyright (c) 2014 Anton Titov.
+ * Copyright (c) 2014 pCloud Ltd.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of pCloud Ltd nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL pCloud Ltd BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "pcompat.h"
+#include "plibs.h"
+#include "psettings.h"
+#include "pmem.h"
+#include <string.h>
+#include <stdlib.h>
+
+/* A free object of a slab links to the next free object, the first object of a batch that was moved to the slab free
+ * list also links to the next batch and has the number of objects in the batch. Batches are moved between the thread
+ * lists and the slab as a whole.
+ */
+typedef struct _slab_obj_t {
+  struct _slab_obj_t *next;
+  struct _slab_obj_t *nextbatch;
+  size_t batchcnt;
+} slab_obj_t;
+
+typedef struct {
+  slab_obj_t *head;
+  uint32_t cnt;
+  uint32_t allocs;
+} slab_thread_list_t;
+
+struct _psync_arena_chunk_t {
+  psync_arena_chunk_t *next;
+  size_t size;
+};
+
+typedef struct {
+  slab_thread_list_t slabs[PSYNC_SLAB_MAX_SLABS];
+  psync_arena_chunk_t *arenachunks;
+  uint32_t arenachunkcnt;
+} mem_thread_cache_t;
+
+#if IS_DEBUG
+typedef struct {
+  const void *site;
+  uint64_t cnt;
+  uint64_t bytes;
+} alloc_site_t;
+
+static alloc_site_t alloc_sites[PSYNC_DEBUG_ALLOC_SITES];
+static uint64_t alloc_sites_lost=0;
+#endif
+
+#define MEM_ALIGN 8
+#define mem_align(size) (((size)+MEM_ALIGN-1)/MEM_ALIGN*MEM_ALIGN)
+
+static PSYNC_THREAD mem_thread_cache_t *mem_thread_cache=NULL;
+static pthread_once_t mem_thread_cache_once=PTHREAD_ONCE_INIT;
+static pthread_key_t mem_thread_cache_key;
+static pthread_mutex_t slab_mutex=PTHREAD_MUTEX_INITIALIZER;
+static psync_slab_t *slabs=NULL;
+static psync_slab_t *slabs_by_id[PSYNC_SLAB_MAX_SLABS];
+static uint32_t slabs_cnt=0;
+static uint64_t arena_allocs=0;
+static uint64_t arena_chunks=0;
+
+static void slab_put_batch_locked(psync_slab_t *slab, slab_obj_t *batch, uint32_t cnt){
+  batch->nextbatch=(slab_obj_t *)slab->freelist;
+  batch->batchcnt=cnt;
+  slab->freelist=batch;
+  slab->freecnt+=cnt;
+}
+
+static void mem_thread_cache_destroy(void *ptr){
+  mem_thread_cache_t *cache;
+  psync_arena_chunk_t *chunk;
+  uint32_t i;
+  cache=(mem_thread_cache_t *)ptr;
+  pthread_mutex_lock(&slab_mutex);
+  for (i=0; i<slabs_cnt; i++){
+    slabs_by_id[i]->allocs+=cache->slabs[i].allocs;
+    if (cache->slabs[i].head)
+      slab_put_batch_locked(slabs_by_id[i], cache->slabs[i].head, cache->slabs[i].cnt);
+  }
+  pthread_mutex_unlock(&slab_mutex);
+  while ((chunk=cache->arenachunks)){
+    cache->arenachunks=chunk->next;
+    psync_free(chunk);
+  }
+  psync_free(cache);
+  mem_thread_cache=NULL;
+}
+
+static void mem_thread_cache_key_create(){
+  pthread_key_create(&mem_thread_cache_key, mem_thread_cache_destroy);
+}
+
+static mem_thread_cache_t *mem_get_thread_cache(){
+  mem_thread_cache_t *cache;
+  if (likely(mem_thread_cache))
+    return mem_thread_cache;
+  pthread_once(&mem_thread_cache_once, mem_thread_cache_key_create);
+  cache=psync_new(mem_thread_cache_t);
+  memset(cache, 0, sizeof(mem_thread_cache_t));
+  pthread_setspecific(mem_thread_cache_key, cache);
+  mem_thread_cache=cache;
+  return cache;
+}
+
+static void slab_register(psync_slab_t *slab){
+  pthread_mutex_lock(&slab_mutex);
+  if (!slab->id){
+    if (slab->size<sizeof(slab_obj_t))
+      slab->size=sizeof(slab_obj_t);
+    slab->size=mem_align(slab->size);
+    if (likely_log(slabs_cnt<PSYNC_SLAB_MAX_SLABS)){
+      slabs_by_id[slabs_cnt]=slab;
+      slab->id=++slabs_cnt;
+    }
+    else{
+      debug(D_BUG, "too many slabs, increase PSYNC_SLAB_MAX_SLABS, objects of %s will come from psync_malloc", slab->name);
+      slab->id=UINT32_MAX;
+    }
+    slab->next=slabs;
+    slabs=slab;
+  }
+  pthread_mutex_unlock(&slab_mutex);
+}
+
+static void slab_refill(psync_slab_t *slab, slab_thread_list_t *tl){
+  slab_obj_t *obj;
+  char *chunk;
+  size_t cnt, i;
+  pthread_mutex_lock(&slab_mutex);
+  slab->allocs+=tl->allocs;
+  tl->allocs=0;
+  obj=(slab_obj_t *)slab->freelist;
+  if (obj){
+    slab->freelist=obj->nextbatch;
+    slab->freecnt-=obj->batchcnt;
+  }
+  pthread_mutex_unlock(&slab_mutex);
+  if (obj){
+    tl->head=obj;
+    tl->cnt=obj->batchcnt;
+    return;
+  }
+  cnt=PSYNC_SLAB_CHUNK_SIZE/slab->size;
+  if (cnt<8)
+    cnt=8;
+  chunk=(char *)psync_malloc(cnt*slab->size);
+  psync_atomic_add_uint64(&slab->chunks, 1);
+  for (i=0; i<cnt-1; i++)
+    ((slab_obj_t *)(chunk+i*slab->size))->next=(slab_obj_t *)(chunk+(i+1)*slab->size);
+  ((slab_obj_t *)(chunk+i*slab->size))->next=NULL;
+  tl->head=(slab_obj_t *)chunk;
+  tl->cnt=cnt;
+}
+
+/* keeps the objects freed last, as they are the most likely to be in the cpu cache */
+static void slab_drain(psync_slab_t *slab, slab_thread_list_t *tl){
+  slab_obj_t *obj, *batch;
+  uint32_t i;
+  obj=tl->head;
+  for (i=1; i<PSYNC_SLAB_THREAD_CACHE/2; i++)
+    obj=obj->next;
+  batch=obj->next;
+  obj->next=NULL;
+  pthread_mutex_lock(&slab_mutex);
+  slab->allocs+=tl->allocs;
+  tl->allocs=0;
+  slab_put_batch_locked(slab, batch, tl->cnt-PSYNC_SLAB_THREAD_CACHE/2);
+  pthread_mutex_unlock(&slab_mutex);
+  tl->cnt=PSYNC_SLAB_THREAD_CACHE/2;
+}
+
+void *psync_slab_alloc(psync_slab_t *slab){
+  slab_thread_list_t *tl;
+  slab_obj_t *obj;
+  if (unlikely(!slab->id))
+    slab_register(slab);
+  if (unlikely(slab->id==UINT32_MAX))
+    return psync_malloc(slab->size);
+  tl=&mem_get_thread_cache()->slabs[slab->id-1];
+  if (unlikely(!tl->head))
+    slab_refill(slab, tl);
+  obj=tl->head;
+  tl->head=obj->next;
+  tl->cnt--;
+  tl->allocs++;
+#if IS_DEBUG
+  memset(obj, 0xfa, slab->size);
+#endif
+  return obj;
+}
+
+void psync_slab_free(psync_slab_t *slab, void *ptr){
+  slab_thread_list_t *tl;
+  slab_obj_t *obj;
+  if (unlikely(!ptr))
+    return;
+  if (unlikely(slab->id==UINT32_MAX)){
+    psync_free(ptr);
+    return;
+  }
+  tl=&mem_get_thread_cache()->slabs[slab->id-1];
+  obj=(slab_obj_t *)ptr;
+  obj->next=tl->head;
+  tl->head=obj;
+  if (unlikely(++tl->cnt>=PSYNC_SLAB_THREAD_CACHE))
+    slab_drain(slab, tl);
+}
+
+void psync_arena_init(psync_arena_t *arena){
+  arena->chunks=NULL;
+  arena->ptr=NULL;
+  arena->end=NULL;
+  arena->allocs=0;
+}
+
+static void *arena_alloc_chunk(psync_arena_t *arena, size_t size){
+  mem_thread_cache_t *cache;
+  psync_arena_chunk_t *chunk;
+  size_t hsize;
+  hsize=mem_align(sizeof(psync_arena_chunk_t));
+  if (size>PSYNC_ARENA_CHUNK_SIZE/4){
+    chunk=(psync_arena_chunk_t *)psync_malloc(hsize+size);
+    psync_atomic_add_uint64(&arena_chunks, 1);
+    chunk->size=hsize+size;
+    if (arena->chunks){
+      chunk->next=arena->chunks->next;
+      arena->chunks->next=chunk;
+    }
+    else{
+      chunk->next=NULL;
+      arena->chunks=chunk;
+    }
+    return ((char *)chunk)+hsize;
+  }
+  cache=mem_get_thread_cache();
+  if (cache->arenachunks){
+    chunk=cache->arenachunks;
+    cache->arenachunks=chunk->next;
+    cache->arenachunkcnt--;
+  }
+  else{
+    chunk=(psync_arena_chunk_t *)psync_malloc(PSYNC_ARENA_CHUNK_SIZE);
+    psync_atomic_add_uint64(&arena_chunks, 1);
+    chunk->size=PSYNC_ARENA_CHUNK_SIZE;
+  }
+  chunk->next=arena->chunks;
+  arena->chunks=chunk;
+  arena->ptr=((char *)chunk)+hsize+size;
+  arena->end=((char *)chunk)+PSYNC_ARENA_CHUNK_SIZE;
+  return ((char *)chunk)+hsize;
+}
+
+void *psync_arena_alloc(psync_arena_t *arena, size_t size){
+  void *ret;
+  size=mem_align(size);
+  arena->allocs++;
+  if (likely((size_t)(arena->end-arena->ptr)>=size)){
+    ret=arena->ptr;
+    arena->ptr+=size;
+    return ret;
+  }
+  else
+    return arena_alloc_chunk(arena, size);
+}
+
+void psync_arena_destroy(psync_arena_t *arena){
+  mem_thread_cache_t *cache;
+  psync_arena_chunk_t *chunk;
+  cache=mem_get_thread_cache();
+  while ((chunk=arena->chunks)){
+    arena->chunks=chunk->next;
+    if (chunk->size==PSYNC_ARENA_CHUNK_SIZE && cache->arenachunkcnt<PSYNC_ARENA_THREAD_CHUNKS){
+      chunk->next=cache->arenachunks;
+      cache->arenachunks=chunk;
+      cache->arenachunkcnt++;
+    }
+    else
+      psync_free(chunk);
+  }
+  psync_atomic_add_uint64(&arena_allocs, arena->allocs);
+  arena->ptr=NULL;
+  arena->end=NULL;
+  arena->allocs=0;
+}
+
+/* Called by the debug build psync_malloc with the address it was called from. Sites are kept in an open addressing table
+ * that is only ever added to, so counting an allocation does not take a lock.
+ */
+void psync_mem_count_alloc(const void *site, size_t size){
+#if IS_DEBUG
+  alloc_site_t *e;
+  const void *s;
+  psync_uint_t h, i;
+  h=((uintptr_t)site>>2)*2654435761U;
+  for (i=0; i<16; i++){
+    e=&alloc_sites[(h+i)%PSYNC_DEBUG_ALLOC_SITES];
+    s=(const void *)psync_atomic_load_ptr(&e->site);
+    if (!s && psync_atomic_cas_ptr(&e->site, NULL, site))
+      s=site;
+    if (s==site){
+      psync_atomic_add_uint64(&e->cnt, 1);
+      psync_atomic_add_uint64(&e->bytes, size);
+      return;
+    }
+  }
+  psync_atomic_add_uint64(&alloc_sites_lost, 1);
+#endif
+}
+
+#if IS_DEBUG
+static int alloc_site_cmp(const void *p1, const void *p2){
+  const alloc_site_t *s1, *s2;
+  s1=(const alloc_site_t *)p1;
+  s2=(const alloc_site_t *)p2;
+  if (s1->cnt>s2->cnt)
+    return -1;
+  else if (s1->cnt<s2->cnt)
+    return 1;
+  else
+    return 0;
+}
+#endif
+
+/* allocation counts of the thread lists are added to the slab on refill and drain, so other threads may still hold some */
+void psync_mem_dump_stats(){
+  psync_slab_t *slab;
+  psync_uint_t i;
+#if IS_DEBUG
+  alloc_site_t *sites;
+  psync_uint_t cnt;
+  sites=psync_new_cnt(alloc_site_t, PSYNC_DEBUG_ALLOC_SITES);
+  cnt=0;
+  for (i=0; i<PSYNC_DEBUG_ALLOC_SITES; i++)
+    if (psync_atomic_load_ptr(&alloc_sites[i].site))
+      sites[cnt++]=alloc_sites[i];
+  qsort(sites, cnt, sizeof(alloc_site_t), alloc_site_cmp);
+  for (i=0; i<cnt && i<PSYNC_DEBUG_ALLOC_SITES_DUMP; i++)
+    debug(D_NOTICE, "psync_malloc called from %p: %lu times, %lu bytes", sites[i].site, (unsigned long)sites[i].cnt,
+          (unsigned long)sites[i].bytes);
+  if (alloc_sites_lost)
+    debug(D_NOTICE, "%lu allocations from sites that did not fit in the table", (unsigned long)alloc_sites_lost);
+  psync_free(sites);
+#endif
+  pthread_mutex_lock(&slab_mutex);
+  if (mem_thread_cache)
+    for (i=0; i<slabs_cnt; i++){
+      slabs_by_id[i]->allocs+=mem_thread_cache->slabs[i].allocs;
+      mem_thread_cache->slabs[i].allocs=0;
+    }
+  for (slab=slabs; slab; slab=slab->next)
+    debug(D_NOTICE, "slab %s: %lu objects of %u bytes allocated, %lu chunks from psync_malloc, %u objects free",
+          slab->name, (unsigned long)slab->allocs, (unsigned)slab->size, (unsigned long)slab->chunks, (unsigned)slab->freecnt);
+  pthread_mutex_unlock(&slab_mutex);
+  debug(D_NOTICE, "arenas: %lu objects allocated, %lu chunks from psync_malloc", (unsigned long)arena_allocs, (unsigned long)arena_chunks);
+}
@@ -0,0 +1,72 @@
+/* Copyright (c) 2014 Anton Titov.
+ * Copyright (c) 2014 pCloud Ltd.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of pCloud Ltd nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL pCloud Ltd BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _PSYNC_MEM_H
+#define _PSYNC_MEM_H
+
+#include "pcompiler.h"
+#include <stddef.h>
+#include <stdint.h>
+
+/* Slab of fixed size objects, declared once with PSYNC_SLAB in the file that allocates them. Objects are taken from and
+ * returned to a per-thread free list, only refills and drains of that list take a lock. Memory comes from psync_malloc in
+ * PSYNC_SLAB_CHUNK_SIZE chunks and is only ever reused for objects of the same slab.
+ */
+typedef struct _psync_slab_t {
+  const char *name;
+  size_t size;
+  struct _psync_slab_t *next;
+  void *freelist;
+  uint32_t id;
+  uint32_t freecnt;
+  uint64_t allocs;
+  uint64_t chunks;
+} psync_slab_t;
+
+#define PSYNC_SLAB(name, type) static psync_slab_t name={#type, sizeof(type), NULL, NULL, 0, 0, 0, 0}
+
+/* Arena for short lived objects that are all freed together by psync_arena_destroy. */
+typedef struct _psync_arena_chunk_t psync_arena_chunk_t;
+
+typedef struct {
+  psync_arena_chunk_t *chunks;
+  char *ptr;
+  char *end;
+  uint32_t allocs;
+} psync_arena_t;
+
+void *psync_slab_alloc(psync_slab_t *slab) PSYNC_MALLOC PSYNC_NONNULL(1);
+void psync_slab_free(psync_slab_t *slab, void *ptr) PSYNC_NONNULL(1);
+
+void psync_arena_init(psync_arena_t *arena) PSYNC_NONNULL(1);
+void *psync_arena_alloc(psync_arena_t *arena, size_t size) PSYNC_MALLOC PSYNC_NONNULL(1);
+void psync_arena_destroy(psync_arena_t *arena) PSYNC_NONNULL(1);
+
+void psync_mem_count_alloc(const void *site, size_t size);
+void psync_mem_dump_stats();
+
+#endif
@@ -0,0 +1,437 @@
+/* Copyright (c) 2014 Anton Titov.
+ * Copyright (c) 2014 pCloud Ltd.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of pCloud Ltd nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL pCloud Ltd BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "pcompat.h"
+#include "plibs.h"
+#include "plist.h"
+#include "psettings.h"
+#include "pmetrics.h"
+#include <string.h>
+#include <stdio.h>
+
+#if defined(P_OS_POSIX)
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+/* Histograms are log-linear: values below 2<<METRIC_SUB_BITS get a bucket each, above that every power of two is split in
+ * 1<<METRIC_SUB_BITS buckets, so a value is off by at most 1/8 of it. Values are normally microseconds or bytes and anything
+ * above 1<<PSYNC_METRICS_HIST_MAX_BITS goes in the last bucket.
+ */
+#define METRIC_SUB_BITS 3
+#define METRIC_HIST_BUCKETS ((PSYNC_METRICS_HIST_MAX_BITS-METRIC_SUB_BITS+1)<<METRIC_SUB_BITS)
+
+#define METRIC_LINE_MAX 256
+
+struct _psync_metric_hist_t {
+  uint64_t count;
+  uint64_t sum;
+  uint64_t max;
+  uint64_t buckets[METRIC_HIST_BUCKETS];
+};
+
+/* only the owning thread writes to a shard, readers hold metrics_mutex that keeps the shard from being freed */
+typedef struct {
+  psync_list list;
+  uint64_t counters[PSYNC_METRICS_MAX];
+  psync_metric_hist_t *hists[PSYNC_METRICS_MAX];
+} metric_shard_t;
+
+static PSYNC_THREAD metric_shard_t *metric_shard=NULL;
+static pthread_once_t metric_shard_once=PTHREAD_ONCE_INIT;
+static pthread_key_t metric_shard_key;
+static pthread_mutex_t metrics_mutex=PTHREAD_MUTEX_INITIALIZER;
+static psync_list metric_shards=PSYNC_LIST_STATIC_INIT(metric_shards);
+static psync_metric_t *metrics=NULL;
+static psync_metric_t *metrics_by_id[PSYNC_METRICS_MAX];
+static uint32_t metrics_cnt=0;
+
+static psync_metric_hist_t *metric_hist_new(){
+  psync_metric_hist_t *hist;
+  hist=psync_new(psync_metric_hist_t);
+  memset(hist, 0, sizeof(psync_metric_hist_t));
+  return hist;
+}
+
+static uint32_t metric_bucket(uint64_t val){
+  uint32_t e;
+  if (val<(2<<METRIC_SUB_BITS))
+    return (uint32_t)val;
+  if (unlikely(val>=((uint64_t)1<<PSYNC_METRICS_HIST_MAX_BITS)))
+    return METRIC_HIST_BUCKETS-1;
+#if defined(__GNUC__)
+  e=63-__builtin_clzll(val);
+#else
+  e=METRIC_SUB_BITS+1;
+  while (val>>(e+1))
+    e++;
+#endif
+  return ((e-METRIC_SUB_BITS)<<METRIC_SUB_BITS)+(uint32_t)(val>>(e-METRIC_SUB_BITS));
+}
+
+static uint64_t metric_bucket_max(uint32_t bucket){
+  uint32_t shift;
+  if (bucket<(2<<METRIC_SUB_BITS))
+    return bucket;
+  shift=(bucket>>METRIC_SUB_BITS)-1;
+  return (((uint64_t)((bucket&((1<<METRIC_SUB_BITS)-1))|(1<<METRIC_SUB_BITS)))<<shift)+((uint64_t)1<<shift)-1;
+}
+
+static void metric_hist_add(psync_metric_hist_t *hist, uint64_t val){
+  hist->count++;
+  hist->sum+=val;
+  if (val>hist->max)
+    hist->max=val;
+  hist->buckets[metric_bucket(val)]++;
+}
+
+static void metric_hist_merge(psync_metric_hist_t *dst, const psync_metric_hist_t *src){
+  uint32_t i;
+  dst->count+=src->count;
+  dst->sum+=src->sum;
+  if (src->max>dst->max)
+    dst->max=src->max;
+  for (i=0; i<METRIC_HIST_BUCKETS; i++)
+    dst->buckets[i]+=src->buckets[i];
+}
+
+static void metric_shard_destroy(void *ptr){
+  metric_shard_t *shard;
+  psync_metric_t *metric;
+  uint32_t i;
+  shard=(metric_shard_t *)ptr;
+  pthread_mutex_lock(&metrics_mutex);
+  psync_list_del(&shard->list);
+  for (i=0; i<metrics_cnt; i++){
+    metric=metrics_by_id[i];
+    if (metric->type==PSYNC_METRIC_TYPE_COUNTER)
+      metric->value+=shard->counters[i];
+    else if (shard->hists[i]){
+      if (!metric->hist)
+        metric->hist=metric_hist_new();
+      metric_hist_merge(metric->hist, shard->hists[i]);
+      psync_free(shard->hists[i]);
+    }
+  }
+  pthread_mutex_unlock(&metrics_mutex);
+  psync_free(shard);
+  metric_shard=NULL;
+}
+
+static void metric_shard_key_create(){
+  pthread_key_create(&metric_shard_key, metric_shard_destroy);
+}
+
+static metric_shard_t *metric_get_shard(){
+  metric_shard_t *shard;
+  if (likely(metric_shard))
+    return metric_shard;
+  pthread_once(&metric_shard_once, metric_shard_key_create);
+  shard=psync_new(metric_shard_t);
+  memset(shard, 0, sizeof(metric_shard_t));
+  pthread_mutex_lock(&metrics_mutex);
+  psync_list_add_tail(&metric_shards, &shard->list);
+  pthread_mutex_unlock(&metrics_mutex);
+  pthread_setspecific(metric_shard_key, shard);
+  metric_shard=shard;
+  return shard;
+}
+
+/* keeps the list sorted by name, so the dump is stable; metrics that do not fit in the shards are counted under the lock */
+void psync_metric_register(psync_metric_t *metric){
+  psync_metric_t **m;
+  pthread_mutex_lock(&metrics_mutex);
+  if (!metric->id){
+    if (likely_log(metrics_cnt<PSYNC_METRICS_MAX)){
+      metrics_by_id[metrics_cnt]=metric;
+      metric->id=++metrics_cnt;
+    }
+    else{
+      debug(D_BUG, "too many metrics, increase PSYNC_METRICS_MAX, %s will not be sharded", metric->name);
+      metric->id=UINT32_MAX;
+    }
+    m=&metrics;
+    while (*m && strcmp((*m)->name, metric->name)<0)
+      m=&(*m)->next;
+    metric->next=*m;
+    *m=metric;
+  }
+  pthread_mutex_unlock(&metrics_mutex);
+}
+
+void psync_metric_add(psync_metric_t *metric, uint64_t val){
+  if (unlikely(!metric->id))
+    psync_metric_register(metric);
+  if (metric->type==PSYNC_METRIC_TYPE_GAUGE || unlikely(metric->id==UINT32_MAX))
+    psync_atomic_add_uint64(&metric->value, val);
+  else
+    metric_get_shard()->counters[metric->id-1]+=val;
+}
+
+void psync_metric_gauge_add(psync_metric_t *metric, int64_t val){
+  if (unlikely(!metric->id))
+    psync_metric_register(metric);
+  psync_atomic_add_uint64(&metric->value, (uint64_t)val);
+}
+
+void psync_metric_record(psync_metric_t *metric, uint64_t val){
+  metric_shard_t *shard;
+  psync_metric_hist_t *hist;
+  if (unlikely(!metric->id))
+    psync_metric_register(metric);
+  if (unlikely(metric->id==UINT32_MAX)){
+    pthread_mutex_lock(&metrics_mutex);
+    if (!metric->hist)
+      metric->hist=metric_hist_new();
+    metric_hist_add(metric->hist, val);
+    pthread_mutex_unlock(&metrics_mutex);
+    return;
+  }
+  shard=metric_get_shard();
+  hist=shard->hists[metric->id-1];
+  if (unlikely(!hist)){
+    hist=metric_hist_new();
+    psync_atomic_store_ptr(&shard->hists[metric->id-1], hist);
+  }
+  metric_hist_add(hist, val);
+}
+
+static uint64_t metric_get_value_locked(psync_metric_t *metric){
+  metric_shard_t *shard;
+  uint64_t ret;
+  if (metric->sample)
+    return (uint64_t)metric->sample();
+  ret=metric->value;
+  if (metric->type==PSYNC_METRIC_TYPE_COUNTER && metric->id!=UINT32_MAX)
+    psync_list_for_each_element(shard, &metric_shards, metric_shard_t, list)
+      ret+=shard->counters[metric->id-1];
+  return ret;
+}
+
+static void metric_get_hist_locked(psync_metric_t *metric, psync_metric_hist_t *hist){
+  metric_shard_t *shard;
+  psync_metric_hist_t *h;
+  memset(hist, 0, sizeof(psync_metric_hist_t));
+  if (metric->hist)
+    metric_hist_merge(hist, metric->hist);
+  if (metric->id!=UINT32_MAX)
+    psync_list_for_each_element(shard, &metric_shards, metric_shard_t, list){
+      h=(psync_metric_hist_t *)psync_atomic_load_ptr(&shard->hists[metric->id-1]);
+      if (h)
+        metric_hist_merge(hist, h);
+    }
+}
+
+/* for histograms returns the number of recorded values */
+uint64_t psync_metric_get(psync_metric_t *metric){
+  psync_metric_hist_t *hist;
+  uint64_t ret;
+  if (!metric->id)
+    return metric->sample?(uint64_t)metric->sample():0;
+  if (metric->type==PSYNC_METRIC_TYPE_HISTOGRAM){
+    hist=metric_hist_new();
+    pthread_mutex_lock(&metrics_mutex);
+    metric_get_hist_locked(metric, hist);
+    pthread_mutex_unlock(&metrics_mutex);
+    ret=hist->count;
+    psync_free(hist);
+    return ret;
+  }
+  pthread_mutex_lock(&metrics_mutex);
+  ret=metric_get_value_locked(metric);
+  pthread_mutex_unlock(&metrics_mutex);
+  return ret;
+}
+
+/* monotonic time in microseconds, only meaningful as a difference */
+uint64_t psync_metric_time(){
+#if defined(P_OS_WINDOWS)
+  static LARGE_INTEGER freq={{0, 0}};
+  LARGE_INTEGER cnt;
+  if (unlikely(!freq.QuadPart))
+    QueryPerformanceFrequency(&freq);
+  QueryPerformanceCounter(&cnt);
+  return cnt.QuadPart/freq.QuadPart*1000000+cnt.QuadPart%freq.QuadPart*1000000/freq.QuadPart;
+#elif defined(CLOCK_MONOTONIC)
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec*1000000+ts.tv_nsec/1000;
+#else
+  struct timespec ts;
+  psync_nanotime(&ts);
+  return (uint64_t)ts.tv_sec*1000000+ts.tv_nsec/1000;
+#endif
+}
+
+static uint64_t metric_hist_percentile(const psync_metric_hist_t *hist, uint32_t percent){
+  uint64_t target, sum, val;
+  uint32_t i;
+  target=(hist->count*percent+99)/100;
+  sum=0;
+  for (i=0; i<METRIC_HIST_BUCKETS; i++){
+    sum+=hist->buckets[i];
+    if (sum>=target && sum)
+      break;
+  }
+  val=metric_bucket_max(i);
+  return val>hist->max?hist->max:val;
+}
+
+/* Returns one line per metric: "name value" for counters and gauges and "name count=.. sum=.. p50=.. p90=.. p99=.. max=.."
+ * for histograms. Sample functions of gauges are called with the metrics lock held and should not take locks of their own.
+ */
+char *psync_metrics_dump(){
+  psync_metric_hist_t *hist;
+  psync_metric_t *metric;
+  char *ret;
+  size_t len, alloced;
+  hist=metric_hist_new();
+  pthread_mutex_lock(&metrics_mutex);
+  alloced=1;
+  for (metric=metrics; metric; metric=metric->next)
+    alloced+=strlen(metric->name)+METRIC_LINE_MAX;
+  ret=psync_new_cnt(char, alloced);
+  len=0;
+  for (metric=metrics; metric; metric=metric->next)
+    if (metric->type==PSYNC_METRIC_TYPE_HISTOGRAM){
+      metric_get_hist_locked(metric, hist);
+      len+=snprintf(ret+len, alloced-len, "%s count=%"P_PRI_U64" sum=%"P_PRI_U64" p50=%"P_PRI_U64" p90=%"P_PRI_U64" p99=%"P_PRI_U64" max=%"P_PRI_U64"\n",
+                    metric->name, hist->count, hist->sum, metric_hist_percentile(hist, 50), metric_hist_percentile(hist, 90),
+                    metric_hist_percentile(hist, 99), hist->max);
+    }
+    else if (metric->type==PSYNC_METRIC_TYPE_GAUGE)
+      len+=snprintf(ret+len, alloced-len, "%s %"P_PRI_I64"\n", metric->name, (int64_t)metric_get_value_locked(metric));
+    else
+      len+=snprintf(ret+len, alloced-len, "%s %"P_PRI_U64"\n", metric->name, metric_get_value_locked(metric));
+  pthread_mutex_unlock(&metrics_mutex);
+  ret[len]=0;
+  psync_free(hist);
+  return ret;
+}
+
+#if defined(P_OS_POSIX)
+static void metrics_socket_thread(void *ptr){
+  char *dump;
+  size_t len, off;
+  ssize_t wr;
+  int lsock, sock;
+  lsock=(int)(uintptr_t)ptr;
+  while (1){
+    sock=accept(lsock, NULL, NULL);
+    if (sock==-1){
+      if (errno==EINTR || errno==ECONNABORTED)
+        continue;
+      debug(D_ERROR, "accept on metrics socket failed, errno=%d", (int)errno);
+      break;
+    }
+    dump=psync_metrics_dump();
+    len=strlen(dump);
+    off=0;
+    while (off<len){
+      wr=write(sock, dump+off, len-off);
+      if (wr<=0 && errno!=EINTR)
+        break;
+      if (wr>0)
+        off+=wr;
+    }
+    psync_free(dump);
+    close(sock);
+  }
+  close(lsock);
+}
+#endif
+
+#if defined(P_OS_POSIX)
+/* The socket is bound inside a fresh 0700 directory next to path, made private with chmod while nobody else can reach it and then
+ * renamed over path, so it is never accessible to others, without touching the process wide umask. */
+static int metrics_bind_private(int sock, const char *path){
+  struct sockaddr_un addr;
+  const char *sl;
+  char *parent, *dir, *tmppath;
+  int ret;
+  sl=strrchr(path, '/');
+  if (sl)
+    parent=psync_strndup(path, sl-path+1);
+  else
+    parent=psync_strdup("./");
+  dir=psync_strcat(parent, ".psync-metrics-XXXXXX", NULL);
+  psync_free(parent);
+  if (unlikely_log(!mkdtemp(dir))){
+    psync_free(dir);
+    return -1;
+  }
+  tmppath=psync_strcat(dir, "/s", NULL);
+  ret=-1;
+  if (likely_log(strlen(tmppath)<sizeof(addr.sun_path))){
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family=AF_UNIX;
+    strcpy(addr.sun_path, tmppath);
+    if (!bind(sock, (struct sockaddr *)&addr, sizeof(addr))){
+      if (!chmod(tmppath, 0600) && !rename(tmppath, path))
+        ret=0;
+      else
+        unlink(tmppath);
+    }
+  }
+  rmdir(dir);
+  psync_free(tmppath);
+  psync_free(dir);
+  return ret;
+}
+#endif
+
+/* Listens on a local unix socket at path and writes the output of psync_metrics_dump to every connection. */
+int psync_metrics_start_socket(const char *path){
+#if defined(P_OS_POSIX)
+  struct sockaddr_un addr;
+  struct stat st;
+  int sock;
+  if (unlikely_log(strlen(path)>=sizeof(addr.sun_path)))
+    return -1;
+  /* only a stale socket from a previous run may be replaced, never a file that happens to be at that path */
+  if (!lstat(path, &st) && !S_ISSOCK(st.st_mode)){
+    debug(D_ERROR, "%s exists and is not a socket, not starting metrics socket", path);
+    return -1;
+  }
+  sock=socket(AF_UNIX, SOCK_STREAM, 0);
+  if (unlikely_log(sock==-1))
+    return -1;
+  if (unlikely(metrics_bind_private(sock, path) || listen(sock, PSYNC_METRICS_SOCKET_BACKLOG))){
+    debug(D_ERROR, "could not listen on metrics socket %s, errno=%d", path, (int)errno);
+    close(sock);
+    return -1;
+  }
+  psync_run_thread1("metrics socket", metrics_socket_thread, (void *)(uintptr_t)sock);
+  return 0;
+#else
+  debug(D_WARNING, "metrics socket is not supported on this platform");
+  return -1;
+#endif
+}
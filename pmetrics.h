@@ -0,0 +1,75 @@
+/* Copyright (c) 2014 Anton Titov.
+ * Copyright (c) 2014 pCloud Ltd.
+ * All rights reserved.
+ * 
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *     * Redistributions of source code must retain the above copyright
+ *       notice, this list of conditions and the following disclaimer.
+ *     * Redistributions in binary form must reproduce the above copyright
+ *       notice, this list of conditions and the following disclaimer in the
+ *       documentation and/or other materials provided with the distribution.
+ *     * Neither the name of pCloud Ltd nor the
+ *       names of its contributors may be used to endorse or promote products
+ *       derived from this software without specific prior written permission.
+ * 
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED
+ * WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE
+ * DISCLAIMED. IN NO EVENT SHALL pCloud Ltd BE LIABLE FOR ANY
+ * DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES
+ * (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES;
+ * LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND
+ * ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF THIS
+ * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#ifndef _PSYNC_METRICS_H
+#define _PSYNC_METRICS_H
+
+#include "pcompiler.h"
+#include <stdint.h>
+
+#define PSYNC_METRIC_TYPE_COUNTER   1
+#define PSYNC_METRIC_TYPE_GAUGE     2
+#define PSYNC_METRIC_TYPE_HISTOGRAM 3
+
+typedef struct _psync_metric_hist_t psync_metric_hist_t;
+
+typedef int64_t (*psync_metric_sample_t)();
+
+/* Metric declared once with one of the PSYNC_METRIC_* macros in the file that updates it and registered on first use.
+ * Counters and histograms are updated in a per-thread shard without locks or atomic operations and summed up only when
+ * read, value and hist hold what threads that have exited counted. Gauges are a single value updated with atomic adds,
+ * or sampled with a function when the metrics are read.
+ */
+typedef struct _psync_metric_t {
+  const char *name;
+  struct _psync_metric_t *next;
+  psync_metric_sample_t sample;
+  psync_metric_hist_t *hist;
+  uint64_t value;
+  uint32_t id;
+  uint32_t type;
+} psync_metric_t;
+
+#define PSYNC_METRIC_COUNTER(var, name) static psync_metric_t var={name, NULL, NULL, NULL, 0, 0, PSYNC_METRIC_TYPE_COUNTER}
+#define PSYNC_METRIC_GAUGE(var, name) static psync_metric_t var={name, NULL, NULL, NULL, 0, 0, PSYNC_METRIC_TYPE_GAUGE}
+#define PSYNC_METRIC_GAUGE_FN(var, name, fn) static psync_metric_t var={name, NULL, fn, NULL, 0, 0, PSYNC_METRIC_TYPE_GAUGE}
+#define PSYNC_METRIC_HISTOGRAM(var, name) static psync_metric_t var={name, NULL, NULL, NULL, 0, 0, PSYNC_METRIC_TYPE_HISTOGRAM}
+
+#define psync_metric_inc(metric) psync_metric_add(metric, 1)
+#define psync_metric_record_since(metric, start) psync_metric_record(metric, psync_metric_time()-(start))
+
+void psync_metric_register(psync_metric_t *metric) PSYNC_NONNULL(1);
+void psync_metric_add(psync_metric_t *metric, uint64_t val) PSYNC_NONNULL(1);
+void psync_metric_gauge_add(psync_metric_t *metric, int64_t val) PSYNC_NONNULL(1);
+void psync_metric_record(psync_metric_t *metric, uint64_t val) PSYNC_NONNULL(1);
+uint64_t psync_metric_get(psync_metric_t *metric) PSYNC_NONNULL(1);
+uint64_t psync_metric_time();
+
+char *psync_metrics_dump();
+int psync_metrics_start_socket(const char *path) PSYNC_NONNULL(1);
+
+#endif
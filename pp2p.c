@@ -39,6 +39,10 @@
 #include "pfolder.h"
 #include <string.h>
 
+#if defined(P_OS_POSIX)
+#include <netinet/tcp.h>
+#endif
+
 #define P2P_ENCTYPE_RSA_AES 0
 
 typedef uint32_t packet_type_t;
@@ -59,6 +63,7 @@ typedef PSYNC_PACKED_STRUCT {
   uint32_t port;
   unsigned char rand[PSYNC_HASH_BLOCK_SIZE-PSYNC_HASH_DIGEST_HEXLEN];
   unsigned char genhash[PSYNC_HASH_DIGEST_HEXLEN];
+  uint32_t flags;
 } packet_check_resp;
 
 typedef PSYNC_PACKED_STRUCT {
@@ -72,6 +77,11 @@ typedef PSYNC_PACKED_STRUCT {
   unsigned char computername[PSYNC_HASH_DIGEST_HEXLEN];
 } packet_get;
 
+typedef PSYNC_PACKED_STRUCT {
+  uint64_t offset;
+  uint64_t length;
+} packet_range;
+
 static const int on=1;
 
 static const size_t min_packet_size[]={
@@ -83,6 +93,13 @@ static const size_t min_packet_size[]={
   sizeof(packet_get)
 };
 
+/* tcp only, after the key is sent the client sends any number of packet_range requests (without waiting for the data of the
+ * previous ones) and the peer answers each with the encrypted bytes of that range, a zero length range ends the session */
+#define P2P_GET_RANGES 3
+
+/* flags in packet_check_resp, peers that do not send flags do not support anything but P2P_GET */
+#define P2P_FLAG_RANGES 1
+
 #define P2P_RESP_NOPE   0
 #define P2P_RESP_HAVEIT 1
 #define P2P_RESP_WAIT   2
@@ -109,6 +126,8 @@ static psync_rsa_publickey_t rsa_public=PSYNC_INVALID_RSA;
 static psync_rsa_privatekey_t rsa_private=PSYNC_INVALID_RSA;
 static psync_binary_rsa_key_t rsa_public_bin=PSYNC_INVALID_BIN_RSA;
 
+static void p2p_close_idle_sessions(psync_timer_t timer, void *ptr);
+
 PSYNC_PURE static const char *p2p_get_address(void *addr){
   if (((struct sockaddr_in *)addr)->sin_family==AF_INET)
     return inet_ntoa(((struct sockaddr_in *)addr)->sin_addr);
@@ -201,6 +220,7 @@ static void psync_p2p_check(const packet_check *packet){
   else
     return;
   resp.port=tcpport;
+  resp.flags=P2P_FLAG_RANGES;
   psync_ssl_rand_weak(resp.rand, sizeof(resp.rand));
   memcpy(hashsource, hashhex, PSYNC_HASH_DIGEST_HEXLEN);
   memcpy(hashsource+PSYNC_HASH_DIGEST_HEXLEN, resp.rand, sizeof(resp.rand));
@@ -236,12 +256,14 @@ static void psync_p2p_process_packet(const char *packet, size_t plen){
   }
 }
 
+/* p2p sockets are blocking with SO_RCVTIMEO/SO_SNDTIMEO set, so P_AGAIN/P_WOULDBLOCK mean that the peer stalled and the
+ * operation timed out */
 static int socket_write_all(psync_socket_t sock, const void *buff, size_t len){
   ssize_t ret;
   while (len){
     ret=psync_write_socket(sock, buff, len);
     if (ret==SOCKET_ERROR){
-      if (psync_sock_err()==P_INTR || psync_sock_err()==P_AGAIN || psync_sock_err()==P_WOULDBLOCK)
+      if (psync_sock_err()==P_INTR)
         continue;
       return -1;
     }
@@ -251,12 +273,17 @@ static int socket_write_all(psync_socket_t sock, const void *buff, size_t len){
   return 0;
 }
 
-static int socket_read_all(psync_socket_t sock, void *buff, size_t len){
+/* deadline is in psync_timer_time() seconds, 0 means no deadline besides the per-call socket timeout */
+static int socket_read_all_deadline(psync_socket_t sock, void *buff, size_t len, time_t deadline){
   ssize_t ret;
   while (len){
+    if (deadline && psync_timer_time()>deadline){
+      debug(D_WARNING, "peer did not send %lu bytes in time", (unsigned long)len);
+      return -1;
+    }
     ret=psync_read_socket(sock, buff, len);
     if (ret==SOCKET_ERROR){
-      if (psync_sock_err()==P_INTR || psync_sock_err()==P_AGAIN || psync_sock_err()==P_WOULDBLOCK)
+      if (psync_sock_err()==P_INTR)
         continue;
       return -1;
     }
@@ -268,6 +295,309 @@ static int socket_read_all(psync_socket_t sock, void *buff, size_t len){
   return 0;
 }
 
+static int socket_read_all(psync_socket_t sock, void *buff, size_t len){
+  return socket_read_all_deadline(sock, buff, len, 0);
+}
+
+static void p2p_set_socket_timeout(psync_socket_t sock, int opt, uint32_t sec){
+#if defined(P_OS_WINDOWS)
+  DWORD tm;
+  tm=sec*1000;
+  setsockopt(sock, SOL_SOCKET, opt, (const char *)&tm, sizeof(tm));
+#else
+  struct timeval tv;
+  tv.tv_sec=sec;
+  tv.tv_usec=0;
+  setsockopt(sock, SOL_SOCKET, opt, (const char *)&tv, sizeof(tv));
+#endif
+}
+
+static void p2p_set_socket_options(psync_socket_t sock){
+  int bufsize;
+  bufsize=PSYNC_P2P_SOCKET_BUFFER;
+#if defined(SO_RCVBUF) && defined(SOL_SOCKET)
+  setsockopt(sock, SOL_SOCKET, SO_RCVBUF, (const char *)&bufsize, sizeof(bufsize));
+#endif
+#if defined(SO_SNDBUF) && defined(SOL_SOCKET)
+  setsockopt(sock, SOL_SOCKET, SO_SNDBUF, (const char *)&bufsize, sizeof(bufsize));
+#endif
+#if defined(TCP_NODELAY)
+  setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char *)&on, sizeof(on));
+#endif
+  p2p_set_socket_timeout(sock, SO_RCVTIMEO, PSYNC_P2P_SOCKET_TIMEOUT);
+  p2p_set_socket_timeout(sock, SO_SNDTIMEO, PSYNC_P2P_SOCKET_TIMEOUT);
+}
+
+static void p2p_set_socket_nonblocking(psync_socket_t sock, int nonblock){
+#if defined(P_OS_WINDOWS)
+  unsigned long mode;
+  mode=nonblock;
+  ioctlsocket(sock, FIONBIO, &mode);
+#else
+  if (nonblock)
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL)|O_NONBLOCK);
+  else
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL)&~O_NONBLOCK);
+#endif
+}
+
+/* connect() to a peer that is gone from the LAN would block for the whole OS SYN timeout */
+static int p2p_connect_timeout(psync_socket_t sock, const struct sockaddr *addr, socklen_t addrlen){
+  struct timeval tv;
+  fd_set wfds;
+  socklen_t slen;
+  int sret, serr;
+  p2p_set_socket_nonblocking(sock, 1);
+  if (connect(sock, addr, addrlen)==SOCKET_ERROR){
+    if (psync_sock_err()!=P_INPROGRESS)
+      return -1;
+    FD_ZERO(&wfds);
+    FD_SET(sock, &wfds);
+    tv.tv_sec=PSYNC_P2P_CONNECT_TIMEOUT;
+    tv.tv_usec=0;
+    sret=select(sock+1, NULL, &wfds, NULL, &tv);
+    if (sret!=1)
+      return -1;
+    serr=0;
+    slen=sizeof(serr);
+    if (getsockopt(sock, SOL_SOCKET, SO_ERROR, (char *)&serr, &slen) || serr)
+      return -1;
+  }
+  p2p_set_socket_nonblocking(sock, 0);
+  return 0;
+}
+
+/* Two stage pipeline over PSYNC_P2P_PIPELINE_BUFFERS buffers. On the sending side a helper thread reads and encrypts the file while
+ * the connection thread writes to the socket, on the receiving side the connection thread reads the socket while the helper thread
+ * decrypts, hashes and writes to the file.
+ */
+typedef struct {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  unsigned char *buffs[PSYNC_P2P_PIPELINE_BUFFERS];
+  uint64_t offsets[PSYNC_P2P_PIPELINE_BUFFERS];
+  size_t lens[PSYNC_P2P_PIPELINE_BUFFERS];
+  psync_crypto_aes256_ctr_encoder_decoder_t encoder;
+  psync_hash_ctx *hashctx;
+  uint64_t offset;
+  uint64_t length;
+  psync_file_t fd;
+  uint32_t produced;
+  uint32_t consumed;
+  int finished;
+  int error;
+  int threadrunning;
+} p2p_pipeline_t;
+
+static void p2p_pipeline_init(p2p_pipeline_t *pl, psync_crypto_aes256_ctr_encoder_decoder_t encoder, psync_file_t fd, psync_hash_ctx *hashctx,
+                              uint64_t offset, uint64_t length){
+  unsigned char *buff;
+  uint32_t i;
+  pthread_mutex_init(&pl->mutex, NULL);
+  pthread_cond_init(&pl->cond, NULL);
+  buff=psync_malloc(PSYNC_P2P_BUFFER_SIZE*PSYNC_P2P_PIPELINE_BUFFERS);
+  for (i=0; i<PSYNC_P2P_PIPELINE_BUFFERS; i++)
+    pl->buffs[i]=buff+i*PSYNC_P2P_BUFFER_SIZE;
+  pl->encoder=encoder;
+  pl->hashctx=hashctx;
+  pl->offset=offset;
+  pl->length=length;
+  pl->fd=fd;
+  pl->produced=0;
+  pl->consumed=0;
+  pl->finished=0;
+  pl->error=0;
+  pl->threadrunning=1;
+}
+
+static void p2p_pipeline_destroy(p2p_pipeline_t *pl){
+  pthread_mutex_lock(&pl->mutex);
+  while (pl->threadrunning)
+    pthread_cond_wait(&pl->cond, &pl->mutex);
+  pthread_mutex_unlock(&pl->mutex);
+  pthread_cond_destroy(&pl->cond);
+  pthread_mutex_destroy(&pl->mutex);
+  psync_free(pl->buffs[0]);
+}
+
+static int p2p_pipeline_get_empty(p2p_pipeline_t *pl){
+  int ret;
+  pthread_mutex_lock(&pl->mutex);
+  while (pl->produced-pl->consumed==PSYNC_P2P_PIPELINE_BUFFERS && !pl->error)
+    pthread_cond_wait(&pl->cond, &pl->mutex);
+  if (pl->error)
+    ret=-1;
+  else
+    ret=pl->produced%PSYNC_P2P_PIPELINE_BUFFERS;
+  pthread_mutex_unlock(&pl->mutex);
+  return ret;
+}
+
+static void p2p_pipeline_put_full(p2p_pipeline_t *pl){
+  pthread_mutex_lock(&pl->mutex);
+  pl->produced++;
+  pthread_cond_broadcast(&pl->cond);
+  pthread_mutex_unlock(&pl->mutex);
+}
+
+/* returns -1 both on error and when the producer has finished and everything is consumed */
+static int p2p_pipeline_get_full(p2p_pipeline_t *pl){
+  int ret;
+  pthread_mutex_lock(&pl->mutex);
+  while (pl->produced==pl->consumed && !pl->finished && !pl->error)
+    pthread_cond_wait(&pl->cond, &pl->mutex);
+  if (pl->error || pl->produced==pl->consumed)
+    ret=-1;
+  else
+    ret=pl->consumed%PSYNC_P2P_PIPELINE_BUFFERS;
+  pthread_mutex_unlock(&pl->mutex);
+  return ret;
+}
+
+static void p2p_pipeline_put_empty(p2p_pipeline_t *pl){
+  pthread_mutex_lock(&pl->mutex);
+  pl->consumed++;
+  pthread_cond_broadcast(&pl->cond);
+  pthread_mutex_unlock(&pl->mutex);
+}
+
+static void p2p_pipeline_finish(p2p_pipeline_t *pl, int error){
+  pthread_mutex_lock(&pl->mutex);
+  if (error)
+    pl->error=1;
+  else
+    pl->finished=1;
+  pthread_cond_broadcast(&pl->cond);
+  pthread_mutex_unlock(&pl->mutex);
+}
+
+static void p2p_pipeline_thread_done(p2p_pipeline_t *pl){
+  pthread_mutex_lock(&pl->mutex);
+  pl->threadrunning=0;
+  pthread_cond_broadcast(&pl->cond);
+  pthread_mutex_unlock(&pl->mutex);
+}
+
+static void p2p_send_reader_thread(void *ptr){
+  p2p_pipeline_t *pl;
+  uint64_t off, end;
+  size_t rd;
+  int idx;
+  pl=(p2p_pipeline_t *)ptr;
+  off=pl->offset;
+  end=pl->offset+pl->length;
+  while (off<end){
+    idx=p2p_pipeline_get_empty(pl);
+    if (idx==-1)
+      break;
+    if (end-off>PSYNC_P2P_BUFFER_SIZE)
+      rd=PSYNC_P2P_BUFFER_SIZE;
+    else
+      rd=end-off;
+    if (unlikely_log(psync_file_pread(pl->fd, pl->buffs[idx], rd, off)!=rd)){
+      p2p_pipeline_finish(pl, 1);
+      break;
+    }
+    psync_crypto_aes256_ctr_encode_decode_inplace(pl->encoder, pl->buffs[idx], rd, off);
+    pl->lens[idx]=rd;
+    p2p_pipeline_put_full(pl);
+    off+=rd;
+  }
+  p2p_pipeline_finish(pl, 0);
+  p2p_pipeline_thread_done(pl);
+}
+
+static int p2p_send_range(psync_socket_t sock, psync_file_t fd, psync_crypto_aes256_ctr_encoder_decoder_t encoder, uint64_t offset, uint64_t length){
+  p2p_pipeline_t pl;
+  uint64_t sent;
+  int idx;
+  if (length<=PSYNC_P2P_BUFFER_SIZE){
+    unsigned char *buff;
+    buff=psync_malloc(length+1);
+    if (unlikely_log(psync_file_pread(fd, buff, length, offset)!=length)){
+      psync_free(buff);
+      return -1;
+    }
+    psync_crypto_aes256_ctr_encode_decode_inplace(encoder, buff, length, offset);
+    idx=socket_write_all(sock, buff, length);
+    psync_free(buff);
+    return idx;
+  }
+  p2p_pipeline_init(&pl, encoder, fd, NULL, offset, length);
+  psync_run_thread1("p2p send", p2p_send_reader_thread, &pl);
+  sent=0;
+  while ((idx=p2p_pipeline_get_full(&pl))!=-1){
+    if (unlikely_log(socket_write_all(sock, pl.buffs[idx], pl.lens[idx]))){
+      p2p_pipeline_finish(&pl, 1);
+      break;
+    }
+    sent+=pl.lens[idx];
+    p2p_pipeline_put_empty(&pl);
+  }
+  p2p_pipeline_destroy(&pl);
+  return sent==length?0:-1;
+}
+
+static void p2p_recv_writer_thread(void *ptr){
+  p2p_pipeline_t *pl;
+  int idx;
+  pl=(p2p_pipeline_t *)ptr;
+  while ((idx=p2p_pipeline_get_full(pl))!=-1){
+    psync_crypto_aes256_ctr_encode_decode_inplace(pl->encoder, pl->buffs[idx], pl->lens[idx], pl->offsets[idx]);
+    if (unlikely_log(psync_file_pwrite(pl->fd, pl->buffs[idx], pl->lens[idx], pl->offsets[idx])!=pl->lens[idx])){
+      p2p_pipeline_finish(pl, 1);
+      break;
+    }
+    if (pl->hashctx)
+      psync_hash_update(pl->hashctx, pl->buffs[idx], pl->lens[idx]);
+    p2p_pipeline_put_empty(pl);
+  }
+  p2p_pipeline_thread_done(pl);
+}
+
+static int p2p_recv_range(psync_socket_t sock, psync_file_t fd, psync_crypto_aes256_ctr_encoder_decoder_t decoder, psync_hash_ctx *hashctx,
+                          uint64_t offset, uint64_t length){
+  p2p_pipeline_t pl;
+  uint64_t off, end;
+  size_t rd;
+  int idx, ret;
+  p2p_pipeline_init(&pl, decoder, fd, hashctx, offset, length);
+  psync_run_thread1("p2p receive", p2p_recv_writer_thread, &pl);
+  off=offset;
+  end=offset+length;
+  ret=0;
+  while (off<end){
+    idx=p2p_pipeline_get_empty(&pl);
+    if (idx==-1){
+      ret=-1;
+      break;
+    }
+    if (end-off>PSYNC_P2P_BUFFER_SIZE)
+      rd=PSYNC_P2P_BUFFER_SIZE;
+    else
+      rd=end-off;
+    if (unlikely_log(socket_read_all(sock, pl.buffs[idx], rd))){
+      p2p_pipeline_finish(&pl, 1);
+      ret=-1;
+      break;
+    }
+    pl.offsets[idx]=off;
+    pl.lens[idx]=rd;
+    p2p_pipeline_put_full(&pl);
+    off+=rd;
+  }
+  if (!ret)
+    p2p_pipeline_finish(&pl, 0);
+  pthread_mutex_lock(&pl.mutex);
+  while (pl.threadrunning)
+    pthread_cond_wait(&pl.cond, &pl.mutex);
+  if (pl.error)
+    ret=-1;
+  pthread_mutex_unlock(&pl.mutex);
+  p2p_pipeline_destroy(&pl);
+  return ret;
+}
+
 static int check_token(char *token, uint32_t tlen, unsigned char *key, uint32_t keylen, unsigned char *hashhex){
   binparam params[]={P_LSTR(PSYNC_CHECKSUM, hashhex, PSYNC_HASH_DIGEST_HEXLEN), 
                      P_LSTR("keydata", key, keylen), P_LSTR("token", token, tlen)};
@@ -286,6 +616,25 @@ static int check_token(char *token, uint32_t tlen, unsigned char *key, uint32_t
   return result?0:1;
 }
 
+/* the checksum in localfile is only valid for the file as it was when the scanner last saw it, refuse to serve a file that
+ * has changed since then as a range request (unlike a whole file transfer) can not be verified by the other side */
+static int psync_p2p_local_file_unchanged(psync_fileid_t localfileid, psync_file_t fd, uint64_t filesize){
+  psync_sql_res *res;
+  psync_uint_row row;
+  psync_stat_t st;
+  int ret;
+  if (unlikely_log(psync_fstat(fd, &st)))
+    return 0;
+  res=psync_sql_query("SELECT size, inode, mtimenative FROM localfile WHERE id=?");
+  psync_sql_bind_uint(res, 1, localfileid);
+  if ((row=psync_sql_fetch_rowint(res)))
+    ret=row[0]==filesize && psync_stat_size(&st)==filesize && row[1]==psync_stat_inode(&st) && row[2]==psync_stat_mtime_native(&st);
+  else
+    ret=0;
+  psync_sql_free_result(res);
+  return ret;
+}
+
 static void psync_p2p_tcphandler(void *ptr){
   packet_get packet;
   psync_fileid_t localfileid;
@@ -295,17 +644,19 @@ static void psync_p2p_tcphandler(void *ptr){
   psync_encrypted_symmetric_key_t encaeskey;
   psync_crypto_aes256_ctr_encoder_decoder_t encoder;
   char *token, *localpath;
-  uint64_t off;
-  size_t rd;
+  packet_range range;
   psync_socket_t sock;
   psync_file_t fd;
   uint32_t keylen, enctype;
-  unsigned char hashhex[PSYNC_HASH_DIGEST_HEXLEN], buff[4096];
+  unsigned char hashhex[PSYNC_HASH_DIGEST_HEXLEN];
   sock=*((psync_socket_t *)ptr);
   psync_free(ptr);
   debug(D_NOTICE, "got tcp connection");
+  p2p_set_socket_options(sock);
   if (unlikely_log(socket_read_all(sock, &packet, sizeof(packet))))
     goto err0;
+  if (unlikely_log(packet.type!=P2P_GET && packet.type!=P2P_GET_RANGES))
+    goto err0;
   if (unlikely_log(packet.keylen>PSYNC_P2P_RSA_SIZE) || unlikely_log(packet.tokenlen>512)) /* lets allow 8 times larger keys than we use */
     goto err0;
   localfileid=psync_p2p_has_file(packet.hashstart, packet.genhash, packet.rand, packet.filesize, hashhex);
@@ -340,6 +691,11 @@ static void psync_p2p_tcphandler(void *ptr){
     debug(D_WARNING, "could not open local file %lu", (unsigned long)localfileid);
     goto err0;
   }
+  if (!psync_p2p_local_file_unchanged(localfileid, fd, packet.filesize)){
+    debug(D_WARNING, "local file %lu changed since it was last scanned, not sending it", (unsigned long)localfileid);
+    psync_file_close(fd);
+    goto err0;
+  }
   aeskey=psync_crypto_aes256_ctr_gen_key();
   encaeskey=psync_ssl_rsa_encrypt_symmetric_key(pubrsa, aeskey);
   encoder=psync_crypto_aes256_ctr_encoder_decoder_create(aeskey);
@@ -357,22 +713,25 @@ static void psync_p2p_tcphandler(void *ptr){
     goto err0;
   }
   psync_free(encaeskey);  
-  off=0;
-  while (off<packet.filesize){
-    if (packet.filesize-off<sizeof(buff))
-      rd=packet.filesize-off;
-    else
-      rd=sizeof(buff);
-    if (unlikely_log(psync_file_read(fd, buff, rd)!=rd))
-      break;
-    psync_crypto_aes256_ctr_encode_decode_inplace(encoder, buff, rd, off);
-    if (unlikely_log(socket_write_all(sock, buff, rd)))
-      break;
-    off+=rd;
+  if (packet.type==P2P_GET_RANGES){
+    /* the client keeps range sessions idle for up to PSYNC_P2P_SESSION_IDLE_TIME between requests */
+    p2p_set_socket_timeout(sock, SO_RCVTIMEO, PSYNC_P2P_SESSION_IDLE_TIME+PSYNC_P2P_SOCKET_TIMEOUT);
+    while (1){
+      if (unlikely_log(socket_read_all(sock, &range, sizeof(range))))
+        break;
+      if (!range.length){
+        debug(D_NOTICE, "range session finished");
+        break;
+      }
+      if (unlikely_log(range.offset>packet.filesize || range.length>packet.filesize-range.offset) ||
+          p2p_send_range(sock, fd, encoder, range.offset, range.length))
+        break;
+    }
   }
+  else if (!p2p_send_range(sock, fd, encoder, 0, packet.filesize))
+    debug(D_NOTICE, "file sent successfuly");
   psync_crypto_aes256_ctr_encoder_decoder_free(encoder);
   psync_file_close(fd);
-  debug(D_NOTICE, "file sent successfuly");
 err0:
   psync_close_socket(sock);
 }
@@ -515,6 +874,7 @@ void psync_p2p_init(){
   psync_ssl_rand_weak(computerbin, PSYNC_HASH_DIGEST_LEN);
   psync_binhex(computername, computerbin, PSYNC_HASH_DIGEST_LEN);
   psync_timer_exception_handler(psync_p2p_wake);
+  psync_timer_register(p2p_close_idle_sessions, PSYNC_P2P_SESSION_IDLE_TIME, NULL);
   if (!psync_setting_get_bool(_PS(p2psync)))
     return;
   psync_p2p_start();
@@ -599,109 +959,54 @@ static int psync_p2p_get_download_token(psync_fileid_t fileid, const unsigned ch
   return PSYNC_NET_OK;
 }
 
-static int psync_p2p_download(psync_socket_t sock, psync_fileid_t fileid, const unsigned char *filehashhex, uint64_t fsize, const char *filename){
-  uint32_t keylen, enctype;
-  psync_symmetric_key_t key;
-  psync_encrypted_symmetric_key_t ekey;
-  psync_crypto_aes256_ctr_encoder_decoder_t decoder;
-  psync_hash_ctx hashctx;
-  uint64_t off;
-  size_t rd;
-  psync_file_t fd;
-  unsigned char buff[4096];
-  unsigned char hashbin[PSYNC_HASH_DIGEST_LEN], hashhex[PSYNC_HASH_DIGEST_HEXLEN];
-  if (unlikely_log(socket_read_all(sock, &keylen, sizeof(keylen)) || socket_read_all(sock, &enctype, sizeof(enctype))))
-    return PSYNC_NET_TEMPFAIL;
-  if (enctype!=P2P_ENCTYPE_RSA_AES){
-    debug(D_ERROR, "unknown encryption type %u", (unsigned)enctype);
-    return PSYNC_NET_PERMFAIL;
-  }
-  if (keylen>PSYNC_P2P_RSA_SIZE/8*2){ /* PSYNC_P2P_RSA_SIZE/8 is enough actually */
-    debug(D_ERROR, "too long key - %u bytes", (unsigned)keylen);
-    return PSYNC_NET_PERMFAIL;
-  }
-  ekey=psync_ssl_alloc_encrypted_symmetric_key(keylen);
-  if (unlikely_log(socket_read_all(sock, ekey->data, keylen)) || 
-      unlikely_log((key=psync_ssl_rsa_decrypt_symmetric_key(rsa_private, ekey))==PSYNC_INVALID_SYM_KEY)){
-    psync_free(ekey);
-    return PSYNC_NET_TEMPFAIL;
-  }
-  psync_free(ekey);
-  decoder=psync_crypto_aes256_ctr_encoder_decoder_create(key);
-  psync_ssl_free_symmetric_key(key);
-  if (decoder==PSYNC_CRYPTO_INVALID_ENCODER)
-    return PSYNC_NET_PERMFAIL;
-  fd=psync_file_open(filename, P_O_WRONLY, P_O_CREAT|P_O_TRUNC);
-  if (unlikely(fd==INVALID_HANDLE_VALUE)){
-    psync_crypto_aes256_ctr_encoder_decoder_free(decoder);
-    debug(D_ERROR, "could not open %s", filename);
-    
-  }
-  off=0;
-  psync_hash_init(&hashctx);
-  while (off<fsize){
-    if (fsize-off>sizeof(buff))
-      rd=sizeof(buff);
-    else
-      rd=fsize-off;
-    if (unlikely_log(socket_read_all(sock, buff, rd)))
-      goto err0;
-    psync_crypto_aes256_ctr_encode_decode_inplace(decoder, buff, rd, off);
-    if (unlikely_log(psync_file_write(fd, buff, rd)!=rd))
-      goto err0;
-    psync_hash_update(&hashctx, buff, rd);
-    off+=rd;
-  }
-  psync_crypto_aes256_ctr_encoder_decoder_free(decoder);
-  psync_file_close(fd);
-  psync_hash_final(hashbin, &hashctx);
-  psync_binhex(hashhex, hashbin, PSYNC_HASH_DIGEST_LEN);
-  if (memcmp(hashhex, filehashhex, PSYNC_HASH_DIGEST_HEXLEN)){
-    /* it is better to return permanent fail and let the block checksum algo to find bad blocks */
-    debug(D_WARNING, "got bad checksum for file %s", filename);
-    return PSYNC_NET_PERMFAIL;
-  }
-  else
-    return PSYNC_NET_OK;
-  
-err0:
-  psync_crypto_aes256_ctr_encoder_decoder_free(decoder);
-  psync_file_close(fd);
-  psync_hash_final(hashbin, &hashctx);
-  return PSYNC_NET_TEMPFAIL;
+typedef struct {
+  struct sockaddr_storage addr;
+  socklen_t addrlen;
+  uint32_t port;
+  uint32_t flags;
+} p2p_peer_t;
+
+static void p2p_make_check_packet(packet_check *pct, const unsigned char *filehashhex, uint64_t fsize){
+  unsigned char hashsource[PSYNC_HASH_BLOCK_SIZE], hashbin[PSYNC_HASH_DIGEST_LEN];
+  pct->type=P2P_CHECK;
+  memcpy(pct->hashstart, filehashhex, PSYNC_P2P_HEXHASH_BYTES);
+  pct->filesize=fsize;
+  psync_ssl_rand_weak(pct->rand, sizeof(pct->rand));
+  memcpy(hashsource, filehashhex, PSYNC_HASH_DIGEST_HEXLEN);
+  memcpy(hashsource+PSYNC_HASH_DIGEST_HEXLEN, pct->rand, sizeof(pct->rand));
+  psync_hash(hashsource, PSYNC_HASH_BLOCK_SIZE, hashbin);
+  psync_binhex(pct->genhash, hashbin, PSYNC_HASH_DIGEST_LEN);
+  memcpy(pct->computername, computername, PSYNC_HASH_DIGEST_HEXLEN);
 }
 
-int psync_p2p_check_download(psync_fileid_t fileid, const unsigned char *filehashhex, uint64_t fsize, const char *filename){
-  struct sockaddr_in6 addr;
+static int p2p_has_peer(const p2p_peer_t *peers, uint32_t peercnt, const struct sockaddr_storage *addr, socklen_t addrlen){
+  uint32_t i;
+  for (i=0; i<peercnt; i++)
+    if (peers[i].addrlen==addrlen && !memcmp(&peers[i].addr, addr, addrlen))
+      return 1;
+  return 0;
+}
+
+/* Broadcasts pct on all interfaces and collects up to PSYNC_P2P_MAX_PEERS peers that have the file. After the first such peer
+ * answers, others are waited for PSYNC_P2P_PEER_COLLECT_TIMEOUT more, as on a LAN all replies come at about the same time.
+ */
+static packet_resp_t p2p_discover_peers(const unsigned char *filehashhex, const packet_check *pct, p2p_peer_t *peers, uint32_t *peercnt){
+  struct sockaddr_storage addr;
   fd_set rfds;
-  packet_check pct1;
-  packet_get pct2;
   packet_check_resp resp;
   struct timeval tv;
   psync_interface_list_t *il;
   psync_socket_t *sockets;
-  size_t i, tlen;
+  size_t i;
   psync_socket_t sock, msock;
   packet_resp_t bresp;
   unsigned char hashsource[PSYNC_HASH_BLOCK_SIZE], hashbin[PSYNC_HASH_DIGEST_LEN], hashhex[PSYNC_HASH_DIGEST_HEXLEN];
-  unsigned char *token;
   socklen_t slen;
   int sret;
-  if (!psync_setting_get_bool(_PS(p2psync)))
-    return PSYNC_NET_PERMFAIL;
-  debug(D_NOTICE, "sending P2P_CHECK for file with hash %."NTO_STR(PSYNC_HASH_DIGEST_HEXLEN)"s", filehashhex);
-  pct1.type=P2P_CHECK;
-  memcpy(pct1.hashstart, filehashhex, PSYNC_P2P_HEXHASH_BYTES);
-  pct1.filesize=fsize;
-  psync_ssl_rand_weak(pct1.rand, sizeof(pct1.rand));
-  memcpy(hashsource, filehashhex, PSYNC_HASH_DIGEST_HEXLEN);
-  memcpy(hashsource+PSYNC_HASH_DIGEST_HEXLEN, pct1.rand, sizeof(pct1.rand));
-  psync_hash(hashsource, PSYNC_HASH_BLOCK_SIZE, hashbin);
-  psync_binhex(pct1.genhash, hashbin, PSYNC_HASH_DIGEST_LEN);
-  memcpy(pct1.computername, computername, PSYNC_HASH_DIGEST_HEXLEN);
+  *peercnt=0;
+  bresp=P2P_RESP_NOPE;
   il=psync_list_ip_adapters();
   sockets=psync_new_cnt(psync_socket_t, il->interfacecnt);
-  FD_ZERO(&rfds);
   msock=0;
   for (i=0; i<il->interfacecnt; i++){
     sockets[i]=INVALID_SOCKET;
@@ -720,9 +1025,8 @@ int psync_p2p_check_download(psync_fileid_t fileid, const unsigned char *filehas
       ((struct sockaddr_in *)(&il->interfaces[i].broadcast))->sin_port=htons(PSYNC_P2P_PORT);
     else if (il->interfaces[i].broadcast.ss_family==AF_INET6)
       ((struct sockaddr_in6 *)(&il->interfaces[i].broadcast))->sin6_port=htons(PSYNC_P2P_PORT);
-    if (sendto(sock, (const char *)&pct1, sizeof(pct1), 0, (struct sockaddr *)&il->interfaces[i].broadcast, il->interfaces[i].addrsize)!=SOCKET_ERROR){
+    if (sendto(sock, (const char *)pct, sizeof(packet_check), 0, (struct sockaddr *)&il->interfaces[i].broadcast, il->interfaces[i].addrsize)!=SOCKET_ERROR){
       sockets[i]=sock;
-      FD_SET(sock, &rfds);
       if (sock>=msock)
         msock=sock+1;
     }
@@ -730,109 +1034,633 @@ int psync_p2p_check_download(psync_fileid_t fileid, const unsigned char *filehas
       psync_close_socket(sock);
   }
   if (unlikely_log(!msock))
-    goto err_perm;
+    goto ex;
   tv.tv_sec=PSYNC_P2P_INITIAL_TIMEOUT/1000;
   tv.tv_usec=(PSYNC_P2P_INITIAL_TIMEOUT%1000)*1000;
-  sret=select(msock, &rfds, NULL, NULL, &tv);
-  if (sret==0 || unlikely_log(sret==SOCKET_ERROR))
-    goto err_perm;
-  bresp=P2P_RESP_NOPE;
-  for (i=0; i<il->interfacecnt; i++)
-    if (sockets[i]!=INVALID_SOCKET && FD_ISSET(sockets[i], &rfds)){
-      slen=sizeof(addr);
-      sret=recvfrom(sockets[i], (char *)&resp, sizeof(resp), 0, (struct sockaddr *)&addr, &slen);
-      if (unlikely_log(sret==SOCKET_ERROR) || unlikely_log(sret<sizeof(resp)))
-        continue;
-      if (!memcmp(pct1.rand, resp.rand, sizeof(resp.rand))){
-        debug(D_WARNING, "clients are supposed to generate random data, not to reuse mine");
-        continue;
-      }
-      memcpy(hashsource, filehashhex, PSYNC_HASH_DIGEST_HEXLEN);
-      memcpy(hashsource+PSYNC_HASH_DIGEST_HEXLEN, resp.rand, sizeof(resp.rand));
-      psync_hash(hashsource, PSYNC_HASH_BLOCK_SIZE, hashbin);
-      psync_binhex(hashhex, hashbin, PSYNC_HASH_DIGEST_LEN);
-      if (unlikely_log(memcmp(hashhex, resp.genhash, PSYNC_HASH_DIGEST_HEXLEN)))
-        continue;
-      if (resp.type==P2P_RESP_HAVEIT){
-        debug(D_NOTICE, "got P2P_RESP_HAVEIT");
-        bresp=P2P_RESP_HAVEIT;
-        break;
+  while (*peercnt<PSYNC_P2P_MAX_PEERS){
+    FD_ZERO(&rfds);
+    for (i=0; i<il->interfacecnt; i++)
+      if (sockets[i]!=INVALID_SOCKET)
+        FD_SET(sockets[i], &rfds);
+    sret=select(msock, &rfds, NULL, NULL, &tv);
+    if (sret==0 || unlikely_log(sret==SOCKET_ERROR))
+      break;
+    for (i=0; i<il->interfacecnt && *peercnt<PSYNC_P2P_MAX_PEERS; i++)
+      if (sockets[i]!=INVALID_SOCKET && FD_ISSET(sockets[i], &rfds)){
+        slen=sizeof(addr);
+        resp.flags=0;
+        sret=recvfrom(sockets[i], (char *)&resp, sizeof(resp), 0, (struct sockaddr *)&addr, &slen);
+        if (unlikely_log(sret==SOCKET_ERROR) || unlikely_log(sret<offsetof(packet_check_resp, flags)))
+          continue;
+        if (!memcmp(pct->rand, resp.rand, sizeof(resp.rand))){
+          debug(D_WARNING, "clients are supposed to generate random data, not to reuse mine");
+          continue;
+        }
+        memcpy(hashsource, filehashhex, PSYNC_HASH_DIGEST_HEXLEN);
+        memcpy(hashsource+PSYNC_HASH_DIGEST_HEXLEN, resp.rand, sizeof(resp.rand));
+        psync_hash(hashsource, PSYNC_HASH_BLOCK_SIZE, hashbin);
+        psync_binhex(hashhex, hashbin, PSYNC_HASH_DIGEST_LEN);
+        if (unlikely_log(memcmp(hashhex, resp.genhash, PSYNC_HASH_DIGEST_HEXLEN)))
+          continue;
+        if (resp.type==P2P_RESP_HAVEIT){
+          if (addr.ss_family==AF_INET)
+            ((struct sockaddr_in *)&addr)->sin_port=htons(resp.port);
+          else if (addr.ss_family==AF_INET6)
+            ((struct sockaddr_in6 *)&addr)->sin6_port=htons(resp.port);
+          else{
+            debug(D_ERROR, "unknown address family %u", (unsigned)addr.ss_family);
+            continue;
+          }
+          if (p2p_has_peer(peers, *peercnt, &addr, slen))
+            continue;
+          debug(D_NOTICE, "got P2P_RESP_HAVEIT from %s", p2p_get_address(&addr));
+          memcpy(&peers[*peercnt].addr, &addr, slen);
+          peers[*peercnt].addrlen=slen;
+          peers[*peercnt].port=resp.port;
+          peers[*peercnt].flags=sret>=sizeof(resp)?resp.flags:0;
+          (*peercnt)++;
+          bresp=P2P_RESP_HAVEIT;
+          tv.tv_sec=PSYNC_P2P_PEER_COLLECT_TIMEOUT/1000;
+          tv.tv_usec=(PSYNC_P2P_PEER_COLLECT_TIMEOUT%1000)*1000;
+        }
+        else if (resp.type==P2P_RESP_WAIT && bresp==P2P_RESP_NOPE)
+          bresp=P2P_RESP_WAIT;
       }
-      else if (resp.type==P2P_RESP_WAIT && bresp==P2P_RESP_NOPE)
-        bresp=P2P_RESP_WAIT;
-    }
+    if (bresp==P2P_RESP_WAIT)
+      break;
+  }
+ex:
   for (i=0; i<il->interfacecnt; i++)
     if (sockets[i]!=INVALID_SOCKET)
       psync_close_socket(sockets[i]);
   psync_free(il);
   psync_free(sockets);
-  if (bresp==P2P_RESP_NOPE)
-    goto err_perm2;
-  else if (bresp==P2P_RESP_WAIT){
-    psync_milisleep(PSYNC_P2P_SLEEP_WAIT_DOWNLOAD);
-    goto err_temp2;
-  }
-  if (psync_p2p_check_rsa())
-    goto err_perm2;
-  sret=psync_p2p_get_download_token(fileid, filehashhex, fsize, &token, &tlen);
-  debug(D_NOTICE, "got token");
-  if (unlikely_log(sret!=PSYNC_NET_OK)){
-    if (sret==PSYNC_NET_TEMPFAIL)
-      goto err_temp2;
-    else
-      goto err_perm2;
-  }
-  if (addr.sin6_family==AF_INET6){
-    sock=psync_create_socket(AF_INET6, SOCK_STREAM, IPPROTO_TCP);
-    addr.sin6_port=htons(resp.port);
+  return bresp;
+}
+
+static int psync_p2p_read_key(psync_socket_t sock, psync_crypto_aes256_ctr_encoder_decoder_t *decoder){
+  uint32_t keylen, enctype;
+  psync_symmetric_key_t key;
+  psync_encrypted_symmetric_key_t ekey;
+  if (unlikely_log(socket_read_all(sock, &keylen, sizeof(keylen)) || socket_read_all(sock, &enctype, sizeof(enctype))))
+    return PSYNC_NET_TEMPFAIL;
+  if (enctype!=P2P_ENCTYPE_RSA_AES){
+    debug(D_ERROR, "unknown encryption type %u", (unsigned)enctype);
+    return PSYNC_NET_PERMFAIL;
   }
-  else if (addr.sin6_family==AF_INET){
-    sock=psync_create_socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
-    ((struct sockaddr_in *)&addr)->sin_port=htons(resp.port);
+  if (keylen>PSYNC_P2P_RSA_SIZE/8*2){ /* PSYNC_P2P_RSA_SIZE/8 is enough actually */
+    debug(D_ERROR, "too long key - %u bytes", (unsigned)keylen);
+    return PSYNC_NET_PERMFAIL;
   }
-  else{
-    debug(D_ERROR, "unknown address family %u", (unsigned)addr.sin6_family);
-    goto err_perm2;
+  ekey=psync_ssl_alloc_encrypted_symmetric_key(keylen);
+  if (unlikely_log(socket_read_all(sock, ekey->data, keylen)) ||
+      unlikely_log((key=psync_ssl_rsa_decrypt_symmetric_key(rsa_private, ekey))==PSYNC_INVALID_SYM_KEY)){
+    psync_free(ekey);
+    return PSYNC_NET_TEMPFAIL;
   }
+  psync_free(ekey);
+  *decoder=psync_crypto_aes256_ctr_encoder_decoder_create(key);
+  psync_ssl_free_symmetric_key(key);
+  if (*decoder==PSYNC_CRYPTO_INVALID_ENCODER)
+    return PSYNC_NET_PERMFAIL;
+  return PSYNC_NET_OK;
+}
+
+static psync_socket_t p2p_connect_peer(const p2p_peer_t *peer, packet_type_t type, const packet_check *pct, const unsigned char *token, size_t tlen,
+                                       psync_crypto_aes256_ctr_encoder_decoder_t *decoder, int *err){
+  packet_get pct2;
+  psync_socket_t sock;
+  *err=PSYNC_NET_PERMFAIL;
+  sock=psync_create_socket(peer->addr.ss_family, SOCK_STREAM, IPPROTO_TCP);
   if (unlikely_log(sock==INVALID_SOCKET))
-    goto err_perm3;
-  if (unlikely(connect(sock, (struct sockaddr *)&addr, slen)==SOCKET_ERROR)){
-    debug(D_WARNING, "could not connect to %s port %u", p2p_get_address(&addr), (unsigned)resp.port);
-    goto err_perm3;
+    return INVALID_SOCKET;
+  p2p_set_socket_options(sock);
+  if (unlikely(p2p_connect_timeout(sock, (const struct sockaddr *)&peer->addr, peer->addrlen))){
+    debug(D_WARNING, "could not connect to %s port %u", p2p_get_address((void *)&peer->addr), (unsigned)peer->port);
+    psync_close_socket(sock);
+    return INVALID_SOCKET;
   }
   debug(D_NOTICE, "connected to peer");
-  pct2.type=P2P_GET;
-  memcpy(pct2.hashstart, filehashhex, PSYNC_P2P_HEXHASH_BYTES);
-  pct2.filesize=fsize;
+  pct2.type=type;
+  memcpy(pct2.hashstart, pct->hashstart, PSYNC_P2P_HEXHASH_BYTES);
+  pct2.filesize=pct->filesize;
   pct2.keylen=rsa_public_bin->datalen;
   pct2.tokenlen=tlen;
-  memcpy(pct2.rand, pct1.rand, sizeof(pct1.rand));
-  memcpy(pct2.genhash, pct1.genhash, sizeof(pct1.genhash));
+  memcpy(pct2.rand, pct->rand, sizeof(pct->rand));
+  memcpy(pct2.genhash, pct->genhash, sizeof(pct->genhash));
   memcpy(pct2.computername, computername, PSYNC_HASH_DIGEST_HEXLEN);
-  if (socket_write_all(sock, &pct2, sizeof(pct2)) || 
+  if (socket_write_all(sock, &pct2, sizeof(pct2)) ||
       socket_write_all(sock, rsa_public_bin->data, rsa_public_bin->datalen) ||
       socket_write_all(sock, token, tlen)){
     debug(D_WARNING, "writing to socket failed");
-    goto err_temp3;
+    *err=PSYNC_NET_TEMPFAIL;
+    psync_close_socket(sock);
+    return INVALID_SOCKET;
   }
-  psync_free(token);
-  sret=psync_p2p_download(sock, fileid, filehashhex, fsize, filename);
+  *err=psync_p2p_read_key(sock, decoder);
+  if (*err!=PSYNC_NET_OK){
+    psync_close_socket(sock);
+    return INVALID_SOCKET;
+  }
+  return sock;
+}
+
+static int psync_p2p_download(psync_socket_t sock, psync_crypto_aes256_ctr_encoder_decoder_t decoder, const unsigned char *filehashhex,
+                              uint64_t fsize, const char *filename){
+  psync_hash_ctx hashctx;
+  psync_file_t fd;
+  unsigned char hashbin[PSYNC_HASH_DIGEST_LEN], hashhex[PSYNC_HASH_DIGEST_HEXLEN];
+  fd=psync_file_open(filename, P_O_WRONLY, P_O_CREAT|P_O_TRUNC);
+  if (unlikely(fd==INVALID_HANDLE_VALUE)){
+    debug(D_ERROR, "could not open %s", filename);
+    return PSYNC_NET_TEMPFAIL;
+  }
+  psync_hash_init(&hashctx);
+  if (p2p_recv_range(sock, fd, decoder, &hashctx, 0, fsize)){
+    psync_file_close(fd);
+    psync_hash_final(hashbin, &hashctx);
+    return PSYNC_NET_TEMPFAIL;
+  }
+  psync_file_close(fd);
+  psync_hash_final(hashbin, &hashctx);
+  psync_binhex(hashhex, hashbin, PSYNC_HASH_DIGEST_LEN);
+  if (memcmp(hashhex, filehashhex, PSYNC_HASH_DIGEST_HEXLEN)){
+    /* it is better to return permanent fail and let the block checksum algo to find bad blocks */
+    debug(D_WARNING, "got bad checksum for file %s", filename);
+    return PSYNC_NET_PERMFAIL;
+  }
+  else
+    return PSYNC_NET_OK;
+}
+
+typedef struct {
+  psync_list list;
+  uint64_t offset;
+  uint64_t length;
+} p2p_chunk_t;
+
+typedef struct {
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  psync_list retry;
+  const packet_check *pct;
+  const unsigned char *token;
+  size_t tlen;
+  uint64_t fsize;
+  uint64_t nextoff;
+  uint64_t received;
+  psync_file_t fd;
+  uint32_t inflight;
+  uint32_t running;
+} p2p_multi_download_t;
+
+typedef struct {
+  p2p_multi_download_t *md;
+  p2p_peer_t peer;
+} p2p_multi_worker_t;
+
+/* Chunks given back by failed peers are served first. A worker with no outstanding requests waits while other workers still have
+ * chunks in flight, as they may fail and give them back.
+ */
+static p2p_chunk_t *p2p_get_chunk(p2p_multi_download_t *md, int wait){
+  p2p_chunk_t *chunk;
+  pthread_mutex_lock(&md->mutex);
+  while (1){
+    if (!psync_list_isempty(&md->retry)){
+      chunk=psync_list_remove_head_element(&md->retry, p2p_chunk_t, list);
+      break;
+    }
+    if (md->nextoff<md->fsize){
+      chunk=psync_new(p2p_chunk_t);
+      chunk->offset=md->nextoff;
+      if (md->fsize-md->nextoff>PSYNC_P2P_RANGE_CHUNK)
+        chunk->length=PSYNC_P2P_RANGE_CHUNK;
+      else
+        chunk->length=md->fsize-md->nextoff;
+      md->nextoff+=chunk->length;
+      break;
+    }
+    if (!wait || !md->inflight){
+      pthread_mutex_unlock(&md->mutex);
+      return NULL;
+    }
+    pthread_cond_wait(&md->cond, &md->mutex);
+  }
+  md->inflight++;
+  pthread_mutex_unlock(&md->mutex);
+  return chunk;
+}
+
+static void p2p_chunk_done(p2p_multi_download_t *md, p2p_chunk_t *chunk, int ok){
+  pthread_mutex_lock(&md->mutex);
+  md->inflight--;
+  if (ok){
+    md->received+=chunk->length;
+    psync_free(chunk);
+  }
+  else
+    psync_list_add_tail(&md->retry, &chunk->list);
+  pthread_cond_broadcast(&md->cond);
+  pthread_mutex_unlock(&md->mutex);
+}
+
+static void p2p_multi_worker_thread(void *ptr){
+  p2p_multi_worker_t *w;
+  p2p_multi_download_t *md;
+  p2p_chunk_t *chunks[PSYNC_P2P_RANGE_WINDOW];
+  psync_crypto_aes256_ctr_encoder_decoder_t decoder;
+  packet_range range;
+  psync_socket_t sock;
+  uint32_t cnt, i;
+  int err;
+  w=(p2p_multi_worker_t *)ptr;
+  md=w->md;
+  sock=p2p_connect_peer(&w->peer, P2P_GET_RANGES, md->pct, md->token, md->tlen, &decoder, &err);
+  if (sock==INVALID_SOCKET)
+    goto ex;
+  cnt=0;
+  while (1){
+    while (cnt<PSYNC_P2P_RANGE_WINDOW && (chunks[cnt]=p2p_get_chunk(md, !cnt))){
+      range.offset=chunks[cnt]->offset;
+      range.length=chunks[cnt]->length;
+      cnt++;
+      if (unlikely_log(socket_write_all(sock, &range, sizeof(range))))
+        goto err;
+    }
+    if (!cnt)
+      break;
+    if (p2p_recv_range(sock, md->fd, decoder, NULL, chunks[0]->offset, chunks[0]->length))
+      goto err;
+    p2p_chunk_done(md, chunks[0], 1);
+    cnt--;
+    for (i=0; i<cnt; i++)
+      chunks[i]=chunks[i+1];
+  }
+  range.offset=0;
+  range.length=0;
+  socket_write_all(sock, &range, sizeof(range));
+  goto cl;
+err:
+  debug(D_WARNING, "peer %s failed, giving back %u chunks", p2p_get_address(&w->peer.addr), (unsigned)cnt);
+  for (i=0; i<cnt; i++)
+    p2p_chunk_done(md, chunks[i], 0);
+cl:
+  psync_crypto_aes256_ctr_encoder_decoder_free(decoder);
   psync_close_socket(sock);
-  return sret;
-err_perm3:
+ex:
+  psync_free(w);
+  pthread_mutex_lock(&md->mutex);
+  md->running--;
+  pthread_cond_broadcast(&md->cond);
+  pthread_mutex_unlock(&md->mutex);
+}
+
+static int p2p_multi_download(const p2p_peer_t *peers, uint32_t peercnt, const packet_check *pct, const unsigned char *token, size_t tlen,
+                              const unsigned char *filehashhex, uint64_t fsize, const char *filename){
+  p2p_multi_download_t md;
+  p2p_multi_worker_t *w;
+  unsigned char hashhex[PSYNC_HASH_DIGEST_HEXLEN];
+  uint64_t rsize;
+  uint32_t i;
+  md.fd=psync_file_open(filename, P_O_WRONLY, P_O_CREAT|P_O_TRUNC);
+  if (unlikely(md.fd==INVALID_HANDLE_VALUE)){
+    debug(D_ERROR, "could not open %s", filename);
+    return PSYNC_NET_TEMPFAIL;
+  }
+  debug(D_NOTICE, "downloading %s from %u peers", filename, (unsigned)peercnt);
+  pthread_mutex_init(&md.mutex, NULL);
+  pthread_cond_init(&md.cond, NULL);
+  psync_list_init(&md.retry);
+  md.pct=pct;
+  md.token=token;
+  md.tlen=tlen;
+  md.fsize=fsize;
+  md.nextoff=0;
+  md.received=0;
+  md.inflight=0;
+  md.running=peercnt;
+  for (i=1; i<peercnt; i++){
+    w=psync_new(p2p_multi_worker_t);
+    w->md=&md;
+    w->peer=peers[i];
+    psync_run_thread1("p2p peer", p2p_multi_worker_thread, w);
+  }
+  w=psync_new(p2p_multi_worker_t);
+  w->md=&md;
+  w->peer=peers[0];
+  p2p_multi_worker_thread(w);
+  pthread_mutex_lock(&md.mutex);
+  while (md.running)
+    pthread_cond_wait(&md.cond, &md.mutex);
+  pthread_mutex_unlock(&md.mutex);
+  psync_list_for_each_element_call(&md.retry, p2p_chunk_t, list, psync_free);
+  pthread_cond_destroy(&md.cond);
+  pthread_mutex_destroy(&md.mutex);
+  psync_file_close(md.fd);
+  if (md.received!=fsize)
+    return PSYNC_NET_TEMPFAIL;
+  if (psync_get_local_file_checksum(filename, hashhex, &rsize) || rsize!=fsize || memcmp(hashhex, filehashhex, PSYNC_HASH_DIGEST_HEXLEN)){
+    debug(D_WARNING, "got bad checksum for file %s", filename);
+    return PSYNC_NET_PERMFAIL;
+  }
+  return PSYNC_NET_OK;
+}
+
+int psync_p2p_check_download(psync_fileid_t fileid, const unsigned char *filehashhex, uint64_t fsize, const char *filename){
+  p2p_peer_t peers[PSYNC_P2P_MAX_PEERS], rangepeers[PSYNC_P2P_MAX_PEERS];
+  packet_check pct1;
+  psync_crypto_aes256_ctr_encoder_decoder_t decoder;
+  psync_socket_t sock;
+  size_t tlen;
+  uint32_t peercnt, rangepeercnt, i;
+  packet_resp_t bresp;
+  unsigned char *token;
+  int sret;
+  if (!psync_setting_get_bool(_PS(p2psync)))
+    return PSYNC_NET_PERMFAIL;
+  debug(D_NOTICE, "sending P2P_CHECK for file with hash %."NTO_STR(PSYNC_HASH_DIGEST_HEXLEN)"s", filehashhex);
+  p2p_make_check_packet(&pct1, filehashhex, fsize);
+  bresp=p2p_discover_peers(filehashhex, &pct1, peers, &peercnt);
+  if (bresp==P2P_RESP_NOPE)
+    return PSYNC_NET_PERMFAIL;
+  else if (bresp==P2P_RESP_WAIT){
+    psync_milisleep(PSYNC_P2P_SLEEP_WAIT_DOWNLOAD);
+    return PSYNC_NET_TEMPFAIL;
+  }
+  if (psync_p2p_check_rsa())
+    return PSYNC_NET_PERMFAIL;
+  sret=psync_p2p_get_download_token(fileid, filehashhex, fsize, &token, &tlen);
+  debug(D_NOTICE, "got token");
+  if (unlikely_log(sret!=PSYNC_NET_OK))
+    return sret;
+  rangepeercnt=0;
+  for (i=0; i<peercnt; i++)
+    if (peers[i].flags&P2P_FLAG_RANGES)
+      rangepeers[rangepeercnt++]=peers[i];
+  if (rangepeercnt>=2 && fsize>=PSYNC_P2P_MIN_SIZE_FOR_MULTIPEER){
+    sret=p2p_multi_download(rangepeers, rangepeercnt, &pct1, token, tlen, filehashhex, fsize, filename);
+    psync_free(token);
+    return sret;
+  }
+  sret=PSYNC_NET_PERMFAIL;
+  for (i=0; i<peercnt; i++){
+    sock=p2p_connect_peer(&peers[i], P2P_GET, &pct1, token, tlen, &decoder, &sret);
+    if (sock==INVALID_SOCKET)
+      continue;
+    sret=psync_p2p_download(sock, decoder, filehashhex, fsize, filename);
+    psync_crypto_aes256_ctr_encoder_decoder_free(decoder);
+    psync_close_socket(sock);
+    break;
+  }
   psync_free(token);
-  goto err_perm2;
-err_perm:
-  for (i=0; i<il->interfacecnt; i++)
-    if (sockets[i]!=INVALID_SOCKET)
-      psync_close_socket(sockets[i]);
-  psync_free(il);
-  psync_free(sockets);
-err_perm2:
-  return PSYNC_NET_PERMFAIL;
-err_temp3:
-  psync_close_socket(sock);
+  return sret;
+}
+
+struct _psync_p2p_range_session_t {
+  psync_list list;
+  psync_socket_t sock;
+  psync_crypto_aes256_ctr_encoder_decoder_t decoder;
+  uint64_t fsize;
+  time_t lastuse;
+  unsigned char checksum[PSYNC_HASH_DIGEST_HEXLEN];
+};
+
+typedef struct {
+  psync_list list;
+  p2p_peer_t peer;
+  time_t expires;
+  int found;
+  unsigned char checksum[PSYNC_HASH_DIGEST_HEXLEN];
+} p2p_peer_cache_t;
+
+#define P2P_PEER_CACHE_NONE    0
+#define P2P_PEER_CACHE_FOUND   1
+#define P2P_PEER_CACHE_PENDING 2
+
+static pthread_mutex_t session_mutex=PTHREAD_MUTEX_INITIALIZER;
+static psync_list idle_sessions=PSYNC_LIST_STATIC_INIT(idle_sessions);
+static psync_list peer_cache=PSYNC_LIST_STATIC_INIT(peer_cache);
+static uint32_t peer_cache_cnt=0;
+static uint32_t fs_discovery_misses=0;
+static time_t fs_discovery_backoff_until=0;
+
+static void p2p_close_session(psync_p2p_range_session_t *sess){
+  psync_crypto_aes256_ctr_encoder_decoder_free(sess->decoder);
+  psync_close_socket(sess->sock);
+  psync_free(sess);
+}
+
+static int p2p_get_checksum_by_hash(uint64_t hash, uint64_t fsize, unsigned char *checksum){
+  psync_sql_res *res;
+  psync_variant_row row;
+  int ret;
+  res=psync_sql_query("SELECT checksum FROM hashchecksum WHERE hash=? AND size=?");
+  psync_sql_bind_uint(res, 1, hash);
+  psync_sql_bind_uint(res, 2, fsize);
+  if ((row=psync_sql_fetch_row(res)) && row[0].type==PSYNC_TSTRING && row[0].length==PSYNC_HASH_DIGEST_HEXLEN){
+    memcpy(checksum, row[0].str, PSYNC_HASH_DIGEST_HEXLEN);
+    ret=0;
+  }
+  else
+    ret=-1;
+  psync_sql_free_result(res);
+  return ret;
+}
+
+/* returns 1 and fills peer if a peer serving the file is known, 0 if it is known that there is none (or a discovery for the file is
+ * already running) and -1 if a check has to be made */
+static int p2p_peer_cache_get_locked(const unsigned char *checksum, p2p_peer_t *peer){
+  p2p_peer_cache_t *pc;
+  psync_list *l1, *l2;
+  time_t now;
+  now=psync_timer_time();
+  psync_list_for_each_safe(l1, l2, &peer_cache){
+    pc=psync_list_element(l1, p2p_peer_cache_t, list);
+    if (pc->expires<now){
+      psync_list_del(&pc->list);
+      psync_free(pc);
+      peer_cache_cnt--;
+    }
+    else if (!memcmp(pc->checksum, checksum, PSYNC_HASH_DIGEST_HEXLEN)){
+      if (pc->found==P2P_PEER_CACHE_FOUND)
+        *peer=pc->peer;
+      return pc->found==P2P_PEER_CACHE_FOUND;
+    }
+  }
+  return -1;
+}
+
+static void p2p_peer_cache_put_locked(const unsigned char *checksum, const p2p_peer_t *peer, int found){
+  p2p_peer_cache_t *pc;
+  psync_list_for_each_element(pc, &peer_cache, p2p_peer_cache_t, list)
+    if (!memcmp(pc->checksum, checksum, PSYNC_HASH_DIGEST_HEXLEN)){
+      psync_list_del(&pc->list);
+      peer_cache_cnt--;
+      psync_free(pc);
+      break;
+    }
+  if (peer_cache_cnt>=PSYNC_P2P_PEER_CACHE_MAX){
+    pc=psync_list_remove_head_element(&peer_cache, p2p_peer_cache_t, list);
+    psync_free(pc);
+    peer_cache_cnt--;
+  }
+  pc=psync_new(p2p_peer_cache_t);
+  memcpy(pc->checksum, checksum, PSYNC_HASH_DIGEST_HEXLEN);
+  pc->found=found;
+  if (found==P2P_PEER_CACHE_FOUND){
+    pc->peer=*peer;
+    pc->expires=psync_timer_time()+PSYNC_P2P_PEER_CACHE_TIME;
+    fs_discovery_misses=0;
+  }
+  else if (found==P2P_PEER_CACHE_NONE){
+    pc->expires=psync_timer_time()+PSYNC_P2P_PEER_CACHE_NEG_TIME;
+    if (++fs_discovery_misses>=PSYNC_P2P_FS_MAX_MISSES){
+      debug(D_NOTICE, "no P2P peers for %u files in a row, not checking for %u seconds", (unsigned)fs_discovery_misses, (unsigned)PSYNC_P2P_FS_NOPEER_BACKOFF);
+      fs_discovery_backoff_until=psync_timer_time()+PSYNC_P2P_FS_NOPEER_BACKOFF;
+      fs_discovery_misses=0;
+    }
+  }
+  else
+    pc->expires=psync_timer_time()+PSYNC_P2P_PEER_CACHE_TIME;
+  psync_list_add_tail(&peer_cache, &pc->list);
+  peer_cache_cnt++;
+}
+
+static void p2p_peer_cache_put(const unsigned char *checksum, const p2p_peer_t *peer){
+  pthread_mutex_lock(&session_mutex);
+  p2p_peer_cache_put_locked(checksum, peer, peer?P2P_PEER_CACHE_FOUND:P2P_PEER_CACHE_NONE);
+  pthread_mutex_unlock(&session_mutex);
+}
+
+typedef struct {
+  psync_fileid_t fileid;
+  uint64_t fsize;
+  unsigned char checksum[PSYNC_HASH_DIGEST_HEXLEN];
+} p2p_discover_req_t;
+
+static void p2p_discover_range_peer_thread(void *ptr){
+  p2p_discover_req_t *dr;
+  p2p_peer_t peers[PSYNC_P2P_MAX_PEERS];
+  packet_check pct;
+  uint32_t peercnt, i;
+  dr=(p2p_discover_req_t *)ptr;
+  debug(D_NOTICE, "looking for a LAN peer with file %lu", (unsigned long)dr->fileid);
+  p2p_make_check_packet(&pct, dr->checksum, dr->fsize);
+  peercnt=0;
+  p2p_discover_peers(dr->checksum, &pct, peers, &peercnt);
+  for (i=0; i<peercnt; i++)
+    if (peers[i].flags&P2P_FLAG_RANGES)
+      break;
+  if (i==peercnt)
+    p2p_peer_cache_put(dr->checksum, NULL);
+  else
+    p2p_peer_cache_put(dr->checksum, &peers[i]);
+  psync_free(dr);
+}
+
+/* Discovery waits up to PSYNC_P2P_INITIAL_TIMEOUT for answers, so it is never done in front of a read. The first request for a file
+ * starts it in the background and goes to the content servers, the answer is cached per file (a pending entry keeps parallel
+ * connections for the same file from broadcasting again) and used by the following requests.
+ */
+psync_p2p_range_session_t *psync_p2p_open_range_session(psync_fileid_t fileid, uint64_t hash, uint64_t fsize){
+  p2p_peer_t peer;
+  packet_check pct;
+  psync_p2p_range_session_t *sess;
+  psync_crypto_aes256_ctr_encoder_decoder_t decoder;
+  p2p_discover_req_t *dr;
+  psync_socket_t sock;
+  unsigned char *token;
+  size_t tlen;
+  int found, err;
+  unsigned char checksum[PSYNC_HASH_DIGEST_HEXLEN];
+  if (fsize<PSYNC_MIN_SIZE_FOR_P2P || !psync_setting_get_bool(_PS(p2psync)) || p2p_get_checksum_by_hash(hash, fsize, checksum))
+    return NULL;
+  pthread_mutex_lock(&session_mutex);
+  psync_list_for_each_element(sess, &idle_sessions, psync_p2p_range_session_t, list)
+    if (!memcmp(sess->checksum, checksum, PSYNC_HASH_DIGEST_HEXLEN)){
+      psync_list_del(&sess->list);
+      pthread_mutex_unlock(&session_mutex);
+      return sess;
+    }
+  found=p2p_peer_cache_get_locked(checksum, &peer);
+  if (found==-1){
+    if (fs_discovery_backoff_until>psync_timer_time()){
+      pthread_mutex_unlock(&session_mutex);
+      return NULL;
+    }
+    p2p_peer_cache_put_locked(checksum, NULL, P2P_PEER_CACHE_PENDING);
+    pthread_mutex_unlock(&session_mutex);
+    dr=psync_new(p2p_discover_req_t);
+    dr->fileid=fileid;
+    dr->fsize=fsize;
+    memcpy(dr->checksum, checksum, PSYNC_HASH_DIGEST_HEXLEN);
+    psync_run_thread1("p2p discover", p2p_discover_range_peer_thread, dr);
+    return NULL;
+  }
+  pthread_mutex_unlock(&session_mutex);
+  if (!found)
+    return NULL;
+  p2p_make_check_packet(&pct, checksum, fsize);
+  if (psync_p2p_check_rsa() || psync_p2p_get_download_token(fileid, checksum, fsize, &token, &tlen)!=PSYNC_NET_OK)
+    return NULL;
+  sock=p2p_connect_peer(&peer, P2P_GET_RANGES, &pct, token, tlen, &decoder, &err);
   psync_free(token);
-err_temp2:
-  return PSYNC_NET_TEMPFAIL;
+  if (sock==INVALID_SOCKET){
+    p2p_peer_cache_put(checksum, NULL);
+    return NULL;
+  }
+  p2p_peer_cache_put(checksum, &peer);
+  sess=psync_new(psync_p2p_range_session_t);
+  sess->sock=sock;
+  sess->decoder=decoder;
+  sess->fsize=fsize;
+  memcpy(sess->checksum, checksum, PSYNC_HASH_DIGEST_HEXLEN);
+  debug(D_NOTICE, "opened P2P range session for file %lu with %s", (unsigned long)fileid, p2p_get_address(&peer.addr));
+  return sess;
+}
+
+int psync_p2p_range_session_request(psync_p2p_range_session_t *sess, uint64_t offset, uint64_t length){
+  packet_range range;
+  if (unlikely_log(!length || offset>sess->fsize || length>sess->fsize-offset))
+    return -1;
+  range.offset=offset;
+  range.length=length;
+  return socket_write_all(sess->sock, &range, sizeof(range));
+}
+
+int psync_p2p_range_session_read(psync_p2p_range_session_t *sess, void *buff, size_t len, uint64_t offset){
+  if (unlikely_log(socket_read_all_deadline(sess->sock, buff, len, psync_timer_time()+PSYNC_P2P_SOCKET_TIMEOUT+len/PSYNC_P2P_MIN_RATE)))
+    return -1;
+  psync_crypto_aes256_ctr_encode_decode_inplace(sess->decoder, buff, len, offset);
+  return 0;
+}
+
+void psync_p2p_release_range_session(psync_p2p_range_session_t *sess, int reusable){
+  if (!reusable){
+    p2p_close_session(sess);
+    return;
+  }
+  sess->lastuse=psync_timer_time();
+  pthread_mutex_lock(&session_mutex);
+  psync_list_add_head(&idle_sessions, &sess->list);
+  pthread_mutex_unlock(&session_mutex);
+}
+
+static void p2p_close_idle_sessions(psync_timer_t timer, void *ptr){
+  psync_p2p_range_session_t *sess;
+  psync_list *l1, *l2;
+  psync_list toclose;
+  time_t old;
+  psync_list_init(&toclose);
+  old=psync_timer_time()-PSYNC_P2P_SESSION_IDLE_TIME;
+  pthread_mutex_lock(&session_mutex);
+  psync_list_for_each_safe(l1, l2, &idle_sessions){
+    sess=psync_list_element(l1, psync_p2p_range_session_t, list);
+    if (sess->lastuse<=old){
+      psync_list_del(&sess->list);
+      psync_list_add_tail(&toclose, &sess->list);
+    }
+  }
+  pthread_mutex_unlock(&session_mutex);
+  psync_list_for_each_element_call(&toclose, psync_p2p_range_session_t, list, p2p_close_session);
 }
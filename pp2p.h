@@ -30,8 +30,21 @@
 
 #include "psynclib.h"
 
+typedef struct _psync_p2p_range_session_t psync_p2p_range_session_t;
+
 void psync_p2p_init();
 void psync_p2p_change();
 int psync_p2p_check_download(psync_fileid_t fileid, const unsigned char *filehashhex, uint64_t fsize, const char *filename);
 
+/* LAN-first access to parts of a file that is identified by its server hash and size. Open returns NULL if no peer on the LAN has
+ * the file (answers are cached), it is not yet known (discovery is then started in the background and does not delay the caller)
+ * or p2p is disabled. Any number of requests may be sent before reading the data, ranges are returned
+ * in order of requests and reads have to consume exactly the requested bytes. Release with reusable set only if all requested
+ * data was read, the session is then kept open for a while for further requests for the same file.
+ */
+psync_p2p_range_session_t *psync_p2p_open_range_session(psync_fileid_t fileid, uint64_t hash, uint64_t fsize);
+int psync_p2p_range_session_request(psync_p2p_range_session_t *sess, uint64_t offset, uint64_t length);
+int psync_p2p_range_session_read(psync_p2p_range_session_t *sess, void *buff, size_t len, uint64_t offset);
+void psync_p2p_release_range_session(psync_p2p_range_session_t *sess, int reusable);
+
 #endif
\ No newline at end of file
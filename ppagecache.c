@@ -32,13 +32,13 @@
 #include "pnetlibs.h"
 #include "pstatus.h"
 #include "pcache.h"
+#include "pp2p.h"
+#include "pmem.h"
+#include "pmetrics.h"
 #include <errno.h>
 #include <string.h>
 #include <stdio.h>
 
-#define CACHE_PAGES (PSYNC_FS_MEMORY_CACHE/PSYNC_FS_PAGE_SIZE)
-#define CACHE_HASH (CACHE_PAGES/2)
-
 #define PAGE_WAITER_HASH 1024
 #define PAGE_WAITER_MUTEXES 16
 
@@ -46,11 +46,16 @@
 
 #define PAGE_TYPE_FREE 0
 #define PAGE_TYPE_READ 1
+/* pages received from a LAN peer can not be verified, they are only kept in memory to serve reads and are dropped instead of
+ * flushed to the cache file; they are never used to build file contents that get uploaded */
+#define PAGE_TYPE_READ_P2P 2
+
+#define page_type_is_readable(type) ((type)==PAGE_TYPE_READ || (type)==PAGE_TYPE_READ_P2P)
 
 #define PAGE_TASK_TYPE_CREAT  0
 #define PAGE_TASK_TYPE_MODIFY 1
 
-#define pagehash_by_hash_and_pageid(hash, pageid) (((hash)+(pageid))%CACHE_HASH)
+#define pagehash_by_hash_and_pageid(hash, pageid) (((hash)+(pageid))%cache_hash_size)
 #define waiterhash_by_hash_and_pageid(hash, pageid) (((hash)+(pageid))%PAGE_WAITER_HASH)
 #define waiter_mutex_by_hash(hash) (hash%PAGE_WAITER_MUTEXES)
 #define lock_wait(hash) pthread_mutex_lock(&wait_page_mutexes[waiter_mutex_by_hash(hash)])
@@ -122,13 +127,17 @@ typedef struct {
   uint32_t status;
 } psync_urls_t;
 
-static psync_list cache_hash[CACHE_HASH];
+static psync_list *cache_hash;
+static uint32_t cache_pages;
+static uint32_t cache_hash_size;
 static uint32_t cache_pages_in_hash=0;
 static uint32_t cache_pages_free;
 static psync_list free_pages;
 static psync_list wait_page_hash[PAGE_WAITER_HASH];
 static char *pages_base;
 
+PSYNC_SLAB(range_slab, psync_request_range_t);
+
 static psync_cachepage_to_update cachepages_to_update[DB_CACHE_UPDATE_HASH];
 static uint32_t cachepages_to_update_cnt=0;
 static uint32_t free_db_pages;
@@ -137,6 +146,7 @@ static pthread_mutex_t clean_cache_mutex=PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t clean_cache_cond=PTHREAD_COND_INITIALIZER;
 static pthread_mutex_t cache_mutex=PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t flush_cache_mutex=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t flush_cond=PTHREAD_COND_INITIALIZER;
 static pthread_mutex_t url_cache_mutex=PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t url_cache_cond=PTHREAD_COND_INITIALIZER;
 static pthread_mutex_t wait_page_mutexes[PAGE_WAITER_MUTEXES];
@@ -153,21 +163,60 @@ static uint64_t db_cache_max_page;
 
 static psync_file_t readcache=INVALID_HANDLE_VALUE;
 
+/* secondary cache is a ring of pages in a (large, possibly slow) file, id in pagecachesecondary is an ever increasing sequence
+ * number and the page lives at slot id%secondary_cache_pages, so writing the next page overwrites the oldest one
+ */
+static pthread_mutex_t secondary_cache_mutex=PTHREAD_MUTEX_INITIALIZER;
+static psync_file_t secondarycache=INVALID_HANDLE_VALUE;
+static char *secondary_cache_dir=NULL;
+static uint64_t secondary_cache_pages=0;
+static uint64_t secondary_cache_seq;
+static int pagecache_inited=0;
+
+PSYNC_METRIC_COUNTER(metric_memhits, "pagecache_memory_hits");
+PSYNC_METRIC_COUNTER(metric_diskhits, "pagecache_disk_hits");
+PSYNC_METRIC_COUNTER(metric_secondaryhits, "pagecache_secondary_hits");
+PSYNC_METRIC_COUNTER(metric_misses, "pagecache_misses");
+PSYNC_METRIC_COUNTER(metric_promoted, "pagecache_promoted");
+PSYNC_METRIC_COUNTER(metric_demoted, "pagecache_demoted");
+
 static psync_tree *url_cache_tree=PSYNC_TREE_EMPTY;
 
+PSYNC_SQL_STMT(stmt_pages_in_range, "SELECT pageid, id FROM pagecache WHERE type=+"NTO_STR(PAGE_TYPE_READ)" AND hash=? AND pageid>=? AND pageid<? ORDER BY pageid");
+PSYNC_SQL_STMT(stmt_page_exists, "SELECT pageid FROM pagecache WHERE type=+"NTO_STR(PAGE_TYPE_READ)" AND hash=? AND pageid=?");
+PSYNC_SQL_STMT(stmt_page_by_hash, "SELECT id, size FROM pagecache WHERE type="NTO_STR(PAGE_TYPE_READ)" AND hash=? AND pageid=?");
+PSYNC_SQL_STMT(stmt_page_secondary_by_hash, "SELECT id, size, usecnt FROM pagecachesecondary WHERE hash=? AND pageid=?");
+PSYNC_SQL_STMT(stmt_pages_secondary_in_range, "SELECT pageid FROM pagecachesecondary WHERE hash=? AND pageid>=? AND pageid<?");
+PSYNC_SQL_STMT(stmt_pages_size_in_range, "SELECT pageid, id, size FROM pagecache WHERE type=+"NTO_STR(PAGE_TYPE_READ)" AND hash=? AND pageid>=? AND pageid<? ORDER BY pageid");
+PSYNC_SQL_STMT(stmt_page_set_used, "UPDATE pagecache SET lastuse=?, usecnt=usecnt+? WHERE id=?");
+
 static int flush_pages(int nosleep);
 
-static void flush_pages_noret(){
-  flush_pages(0);
+static void psync_pagecache_wake_flusher_locked(){
+  if (!flushchacherun){
+    flushchacherun=1;
+    pthread_cond_signal(&flush_cond);
+  }
+}
+
+static void psync_pagecache_flush_thread(){
+  pthread_mutex_lock(&cache_mutex);
+  while (1){
+    while (!flushchacherun)
+      pthread_cond_wait(&flush_cond, &cache_mutex);
+    flushchacherun=0;
+    pthread_mutex_unlock(&cache_mutex);
+    if (flush_pages(0))
+      psync_milisleep(1000);
+    pthread_mutex_lock(&cache_mutex);
+  }
 }
 
 static psync_cache_page_t *psync_pagecache_get_free_page(){
   psync_cache_page_t *page;
   pthread_mutex_lock(&cache_mutex);
-  if (cache_pages_free<=CACHE_PAGES*10/100 && !flushchacherun){
-    psync_run_thread("flush pages get free page", flush_pages_noret);
-    flushchacherun=1;
-  }
+  if (cache_pages_free<=cache_pages*PSYNC_FS_FLUSH_START_FREE_PERCENT/100)
+    psync_pagecache_wake_flusher_locked();
   if (likely(!psync_list_isempty(&free_pages)))
     page=psync_list_remove_head_element(&free_pages, psync_cache_page_t, list);
   else{
@@ -232,6 +281,10 @@ static void psync_pagecache_return_free_page(psync_cache_page_t *page){
   pthread_mutex_unlock(&cache_mutex);
 }
 
+static void psync_pagecache_free_range(psync_request_range_t *range){
+  psync_slab_free(&range_slab, range);
+}
+
 static int psync_pagecache_read_range_from_api(psync_request_t *request, psync_request_range_t *range, psync_socket *api){
   uint64_t first_page_id, dlen;
   psync_page_wait_t *pw;
@@ -455,7 +508,7 @@ static int get_urls(psync_request_t *request, psync_urls_t *urls){
       }
       psync_list_del(l1);
       debug(D_NOTICE, "request for offset %lu, size %lu read from API", (unsigned long)range->offset, (unsigned long)range->length);
-      psync_free(range);
+      psync_pagecache_free_range(range);
     }
     if (pass_shared_api(api))
       psync_apipool_release(api);
@@ -584,7 +637,7 @@ static int has_page_in_cache_by_hash(uint64_t hash, uint64_t pageid){
   h=pagehash_by_hash_and_pageid(hash, pageid);
   pthread_mutex_lock(&cache_mutex);
   psync_list_for_each_element(page, &cache_hash[h], psync_cache_page_t, list)
-    if (page->type==PAGE_TYPE_READ && page->hash==hash && page->pageid==pageid){
+    if (page_type_is_readable(page->type) && page->hash==hash && page->pageid==pageid){
       pthread_mutex_unlock(&cache_mutex);
       return 1;
     }
@@ -592,6 +645,15 @@ static int has_page_in_cache_by_hash(uint64_t hash, uint64_t pageid){
   return 0;
 }
 
+static int secondary_cache_enabled(){
+  int ret;
+  pthread_mutex_lock(&secondary_cache_mutex);
+  ret=secondarycache!=INVALID_HANDLE_VALUE;
+  pthread_mutex_unlock(&secondary_cache_mutex);
+  return ret;
+}
+
+/* marks pages that are in the main cache file or in the secondary cache */
 static unsigned char *has_pages_in_db(uint64_t hash, uint64_t pageid, uint32_t pagecnt, int readahead){
   psync_sql_res *res;
   psync_uint_row row;
@@ -602,7 +664,7 @@ static unsigned char *has_pages_in_db(uint64_t hash, uint64_t pageid, uint32_t p
   memset(ret, 0, pagecnt);
   fromid=0;
   fcnt=0;
-  res=psync_sql_query("SELECT pageid, id FROM pagecache WHERE type=+"NTO_STR(PAGE_TYPE_READ)" AND hash=? AND pageid>=? AND pageid<? ORDER BY pageid");
+  res=psync_sql_query_stmt(&stmt_pages_in_range);
   psync_sql_bind_uint(res, 1, hash);
   psync_sql_bind_uint(res, 2, pageid);
   psync_sql_bind_uint(res, 3, pageid+pagecnt);
@@ -620,13 +682,22 @@ static unsigned char *has_pages_in_db(uint64_t hash, uint64_t pageid, uint32_t p
   psync_sql_free_result(res);
   if (fcnt && readahead)
     psync_file_readahead(readcache, fromid*PSYNC_FS_PAGE_SIZE, fcnt*PSYNC_FS_PAGE_SIZE);
+  if (secondary_cache_enabled()){
+    res=psync_sql_query_stmt(&stmt_pages_secondary_in_range);
+    psync_sql_bind_uint(res, 1, hash);
+    psync_sql_bind_uint(res, 2, pageid);
+    psync_sql_bind_uint(res, 3, pageid+pagecnt);
+    while ((row=psync_sql_fetch_rowint(res)))
+      ret[row[0]-pageid]=1;
+    psync_sql_free_result(res);
+  }
   return ret;
 }
 
 static int has_page_in_db(uint64_t hash, uint64_t pageid){
   psync_sql_res *res;
   psync_uint_row row;
-  res=psync_sql_query("SELECT pageid FROM pagecache WHERE type=+"NTO_STR(PAGE_TYPE_READ)" AND hash=? AND pageid=?");
+  res=psync_sql_query_stmt(&stmt_page_exists);
   psync_sql_bind_uint(res, 1, hash);
   psync_sql_bind_uint(res, 2, pageid);
   row=psync_sql_fetch_rowint(res);
@@ -634,7 +705,7 @@ static int has_page_in_db(uint64_t hash, uint64_t pageid){
   return row!=NULL;
 }
 
-static psync_int_t check_page_in_memory_by_hash(uint64_t hash, uint64_t pageid, char *buff, psync_uint_t size, psync_uint_t off){
+static psync_int_t check_page_in_memory_by_hash(uint64_t hash, uint64_t pageid, char *buff, psync_uint_t size, psync_uint_t off, int allowp2p){
   psync_cache_page_t *page;
   psync_uint_t h;
   psync_int_t ret;
@@ -643,12 +714,13 @@ static psync_int_t check_page_in_memory_by_hash(uint64_t hash, uint64_t pageid,
   h=pagehash_by_hash_and_pageid(hash, pageid);
   pthread_mutex_lock(&cache_mutex);
   psync_list_for_each_element(page, &cache_hash[h], psync_cache_page_t, list)
-    if (page->type==PAGE_TYPE_READ && page->hash==hash && page->pageid==pageid){
+    if ((page->type==PAGE_TYPE_READ || (allowp2p && page->type==PAGE_TYPE_READ_P2P)) && page->hash==hash && page->pageid==pageid){
       tm=psync_timer_time();
       if (tm>page->lastuse+5){
         page->usecnt++;
         page->lastuse=tm;
       }
+      psync_metric_inc(&metric_memhits);
       if (size+off>page->size){
         if (off>page->size)
           size=0;
@@ -739,6 +811,99 @@ static int pagecache_entry_cmp_usecnt_lastuse16(const void *p1, const void *p2){
     return (int)((int64_t)e1->lastuse-(int64_t)e2->lastuse);
 }
 
+typedef struct {
+  uint64_t hash;
+  uint64_t pageid;
+  time_t lastuse;
+  uint32_t size;
+} pagecache_demoted_page;
+
+/* Copies pages that clean_cache() is about to drop from the main cache to the secondary one. Only slots that are still of type
+ * PAGE_TYPE_READ are copied and as the flusher only writes to free slots, their content can not change under us.
+ */
+static void demote_pages_to_secondary(const pagecache_entry *entries, psync_uint_t cnt){
+  psync_iovec_t iov[PSYNC_FS_FLUSH_MAX_IOV];
+  psync_sql_res *res;
+  psync_uint_row row;
+  pagecache_demoted_page *pages;
+  char *buff;
+  uint64_t first, slot;
+  psync_uint_t i, j, n, wcnt;
+  int enabled;
+  pthread_mutex_lock(&secondary_cache_mutex);
+  enabled=secondarycache!=INVALID_HANDLE_VALUE;
+  pthread_mutex_unlock(&secondary_cache_mutex);
+  if (!enabled)
+    return;
+  pages=psync_new_cnt(pagecache_demoted_page, cnt);
+  buff=(char *)psync_malloc(cnt*PSYNC_FS_PAGE_SIZE);
+  res=psync_sql_query("SELECT hash, pageid, lastuse, size FROM pagecache WHERE id=? AND type="NTO_STR(PAGE_TYPE_READ));
+  n=0;
+  for (i=0; i<cnt; i++){
+    psync_sql_bind_uint(res, 1, entries[i].id);
+    if ((row=psync_sql_fetch_rowint(res))){
+      pages[n].hash=row[0];
+      pages[n].pageid=row[1];
+      pages[n].lastuse=row[2];
+      pages[n].size=row[3];
+    }
+    psync_sql_reset(res);
+    if (row && psync_file_pread(readcache, buff+n*PSYNC_FS_PAGE_SIZE, pages[n].size, (uint64_t)entries[i].id*PSYNC_FS_PAGE_SIZE)==pages[n].size)
+      n++;
+  }
+  psync_sql_free_result(res);
+  psync_sql_lock();
+  pthread_mutex_lock(&secondary_cache_mutex);
+  if (n && secondarycache!=INVALID_HANDLE_VALUE){
+    first=secondary_cache_seq;
+    secondary_cache_seq+=n;
+    if (secondary_cache_seq>secondary_cache_pages){
+      res=psync_sql_prep_statement("DELETE FROM pagecachesecondary WHERE id<?");
+      psync_sql_bind_uint(res, 1, secondary_cache_seq-secondary_cache_pages);
+      psync_sql_run_free(res);
+    }
+    for (i=0; i<n; i+=wcnt){
+      slot=(first+i)%secondary_cache_pages;
+      wcnt=n-i;
+      if (wcnt>secondary_cache_pages-slot)
+        wcnt=secondary_cache_pages-slot;
+      if (wcnt>PSYNC_FS_FLUSH_MAX_IOV)
+        wcnt=PSYNC_FS_FLUSH_MAX_IOV;
+      for (j=0; j<wcnt; j++){
+        iov[j].iov_base=buff+(i+j)*PSYNC_FS_PAGE_SIZE;
+        iov[j].iov_len=PSYNC_FS_PAGE_SIZE;
+      }
+      if (unlikely(psync_file_pwritev(secondarycache, iov, wcnt, slot*PSYNC_FS_PAGE_SIZE)!=wcnt*PSYNC_FS_PAGE_SIZE)){
+        debug(D_ERROR, "write to secondary cache file failed");
+        break;
+      }
+    }
+    n=i;
+    psync_sql_start_transaction();
+    res=psync_sql_prep_statement("REPLACE INTO pagecachesecondary (id, hash, pageid, lastuse, usecnt, size) VALUES (?, ?, ?, ?, 0, ?)");
+    for (i=0; i<n; i++){
+      psync_sql_bind_uint(res, 1, first+i);
+      psync_sql_bind_uint(res, 2, pages[i].hash);
+      psync_sql_bind_uint(res, 3, pages[i].pageid);
+      psync_sql_bind_uint(res, 4, pages[i].lastuse);
+      psync_sql_bind_uint(res, 5, pages[i].size);
+      psync_sql_run(res);
+    }
+    psync_sql_free_result(res);
+    psync_sql_commit_transaction();
+  }
+  else
+    n=0;
+  pthread_mutex_unlock(&secondary_cache_mutex);
+  psync_sql_unlock();
+  psync_free(buff);
+  psync_free(pages);
+  if (n){
+    psync_metric_add(&metric_demoted, n);
+    debug(D_NOTICE, "demoted %u pages to secondary cache", (unsigned)n);
+  }
+}
+
 /* sum should be around 90-95 percent, so after a run cache get smaller */
 #define PSYNC_FS_CACHE_LRU_PERCENT 40
 #define PSYNC_FS_CACHE_LRU2_PERCENT 25
@@ -807,6 +972,7 @@ static void clean_cache(){
     e=i+256;
     if (e>cnt)
       e=cnt;
+    demote_pages_to_secondary(entries+i, e-i);
     psync_sql_start_transaction();
     res=psync_sql_prep_statement("UPDATE pagecache SET type="NTO_STR(PAGE_TYPE_FREE)", hash=NULL, pageid=NULL WHERE id=?");
     for (; i<e; i++){
@@ -881,13 +1047,27 @@ static int check_disk_full(){
   return 1;
 }
 
+/* Pages to flush are sorted by hash and pageid and get free database pages in increasing order, so most of them end up in runs of
+ * consecutive cache file pages that are written with a single pwritev.
+ */
+static int flush_pages_write_run(psync_iovec_t *iov, psync_uint_t cnt, uint64_t firstpageid){
+  if (unlikely(psync_file_pwritev(readcache, iov, cnt, firstpageid*PSYNC_FS_PAGE_SIZE)!=cnt*PSYNC_FS_PAGE_SIZE)){
+    debug(D_ERROR, "write to cache file failed");
+    return -1;
+  }
+  else
+    return 0;
+}
+
 static int flush_pages(int nosleep){
   static time_t lastflush=0;
+  psync_iovec_t iov[PSYNC_FS_FLUSH_MAX_IOV];
   psync_sql_res *res;
   psync_uint_row row;
   psync_cache_page_t *page;
-  psync_list pages_to_flush;
-  psync_uint_t i, updates, pagecnt;
+  psync_list pages_to_flush, pages_to_drop;
+  uint64_t firstpageid;
+  psync_uint_t i, updates, pagecnt, iovcnt, runs;
   time_t ctime;
   uint32_t cpih;
   int ret, diskfull;
@@ -901,9 +1081,9 @@ static int flush_pages(int nosleep){
   pthread_mutex_lock(&cache_mutex);
   if (diskfull && psync_list_isempty(&free_pages) && free_db_pages==0){
     debug(D_NOTICE, "disk is full, discarding some pages");
-    for (i=0; i<CACHE_HASH; i++)
+    for (i=0; i<cache_hash_size; i++)
       psync_list_for_each_element(page, &cache_hash[i], psync_cache_page_t, list)
-        if (page->type==PAGE_TYPE_READ)
+        if (page_type_is_readable(page->type))
           psync_list_add_tail(&pages_to_flush, &page->flushlist);
     pthread_mutex_unlock(&cache_mutex);
     psync_list_sort(&pages_to_flush, cmp_discard_pages);
@@ -913,7 +1093,7 @@ static int flush_pages(int nosleep){
       psync_list_del(&page->list);
       psync_list_add_head(&free_pages, &page->list);
       cache_pages_in_hash--;
-      if (++i>=CACHE_PAGES/2)
+      if (++i>=cache_pages/2)
         break;
     }
     debug(D_NOTICE, "discarded %u pages", (unsigned)i);
@@ -921,12 +1101,19 @@ static int flush_pages(int nosleep){
   }
   if (cache_pages_in_hash){
     debug(D_NOTICE, "flushing cache");
-    for (i=0; i<CACHE_HASH; i++)
+    psync_list_init(&pages_to_drop);
+    for (i=0; i<cache_hash_size; i++)
       psync_list_for_each_element(page, &cache_hash[i], psync_cache_page_t, list)
         if (page->type==PAGE_TYPE_READ){
           psync_list_add_tail(&pages_to_flush, &page->flushlist);
           pagecnt++;
         }
+        else if (page->type==PAGE_TYPE_READ_P2P)
+          psync_list_add_tail(&pages_to_drop, &page->flushlist);
+    psync_list_for_each_element(page, &pages_to_drop, psync_cache_page_t, flushlist){
+      psync_list_del(&page->list);
+      psync_pagecache_return_free_page_locked(page);
+    }
     cache_pages_in_hash=pagecnt;
     pthread_mutex_unlock(&cache_mutex);
     debug(D_NOTICE, "cache_pages_in_hash=%u", (unsigned)pagecnt);
@@ -948,7 +1135,7 @@ static int flush_pages(int nosleep){
     }
     psync_sql_free_result(res);
 /*    res=psync_sql_query("SELECT id FROM pagecache WHERE type="NTO_STR(PAGE_TYPE_FREE)" ORDER BY id");
-    for (i=0; i<CACHE_HASH; i++)
+    for (i=0; i<cache_hash_size; i++)
       psync_list_for_each_element(page, &cache_hash[i], psync_cache_page_t, list)
         if (page->type==PAGE_TYPE_READ){
           if (!(row=psync_sql_fetch_rowint(res)))
@@ -960,20 +1147,38 @@ break2:
     psync_sql_free_result(res);
     pthread_mutex_unlock(&cache_mutex);*/
     i=0;
+    runs=0;
+    iovcnt=0;
+    firstpageid=0;
     psync_list_for_each_element(page, &pages_to_flush, psync_cache_page_t, flushlist){
-      if (psync_file_pwrite(readcache, page->page, PSYNC_FS_PAGE_SIZE, (uint64_t)page->flushpageid*PSYNC_FS_PAGE_SIZE)!=PSYNC_FS_PAGE_SIZE){
-        debug(D_ERROR, "write to cache file failed");
+      if (iovcnt && (iovcnt==PSYNC_FS_FLUSH_MAX_IOV || page->flushpageid!=firstpageid+iovcnt)){
+        if (flush_pages_write_run(iov, iovcnt, firstpageid)){
+          pthread_mutex_unlock(&flush_cache_mutex);
+          return -1;
+        }
+        runs++;
+        iovcnt=0;
+      }
+      if (!iovcnt)
+        firstpageid=page->flushpageid;
+      iov[iovcnt].iov_base=page->page;
+      iov[iovcnt].iov_len=PSYNC_FS_PAGE_SIZE;
+      iovcnt++;
+      i++;
+    }
+    if (iovcnt){
+      if (flush_pages_write_run(iov, iovcnt, firstpageid)){
         pthread_mutex_unlock(&flush_cache_mutex);
         return -1;
       }
-      i++;
+      runs++;
     }
-    debug(D_NOTICE, "cache data of %u pages written", (unsigned)i);
+    debug(D_NOTICE, "cache data of %u pages written in %u runs", (unsigned)i, (unsigned)runs);
     /* if we can afford it, wait a while before calling fsync() as at least on Linux this blocks reads from the same file until it returns */
     if (!nosleep){
       i=0;
       pthread_mutex_lock(&cache_mutex);
-      while (cache_pages_free>=CACHE_PAGES*5/100 && i++<200){
+      while (cache_pages_free>=cache_pages*PSYNC_FS_FLUSH_URGENT_FREE_PERCENT/100 && i++<200){
         pthread_mutex_unlock(&cache_mutex);
         psync_milisleep(10);
         pthread_mutex_lock(&cache_mutex);
@@ -992,7 +1197,7 @@ break2:
   if (db_cache_max_page<db_cache_in_pages && cache_pages_in_hash && !diskfull){
     i=0;
     res=psync_sql_prep_statement("INSERT INTO pagecache (type) VALUES ("NTO_STR(PAGE_TYPE_FREE)")");
-    while (db_cache_max_page+i<db_cache_in_pages && i<CACHE_PAGES && i<cache_pages_in_hash){
+    while (db_cache_max_page+i<db_cache_in_pages && i<cache_pages && i<cache_pages_in_hash){
       psync_sql_run(res);
       i++;
     }
@@ -1023,7 +1228,7 @@ break2:
         free_db_pages--;
       }
       psync_list_add_head(&free_pages, &page->list);
-      if (updates%64==0){
+      if (updates%PSYNC_FS_FLUSH_DB_BATCH==0){
         psync_sql_free_result(res);
         psync_sql_commit_transaction();
         pthread_mutex_unlock(&cache_mutex);
@@ -1039,7 +1244,7 @@ break2:
     cache_pages_in_hash-=pagecnt;
   }
   if (cachepages_to_update_cnt && (cpih || cachepages_to_update_cnt>=DB_CACHE_UPDATE_HASH/4 || lastflush+300<ctime)){
-    res=psync_sql_prep_statement("UPDATE pagecache SET lastuse=?, usecnt=usecnt+? WHERE id=?");
+    res=psync_sql_prep_stmt(&stmt_page_set_used);
     for (i=0; i<DB_CACHE_UPDATE_HASH; i++)
       if (cachepages_to_update[i].pagecacheid){
         psync_sql_bind_uint(res, 1, cachepages_to_update[i].lastuse);
@@ -1048,14 +1253,14 @@ break2:
         psync_sql_run(res);
         memset(&cachepages_to_update[i], 0, sizeof(psync_cachepage_to_update));
         updates++;
-        if (updates%128==0){
+        if (updates%PSYNC_FS_FLUSH_DB_BATCH==0){
           psync_sql_free_result(res);
           psync_sql_commit_transaction();
           pthread_mutex_unlock(&cache_mutex);
           psync_milisleep(1);
           pthread_mutex_lock(&cache_mutex);
           psync_sql_start_transaction();
-          res=psync_sql_prep_statement("UPDATE pagecache SET lastuse=?, usecnt=usecnt+? WHERE id=?");
+          res=psync_sql_prep_stmt(&stmt_page_set_used);
         }
       }
     psync_sql_free_result(res);
@@ -1063,12 +1268,11 @@ break2:
     cachepages_to_update_cnt=0;
     lastflush=ctime;
   }
-  flushchacherun=0;
   if (updates){
     ret=psync_sql_commit_transaction();
     pthread_mutex_unlock(&cache_mutex);
     pthread_mutex_unlock(&flush_cache_mutex);
-    if (free_db_pages<=CACHE_PAGES*2)
+    if (free_db_pages<=cache_pages*2)
       psync_run_thread("clean cache", clean_cache);
     return ret;
   }
@@ -1088,8 +1292,11 @@ int psync_pagecache_flush(){
 }
 
 static void psync_pagecache_flush_timer(psync_timer_t timer, void *ptr){
-  if (!flushedbetweentimers && (cache_pages_in_hash || cachepages_to_update_cnt))
-    psync_run_thread("flush pages timer", flush_pages_noret);
+  if (!flushedbetweentimers && (cache_pages_in_hash || cachepages_to_update_cnt)){
+    pthread_mutex_lock(&cache_mutex);
+    psync_pagecache_wake_flusher_locked();
+    pthread_mutex_unlock(&cache_mutex);
+  }
   flushedbetweentimers=0;
 }
 
@@ -1101,6 +1308,7 @@ static void mark_pagecache_used(uint64_t pagecacheid){
   h=pagecacheid%DB_CACHE_UPDATE_HASH;
   tm=psync_timer_time();
   pthread_mutex_lock(&cache_mutex);
+  psync_metric_inc(&metric_diskhits);
   while (1){
     if (cachepages_to_update[h].pagecacheid==0){
       cachepages_to_update[h].pagecacheid=pagecacheid;
@@ -1130,7 +1338,7 @@ static psync_int_t check_page_in_database_by_hash(uint64_t hash, uint64_t pageid
   psync_int_t ret;
   uint64_t pagecacheid;
   ret=-1;
-  res=psync_sql_query("SELECT id, size FROM pagecache WHERE type="NTO_STR(PAGE_TYPE_READ)" AND hash=? AND pageid=?");
+  res=psync_sql_query_stmt(&stmt_page_by_hash);
   psync_sql_bind_uint(res, 1, hash);
   psync_sql_bind_uint(res, 2, pageid);
   if ((row=psync_sql_fetch_row(res))){
@@ -1161,12 +1369,279 @@ static psync_int_t check_page_in_database_by_hash(uint64_t hash, uint64_t pageid
   return ret;
 }
 
+/* Pages in the secondary cache that got PSYNC_FS_SECONDARY_PROMOTE_USECNT hits since they were demoted are moved back to the memory
+ * cache, from where the flusher writes them to the main cache file.
+ */
+static psync_int_t check_page_in_secondary_by_hash(uint64_t hash, uint64_t pageid, char *buff, psync_uint_t size, psync_uint_t off){
+  psync_sql_res *res;
+  psync_uint_row row;
+  psync_cache_page_t *page;
+  char *pbuff;
+  uint64_t seq, foff;
+  size_t dsize;
+  ssize_t readret;
+  psync_int_t ret;
+  uint32_t usecnt;
+  psync_sql_lock();
+  pthread_mutex_lock(&secondary_cache_mutex);
+  if (secondarycache==INVALID_HANDLE_VALUE){
+    pthread_mutex_unlock(&secondary_cache_mutex);
+    psync_sql_unlock();
+    return -1;
+  }
+  res=psync_sql_query_stmt(&stmt_page_secondary_by_hash);
+  psync_sql_bind_uint(res, 1, hash);
+  psync_sql_bind_uint(res, 2, pageid);
+  if ((row=psync_sql_fetch_rowint(res))){
+    seq=row[0];
+    dsize=row[1];
+    usecnt=row[2];
+  }
+  psync_sql_free_result(res);
+  if (!row){
+    pthread_mutex_unlock(&secondary_cache_mutex);
+    psync_sql_unlock();
+    return -1;
+  }
+  if (size+off>dsize){
+    if (off>dsize)
+      size=0;
+    else
+      size=dsize-off;
+  }
+  foff=(seq%secondary_cache_pages)*PSYNC_FS_PAGE_SIZE;
+  pbuff=NULL;
+  ret=-1;
+  if (usecnt+1>=PSYNC_FS_SECONDARY_PROMOTE_USECNT){
+    /* psync_pagecache_get_free_page() may flush, which takes the locks we hold, so the page is read into a temporary buffer and
+     * moved to a cache page once they are released */
+    pbuff=(char *)psync_malloc(PSYNC_FS_PAGE_SIZE);
+    readret=psync_file_pread(secondarycache, pbuff, dsize, foff);
+    if (readret==dsize){
+      memcpy(buff, pbuff+off, size);
+      ret=size;
+    }
+    else{
+      psync_free(pbuff);
+      pbuff=NULL;
+    }
+    res=psync_sql_prep_statement("DELETE FROM pagecachesecondary WHERE id=?");
+    psync_sql_bind_uint(res, 1, seq);
+    psync_sql_run_free(res);
+  }
+  else{
+    readret=psync_file_pread(secondarycache, buff, size, foff+off);
+    if (readret==size){
+      res=psync_sql_prep_statement("UPDATE pagecachesecondary SET usecnt=usecnt+1, lastuse=? WHERE id=?");
+      psync_sql_bind_uint(res, 1, psync_timer_time());
+      psync_sql_bind_uint(res, 2, seq);
+      psync_sql_run_free(res);
+      ret=size;
+    }
+    else{
+      res=psync_sql_prep_statement("DELETE FROM pagecachesecondary WHERE id=?");
+      psync_sql_bind_uint(res, 1, seq);
+      psync_sql_run_free(res);
+    }
+  }
+  pthread_mutex_unlock(&secondary_cache_mutex);
+  psync_sql_unlock();
+  if (ret==-1){
+    debug(D_ERROR, "failed to read page from secondary cache file at offset %lu, read returned %ld, errno=%ld",
+          (unsigned long)foff, (long)readret, (long)psync_fs_err());
+    return -1;
+  }
+  if (pbuff){
+    page=psync_pagecache_get_free_page();
+    memcpy(page->page, pbuff, dsize);
+    psync_free(pbuff);
+  }
+  else
+    page=NULL;
+  pthread_mutex_lock(&cache_mutex);
+  psync_metric_inc(&metric_secondaryhits);
+  if (page){
+    page->hash=hash;
+    page->pageid=pageid;
+    page->lastuse=psync_timer_time();
+    page->size=dsize;
+    page->usecnt=usecnt+1;
+    page->type=PAGE_TYPE_READ;
+    psync_list_add_tail(&cache_hash[pagehash_by_hash_and_pageid(hash, pageid)], &page->list);
+    cache_pages_in_hash++;
+    psync_metric_inc(&metric_promoted);
+  }
+  pthread_mutex_unlock(&cache_mutex);
+  return ret;
+}
+
+typedef struct {
+  uint64_t pageid;
+  uint64_t pagecacheid;
+  uint32_t size;
+} pagecache_db_page;
+
+static pagecache_db_page *get_pages_in_db_by_hash(uint64_t hash, uint64_t first_page_id, psync_uint_t pagecnt, psync_uint_t *cnt){
+  psync_sql_res *res;
+  psync_uint_row row;
+  pagecache_db_page *pages;
+  psync_uint_t c;
+  pages=psync_new_cnt(pagecache_db_page, pagecnt);
+  c=0;
+  res=psync_sql_query_stmt(&stmt_pages_size_in_range);
+  psync_sql_bind_uint(res, 1, hash);
+  psync_sql_bind_uint(res, 2, first_page_id);
+  psync_sql_bind_uint(res, 3, first_page_id+pagecnt);
+  while ((row=psync_sql_fetch_rowint(res)) && c<pagecnt){
+    pages[c].pageid=row[0];
+    pages[c].pagecacheid=row[1];
+    pages[c].size=row[2];
+    c++;
+  }
+  psync_sql_free_result(res);
+  *cnt=c;
+  return pages;
+}
+
+/* Pages i..*end-1 of the array form a run that is continuous both in the file and in the cache file, only the last one may be short.
+ * Returns the number of bytes of the span [pageoff, pageoff+size) that the run covers and stores the size of every page in psizes
+ * (indexed by page number in the span) if it is not NULL.
+ */
+static uint64_t get_db_pages_run(pagecache_db_page *pages, psync_uint_t i, psync_uint_t cnt, psync_uint_t *end, uint64_t first_page_id,
+                                 psync_uint_t pageoff, uint64_t size, psync_int_t *psizes){
+  psync_uint_t j, idx, copyoff, copysize;
+  uint64_t rsize;
+  for (j=i+1; j<cnt; j++)
+    if (pages[j].pageid!=pages[j-1].pageid+1 || pages[j].pagecacheid!=pages[j-1].pagecacheid+1 || pages[j-1].size!=PSYNC_FS_PAGE_SIZE)
+      break;
+  *end=j;
+  rsize=0;
+  for (; i<j; i++){
+    idx=pages[i].pageid-first_page_id;
+    copyoff=idx?0:pageoff;
+    copysize=size+pageoff-idx*PSYNC_FS_PAGE_SIZE-copyoff;
+    if (copysize>PSYNC_FS_PAGE_SIZE-copyoff)
+      copysize=PSYNC_FS_PAGE_SIZE-copyoff;
+    if (copysize+copyoff>pages[i].size)
+      copysize=copyoff>pages[i].size?0:pages[i].size-copyoff;
+    if (psizes)
+      psizes[idx]=copysize;
+    rsize+=copysize;
+  }
+  return rsize;
+}
+
+/* Reads all pages of the span [pageoff, pageoff+size) starting at first_page_id that are present in the database, consecutive pages
+ * that are also consecutive in the cache file are read with a single pread. Returns an array with number of bytes copied for every
+ * page or -1 if the page was not read, NULL if no page is found.
+ */
+static psync_int_t *read_pages_from_database_by_hash(uint64_t hash, uint64_t first_page_id, psync_uint_t pagecnt, char *buf,
+                                                     psync_uint_t pageoff, uint64_t size){
+  pagecache_db_page *pages;
+  psync_int_t *ret;
+  char *pbuff;
+  uint64_t foff, rsize;
+  psync_uint_t cnt, i, j, k, idx, copyoff;
+  ssize_t readret;
+  pages=get_pages_in_db_by_hash(hash, first_page_id, pagecnt, &cnt);
+  if (!cnt){
+    psync_free(pages);
+    return NULL;
+  }
+  ret=psync_new_cnt(psync_int_t, pagecnt);
+  for (i=0; i<pagecnt; i++)
+    ret[i]=-1;
+  for (i=0; i<cnt; i=j){
+    idx=pages[i].pageid-first_page_id;
+    copyoff=idx?0:pageoff;
+    pbuff=buf+idx*PSYNC_FS_PAGE_SIZE+copyoff-pageoff;
+    foff=pages[i].pagecacheid*PSYNC_FS_PAGE_SIZE+copyoff;
+    rsize=get_db_pages_run(pages, i, cnt, &j, first_page_id, pageoff, size, ret);
+    readret=psync_file_pread(readcache, pbuff, rsize, foff);
+    if (readret!=rsize){
+      debug(D_ERROR, "failed to read %lu bytes from cache file at offset %lu, read returned %ld, errno=%ld",
+            (unsigned long)rsize, (unsigned long)foff, (long)readret, (long)psync_fs_err());
+      for (k=i; k<j; k++)
+        ret[pages[k].pageid-first_page_id]=-1;
+    }
+    else
+      for (k=i; k<j; k++)
+        mark_pagecache_used(pages[k].pagecacheid);
+  }
+  psync_free(pages);
+  return ret;
+}
+
+static char *page_copy_range(char *buf, psync_uint_t i, psync_uint_t pagecnt, psync_uint_t pageoff, uint64_t size,
+                             psync_uint_t *copyoff, psync_uint_t *copysize){
+  if (i==0){
+    *copyoff=pageoff;
+    if (size>PSYNC_FS_PAGE_SIZE-pageoff)
+      *copysize=PSYNC_FS_PAGE_SIZE-pageoff;
+    else
+      *copysize=size;
+    return buf;
+  }
+  *copyoff=0;
+  if (i==pagecnt-1){
+    *copysize=(size+pageoff)&(PSYNC_FS_PAGE_SIZE-1);
+    if (!*copysize)
+      *copysize=PSYNC_FS_PAGE_SIZE;
+  }
+  else
+    *copysize=PSYNC_FS_PAGE_SIZE;
+  return buf+i*PSYNC_FS_PAGE_SIZE-pageoff;
+}
+
+/* Secondary cache reads take an SQL query and a pread (possibly from slow storage) each, so they are done before lock_wait() for
+ * the pages that read_pages_from_database_by_hash() did not find and that are not in memory. Results are merged into dbpages,
+ * which is allocated if needed.
+ */
+static psync_int_t *read_pages_from_secondary_by_hash(uint64_t hash, uint64_t first_page_id, psync_uint_t pagecnt, char *buf,
+                                                      psync_uint_t pageoff, uint64_t size, psync_int_t *dbpages){
+  psync_sql_res *res;
+  psync_uint_row row;
+  unsigned char *insec;
+  char *pbuff;
+  psync_uint_t i, copyoff, copysize, cnt;
+  if (!secondary_cache_enabled())
+    return dbpages;
+  insec=psync_new_cnt(unsigned char, pagecnt);
+  memset(insec, 0, pagecnt);
+  cnt=0;
+  res=psync_sql_query_stmt(&stmt_pages_secondary_in_range);
+  psync_sql_bind_uint(res, 1, hash);
+  psync_sql_bind_uint(res, 2, first_page_id);
+  psync_sql_bind_uint(res, 3, first_page_id+pagecnt);
+  while ((row=psync_sql_fetch_rowint(res))){
+    insec[row[0]-first_page_id]=1;
+    cnt++;
+  }
+  psync_sql_free_result(res);
+  if (cnt){
+    if (!dbpages){
+      dbpages=psync_new_cnt(psync_int_t, pagecnt);
+      for (i=0; i<pagecnt; i++)
+        dbpages[i]=-1;
+    }
+    for (i=0; i<pagecnt; i++){
+      if (!insec[i] || dbpages[i]!=-1 || has_page_in_cache_by_hash(hash, first_page_id+i))
+        continue;
+      pbuff=page_copy_range(buf, i, pagecnt, pageoff, size, &copyoff, &copysize);
+      dbpages[i]=check_page_in_secondary_by_hash(hash, first_page_id+i, pbuff, copysize, copyoff);
+    }
+  }
+  psync_free(insec);
+  return dbpages;
+}
+
 int psync_pagecache_read_modified_locked(psync_openfile_t *of, char *buf, uint64_t size, uint64_t offset){
-  psync_interval_tree_t *fi;
+  psync_interval_tree_iter_t it;
+  const psync_interval_t *fi;
   uint64_t isize, ioffset;
   ssize_t br;
   int rd;
-  fi=psync_interval_tree_first_interval_containing_or_after(of->writeintervals, offset);
+  fi=psync_interval_tree_first_interval_containing_or_after(of->writeintervals, offset, &it);
   if (fi && fi->from<=offset && fi->to>=offset+size){
     debug(D_NOTICE, "reading %lu bytes at offset %lu only from local storage", (unsigned long)size, (unsigned long)offset);
     br=psync_file_pread(of->datafile, buf, size, offset);
@@ -1180,7 +1655,7 @@ int psync_pagecache_read_modified_locked(psync_openfile_t *of, char *buf, uint64
   if (rd<0)
     return rd;
   pthread_mutex_lock(&of->mutex);
-  fi=psync_interval_tree_first_interval_containing_or_after(of->writeintervals, offset);
+  fi=psync_interval_tree_first_interval_containing_or_after(of->writeintervals, offset, &it);
   if (!fi || fi->from>=offset+size){
     pthread_mutex_unlock(&of->mutex);
     if (fi)
@@ -1209,7 +1684,7 @@ int psync_pagecache_read_modified_locked(psync_openfile_t *of, char *buf, uint64
     }
     if (rd!=size && br+ioffset-offset>rd)
       rd=br+ioffset-offset;
-    fi=psync_interval_tree_get_next(fi);
+    fi=psync_interval_tree_get_next(&it);
   } while (fi && fi->from<offset+size);
   pthread_mutex_unlock(&of->mutex);
   return rd;
@@ -1245,7 +1720,7 @@ neterr:
 }*/
 
 static void psync_pagecache_free_request(psync_request_t *request){
-  psync_list_for_each_element_call(&request->ranges, psync_request_range_t, list, psync_free);
+  psync_list_for_each_element_call(&request->ranges, psync_request_range_t, list, psync_pagecache_free_range);
   psync_free(request);
 }
 
@@ -1337,6 +1812,86 @@ static int psync_pagecache_read_range_from_sock(psync_request_t *request, psync_
   return 0;
 }
 
+static int psync_pagecache_read_range_from_p2p(psync_request_t *request, psync_request_range_t *range, psync_p2p_range_session_t *sess, uint64_t fsize){
+  uint64_t first_page_id, off;
+  psync_page_wait_t *pw;
+  psync_cache_page_t *page;
+  psync_uint_t len, i, h, rd;
+  first_page_id=range->offset/PSYNC_FS_PAGE_SIZE;
+  len=range->length/PSYNC_FS_PAGE_SIZE;
+  for (i=0; i<len; i++){
+    off=(first_page_id+i)*PSYNC_FS_PAGE_SIZE;
+    if (fsize-off>PSYNC_FS_PAGE_SIZE)
+      rd=PSYNC_FS_PAGE_SIZE;
+    else
+      rd=fsize-off;
+    page=psync_pagecache_get_free_page();
+    if (psync_p2p_range_session_read(sess, page->page, rd, off)){
+      psync_pagecache_return_free_page(page);
+      return -1;
+    }
+    page->hash=request->of->hash;
+    page->pageid=first_page_id+i;
+    page->lastuse=psync_timer_time();
+    page->size=rd;
+    page->usecnt=0;
+    page->type=PAGE_TYPE_READ_P2P;
+    h=waiterhash_by_hash_and_pageid(page->hash, page->pageid);
+    lock_wait(page->hash);
+    psync_list_for_each_element(pw, &wait_page_hash[h], psync_page_wait_t, list)
+      if (pw->hash==page->hash && pw->pageid==page->pageid){
+        psync_pagecache_send_page_wait_page(pw, page);
+        break;
+      }
+    unlock_wait(page->hash);
+    pthread_mutex_lock(&cache_mutex);
+    psync_list_add_tail(&cache_hash[pagehash_by_hash_and_pageid(page->hash, page->pageid)], &page->list);
+    cache_pages_in_hash++;
+    pthread_mutex_unlock(&cache_mutex);
+  }
+  return 0;
+}
+
+/* Tries to serve the ranges of the request from a peer on the LAN that has the file synced. All ranges are requested at once and
+ * the ones that arrive are removed from the request, whatever is left (on any error) is fetched from the content servers.
+ * Range replies carry no checksum, so any host that knows the file hash could feed arbitrary data to the reader. That is why this
+ * only runs when the fsp2preads setting is on.
+ */
+static void psync_pagecache_read_ranges_from_p2p(psync_request_t *request){
+  psync_p2p_range_session_t *sess;
+  psync_request_range_t *range;
+  uint64_t fsize, maxend;
+  psync_uint_t cnt;
+  if (!psync_setting_get_bool(_PS(fsp2preads)))
+    return;
+  fsize=request->of->initialsize;
+  sess=psync_p2p_open_range_session(request->fileid, request->hash, fsize);
+  if (!sess)
+    return;
+  maxend=size_round_up_to_page(fsize);
+  cnt=0;
+  psync_list_for_each_element(range, &request->ranges, psync_request_range_t, list){
+    if (range->offset+range->length>maxend)
+      break;
+    if (psync_p2p_range_session_request(sess, range->offset, range->offset+range->length>fsize?fsize-range->offset:range->length)){
+      psync_p2p_release_range_session(sess, 0);
+      return;
+    }
+    cnt++;
+  }
+  while (cnt--){
+    range=psync_list_element(request->ranges.next, psync_request_range_t, list);
+    if (psync_pagecache_read_range_from_p2p(request, range, sess, fsize)){
+      debug(D_WARNING, "reading from peer failed, falling back to content servers");
+      psync_p2p_release_range_session(sess, 0);
+      return;
+    }
+    psync_list_del(&range->list);
+    psync_pagecache_free_range(range);
+  }
+  psync_p2p_release_range_session(sess, 1);
+}
+
 static void psync_pagecache_read_unmodified_thread(void *ptr){
   psync_request_t *request;
   psync_http_socket *sock;
@@ -1355,6 +1910,13 @@ static void psync_pagecache_read_unmodified_thread(void *ptr){
   range=psync_list_element(request->ranges.next, psync_request_range_t, list);
   debug(D_NOTICE, "thread run, first offset %lu, size %lu", (unsigned long)range->offset, (unsigned long)range->length);
   tries=0;
+  psync_pagecache_read_ranges_from_p2p(request);
+  if (psync_list_isempty(&request->ranges)){
+    debug(D_NOTICE, "request served from LAN peer");
+    psync_fs_dec_of_refcnt_and_readers(request->of);
+    psync_pagecache_free_request(request);
+    return;
+  }
 retry:
   if (!(urls=get_urls_for_request(request))){
     psync_pagecache_send_error(request, -EIO);
@@ -1468,6 +2030,301 @@ err0:
   return;
 }
 
+static void psync_pagecache_start_request(psync_request_t *request){
+  psync_fs_inc_of_refcnt_and_readers(request->of);
+  psync_run_thread1("read unmodified", psync_pagecache_read_unmodified_thread, request);
+}
+
+/* Splits the ranges of a request between up to PSYNC_FS_PARALLEL_FETCH_CONNS threads, each of them using its own (usually cached)
+ * content server connection. Ranges are kept in order, so the pages that the reader waits for are always in the first request and
+ * readahead does not delay them. Requests that are too small to benefit are run as a single pipelined request.
+ */
+static void psync_pagecache_schedule_request(psync_request_t *request){
+  psync_request_t *cur;
+  psync_request_range_t *range, *nrange;
+  psync_openfile_t *of;
+  psync_list tmp;
+  uint64_t total, part, inpart, hash;
+  psync_fileid_t fileid;
+  psync_uint_t conns, n;
+  total=0;
+  psync_list_for_each_element(range, &request->ranges, psync_request_range_t, list)
+    total+=range->length;
+  conns=total/PSYNC_FS_PARALLEL_FETCH_MIN;
+  if (conns>PSYNC_FS_PARALLEL_FETCH_CONNS)
+    conns=PSYNC_FS_PARALLEL_FETCH_CONNS;
+  if (conns<=1){
+    psync_pagecache_start_request(request);
+    return;
+  }
+  of=request->of;
+  fileid=request->fileid;
+  hash=request->hash;
+  part=size_round_up_to_page((total+conns-1)/conns);
+  debug(D_NOTICE, "splitting request for %lu bytes of hash %lu in %u parts", (unsigned long)total, (unsigned long)hash, (unsigned)conns);
+  psync_list_init(&tmp);
+  while (!psync_list_isempty(&request->ranges)){
+    range=psync_list_element(request->ranges.next, psync_request_range_t, list);
+    psync_list_del(&range->list);
+    psync_list_add_tail(&tmp, &range->list);
+  }
+  cur=request;
+  inpart=0;
+  n=1;
+  while (!psync_list_isempty(&tmp)){
+    range=psync_list_element(tmp.next, psync_request_range_t, list);
+    if (n<conns && inpart+range->length>part){
+      if (part>inpart){
+        nrange=(psync_request_range_t *)psync_slab_alloc(&range_slab);
+        nrange->offset=range->offset;
+        nrange->length=part-inpart;
+        range->offset+=nrange->length;
+        range->length-=nrange->length;
+        psync_list_add_tail(&cur->ranges, &nrange->list);
+      }
+      psync_pagecache_start_request(cur);
+      cur=psync_new(psync_request_t);
+      psync_list_init(&cur->ranges);
+      cur->of=of;
+      cur->fileid=fileid;
+      cur->hash=hash;
+      inpart=0;
+      n++;
+      continue;
+    }
+    psync_list_del(&range->list);
+    psync_list_add_tail(&cur->ranges, &range->list);
+    inpart+=range->length;
+  }
+  psync_pagecache_start_request(cur);
+}
+
+/* Access profiles remember which page ranges of a given content (hash) were read while it was open. Reads are recorded as they come
+ * from the kernel, so with kernel readahead enabled they include what the kernel read ahead, but not our own readahead. Each range is
+ * capped at PSYNC_FS_PROFILE_MAX_RANGE_PAGES, so a sequential read of the whole file records just its beginning. The next time the same
+ * content is opened, the most often hit ranges are prefetched in background.
+ */
+static void psync_pagecache_record_access_locked(psync_openfile_t *of, uint64_t offset, uint64_t size){
+  psync_file_profile_range_t *pr;
+  uint64_t frompage, topage;
+  uint32_t i;
+  if (of->initialsize<PSYNC_FS_PROFILE_MIN_FILE_SIZE || offset>=of->initialsize || !size)
+    return;
+  frompage=offset/PSYNC_FS_PAGE_SIZE;
+  topage=(offset+size-1)/PSYNC_FS_PAGE_SIZE;
+  for (i=0; i<of->profilecnt; i++){
+    pr=&of->profile[i];
+    if (frompage<=pr->topage+1 && topage+1>=pr->frompage){
+      if (frompage<pr->frompage)
+        pr->frompage=frompage;
+      if (topage>pr->topage)
+        pr->topage=topage;
+      if (pr->topage-pr->frompage>=PSYNC_FS_PROFILE_MAX_RANGE_PAGES)
+        pr->topage=pr->frompage+PSYNC_FS_PROFILE_MAX_RANGE_PAGES-1;
+      return;
+    }
+  }
+  if (of->profilecnt<PSYNC_FS_PROFILE_RANGES){
+    pr=&of->profile[of->profilecnt++];
+    pr->frompage=frompage;
+    pr->topage=topage;
+    if (pr->topage-pr->frompage>=PSYNC_FS_PROFILE_MAX_RANGE_PAGES)
+      pr->topage=pr->frompage+PSYNC_FS_PROFILE_MAX_RANGE_PAGES-1;
+  }
+}
+
+typedef struct {
+  uint64_t hash;
+  uint32_t profilecnt;
+  psync_file_profile_range_t profile[PSYNC_FS_PROFILE_RANGES];
+} psync_profile_save_t;
+
+static void psync_pagecache_save_profile_thread(void *ptr){
+  static uint32_t savecnt=0;
+  psync_profile_save_t *ps;
+  psync_sql_res *ires, *ures;
+  time_t ctime;
+  uint32_t i;
+  ps=(psync_profile_save_t *)ptr;
+  ctime=psync_timer_time();
+  psync_sql_start_transaction();
+  ires=psync_sql_prep_statement("INSERT OR IGNORE INTO pagecacheprofile (hash, frompage, topage, hits, lastuse) VALUES (?, ?, ?, 0, ?)");
+  ures=psync_sql_prep_statement("UPDATE pagecacheprofile SET topage=MAX(topage, ?), hits=hits+1, lastuse=? WHERE hash=? AND frompage=?");
+  for (i=0; i<ps->profilecnt; i++){
+    psync_sql_bind_uint(ires, 1, ps->hash);
+    psync_sql_bind_uint(ires, 2, ps->profile[i].frompage);
+    psync_sql_bind_uint(ires, 3, ps->profile[i].topage);
+    psync_sql_bind_uint(ires, 4, ctime);
+    psync_sql_run(ires);
+    psync_sql_bind_uint(ures, 1, ps->profile[i].topage);
+    psync_sql_bind_uint(ures, 2, ctime);
+    psync_sql_bind_uint(ures, 3, ps->hash);
+    psync_sql_bind_uint(ures, 4, ps->profile[i].frompage);
+    psync_sql_run(ures);
+  }
+  psync_sql_free_result(ures);
+  psync_sql_free_result(ires);
+  if (++savecnt%64==0){
+    ires=psync_sql_prep_statement("DELETE FROM pagecacheprofile WHERE lastuse<?");
+    psync_sql_bind_uint(ires, 1, ctime-PSYNC_FS_PROFILE_EXPIRE_SEC);
+    psync_sql_run_free(ires);
+  }
+  psync_sql_commit_transaction();
+  psync_free(ps);
+}
+
+/* Called when the file is released, the profile is copied and written by a separate thread so that closing does not wait for the
+ * database transaction.
+ */
+void psync_pagecache_save_access_profile(psync_openfile_t *of){
+  psync_profile_save_t *ps;
+  if (!of->profilecnt)
+    return;
+  ps=psync_new(psync_profile_save_t);
+  ps->hash=of->hash;
+  ps->profilecnt=of->profilecnt;
+  memcpy(ps->profile, of->profile, sizeof(psync_file_profile_range_t)*of->profilecnt);
+  psync_run_thread1("save profile", psync_pagecache_save_profile_thread, ps);
+}
+
+static pthread_mutex_t prefetch_budget_mutex=PTHREAD_MUTEX_INITIALIZER;
+static uint64_t prefetch_budget_used=0;
+static time_t prefetch_budget_start=0;
+
+/* Background prefetch may use up to 1/PSYNC_FS_PROFILE_BUDGET_DIV of the cache size per PSYNC_FS_PROFILE_BUDGET_SEC, so that profiles
+ * can not push out of the cache the pages that are actually being read.
+ */
+static uint64_t psync_pagecache_get_prefetch_budget(uint64_t want){
+  uint64_t allowed;
+  time_t ctime;
+  ctime=psync_timer_time();
+  allowed=psync_setting_get_uint(_PS(fscachesize))/PSYNC_FS_PROFILE_BUDGET_DIV;
+  pthread_mutex_lock(&prefetch_budget_mutex);
+  if (prefetch_budget_start+PSYNC_FS_PROFILE_BUDGET_SEC<=ctime){
+    prefetch_budget_start=ctime;
+    prefetch_budget_used=0;
+  }
+  if (prefetch_budget_used>=allowed)
+    want=0;
+  else if (want>allowed-prefetch_budget_used)
+    want=allowed-prefetch_budget_used;
+  prefetch_budget_used+=want;
+  pthread_mutex_unlock(&prefetch_budget_mutex);
+  return want;
+}
+
+static void psync_pagecache_prefetch_profile_thread(void *ptr){
+  psync_file_profile_range_t profile[PSYNC_FS_PROFILE_RANGES];
+  psync_openfile_t *of;
+  psync_request_t *rq;
+  psync_request_range_t *range;
+  psync_page_wait_t *pw;
+  psync_sql_res *res;
+  psync_uint_row row;
+  unsigned char *pages_in_db[PSYNC_FS_PROFILE_RANGES];
+  uint64_t hash, initialsize, lastpage, budget, pageid;
+  psync_fileid_t fileid;
+  uint32_t cnt, i, j, pagecnt, h;
+  int found, modified;
+  of=(psync_openfile_t *)ptr;
+  pthread_mutex_lock(&of->mutex);
+  hash=of->hash;
+  fileid=of->remotefileid;
+  initialsize=of->initialsize;
+  modified=of->modified;
+  pthread_mutex_unlock(&of->mutex);
+  if (modified || !initialsize)
+    goto ex;
+  lastpage=(initialsize-1)/PSYNC_FS_PAGE_SIZE;
+  cnt=0;
+  res=psync_sql_query("SELECT frompage, topage FROM pagecacheprofile WHERE hash=? ORDER BY hits DESC LIMIT "NTO_STR(PSYNC_FS_PROFILE_RANGES));
+  psync_sql_bind_uint(res, 1, hash);
+  while ((row=psync_sql_fetch_rowint(res)))
+    if (row[0]<=lastpage){
+      profile[cnt].frompage=row[0];
+      profile[cnt].topage=row[1]>lastpage?lastpage:row[1];
+      cnt++;
+    }
+  psync_sql_free_result(res);
+  if (!cnt)
+    goto ex;
+  rq=psync_new(psync_request_t);
+  psync_list_init(&rq->ranges);
+  range=NULL;
+  budget=0;
+  for (i=0; i<cnt; i++)
+    pages_in_db[i]=has_pages_in_db(hash, profile[i].frompage, profile[i].topage-profile[i].frompage+1, 0);
+  lock_wait(hash);
+  for (i=0; i<cnt; i++){
+    pagecnt=profile[i].topage-profile[i].frompage+1;
+    for (j=0; j<pagecnt; j++){
+      pageid=profile[i].frompage+j;
+      if (pages_in_db[i][j] || has_page_in_cache_by_hash(hash, pageid))
+        continue;
+      h=waiterhash_by_hash_and_pageid(hash, pageid);
+      found=0;
+      psync_list_for_each_element(pw, &wait_page_hash[h], psync_page_wait_t, list)
+        if (pw->hash==hash && pw->pageid==pageid){
+          found=1;
+          break;
+        }
+      if (found)
+        continue;
+      if (!budget && !(budget=psync_pagecache_get_prefetch_budget(PSYNC_FS_PROFILE_MAX_RANGE_PAGES*PSYNC_FS_PAGE_SIZE)/PSYNC_FS_PAGE_SIZE)){
+        debug(D_NOTICE, "prefetch budget exhausted, not prefetching profile of hash %lu", (unsigned long)hash);
+        goto out;
+      }
+      budget--;
+      pw=psync_new(psync_page_wait_t);
+      psync_list_add_tail(&wait_page_hash[h], &pw->list);
+      psync_list_init(&pw->waiters);
+      pw->hash=hash;
+      pw->pageid=pageid;
+      pw->fileid=fileid;
+      if (range && range->offset+range->length==pageid*PSYNC_FS_PAGE_SIZE)
+        range->length+=PSYNC_FS_PAGE_SIZE;
+      else{
+        range=(psync_request_range_t *)psync_slab_alloc(&range_slab);
+        psync_list_add_tail(&rq->ranges, &range->list);
+        range->offset=pageid*PSYNC_FS_PAGE_SIZE;
+        range->length=PSYNC_FS_PAGE_SIZE;
+      }
+    }
+  }
+out:
+  unlock_wait(hash);
+  for (i=0; i<cnt; i++)
+    psync_free(pages_in_db[i]);
+  if (budget){
+    pthread_mutex_lock(&prefetch_budget_mutex);
+    prefetch_budget_used-=budget*PSYNC_FS_PAGE_SIZE;
+    pthread_mutex_unlock(&prefetch_budget_mutex);
+  }
+  if (!psync_list_isempty(&rq->ranges)){
+    debug(D_NOTICE, "prefetching %u profile ranges of hash %lu", (unsigned)cnt, (unsigned long)hash);
+    rq->of=of;
+    rq->fileid=fileid;
+    rq->hash=hash;
+    psync_pagecache_schedule_request(rq);
+  }
+  else
+    psync_free(rq);
+ex:
+  psync_fs_dec_of_refcnt(of);
+}
+
+void psync_pagecache_prefetch_access_profile(psync_openfile_t *of){
+  pthread_mutex_lock(&of->mutex);
+  if (of->profileprefetched || of->modified || of->initialsize<PSYNC_FS_PROFILE_MIN_FILE_SIZE){
+    pthread_mutex_unlock(&of->mutex);
+    return;
+  }
+  of->profileprefetched=1;
+  psync_fs_inc_of_refcnt_locked(of);
+  pthread_mutex_unlock(&of->mutex);
+  psync_run_thread1("profile prefetch", psync_pagecache_prefetch_profile_thread, of);
+}
+
 static void psync_pagecache_read_unmodified_readahead(psync_openfile_t *of, uint64_t offset, uint64_t size, psync_list *ranges, psync_request_range_t *range,
                                                       psync_fileid_t fileid, uint64_t hash, uint64_t initialsize){
   uint64_t readahead, frompageoff, topageoff, first_page_id, rto;
@@ -1530,6 +2387,8 @@ static void psync_pagecache_read_unmodified_readahead(psync_openfile_t *of, uint
     readahead=PSYNC_FS_MAX_READAHEAD;
   if (of->currentspeed*PSYNC_FS_MAX_READAHEAD_SEC>PSYNC_FS_MIN_READAHEAD_START && readahead>of->currentspeed*PSYNC_FS_MAX_READAHEAD_SEC)
     readahead=size_round_up_to_page(of->currentspeed*PSYNC_FS_MAX_READAHEAD_SEC);
+  if (of->seqreadbytes>=PSYNC_FS_STREAM_DETECT_BYTES && readahead<PSYNC_FS_STREAM_MIN_READAHEAD)
+    readahead=PSYNC_FS_STREAM_MIN_READAHEAD;
   if (!range){
     if (readahead>=8192*1024)
       readahead=(readahead+offset+size)/(4*1024*1024)*(4*1024*1024)-offset-size;
@@ -1581,7 +2440,7 @@ static void psync_pagecache_read_unmodified_readahead(psync_openfile_t *of, uint
     if (range && range->offset+range->length==(first_page_id+i)*PSYNC_FS_PAGE_SIZE)
       range->length+=PSYNC_FS_PAGE_SIZE;
     else{
-      range=psync_new(psync_request_range_t);
+      range=(psync_request_range_t *)psync_slab_alloc(&range_slab);
       psync_list_add_tail(ranges, &range->list);
       range->offset=(first_page_id+i)*PSYNC_FS_PAGE_SIZE;
       range->length=PSYNC_FS_PAGE_SIZE;
@@ -1609,7 +2468,9 @@ int psync_pagecache_read_unmodified_locked(psync_openfile_t *of, char *buf, uint
   psync_request_t *rq;
   psync_request_range_t *range;
   psync_list waiting;
+  psync_int_t *dbpages;
   int ret;
+  psync_pagecache_record_access_locked(of, offset, size);
   initialsize=of->initialsize;
   hash=of->hash;
   fileid=of->remotefileid;
@@ -1627,31 +2488,21 @@ int psync_pagecache_read_unmodified_locked(psync_openfile_t *of, char *buf, uint
   rq=psync_new(psync_request_t);
   psync_list_init(&rq->ranges);
   range=NULL;
+  if (pagecnt>1)
+    dbpages=read_pages_from_database_by_hash(hash, first_page_id, pagecnt, buf, pageoff, size);
+  else
+    dbpages=NULL;
+  dbpages=read_pages_from_secondary_by_hash(hash, first_page_id, pagecnt, buf, pageoff, size, dbpages);
   lock_wait(hash);
   for (i=0; i<pagecnt; i++){
-    if (i==0){
-      copyoff=pageoff;
-      if (size>PSYNC_FS_PAGE_SIZE-copyoff)
-        copysize=PSYNC_FS_PAGE_SIZE-copyoff;
-      else
-        copysize=size;
-      pbuff=buf;
-    }
-    else if (i==pagecnt-1){
-      copyoff=0;
-      copysize=(size+pageoff)&(PSYNC_FS_PAGE_SIZE-1);
-      if (!copysize)
-        copysize=PSYNC_FS_PAGE_SIZE;
-      pbuff=buf+i*PSYNC_FS_PAGE_SIZE-pageoff;
-    }
+    pbuff=page_copy_range(buf, i, pagecnt, pageoff, size, &copyoff, &copysize);
+    if (dbpages && dbpages[i]!=-1)
+      rb=dbpages[i];
     else{
-      copyoff=0;
-      copysize=PSYNC_FS_PAGE_SIZE;
-      pbuff=buf+i*PSYNC_FS_PAGE_SIZE-pageoff;
+      rb=check_page_in_memory_by_hash(hash, first_page_id+i, pbuff, copysize, copyoff, 1);
+      if (rb==-1)
+        rb=check_page_in_database_by_hash(hash, first_page_id+i, pbuff, copysize, copyoff);
     }
-    rb=check_page_in_memory_by_hash(hash, first_page_id+i, pbuff, copysize, copyoff);
-    if (rb==-1)
-      rb=check_page_in_database_by_hash(hash, first_page_id+i, pbuff, copysize, copyoff);
     if (rb!=-1){
       if (rb==copysize)
         continue;
@@ -1663,6 +2514,7 @@ int psync_pagecache_read_unmodified_locked(psync_openfile_t *of, char *buf, uint
         break;
       }
     }
+    psync_metric_inc(&metric_misses);
     pwt=psync_new(psync_page_waiter_t);
     pthread_cond_init(&pwt->cond, NULL);
     pwt->buff=pbuff;
@@ -1686,7 +2538,7 @@ int psync_pagecache_read_unmodified_locked(psync_openfile_t *of, char *buf, uint
     if (range && range->offset+range->length==(first_page_id+i)*PSYNC_FS_PAGE_SIZE)
       range->length+=PSYNC_FS_PAGE_SIZE;
     else{
-      range=psync_new(psync_request_range_t);
+      range=(psync_request_range_t *)psync_slab_alloc(&range_slab);
       psync_list_add_tail(&rq->ranges, &range->list);
       range->offset=(first_page_id+i)*PSYNC_FS_PAGE_SIZE;
       range->length=PSYNC_FS_PAGE_SIZE;
@@ -1695,14 +2547,14 @@ found:
     psync_list_add_tail(&pw->waiters, &pwt->listpage);
     pwt->waiting_for=pw;
   }
+  psync_free(dbpages);
   psync_pagecache_read_unmodified_readahead(of, poffset, psize, &rq->ranges, range, fileid, hash, initialsize);
   if (!psync_list_isempty(&rq->ranges)){
     unlock_wait(hash);
     rq->of=of;
     rq->fileid=fileid;
     rq->hash=hash;
-    psync_fs_inc_of_refcnt_and_readers(of);
-    psync_run_thread1("read unmodified", psync_pagecache_read_unmodified_thread, rq);
+    psync_pagecache_schedule_request(rq);
     if (psync_list_isempty(&waiting))
       return size;
     lock_wait(hash);
@@ -1753,8 +2605,14 @@ static void psync_pagecache_add_page_if_not_exists(psync_cache_page_t *page, uin
   lock_wait(hash);
   pthread_mutex_lock(&cache_mutex);
   psync_list_for_each_element(pg, &cache_hash[h1], psync_cache_page_t, list)
-    if (pg->type==PAGE_TYPE_READ && pg->hash==hash && pg->pageid==pageid){
-      hasit=1;
+    if (page_type_is_readable(pg->type) && pg->hash==hash && pg->pageid==pageid){
+      if (pg->type==PAGE_TYPE_READ_P2P){
+        psync_list_del(&pg->list);
+        psync_pagecache_return_free_page_locked(pg);
+        cache_pages_in_hash--;
+      }
+      else
+        hasit=1;
       break;
     }
   if (!hasit)
@@ -1825,7 +2683,9 @@ static void psync_pagecache_modify_to_cache(uint64_t taskid, uint64_t hash, uint
   char *filename, *indexname;
   const char *cachepath;
   psync_cache_page_t *page;
-  psync_interval_tree_t *tree, *interval;
+  psync_interval_tree_t *tree;
+  psync_interval_tree_iter_t it;
+  const psync_interval_t *interval;
   uint64_t pageid, off, roff, rdoff, rdlen;
   int64_t fs;
   ssize_t rd;
@@ -1867,11 +2727,11 @@ static void psync_pagecache_modify_to_cache(uint64_t taskid, uint64_t hash, uint
   fs=psync_file_size(fd);
   if (unlikely_log(fs==-1))
     goto err2;
-  interval=psync_interval_tree_get_first(tree);
+  interval=psync_interval_tree_get_first(tree, &it);
   for (off=0; off<fs; off+=PSYNC_FS_PAGE_SIZE){
     pageid=off/PSYNC_FS_PAGE_SIZE;
     while (interval && interval->to<=off)
-      interval=psync_interval_tree_get_next(interval);
+      interval=psync_interval_tree_get_next(&it);
     if (!interval || interval->from>=off+PSYNC_FS_PAGE_SIZE){ // full old page
       if (!tstarted){
         res=psync_sql_prep_statement("UPDATE OR IGNORE pagecache SET hash=? WHERE hash=? AND pageid=? AND type=?");
@@ -1947,7 +2807,7 @@ static void psync_pagecache_modify_to_cache(uint64_t taskid, uint64_t hash, uint
             pdb=roff+rdlen;
           if (interval->to>off+PSYNC_FS_PAGE_SIZE)
             break;
-          interval=psync_interval_tree_get_next(interval);
+          interval=psync_interval_tree_get_next(&it);
           if (!interval || interval->from>=off+PSYNC_FS_PAGE_SIZE)
             break;
         }
@@ -2025,6 +2885,75 @@ static void psync_pagecache_add_task(uint32_t type, uint64_t taskid, uint64_t ha
     psync_run_thread("upload to cache", psync_pagecache_upload_to_cache);
 }
 
+int psync_pagecache_read_unmodified_ranges_locked(psync_openfile_t *of, psync_pagecache_range_t *ranges, psync_uint_t maxranges,
+                                                  uint64_t size, uint64_t offset){
+  uint64_t poffset, psize, first_page_id, initialsize, hash, rsize, needed;
+  psync_uint_t pageoff, pagecnt, cnt, i, j, idx, copyoff;
+  psync_fileid_t fileid;
+  pagecache_db_page *pages;
+  psync_request_t *rq;
+  int ret;
+  psync_pagecache_record_access_locked(of, offset, size);
+  initialsize=of->initialsize;
+  hash=of->hash;
+  fileid=of->remotefileid;
+  pthread_mutex_unlock(&of->mutex);
+  if (offset>=initialsize)
+    return 0;
+  if (offset+size>initialsize)
+    size=initialsize-offset;
+  poffset=offset_round_down_to_page(offset);
+  pageoff=offset-poffset;
+  psize=size_round_up_to_page(size+pageoff);
+  pagecnt=psize/PSYNC_FS_PAGE_SIZE;
+  first_page_id=poffset/PSYNC_FS_PAGE_SIZE;
+  pages=get_pages_in_db_by_hash(hash, first_page_id, pagecnt, &cnt);
+  if (cnt!=pagecnt){
+    psync_free(pages);
+    return -1;
+  }
+  ret=0;
+  needed=size;
+  for (i=0; i<cnt; i=j){
+    if (ret==maxranges){
+      ret=-1;
+      break;
+    }
+    idx=pages[i].pageid-first_page_id;
+    copyoff=idx?0:pageoff;
+    rsize=get_db_pages_run(pages, i, cnt, &j, first_page_id, pageoff, size, NULL);
+    if (rsize>needed || (rsize<needed && j<cnt)){
+      ret=-1;
+      break;
+    }
+    ranges[ret].fd=readcache;
+    ranges[ret].offset=pages[i].pagecacheid*PSYNC_FS_PAGE_SIZE+copyoff;
+    ranges[ret].length=rsize;
+    ret++;
+    needed-=rsize;
+  }
+  if (ret>0)
+    for (i=0; i<cnt; i++)
+      mark_pagecache_used(pages[i].pagecacheid);
+  psync_free(pages);
+  if (ret<=0)
+    return -1;
+  rq=psync_new(psync_request_t);
+  psync_list_init(&rq->ranges);
+  lock_wait(hash);
+  psync_pagecache_read_unmodified_readahead(of, poffset, psize, &rq->ranges, NULL, fileid, hash, initialsize);
+  unlock_wait(hash);
+  if (!psync_list_isempty(&rq->ranges)){
+    rq->of=of;
+    rq->fileid=fileid;
+    rq->hash=hash;
+    psync_pagecache_schedule_request(rq);
+  }
+  else
+    psync_free(rq);
+  return ret;
+}
+
 void psync_pagecache_creat_to_pagecache(uint64_t taskid, uint64_t hash){
   psync_pagecache_add_task(PAGE_TASK_TYPE_CREAT, taskid, hash, 0);
 }
@@ -2051,11 +2980,14 @@ int psync_pagecache_copy_all_pages_from_cache_to_file_locked(psync_openfile_t *o
   psync_int_t rb;
   pagecnt=(size+PSYNC_FS_PAGE_SIZE-1)/PSYNC_FS_PAGE_SIZE;
   for (i=0; i<pagecnt; i++){
-    rb=check_page_in_memory_by_hash(hash, i, buff, PSYNC_FS_PAGE_SIZE, 0);
+    rb=check_page_in_memory_by_hash(hash, i, buff, PSYNC_FS_PAGE_SIZE, 0, 0);
     if (rb==-1){
       rb=check_page_in_database_by_hash(hash, i, buff, PSYNC_FS_PAGE_SIZE, 0);
-      if (rb==-1)
-        return -1;
+      if (rb==-1){
+        rb=check_page_in_secondary_by_hash(hash, i, buff, PSYNC_FS_PAGE_SIZE, 0);
+        if (rb==-1)
+          return -1;
+      }
     }
     assertw(rb==PSYNC_FS_PAGE_SIZE || i*PSYNC_FS_PAGE_SIZE+rb==size);
     if (psync_file_pwrite(of->datafile, buff, rb, i*PSYNC_FS_PAGE_SIZE)!=rb)
@@ -2074,7 +3006,7 @@ int psync_pagecache_lock_pages_in_cache(){
 
 void psync_pagecache_unlock_pages_from_cache(){
   pthread_mutex_lock(&clean_cache_mutex);
-  if (--clean_cache_stoppers && clean_cache_waiters)
+  if (!--clean_cache_stoppers && clean_cache_waiters)
     pthread_cond_broadcast(&clean_cache_cond);
   pthread_mutex_unlock(&clean_cache_mutex);
 }
@@ -2100,6 +3032,96 @@ void psync_pagecache_resize_cache(){
   pthread_mutex_unlock(&flush_cache_mutex);
 }
 
+static void close_secondary_cache_locked(){
+  if (secondarycache!=INVALID_HANDLE_VALUE){
+    psync_file_close(secondarycache);
+    secondarycache=INVALID_HANDLE_VALUE;
+  }
+  psync_free(secondary_cache_dir);
+  secondary_cache_dir=NULL;
+  secondary_cache_pages=0;
+}
+
+static void open_secondary_cache_locked(){
+  const char *cache_dir;
+  char *cache_file;
+  psync_sql_res *res;
+  psync_stat_t st;
+  uint64_t size;
+  cache_dir=psync_setting_get_string(_PS(fssecondarycachepath));
+  size=psync_setting_get_uint(_PS(fssecondarycachesize));
+  if (!cache_dir[0] || size<PSYNC_FS_MIN_SECONDARY_CACHE_SIZE){
+    psync_sql_statement("DELETE FROM pagecachesecondary");
+    return;
+  }
+  if (psync_stat(cache_dir, &st))
+    psync_mkdir(cache_dir);
+  cache_file=psync_strcat(cache_dir, PSYNC_DIRECTORY_SEPARATOR, PSYNC_DEFAULT_SECONDARY_CACHE_FILE, NULL);
+  if (psync_stat(cache_file, &st))
+    psync_sql_statement("DELETE FROM pagecachesecondary");
+  secondarycache=psync_file_open(cache_file, P_O_RDWR, P_O_CREAT);
+  if (unlikely_log(secondarycache==INVALID_HANDLE_VALUE)){
+    psync_sql_statement("DELETE FROM pagecachesecondary");
+    psync_free(cache_file);
+    return;
+  }
+  secondary_cache_dir=psync_strdup(cache_dir);
+  secondary_cache_pages=size/PSYNC_FS_PAGE_SIZE;
+  secondary_cache_seq=psync_sql_cellint("SELECT MAX(id) FROM pagecachesecondary", 0)+1;
+  if (secondary_cache_seq>secondary_cache_pages){
+    res=psync_sql_prep_statement("DELETE FROM pagecachesecondary WHERE id<?");
+    psync_sql_bind_uint(res, 1, secondary_cache_seq-secondary_cache_pages);
+    psync_sql_run_free(res);
+  }
+  debug(D_NOTICE, "using secondary cache %s of %lu pages", cache_file, (unsigned long)secondary_cache_pages);
+  psync_free(cache_file);
+}
+
+void psync_pagecache_resize_secondary_cache(){
+  const char *cache_dir;
+  uint64_t pages;
+  psync_sql_lock();
+  pthread_mutex_lock(&secondary_cache_mutex);
+  cache_dir=psync_setting_get_string(_PS(fssecondarycachepath));
+  pages=psync_setting_get_uint(_PS(fssecondarycachesize))/PSYNC_FS_PAGE_SIZE;
+  if (secondary_cache_dir && pages==secondary_cache_pages && !strcmp(secondary_cache_dir, cache_dir)){
+    pthread_mutex_unlock(&secondary_cache_mutex);
+    psync_sql_unlock();
+    return;
+  }
+  /* slot of a page depends on the size of the cache, so on any change the content is dropped */
+  if (secondarycache!=INVALID_HANDLE_VALUE && psync_file_seek(secondarycache, 0, P_SEEK_SET)!=-1)
+    assertw(psync_file_truncate(secondarycache)==0);
+  close_secondary_cache_locked();
+  psync_sql_statement("DELETE FROM pagecachesecondary");
+  if (pagecache_inited)
+    open_secondary_cache_locked();
+  pthread_mutex_unlock(&secondary_cache_mutex);
+  psync_sql_unlock();
+}
+
+void psync_pagecache_get_stats(pcache_stats_t *stats){
+  uint64_t misses;
+  misses=psync_metric_get(&metric_misses);
+  stats->memory.hits=psync_metric_get(&metric_memhits);
+  stats->disk.hits=psync_metric_get(&metric_diskhits);
+  stats->secondary.hits=psync_metric_get(&metric_secondaryhits);
+  stats->secondary.misses=misses;
+  stats->promoted=psync_metric_get(&metric_promoted);
+  stats->demoted=psync_metric_get(&metric_demoted);
+  pthread_mutex_lock(&cache_mutex);
+  stats->memory.capacity=(uint64_t)cache_pages*PSYNC_FS_PAGE_SIZE;
+  stats->disk.capacity=db_cache_in_pages*PSYNC_FS_PAGE_SIZE;
+  pthread_mutex_unlock(&cache_mutex);
+  pthread_mutex_lock(&secondary_cache_mutex);
+  stats->secondary.capacity=secondary_cache_pages*PSYNC_FS_PAGE_SIZE;
+  pthread_mutex_unlock(&secondary_cache_mutex);
+  if (!stats->secondary.capacity)
+    stats->secondary.misses=0;
+  stats->disk.misses=stats->secondary.hits+misses;
+  stats->memory.misses=stats->disk.hits+stats->disk.misses;
+}
+
 void psync_pagecache_init(){
   uint64_t i;
   char *page_data, *cache_file;
@@ -2107,7 +3129,14 @@ void psync_pagecache_init(){
   psync_sql_res *res;
   psync_cache_page_t *page;
   psync_stat_t st;
-  for (i=0; i<CACHE_HASH; i++)
+  i=psync_setting_get_uint(_PS(fsmemcachesize));
+  if (i<PSYNC_FS_MIN_MEMORY_CACHE)
+    i=PSYNC_FS_MIN_MEMORY_CACHE;
+  cache_pages=i/PSYNC_FS_PAGE_SIZE;
+  cache_hash_size=cache_pages/2;
+  debug(D_NOTICE, "using %u pages of memory cache", (unsigned)cache_pages);
+  cache_hash=psync_new_cnt(psync_list, cache_hash_size);
+  for (i=0; i<cache_hash_size; i++)
     psync_list_init(&cache_hash[i]);
   for (i=0; i<PAGE_WAITER_HASH; i++)
     psync_list_init(&wait_page_hash[i]);
@@ -2115,11 +3144,11 @@ void psync_pagecache_init(){
     pthread_mutex_init(&wait_page_mutexes[i], NULL);
   psync_list_init(&free_pages);
   memset(cachepages_to_update, 0, sizeof(cachepages_to_update));
-  pages_base=(char *)psync_malloc(CACHE_PAGES*(PSYNC_FS_PAGE_SIZE+sizeof(psync_cache_page_t)));
+  pages_base=(char *)psync_malloc(cache_pages*(PSYNC_FS_PAGE_SIZE+sizeof(psync_cache_page_t)));
   page_data=pages_base;
-  page=(psync_cache_page_t *)(page_data+CACHE_PAGES*PSYNC_FS_PAGE_SIZE);
-  cache_pages_free=CACHE_PAGES;
-  for (i=0; i<CACHE_PAGES; i++){
+  page=(psync_cache_page_t *)(page_data+cache_pages*PSYNC_FS_PAGE_SIZE);
+  cache_pages_free=cache_pages;
+  for (i=0; i<cache_pages; i++){
     page->page=page_data;
     psync_list_add_tail(&free_pages, &page->list);
     page_data+=PSYNC_FS_PAGE_SIZE;
@@ -2142,7 +3171,7 @@ void psync_pagecache_init(){
     i=0;
     psync_sql_start_transaction();
     res=psync_sql_prep_statement("INSERT INTO pagecache (type) VALUES ("NTO_STR(PAGE_TYPE_FREE)")");
-    while (db_cache_max_page+i<db_cache_in_pages && i<CACHE_PAGES*4){
+    while (db_cache_max_page+i<db_cache_in_pages && i<cache_pages*4){
       psync_sql_run(res);
       i++;
     }
@@ -2166,18 +3195,25 @@ void psync_pagecache_init(){
     psync_run_thread("upload to cache", psync_pagecache_upload_to_cache);
     upload_to_cache_thread_run=1;
   }
+  pthread_mutex_lock(&secondary_cache_mutex);
+  pagecache_inited=1;
+  open_secondary_cache_locked();
+  pthread_mutex_unlock(&secondary_cache_mutex);
   psync_sql_unlock();
+  psync_run_thread("flush pages", psync_pagecache_flush_thread);
   psync_timer_register(psync_pagecache_flush_timer, PSYNC_FS_DISK_FLUSH_SEC, NULL);
 }
 
 void clean_cache_del(void *delcache, psync_pstat *st){
   int ret;
-  if (!psync_stat_isfolder(&st->stat) && (delcache || psync_filename_cmp(st->name, PSYNC_DEFAULT_READ_CACHE_FILE))){
+  if (!psync_stat_isfolder(&st->stat) && (delcache || (psync_filename_cmp(st->name, PSYNC_DEFAULT_READ_CACHE_FILE) &&
+      psync_filename_cmp(st->name, PSYNC_DEFAULT_SECONDARY_CACHE_FILE)))){
     ret=psync_file_delete(st->path);
     debug(D_NOTICE, "delete of %s=%d", st->path, ret);
   }
 }
 
+/* called with the sql lock held and the database still open, the secondary cache rows are dropped along with its file */
 void psync_pagecache_clean_cache(){
   const char *cache_dir;
   cache_dir=psync_setting_get_string(_PS(fscachepath));
@@ -2188,5 +3224,13 @@ void psync_pagecache_clean_cache(){
   }
   else
     psync_list_dir(cache_dir, clean_cache_del, (void *)1);
+  pthread_mutex_lock(&secondary_cache_mutex);
+  if (secondarycache!=INVALID_HANDLE_VALUE){
+    psync_file_seek(secondarycache, 0, P_SEEK_SET);
+    psync_file_truncate(secondarycache);
+  }
+  psync_sql_statement("DELETE FROM pagecachesecondary");
+  secondary_cache_seq=1;
+  pthread_mutex_unlock(&secondary_cache_mutex);
 }
 
@@ -30,10 +30,20 @@
 
 #include "pfs.h"
 
+typedef struct {
+  psync_file_t fd;
+  uint64_t offset;
+  uint64_t length;
+} psync_pagecache_range_t;
+
 void psync_pagecache_init();
 int psync_pagecache_flush();
 int psync_pagecache_read_modified_locked(psync_openfile_t *of, char *buf, uint64_t size, uint64_t offset);
 int psync_pagecache_read_unmodified_locked(psync_openfile_t *of, char *buf, uint64_t size, uint64_t offset);
+int psync_pagecache_read_unmodified_ranges_locked(psync_openfile_t *of, psync_pagecache_range_t *ranges, psync_uint_t maxranges,
+                                                  uint64_t size, uint64_t offset);
+void psync_pagecache_save_access_profile(psync_openfile_t *of);
+void psync_pagecache_prefetch_access_profile(psync_openfile_t *of);
 void psync_pagecache_creat_to_pagecache(uint64_t taskid, uint64_t hash);
 void psync_pagecache_modify_to_pagecache(uint64_t taskid, uint64_t hash, uint64_t oldhash);
 int psync_pagecache_have_all_pages_in_cache(uint64_t hash, uint64_t size);
@@ -41,6 +51,8 @@ int psync_pagecache_copy_all_pages_from_cache_to_file_locked(psync_openfile_t *o
 int psync_pagecache_lock_pages_in_cache();
 void psync_pagecache_unlock_pages_from_cache();
 void psync_pagecache_resize_cache();
+void psync_pagecache_resize_secondary_cache();
+void psync_pagecache_get_stats(pcache_stats_t *stats);
 void psync_pagecache_clean_cache();
 
 #endif
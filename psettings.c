@@ -67,7 +67,12 @@ static psync_setting_t settings[]={
   {"fsroot", fsroot_change, NULL, {0}, PSYNC_TSTRING},
   {"autostartfs", NULL, NULL, {PSYNC_AUTOSTARTFS_DEFAULT}, PSYNC_TBOOL},
   {"fscachesize", psync_pagecache_resize_cache, NULL, {PSYNC_FS_DEFAULT_CACHE_SIZE}, PSYNC_TNUMBER},
-  {"fscachepath", NULL, NULL, {0}, PSYNC_TSTRING}
+  {"fscachepath", NULL, NULL, {0}, PSYNC_TSTRING},
+  {"fslowlevel", fsroot_change, NULL, {PSYNC_FS_LOWLEVEL_DEFAULT}, PSYNC_TBOOL},
+  {"fsmemcachesize", NULL, NULL, {PSYNC_FS_MEMORY_CACHE}, PSYNC_TNUMBER},
+  {"fssecondarycachepath", psync_pagecache_resize_secondary_cache, NULL, {0}, PSYNC_TSTRING},
+  {"fssecondarycachesize", psync_pagecache_resize_secondary_cache, NULL, {PSYNC_FS_DEFAULT_SECONDARY_CACHE_SIZE}, PSYNC_TNUMBER},
+  {"fsp2preads", NULL, NULL, {PSYNC_FS_P2P_READS_DEFAULT}, PSYNC_TBOOL}
 };
 
 void psync_settings_reset(){
@@ -92,6 +97,11 @@ void psync_settings_reset(){
   settings[_PS(fsroot)].str=defaultfs;
   settings[_PS(fscachesize)].num=PSYNC_FS_DEFAULT_CACHE_SIZE;
   settings[_PS(fscachepath)].str=defaultcache;
+  settings[_PS(fslowlevel)].boolean=PSYNC_FS_LOWLEVEL_DEFAULT;
+  settings[_PS(fsmemcachesize)].num=PSYNC_FS_MEMORY_CACHE;
+  settings[_PS(fssecondarycachepath)].str="";
+  settings[_PS(fssecondarycachesize)].num=PSYNC_FS_DEFAULT_SECONDARY_CACHE_SIZE;
+  settings[_PS(fsp2preads)].boolean=PSYNC_FS_P2P_READS_DEFAULT;
   for (i=0; i<ARRAY_SIZE(settings); i++){
     if (settings[i].type==PSYNC_TSTRING){
       settings[i].str=psync_strdup(settings[i].str);
@@ -124,6 +134,7 @@ void psync_settings_init(){
   settings[_PS(ignorepatterns)].str=PSYNC_IGNORE_PATTERNS_DEFAULT;
   settings[_PS(fsroot)].str=defaultfs;
   settings[_PS(fscachepath)].str=defaultcache;
+  settings[_PS(fssecondarycachepath)].str="";
   for (i=0; i<ARRAY_SIZE(settings); i++){
     if (settings[i].type==PSYNC_TSTRING){
       settings[i].str=psync_strdup(settings[i].str);
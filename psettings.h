@@ -47,9 +47,27 @@
 #define PSYNC_P2P_HEXHASH_BYTES 3
 
 #define PSYNC_P2P_RSA_SIZE 2048
+#define PSYNC_P2P_BUFFER_SIZE (256*1024)
+#define PSYNC_P2P_PIPELINE_BUFFERS 4
+#define PSYNC_P2P_SOCKET_BUFFER (1024*1024)
+#define PSYNC_P2P_MAX_PEERS 4
+#define PSYNC_P2P_RANGE_CHUNK (4*1024*1024)
+#define PSYNC_P2P_RANGE_WINDOW 2
+#define PSYNC_P2P_MIN_SIZE_FOR_MULTIPEER (16*1024*1024)
+#define PSYNC_P2P_PEER_CACHE_TIME 30
+#define PSYNC_P2P_PEER_CACHE_NEG_TIME 120
+#define PSYNC_P2P_PEER_CACHE_MAX 64
+#define PSYNC_P2P_FS_MAX_MISSES 4
+#define PSYNC_P2P_FS_NOPEER_BACKOFF 300
+#define PSYNC_P2P_SESSION_IDLE_TIME 30
+#define PSYNC_P2P_CONNECT_TIMEOUT 2
+#define PSYNC_P2P_SOCKET_TIMEOUT 5
+#define PSYNC_P2P_MIN_RATE (256*1024)
 
 #define PSYNC_DIFF_LIMIT   500000
 
+#define PSYNC_TIMER_WORKERS 4
+
 #define PSYNC_SOCK_CONNECT_TIMEOUT 20
 #define PSYNC_SOCK_READ_TIMEOUT    60
 #define PSYNC_SOCK_WRITE_TIMEOUT   120
@@ -61,9 +79,25 @@
 #define PSYNC_STACK_SIZE (64*1024)
 
 #define PSYNC_DEBUG_LOG_ALLOC_OVER (8*1024*1024)
+#define PSYNC_DEBUG_ALLOC_SITES 4096
+#define PSYNC_DEBUG_ALLOC_SITES_DUMP 32
+
+#define PSYNC_SLAB_CHUNK_SIZE (16*1024)
+#define PSYNC_SLAB_THREAD_CACHE 128
+#define PSYNC_SLAB_MAX_SLABS 32
+#define PSYNC_ARENA_CHUNK_SIZE (16*1024)
+#define PSYNC_ARENA_THREAD_CHUNKS 4
+
+#define PSYNC_METRICS_MAX 128
+#define PSYNC_METRICS_HIST_MAX_BITS 40
+#define PSYNC_METRICS_SOCKET_BACKLOG 4
 
+#define PSYNC_QUERY_THREAD_CACHE_SIZE 64
 #define PSYNC_QUERY_CACHE_SEC 600
 #define PSYNC_QUERY_MAX_CNT 8
+#define PSYNC_QUERY_MAX_STMT_HANDLES 256
+
+#define PSYNC_FOLDER_PATH_CACHE_ENTRIES 16384
 
 #define PSYNC_MAX_PARALLEL_DOWNLOADS 32
 #define PSYNC_MAX_PARALLEL_UPLOADS 32
@@ -80,6 +114,12 @@
 
 #define PSYNC_UPLOAD_OLDER_THAN_SEC 5
 
+#define PSYNC_STATUS_RECONCILE_SEC 15
+#define PSYNC_STATUS_UPDATE_INTERVAL_MS 100
+
+#define PSYNC_EVENT_BATCH_WINDOW_MS 50
+#define PSYNC_EVENT_MAX_BATCH 1024
+
 #define PSYNC_SPEED_CALC_AVERAGE_SEC 8
 
 #define PSYNC_SCANNER_PERCENT     80
@@ -114,6 +154,7 @@
 
 #define PSYNC_DEFAULT_CACHE_FOLDER "Cache"
 #define PSYNC_DEFAULT_READ_CACHE_FILE "cached"
+#define PSYNC_DEFAULT_SECONDARY_CACHE_FILE "cached2"
 
 #define PSYNC_DEFAULT_FS_FOLDER "pCloudDrive"
 
@@ -133,8 +174,12 @@
 
 #define PSYNC_P2P_INITIAL_TIMEOUT      600
 #define PSYNC_P2P_SLEEP_WAIT_DOWNLOAD  20000
+#define PSYNC_P2P_PEER_COLLECT_TIMEOUT 50
 
 #define PSYNC_CRYPTO_PASS_TO_KEY_ITERATIONS 20000
+#define PSYNC_CRYPTO_CTR_BATCH_BLOCKS 256
+#define PSYNC_CRYPTO_PARALLEL_THREADS 4
+#define PSYNC_CRYPTO_PARALLEL_MIN_SECTORS 64
 
 #define PSYNC_HTTP_RESP_BUFFER 4000
 
@@ -169,17 +214,47 @@
 
 #define PSYNC_FS_PAGE_SIZE 4096
 #define PSYNC_FS_MEMORY_CACHE (16*1024*1024)
+#define PSYNC_FS_MIN_MEMORY_CACHE (2*1024*1024)
 #define PSYNC_FS_DISK_FLUSH_SEC 20
+#define PSYNC_FS_FLUSH_START_FREE_PERCENT 50
+#define PSYNC_FS_FLUSH_URGENT_FREE_PERCENT 10
+#define PSYNC_FS_FLUSH_MAX_IOV 64
+#define PSYNC_FS_FLUSH_DB_BATCH 256
 #define PSYNC_FS_FILESTREAMS_CNT 12
 #define PSYNC_FS_MIN_READAHEAD_START (128*1024)
 #define PSYNC_FS_MIN_READAHEAD_RAND (16*1024)
 #define PSYNC_FS_MAX_READAHEAD (16*1024*1024)
 #define PSYNC_FS_MAX_READAHEAD_SEC 16
+#define PSYNC_FS_KERNEL_READAHEAD (1024*1024)
+#define PSYNC_FS_STREAM_DETECT_BYTES (1024*1024)
+#define PSYNC_FS_STREAM_MIN_READAHEAD (4*1024*1024)
+#define PSYNC_FS_MAX_SPLICE_RANGES 32
+#define PSYNC_FS_PARALLEL_FETCH_CONNS 4
+#define PSYNC_FS_PARALLEL_FETCH_MIN (256*1024)
+#define PSYNC_FS_PROFILE_RANGES 16
+#define PSYNC_FS_PROFILE_MAX_RANGE_PAGES 256
+#define PSYNC_FS_PROFILE_MIN_FILE_SIZE (1024*1024)
+#define PSYNC_FS_PROFILE_EXPIRE_SEC (30*86400)
+#define PSYNC_FS_PROFILE_BUDGET_SEC 3600
+#define PSYNC_FS_PROFILE_BUDGET_DIV 16
+#define PSYNC_FS_INDEX_PENDING_RECORDS 256
+#define PSYNC_FS_INDEX_COMPACT_MIN 4096
+#define PSYNC_FS_INDEX_COMPACT_RATIO 4
+#define PSYNC_FS_WRITEBACK_BUFFER (256*1024)
+#define PSYNC_FS_WRITEBACK_MAX_WRITE (64*1024)
+#define PSYNC_FS_WRITEBACK_MAX_AGE_MS 500
+#define PSYNC_FS_WRITEBACK_CHECK_MS 250
+#define PSYNC_FS_FREE_SPACE_CHECK_SEC 1
 #define PSYNC_FS_DEFAULT_CACHE_SIZE ((uint64_t)5*1024*1024*1024)
+#define PSYNC_FS_DEFAULT_SECONDARY_CACHE_SIZE ((uint64_t)50*1024*1024*1024)
+#define PSYNC_FS_MIN_SECONDARY_CACHE_SIZE (64*1024*1024)
+#define PSYNC_FS_SECONDARY_PROMOTE_USECNT 2
 #define PSYNC_FS_DIRECT_UPLOAD_LIMIT (256*1024)
 #define PSYNC_FS_FILESIZE_FOR_2CONN (4*1024*1024)
 #define PSYNC_FS_FILE_LOC_HIST_SEC 30
 #define PSYNC_FS_MAX_SIZE_CONVERT_NEWFILE (32*PSYNC_FS_PAGE_SIZE)
+#define PSYNC_FS_ENTRY_TIMEOUT 30.0
+#define PSYNC_FS_ATTR_TIMEOUT 2.0
 
 /* defaults for database settings */
 #define PSYNC_USE_SSL_DEFAULT 1
@@ -187,7 +262,9 @@
 #define PSYNC_UPL_SHAPER_DEFAULT -1
 #define PSYNC_MIN_LOCAL_FREE_SPACE ((uint64_t)2048*1024*1024)
 #define PSYNC_P2P_SYNC_DEFAULT 1
+#define PSYNC_FS_P2P_READS_DEFAULT 0
 #define PSYNC_AUTOSTARTFS_DEFAULT 1
+#define PSYNC_FS_LOWLEVEL_DEFAULT 0
 #define PSYNC_IGNORE_PATTERNS_DEFAULT ".DS_Store;\
 .DS_Store?;\
 .AppleDouble;\
@@ -219,6 +296,11 @@ $RECYCLE.BIN;\
 #define PSYNC_SETTING_autostartfs       8
 #define PSYNC_SETTING_fscachesize       9
 #define PSYNC_SETTING_fscachepath      10
+#define PSYNC_SETTING_fslowlevel       11
+#define PSYNC_SETTING_fsmemcachesize   12
+#define PSYNC_SETTING_fssecondarycachepath 13
+#define PSYNC_SETTING_fssecondarycachesize 14
+#define PSYNC_SETTING_fsp2preads       15
 
 typedef int psync_settingid_t;
 
@@ -435,27 +435,50 @@ psync_symmetric_key_t psync_ssl_rsa_decrypt_symmetric_key(psync_rsa_privatekey_t
 }
 
 psync_aes256_encoder psync_ssl_aes256_create_encoder(psync_symmetric_key_t key){
-  AES_KEY *aes;
+  psync_aes256_key_t *aes;
   assert(key->keylen>=PSYNC_AES256_KEY_SIZE);
-  aes=psync_new(AES_KEY);
-  AES_set_encrypt_key(key->key, 256, aes);
+  aes=psync_new(psync_aes256_key_t);
+  AES_set_encrypt_key(key->key, 256, &aes->key);
+  aes->evp=EVP_CIPHER_CTX_new();
+  if (likely_log(aes->evp)){
+    if (likely_log(EVP_EncryptInit_ex(aes->evp, EVP_aes_256_ecb(), NULL, key->key, NULL)))
+      EVP_CIPHER_CTX_set_padding(aes->evp, 0);
+    else{
+      EVP_CIPHER_CTX_free(aes->evp);
+      aes->evp=NULL;
+    }
+  }
   return aes;
 }
 
 void psync_ssl_aes256_free_encoder(psync_aes256_encoder aes){
-  psync_ssl_memclean(aes, sizeof(AES_KEY));
+  if (aes->evp)
+    EVP_CIPHER_CTX_free(aes->evp);
+  psync_ssl_memclean(aes, sizeof(psync_aes256_key_t));
   psync_free(aes);
 }
 
+void psync_aes256_encode_blocks(psync_aes256_encoder enc, const unsigned char *src, unsigned char *dst, size_t cnt){
+  int outlen;
+  if (likely(enc->evp) && likely(EVP_EncryptUpdate(enc->evp, dst, &outlen, src, cnt*PSYNC_AES256_BLOCK_SIZE)))
+    return;
+  while (cnt--){
+    AES_encrypt(src, dst, &enc->key);
+    src+=PSYNC_AES256_BLOCK_SIZE;
+    dst+=PSYNC_AES256_BLOCK_SIZE;
+  }
+}
+
 psync_aes256_encoder psync_ssl_aes256_create_decoder(psync_symmetric_key_t key){
-  AES_KEY *aes;
+  psync_aes256_key_t *aes;
   assert(key->keylen>=PSYNC_AES256_KEY_SIZE);
-  aes=psync_new(AES_KEY);
-  AES_set_decrypt_key(key->key, 256, aes);
+  aes=psync_new(psync_aes256_key_t);
+  AES_set_decrypt_key(key->key, 256, &aes->key);
+  aes->evp=NULL;
   return aes;
 }
 
 void psync_ssl_aes256_free_decoder(psync_aes256_encoder aes){
-  psync_ssl_memclean(aes, sizeof(AES_KEY));
+  psync_ssl_memclean(aes, sizeof(psync_aes256_key_t));
   psync_free(aes);
 }
@@ -44,8 +44,16 @@ typedef struct {
   unsigned char key[];
 } psync_symmetric_key_struct_t, *psync_symmetric_key_t;
 
-typedef AES_KEY *psync_aes256_encoder;
-typedef AES_KEY *psync_aes256_decoder;
+/* evp is an ECB context used to encrypt many blocks at once, so that OpenSSL can use its pipelined AES-NI code, it is NULL for
+ * decoders
+ */
+typedef struct {
+  AES_KEY key;
+  EVP_CIPHER_CTX *evp;
+} psync_aes256_key_t;
+
+typedef psync_aes256_key_t *psync_aes256_encoder;
+typedef psync_aes256_key_t *psync_aes256_decoder;
 
 #define PSYNC_INVALID_RSA NULL
 #define PSYNC_INVALID_SYM_KEY NULL
@@ -69,12 +77,14 @@ typedef AES_KEY *psync_aes256_decoder;
 #define psync_sha512_final(checksum, pctx) SHA512_Final(checksum, pctx)
 
 static inline void psync_aes256_encode_block(psync_aes256_encoder enc, const unsigned char *src, unsigned char *dst){
-  AES_encrypt(src, dst, enc);
+  AES_encrypt(src, dst, &enc->key);
 }
 
 static inline void psync_aes256_decode_block(psync_aes256_decoder enc, const unsigned char *src, unsigned char *dst){
-  AES_decrypt(src, dst, enc);
+  AES_decrypt(src, dst, &enc->key);
 }
 
+void psync_aes256_encode_blocks(psync_aes256_encoder enc, const unsigned char *src, unsigned char *dst, size_t cnt);
+
 
 #endif
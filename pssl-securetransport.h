@@ -70,5 +70,10 @@ static inline void psync_aes256_decode_block(psync_aes256_decoder enc, const uns
   CCCryptorUpdate(enc, src, 16, dst, 16, &n);
 }
 
+static inline void psync_aes256_encode_blocks(psync_aes256_encoder enc, const unsigned char *src, unsigned char *dst, size_t cnt){
+  size_t n;
+  CCCryptorUpdate(enc, src, cnt*16, dst, cnt*16, &n);
+}
+
 
 #endif
\ No newline at end of file
@@ -31,6 +31,7 @@
 #include "ptasks.h"
 #include "pfstasks.h"
 #include "psettings.h"
+#include "pmetrics.h"
 #include <string.h>
 #include <stdarg.h>
 
@@ -47,6 +48,34 @@ static pthread_mutex_t statusmutex=PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t statuscond=PTHREAD_COND_INITIALIZER;
 static psync_uint_t status_waiters=0;
 
+/* filestodownload/bytestodownload and filestoupload/bytestoupload are maintained incrementally as tasks are created and
+ * completed, the full COUNT/SUM queries only run on init, after bulk changes and as a delayed reconciliation pass that
+ * corrects whatever drift the increments accumulate (e.g. files whose size changed while queued). */
+static pthread_mutex_t countersmutex=PTHREAD_MUTEX_INITIALIZER;
+static int download_reconcile_pending=0;
+static int upload_reconcile_pending=0;
+
+static int64_t metric_sample_to_download(){
+  return psync_status.filestodownload;
+}
+
+static int64_t metric_sample_downloading(){
+  return psync_status.filesdownloading;
+}
+
+static int64_t metric_sample_to_upload(){
+  return psync_status.filestoupload;
+}
+
+static int64_t metric_sample_uploading(){
+  return psync_status.filesuploading;
+}
+
+PSYNC_METRIC_GAUGE_FN(metric_to_download, "download_queue_files", metric_sample_to_download);
+PSYNC_METRIC_GAUGE_FN(metric_downloading, "download_active_files", metric_sample_downloading);
+PSYNC_METRIC_GAUGE_FN(metric_to_upload, "upload_queue_files", metric_sample_to_upload);
+PSYNC_METRIC_GAUGE_FN(metric_uploading, "upload_active_files", metric_sample_uploading);
+
 static uint32_t psync_calc_status(){
   if (statuses[PSTATUS_TYPE_AUTH]!=PSTATUS_AUTH_PROVIDED && statuses[PSTATUS_TYPE_AUTH]!=PSTATUS_INVALID){
     if (statuses[PSTATUS_TYPE_AUTH]==PSTATUS_AUTH_REQUIRED)
@@ -129,23 +158,33 @@ void psync_status_init(){
   psync_status_recalc_to_download();
   psync_status_recalc_to_upload();
   psync_status.status=psync_calc_status();
+  psync_metric_register(&metric_to_download);
+  psync_metric_register(&metric_downloading);
+  psync_metric_register(&metric_to_upload);
+  psync_metric_register(&metric_uploading);
 }
 
 void psync_status_recalc_to_download(){
   psync_sql_res *res;
   psync_uint_row row;
+  uint64_t bytestod;
+  uint32_t filestod;
   res=psync_sql_query("SELECT COUNT(*), SUM(f.size) FROM task t, file f WHERE t.type=? AND t.itemid=f.id");
   psync_sql_bind_uint(res, 1, PSYNC_DOWNLOAD_FILE);
   if ((row=psync_sql_fetch_rowint(res))){
-    psync_status.filestodownload=row[0];
-    psync_status.bytestodownload=row[1];
+    filestod=row[0];
+    bytestod=row[1];
   }
   else{
-    psync_status.filestodownload=0;
-    psync_status.bytestodownload=0;
+    filestod=0;
+    bytestod=0;
   }
   psync_sql_free_result(res);
-  if (!psync_status.filestodownload){
+  pthread_mutex_lock(&countersmutex);
+  psync_status.filestodownload=filestod;
+  psync_status.bytestodownload=bytestod;
+  pthread_mutex_unlock(&countersmutex);
+  if (!filestod){
     psync_status.downloadspeed=0;
     psync_status.status=psync_calc_status();
   }
@@ -186,22 +225,94 @@ void psync_status_recalc_to_upload(){
     psync_free(filename);
   }
   psync_sql_free_result(res);
+  pthread_mutex_lock(&countersmutex);
   psync_status.filestoupload=filestou;
   psync_status.bytestoupload=bytestou;
+  pthread_mutex_unlock(&countersmutex);
   if (!filestou)
     psync_status.uploadspeed=0;
   psync_status.status=psync_calc_status();
 }
 
-static void psync_status_recalc_to_upload_async_thread(){
+static void psync_status_reconcile_download_thread(){
+  pthread_mutex_lock(&countersmutex);
+  download_reconcile_pending=0;
+  pthread_mutex_unlock(&countersmutex);
+  psync_status_recalc_to_download();
+  psync_send_status_update();
+}
+
+static void psync_status_reconcile_upload_thread(){
+  pthread_mutex_lock(&countersmutex);
+  upload_reconcile_pending=0;
+  pthread_mutex_unlock(&countersmutex);
   psync_status_recalc_to_upload();
   psync_send_status_update();
 }
 
+static void psync_status_reconcile_download_timer(void *ptr){
+  psync_run_thread("recalc download", psync_status_reconcile_download_thread);
+}
+
+static void psync_status_reconcile_upload_timer(void *ptr){
+  psync_run_thread("recalc upload", psync_status_reconcile_upload_thread);
+}
+
+void psync_status_recalc_to_download_async(){
+  int run;
+  pthread_mutex_lock(&countersmutex);
+  run=!download_reconcile_pending;
+  download_reconcile_pending=1;
+  pthread_mutex_unlock(&countersmutex);
+  if (run)
+    psync_run_after_sec(psync_status_reconcile_download_timer, NULL, PSYNC_STATUS_RECONCILE_SEC);
+}
+
 void psync_status_recalc_to_upload_async(){
-  psync_run_thread("recalc upload", psync_status_recalc_to_upload_async_thread);
+  int run;
+  pthread_mutex_lock(&countersmutex);
+  run=!upload_reconcile_pending;
+  upload_reconcile_pending=1;
+  pthread_mutex_unlock(&countersmutex);
+  if (run)
+    psync_run_after_sec(psync_status_reconcile_upload_timer, NULL, PSYNC_STATUS_RECONCILE_SEC);
+}
+
+void psync_status_add_to_download(int32_t files, int64_t bytes){
+  pthread_mutex_lock(&countersmutex);
+  if (files<0 && psync_status.filestodownload<(uint32_t)-files)
+    psync_status.filestodownload=0;
+  else
+    psync_status.filestodownload+=files;
+  if (bytes<0 && psync_status.bytestodownload<(uint64_t)-bytes)
+    psync_status.bytestodownload=0;
+  else
+    psync_status.bytestodownload+=bytes;
+  if (!psync_status.filestodownload){
+    psync_status.bytestodownload=0;
+    psync_status.downloadspeed=0;
+  }
+  pthread_mutex_unlock(&countersmutex);
+  psync_status.status=psync_calc_status();
 }
 
+void psync_status_add_to_upload(int32_t files, int64_t bytes){
+  pthread_mutex_lock(&countersmutex);
+  if (files<0 && psync_status.filestoupload<(uint32_t)-files)
+    psync_status.filestoupload=0;
+  else
+    psync_status.filestoupload+=files;
+  if (bytes<0 && psync_status.bytestoupload<(uint64_t)-bytes)
+    psync_status.bytestoupload=0;
+  else
+    psync_status.bytestoupload+=bytes;
+  if (!psync_status.filestoupload){
+    psync_status.bytestoupload=0;
+    psync_status.uploadspeed=0;
+  }
+  pthread_mutex_unlock(&countersmutex);
+  psync_status.status=psync_calc_status();
+}
 
 uint32_t psync_status_get(uint32_t statusid){
   pthread_mutex_lock(&statusmutex);
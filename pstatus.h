@@ -71,7 +71,10 @@
 void psync_status_init();
 void psync_status_recalc_to_download();
 void psync_status_recalc_to_upload();
+void psync_status_recalc_to_download_async();
 void psync_status_recalc_to_upload_async();
+void psync_status_add_to_download(int32_t files, int64_t bytes);
+void psync_status_add_to_upload(int32_t files, int64_t bytes);
 uint32_t psync_status_get(uint32_t statusid);
 void psync_set_status(uint32_t statusid, uint32_t status);
 void psync_wait_status(uint32_t statusid, uint32_t status);
@@ -289,8 +289,10 @@ void psync_syncer_new(psync_syncid_t syncid){
 static void psync_syncer_thread(){
   int64_t syncid;
   psync_sql_lock();
-  if (psync_sql_cellint("SELECT COUNT(*) FROM task", -1)==0)
+  if (psync_sql_cellint("SELECT COUNT(*) FROM task", -1)==0){
     psync_sql_statement("DELETE FROM syncfolder WHERE folderid IS NULL");
+    psync_path_cache_clean();
+  }
   while ((syncid=psync_sql_cellint("SELECT id FROM syncfolder WHERE flags=0", -1))!=-1)
     psync_sync_newsyncedfolder(syncid);
   psync_sql_unlock();
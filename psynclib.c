@@ -47,6 +47,8 @@
 #include "pp2p.h"
 #include "plocalnotify.h"
 #include "pcache.h"
+#include "pmem.h"
+#include "pmetrics.h"
 #include "pfileops.h"
 #include "ppagecache.h"
 #include <string.h>
@@ -64,6 +66,9 @@ static psync_malloc_t psync_real_malloc=malloc;
 
 static void *debug_malloc(size_t sz){
   void *ptr;
+#if defined(__GNUC__)
+  psync_mem_count_alloc(__builtin_return_address(0), sz);
+#endif
   if (unlikely(sz>=PSYNC_DEBUG_LOG_ALLOC_OVER))
     debug(D_WARNING, "allocating %lu bytes", (unsigned long)sz);
   ptr=psync_real_malloc(sz);
@@ -117,8 +122,8 @@ int psync_init(){
       return 0;
     }
   }
-  psync_cache_init();
   psync_timer_init();
+  psync_cache_init();
   psync_compat_init();
   if (!psync_database){
     psync_database=psync_get_default_database_path();
@@ -196,12 +201,22 @@ void psync_destroy(){
   psync_sql_lock();
   psync_cache_clean_all();
   psync_sql_close();
+  if (IS_DEBUG)
+    psync_mem_dump_stats();
 }
 
 void psync_get_status(pstatus_t *status){
   memcpy(status, &psync_status, sizeof(pstatus_t));
 }
 
+char *psync_get_metrics(){
+  return psync_metrics_dump();
+}
+
+int psync_start_metrics_socket(const char *path){
+  return psync_metrics_start_socket(path);
+}
+
 char *psync_get_username(){
   return psync_sql_cellstr("SELECT value FROM setting WHERE id='username'");
 }
@@ -325,13 +340,14 @@ void psync_unlink(){
   psync_sql_lock();
   debug(D_NOTICE, "clearing database, locked");
   psync_cache_clean_all();
+  psync_path_cache_clean();
+  psync_pagecache_clean_cache();
   ret=psync_sql_close();
   psync_file_delete(psync_database);
   if (ret){
     debug(D_ERROR, "failed to close database, exiting");
     exit(1);
   }
-  psync_pagecache_clean_cache();
   psync_sql_connect(psync_database);
   /*
     psync_sql_res *res;
@@ -590,6 +606,7 @@ int psync_change_synctype(psync_syncid_t syncid, psync_synctype_t synctype){
   psync_sql_bind_uint(res, 1, syncid);
   psync_sql_run_free(res);
   psync_sql_commit_transaction();
+  psync_path_cache_invalidate_sync(syncid);
   psync_localnotify_del_sync(syncid);
   psync_stop_sync_download(syncid);
   psync_stop_sync_upload(syncid);
@@ -642,6 +659,7 @@ int psync_delete_sync(psync_syncid_t syncid){
   if (psync_sql_commit_transaction())
     return -1;
   else{
+    psync_path_cache_invalidate_sync(syncid);
     psync_stop_sync_download(syncid);
     psync_stop_sync_upload(syncid);
     psync_localnotify_del_sync(syncid);
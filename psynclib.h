@@ -75,6 +75,20 @@ typedef struct {
   pentry_t entries[];
 } pfolder_list_t;
 
+typedef struct {
+  uint64_t hits;
+  uint64_t misses;
+  uint64_t capacity; /* in bytes, zero if the tier is not in use */
+} pcache_tier_stats_t;
+
+typedef struct {
+  pcache_tier_stats_t memory;
+  pcache_tier_stats_t disk;
+  pcache_tier_stats_t secondary;
+  uint64_t promoted; /* pages moved from the secondary tier back to memory/disk */
+  uint64_t demoted; /* pages moved from the disk tier to the secondary one */
+} pcache_stats_t;
+
 typedef struct {
   const char *localpath;
   const char *name;
@@ -348,6 +362,20 @@ typedef void (*pstatus_change_callback_t)(pstatus_t *status);
 
 typedef void (*pevent_callback_t)(psync_eventtype_t event, psync_eventdata_t data);
 
+/* Batched event callback receives all events that accumulated during a short window
+ * (and up to a limit) at once, in the order they happened. Same rules as for
+ * pevent_callback_t apply to the data of each event, the whole array and all strings
+ * are freed when the callback returns. Remote paths of file and folder events are
+ * resolved just before delivery.
+ */
+
+typedef struct {
+  psync_eventtype_t event;
+  psync_eventdata_t data;
+} psync_event_t;
+
+typedef void (*pevent_batch_callback_t)(const psync_event_t *events, uint32_t cnt);
+
 /* psync_init inits the sync library. No network or local scan operations are initiated
  * by this call, call psync_start_sync to start those. However listing remote folders,
  * listing and editing syncs is supported.
@@ -358,6 +386,9 @@ typedef void (*pevent_callback_t)(psync_eventtype_t event, psync_eventdata_t dat
  * at least status_callback will make sense. Applications should expect immediate
  * status_callback with status of PSTATUS_LOGIN_REQUIRED after first run of psync_start_sync().
  *
+ * psync_set_event_batch_callback can be called after psync_init and before psync_start_sync
+ * to receive events in batches. In this case event_callback of psync_start_sync should be NULL.
+ *
  * psync_download_state is to be called after psync_init but before/instead of psync_start_sync.
  * This function downloads the directory structure into the local state in foreground (e.g. it can
  * take time to complete). It returns one of PSTATUS_-es, specifically PSTATUS_READY, PSTATUS_OFFLINE
@@ -393,6 +424,7 @@ void psync_set_alloc(psync_malloc_t malloc_call, psync_realloc_t realloc_call, p
 
 int psync_init();
 void psync_start_sync(pstatus_change_callback_t status_callback, pevent_callback_t event_callback);
+void psync_set_event_batch_callback(pevent_batch_callback_t event_callback);
 uint32_t psync_download_state();
 void psync_destroy();
 
@@ -562,6 +594,14 @@ const char *psync_get_auth_string();
  * fscachesize (uint) - size of filesystem cache, in bytes, sane minimum of few tens of Mb or even hundreds is advised
  * fsroot (string) - where to mount the filesystem
  * autostartfs (bool) - if set starts the fs on app startup
+ * fslowlevel (bool) - if set and supported by the platform, the filesystem is served through the low-level (inode based) fuse
+ *                     interface, changing it remounts the filesystem
+ * fsmemcachesize (uint) - size of the in-memory part of filesystem cache, in bytes, takes effect when the filesystem is started
+ * fssecondarycachepath (string) - folder of an optional secondary filesystem cache, usually on a large and slower disk, pages
+ *                     evicted from the main cache are moved there and moved back when accessed again, empty string disables it
+ * fssecondarycachesize (uint) - size of the secondary filesystem cache in bytes, changing it or the path drops its content
+ * fsp2preads (bool) - if set, filesystem reads of files not in the cache are first tried from peers on the LAN, data from peers
+ *                     is not verified, so only enable it on trusted networks, off by default
  * 
  *
  * The following functions operate on settings. The value of psync_get_string_setting does not have to be freed, however if you are
@@ -734,6 +774,8 @@ void psync_run_new_version(psync_new_version_t *ver);
  * psync_fs_get_path_by_folderid() - returns full path (including mountpoint) of a given folderid on the filesystem or
  *                            NULL if it is not mounted or folder could not be found. You are supposed to free the returned
  *                            pointer.
+ * psync_fs_get_cache_stats() - fills stats with hit and miss counters of every tier of the filesystem cache (memory, main disk
+ *                            cache and secondary cache) since the filesystem was started.
  * 
  */
 
@@ -742,6 +784,23 @@ int psync_fs_isstarted();
 void psync_fs_stop();
 char *psync_fs_getmountpoint();
 char *psync_fs_get_path_by_folderid(psync_folderid_t folderid);
+void psync_fs_get_cache_stats(pcache_stats_t *stats);
+
+/* Metrics.
+ *
+ * psync_get_metrics() - returns the current values of the library metrics as text, one metric per line. Counters and gauges
+ *                            are "name value", histograms are "name count=.. sum=.. p50=.. p90=.. p99=.. max=..". Names
+ *                            ending in _usec are latencies in microseconds. You are supposed to free the returned pointer.
+ * psync_start_metrics_socket() - starts listening on a local unix socket at path that writes the same text to anyone
+ *                            that connects and closes the connection, e.g. for "socat - UNIX-CONNECT:path". The socket is
+ *                            only accessible by the current user. A stale socket at path is replaced, if any other file is
+ *                            there the call fails. Returns 0 on success and -1 on failure or if the platform does not have
+ *                            unix sockets.
+ *
+ */
+
+char *psync_get_metrics();
+int psync_start_metrics_socket(const char *path);
 
 #ifdef __cplusplus
 }
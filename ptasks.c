@@ -93,6 +93,20 @@ static void create_task6(psync_uint_t type, psync_syncid_t syncid, uint64_t entr
   psync_sql_run_free(res);
 }
 
+static uint64_t get_size(const char *sql, uint64_t id){
+  psync_sql_res *res;
+  psync_uint_row row;
+  uint64_t size;
+  res=psync_sql_query(sql);
+  psync_sql_bind_uint(res, 1, id);
+  if ((row=psync_sql_fetch_rowint(res)))
+    size=row[0];
+  else
+    size=0;
+  psync_sql_free_result(res);
+  return size;
+}
+
 void psync_task_create_local_folder(psync_syncid_t syncid, psync_folderid_t folderid, psync_folderid_t localfolderid){
   create_task1(PSYNC_CREATE_LOCAL_FOLDER, syncid, folderid, localfolderid);
 }
@@ -113,7 +127,7 @@ void psync_task_rename_local_folder(psync_syncid_t syncid, psync_folderid_t fold
 void psync_task_download_file(psync_syncid_t syncid, psync_fileid_t fileid, psync_folderid_t localfolderid, const char *name){
   create_task3(PSYNC_DOWNLOAD_FILE, syncid, fileid, localfolderid, name);
   psync_wake_download();
-  psync_status_recalc_to_download();
+  psync_status_add_to_download(1, get_size("SELECT size FROM file WHERE id=?", fileid));
   psync_send_status_update();
 }
 
@@ -150,7 +164,7 @@ void psync_task_create_remote_folder(psync_syncid_t syncid, psync_folderid_t loc
 void psync_task_upload_file(psync_syncid_t syncid, psync_fileid_t localfileid, const char *name){
   create_task3(PSYNC_UPLOAD_FILE, syncid, 0, localfileid, name);
   psync_wake_upload();
-  psync_status_recalc_to_upload();
+  psync_status_add_to_upload(1, get_size("SELECT size FROM localfile WHERE id=?", localfileid));
   psync_send_status_update();
 }
 
@@ -29,22 +29,35 @@
 #include "ptimer.h"
 #include "pcompat.h"
 #include "plibs.h"
+#include "psettings.h"
 
-/* Maximum timeout possible is TIMER_ARRAY_SIZE^TIMER_LEVELS seconds, in the worst case
- * TIMER_LEVELS operations will be preformed for each timer to service it
- * (it is log TIMER_ARRAY_SIZE(timer_seconds_after_now)). So servicing a timer is
- * generally constant time task with a maximum constant of TIMER_LEVELS and increasing
- * TIMER_ARRAY_SIZE will trade memory for less processing for each timer.
- * 
+/* Hierarchical timing wheel with millisecond ticks. A timer is kept at the lowest level whose slot index is the only
+ * thing that differs between its expiration time and the current tick, so level 0 holds the timers that expire within
+ * the current TIMER_ARRAY_SIZE ms block and each upper level covers TIMER_ARRAY_SIZE times more. When the index of a level
+ * wraps to zero, the current slot of the level above is cascaded down. The maximum timeout is roughly
+ * TIMER_ARRAY_SIZE^TIMER_LEVELS ms (about 49 days) and a timer is moved at most TIMER_LEVELS times before it fires.
+ *
+ * The timer thread only moves timers around, callbacks are handed to PSYNC_TIMER_WORKERS worker threads, so a slow
+ * callback does not delay other timers. A periodic timer is re-armed only after its callback returns, so it never runs
+ * concurrently with itself.
+ *
+ * psync_timer_stop does not take any lock, it only flips the state of the timer. Stopped timers are unlinked and freed
+ * by the timer thread when it reaches them (or by the worker if the callback is running).
+ *
  * TIMER_ARRAY_SIZE should be a power of two.
  */
 
-#define TIMER_ARRAY_SIZE_SHIFT 6 /* 64 */
+#define TIMER_ARRAY_SIZE_SHIFT 8 /* 256 */
 #define TIMER_ARRAY_SIZE (1<<TIMER_ARRAY_SIZE_SHIFT)
-#define TIMER_LEVELS 3
+#define TIMER_ARRAY_MASK (TIMER_ARRAY_SIZE-1)
+#define TIMER_LEVELS 4
+
+#define TIMER_MAX_MS ((((uint64_t)1)<<(TIMER_ARRAY_SIZE_SHIFT*TIMER_LEVELS))-(((uint64_t)1)<<(TIMER_ARRAY_SIZE_SHIFT*(TIMER_LEVELS-1))))
 
+#define PTIMER_IDLE           0
 #define PTIMER_IS_RUNNING     1
 #define PTIMER_STOP_AFTER_RUN 2
+#define PTIMER_STOPPED        3
 
 time_t psync_current_time;
 
@@ -58,87 +71,171 @@ static psync_list timerlists[TIMER_LEVELS][TIMER_ARRAY_SIZE];
 static struct exception_list *excepions=NULL;
 static pthread_mutex_t timer_mutex=PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t timer_cond=PTHREAD_COND_INITIALIZER;
+static pthread_cond_t timer_thread_cond=PTHREAD_COND_INITIALIZER;
+static uint64_t timer_tick;
+static uint64_t timer_wakeat;
 static uint32_t nextsecwaiters=0;
 static int timer_running=0;
 
-static void timer_check_upper_levels(time_t tmdiv, psync_uint_t level, psync_uint_t sh){
+static psync_list timer_run_queue=PSYNC_LIST_STATIC_INIT(timer_run_queue);
+static pthread_mutex_t timer_run_mutex=PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t timer_run_cond=PTHREAD_COND_INITIALIZER;
+
+static uint64_t timer_now_ms(){
+  struct timespec tm;
+  psync_nanotime(&tm);
+  return (uint64_t)tm.tv_sec*1000+tm.tv_nsec/1000000;
+}
+
+/* timer_mutex should be held, runat should be after timer_tick */
+static void timer_insert(psync_timer_t timer){
+  uint32_t level, sh;
+  for (level=0; level<TIMER_LEVELS-1; level++)
+    if (!((timer->runat^timer_tick)>>((level+1)*TIMER_ARRAY_SIZE_SHIFT)))
+      break;
+  sh=level*TIMER_ARRAY_SIZE_SHIFT;
+  psync_list_add_tail(&timerlists[level][(timer->runat>>sh)&TIMER_ARRAY_MASK], &timer->list);
+}
+
+static void timer_schedule(psync_timer_t timer, uint64_t runat){
+  if (runat<=timer_tick)
+    runat=timer_tick+1;
+  timer->runat=runat;
+  timer_insert(timer);
+  if (runat<timer_wakeat){
+    timer_wakeat=runat;
+    pthread_cond_signal(&timer_thread_cond);
+  }
+}
+
+static void timer_cascade(uint32_t level){
   psync_list *l1, *l2, *l;
-  time_t m;
-  m=tmdiv%TIMER_ARRAY_SIZE;
-  if (m==0 && level<TIMER_LEVELS-2)
-    timer_check_upper_levels(tmdiv/TIMER_ARRAY_SIZE, level+1, sh+TIMER_ARRAY_SIZE_SHIFT);
-  l=&timerlists[level+1][m];
-  psync_list_for_each_safe(l1, l2, l)
-    psync_list_add_tail(&timerlists[level][(psync_list_element(l1, psync_timer_structure_t, list)->runat>>sh)%TIMER_ARRAY_SIZE], l1);
-  psync_list_init(&timerlists[level+1][m]);
-}
-
-static void timer_prepare_timers(time_t from, time_t to, psync_list *list){
-  time_t i, m;
-  psync_list *l1, *l2;
-  for (i=from+1; i<=to; i++){
-    m=i%TIMER_ARRAY_SIZE;
-    if (m==0)
-      timer_check_upper_levels(i/TIMER_ARRAY_SIZE, 0, 0);
-    psync_list_for_each_safe(l1, l2, &timerlists[0][m]){
-      psync_list_element(l1, psync_timer_structure_t, list)->opts|=PTIMER_IS_RUNNING;
-      psync_list_add_tail(list, l1);
+  psync_timer_t timer;
+  uint32_t idx;
+  idx=(timer_tick>>(level*TIMER_ARRAY_SIZE_SHIFT))&TIMER_ARRAY_MASK;
+  if (idx==0 && level<TIMER_LEVELS-1)
+    timer_cascade(level+1);
+  l=&timerlists[level][idx];
+  psync_list_for_each_safe(l1, l2, l){
+    timer=psync_list_element(l1, psync_timer_structure_t, list);
+    if (psync_atomic_load_int(&timer->state)==PTIMER_STOPPED)
+      psync_free(timer);
+    else
+      timer_insert(timer);
+  }
+  psync_list_init(l);
+}
+
+/* returns the first tick after timer_tick at which a non-empty slot has to be processed */
+static uint64_t timer_next_event(){
+  uint64_t base;
+  uint32_t level, sh, idx;
+  for (level=0; level<TIMER_LEVELS; level++){
+    sh=level*TIMER_ARRAY_SIZE_SHIFT;
+    base=(timer_tick>>sh)&~((uint64_t)TIMER_ARRAY_MASK);
+    for (idx=((timer_tick>>sh)&TIMER_ARRAY_MASK)+1; idx<TIMER_ARRAY_SIZE; idx++)
+      if (!psync_list_isempty(&timerlists[level][idx]))
+        return (base+idx)<<sh;
+  }
+  return ((timer_tick>>(TIMER_LEVELS*TIMER_ARRAY_SIZE_SHIFT))+1)<<(TIMER_LEVELS*TIMER_ARRAY_SIZE_SHIFT);
+}
+
+/* Advances timer_tick to now, only stopping at slots that hold timers, so a long sleep costs no more than the
+ * number of timers.
+ */
+static void timer_prepare_timers(uint64_t now, psync_list *list){
+  psync_list *l1, *l2, *l;
+  psync_timer_t timer;
+  uint64_t next;
+  while (timer_tick<now){
+    next=timer_next_event();
+    if (next>now){
+      timer_tick=now;
+      break;
+    }
+    timer_tick=next;
+    if ((timer_tick&TIMER_ARRAY_MASK)==0)
+      timer_cascade(1);
+    l=&timerlists[0][timer_tick&TIMER_ARRAY_MASK];
+    psync_list_for_each_safe(l1, l2, l){
+      timer=psync_list_element(l1, psync_timer_structure_t, list);
+      if (psync_atomic_cas_int(&timer->state, PTIMER_IDLE, PTIMER_IS_RUNNING))
+        psync_list_add_tail(list, l1);
+      else
+        psync_free(timer);
+    }
+    psync_list_init(l);
+  }
+}
+
+static void timer_finish_run(psync_timer_t timer){
+  pthread_mutex_lock(&timer_mutex);
+  if (psync_atomic_cas_int(&timer->state, PTIMER_IS_RUNNING, PTIMER_IDLE)){
+    timer_schedule(timer, timer_now_ms()+timer->numms);
+    timer=NULL;
+  }
+  pthread_mutex_unlock(&timer_mutex);
+  if (timer)
+    psync_free(timer);
+}
+
+static void timer_worker_thread(){
+  psync_timer_t timer;
+  pthread_mutex_lock(&timer_run_mutex);
+  while (psync_do_run){
+    if (psync_list_isempty(&timer_run_queue)){
+      pthread_cond_wait(&timer_run_cond, &timer_run_mutex);
+      continue;
     }
-    psync_list_init(&timerlists[0][m]);
+    timer=psync_list_remove_head_element(&timer_run_queue, psync_timer_structure_t, list);
+    pthread_mutex_unlock(&timer_run_mutex);
+    timer->call(timer, timer->param);
+    timer_finish_run(timer);
+    pthread_mutex_lock(&timer_run_mutex);
   }
+  pthread_mutex_unlock(&timer_run_mutex);
 }
 
 static void timer_thread(){
-//  struct timespec tm;
   psync_list timers;
-  psync_timer_t timer;
   psync_list *l1, *l2;
+  struct timespec tm;
+  uint64_t now, nextsec;
   time_t lt;
   lt=psync_current_time;
-//  tm.tv_nsec=500000000;
+  pthread_mutex_lock(&timer_mutex);
   while (psync_do_run){
-    /* pthread_cond_timedwait is better than sleep as it waits for absolute time and therefore no
-     * matter how much time actual timers wasted, they get called every second sharply.
-     * 
-     * but this is not reliable on Mac OS X
-     */
-//    tm.tv_sec=psync_current_time+1;
     psync_list_init(&timers);
-    psync_milisleep(1000);
-    psync_current_time=psync_time();
-    pthread_mutex_lock(&timer_mutex);
-//    pthread_cond_timedwait(&timer_cond, &timer_mutex, &tm);
-    timer_prepare_timers(lt, psync_current_time, &timers);
-    if (nextsecwaiters)
+    now=timer_now_ms();
+    timer_prepare_timers(now, &timers);
+    psync_current_time=now/1000;
+    if (psync_current_time!=lt && nextsecwaiters)
       pthread_cond_broadcast(&timer_cond);
-    pthread_mutex_unlock(&timer_mutex);
     if (!psync_list_isempty(&timers)){
-      psync_list_for_each_element(timer, &timers, psync_timer_structure_t, list)
-        timer->call(timer, timer->param);
-      pthread_mutex_lock(&timer_mutex);
-      psync_list_for_each_safe(l1, l2, &timers){
-        timer=psync_list_element(l1, psync_timer_structure_t, list);
-        if (!(timer->opts&PTIMER_STOP_AFTER_RUN)){
-          timer->opts=0;
-          psync_list_del(l1);
-          timer->runat=psync_current_time+timer->numsec;
-          psync_list_add_tail(&timerlists[timer->level][(timer->runat>>(timer->level*TIMER_ARRAY_SIZE_SHIFT))%TIMER_ARRAY_SIZE], &timer->list);
-        }
-      }
-      pthread_mutex_unlock(&timer_mutex);
-      psync_list_for_each_element_call(&timers, psync_timer_structure_t, list, psync_free);
+      pthread_mutex_lock(&timer_run_mutex);
+      psync_list_for_each_safe(l1, l2, &timers)
+        psync_list_add_tail(&timer_run_queue, l1);
+      pthread_cond_broadcast(&timer_run_cond);
+      pthread_mutex_unlock(&timer_run_mutex);
     }
-    if (unlikely(psync_current_time-lt>=15)){
-      debug(D_NOTICE, "sleep detected, current_time=%lu, last_current_time=%lu", (unsigned long)psync_current_time, (unsigned long)lt);
-      psync_timer_notify_exception();
-    }
-    else if (unlikely_log(psync_current_time==lt)){
-      if (!psync_do_run)
-        break;
-      psync_milisleep(1000);
+    if (psync_current_time!=lt){
+      if (unlikely(psync_current_time-lt>=15)){
+        debug(D_NOTICE, "sleep detected, current_time=%lu, last_current_time=%lu", (unsigned long)psync_current_time, (unsigned long)lt);
+        pthread_mutex_unlock(&timer_mutex);
+        psync_timer_notify_exception();
+        pthread_mutex_lock(&timer_mutex);
+      }
+      lt=psync_current_time;
     }
-    lt=psync_current_time;
+    nextsec=((uint64_t)psync_current_time+1)*1000;
+    timer_wakeat=timer_next_event();
+    if (timer_wakeat>nextsec)
+      timer_wakeat=nextsec;
+    tm.tv_sec=timer_wakeat/1000;
+    tm.tv_nsec=(timer_wakeat%1000)*1000000;
+    pthread_cond_timedwait(&timer_thread_cond, &timer_mutex, &tm);
   }
+  pthread_mutex_unlock(&timer_mutex);
 }
 
 void psync_timer_init(){
@@ -146,11 +243,19 @@ void psync_timer_init(){
   for (i=0; i<TIMER_LEVELS; i++)
     for (j=0; j<TIMER_ARRAY_SIZE; j++)
       psync_list_init(&timerlists[i][j]);
-  psync_current_time=psync_time();
+  timer_tick=timer_now_ms();
+  timer_wakeat=timer_tick;
+  psync_current_time=timer_tick/1000;
+  for (i=0; i<PSYNC_TIMER_WORKERS; i++)
+    psync_run_thread("timer", timer_worker_thread);
   psync_run_thread("timer", timer_thread);
   timer_running=1;
 }
 
+uint64_t psync_timer_time_ms(){
+  return timer_now_ms();
+}
+
 time_t psync_timer_time(){
   if (timer_running)
     return psync_current_time;
@@ -159,55 +264,52 @@ time_t psync_timer_time(){
 }
 
 void psync_timer_wake(){
-  pthread_cond_signal(&timer_cond);
+  pthread_mutex_lock(&timer_mutex);
+  pthread_cond_signal(&timer_thread_cond);
+  pthread_mutex_unlock(&timer_mutex);
+  pthread_mutex_lock(&timer_run_mutex);
+  pthread_cond_broadcast(&timer_run_cond);
+  pthread_mutex_unlock(&timer_run_mutex);
 }
 
-psync_timer_t psync_timer_register(psync_timer_callback func, time_t numsec, void *param){
+psync_timer_t psync_timer_register_ms(psync_timer_callback func, uint64_t numms, void *param){
   psync_timer_t timer;
-  uint32_t i;
-  time_t n;
+  if (unlikely(numms>TIMER_MAX_MS)){
+    debug(D_ERROR, "requested timeout %lums is larger than the maximum of %lums", (unsigned long)numms, (unsigned long)TIMER_MAX_MS);
+    numms=TIMER_MAX_MS;
+  }
   timer=psync_new(psync_timer_structure_t);
   timer->call=func;
   timer->param=param;
-  n=TIMER_ARRAY_SIZE;
-  for (i=0; i<TIMER_LEVELS; i++){
-    if (numsec<=n)
-      break;
-    else
-      n*=TIMER_ARRAY_SIZE;
-  }
-  if (unlikely(i==TIMER_LEVELS)){
-    n/=TIMER_ARRAY_SIZE;
-    debug(D_ERROR, "requested timeout %lu is larger than the maximum of %lu", (unsigned long)numsec, (unsigned long)n);
-    numsec=n;
-    i--;
-  }
-  timer->numsec=numsec;
-  timer->level=i;
-  timer->opts=0;
+  timer->numms=numms;
+  timer->state=PTIMER_IDLE;
   pthread_mutex_lock(&timer_mutex);
-  timer->runat=psync_current_time+numsec;
-  psync_list_add_tail(&timerlists[i][(timer->runat>>(i*TIMER_ARRAY_SIZE_SHIFT))%TIMER_ARRAY_SIZE], &timer->list);
+  timer_schedule(timer, timer_now_ms()+numms);
   pthread_mutex_unlock(&timer_mutex);
   return timer;
 }
 
+psync_timer_t psync_timer_register(psync_timer_callback func, time_t numsec, void *param){
+  return psync_timer_register_ms(func, (uint64_t)numsec*1000, param);
+}
+
 int psync_timer_stop(psync_timer_t timer){
-  int needfree=0;
-  pthread_mutex_lock(&timer_mutex);
-  if (timer->opts&PTIMER_IS_RUNNING)
-    timer->opts|=PTIMER_STOP_AFTER_RUN;
-  else{
-    psync_list_del(&timer->list);
-    needfree=1;
-  }
-  pthread_mutex_unlock(&timer_mutex);
-  if (needfree){
-    psync_free(timer);
-    return 0;
+  uint32_t state;
+  while (1){
+    state=psync_atomic_load_int(&timer->state);
+    if (state==PTIMER_IDLE){
+      if (psync_atomic_cas_int(&timer->state, PTIMER_IDLE, PTIMER_STOPPED))
+        return 0;
+    }
+    else if (state==PTIMER_IS_RUNNING){
+      if (psync_atomic_cas_int(&timer->state, PTIMER_IS_RUNNING, PTIMER_STOP_AFTER_RUN))
+        return 1;
+    }
+    else{
+      debug(D_BUG, "timer %p stopped twice", timer);
+      return state==PTIMER_STOP_AFTER_RUN;
+    }
   }
-  else
-    return 1;
 }
 
 void psync_timer_exception_handler(psync_exception_callback func){
@@ -44,16 +44,22 @@ typedef struct _psync_timer_t {
   psync_list list;
   psync_timer_callback call;
   void *param;
-  time_t numsec;
-  time_t runat;
-  uint32_t level;
-  uint32_t opts;
+  uint64_t numms;
+  uint64_t runat;
+  uint32_t state;
 } psync_timer_structure_t, *psync_timer_t;
 
 void psync_timer_init();
 time_t psync_timer_time();
+uint64_t psync_timer_time_ms();
 void psync_timer_wake();
 psync_timer_t psync_timer_register(psync_timer_callback func, time_t numsec, void *param);
+psync_timer_t psync_timer_register_ms(psync_timer_callback func, uint64_t numms, void *param);
+
+/* Does not take any lock. Returns 0 if the timer was stopped before its callback got scheduled, in this case the callback
+ * will not be called. Returns 1 if the callback is running or queued to run, it will be called (once) and the timer is freed
+ * after it returns. In both cases the timer pointer should not be used after the call.
+ */
 int psync_timer_stop(psync_timer_t timer);
 void psync_timer_exception_handler(psync_exception_callback func);
 void psync_timer_do_notify_exception();
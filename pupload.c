@@ -56,8 +56,7 @@ typedef struct {
 } upload_task_t;
 
 static pthread_mutex_t upload_mutex=PTHREAD_MUTEX_INITIALIZER;
-static pthread_cond_t upload_cond=PTHREAD_COND_INITIALIZER;
-static uint32_t upload_wakes=0;
+static psync_mpsc_queue upload_queue=PSYNC_MPSC_STATIC_INIT(upload_queue);
 
 static psync_uint_t current_uploads_waiters=0;
 static pthread_mutex_t current_uploads_mutex=PTHREAD_MUTEX_INITIALIZER;
@@ -1092,6 +1091,7 @@ static void task_run_upload_file_thread(void *ptr){
     res=psync_sql_prep_statement("DELETE FROM task WHERE id=?");
     psync_sql_bind_uint(res, 1, ut->upllist.taskid);
     psync_sql_run_free(res);
+    psync_status_add_to_upload(-1, -(int64_t)ut->upllist.filesize);
   }
   pthread_mutex_lock(&current_uploads_mutex);
   psync_status.bytestouploadcurrent-=ut->upllist.filesize;
@@ -1104,7 +1104,6 @@ static void task_run_upload_file_thread(void *ptr){
   psync_list_del(&ut->upllist.list);
   wake_upload_when_ready();
   pthread_mutex_unlock(&current_uploads_mutex);
-  psync_status_recalc_to_upload();
   psync_status_send_update();
   psync_free(ut);
 }
@@ -1254,19 +1253,13 @@ static void upload_thread(){
       continue;
     }
     
-    pthread_mutex_lock(&upload_mutex);
-    if (!upload_wakes)
-      pthread_cond_wait(&upload_cond, &upload_mutex);
-    upload_wakes=0;
-    pthread_mutex_unlock(&upload_mutex);
+    psync_mpsc_wait(&upload_queue);
   }
 }
 
+/* like psync_wake_download(), no task is handed over, the thread reads the next one from the task table */
 void psync_wake_upload(){
-  pthread_mutex_lock(&upload_mutex);
-  if (!upload_wakes++)
-    pthread_cond_signal(&upload_cond);
-  pthread_mutex_unlock(&upload_mutex);  
+  psync_mpsc_wake(&upload_queue);
 }
 
 void psync_upload_init(){
@@ -1277,12 +1270,14 @@ void psync_upload_init(){
 void psync_delete_upload_tasks_for_file(psync_fileid_t localfileid){
   psync_sql_res *res;
   upload_list_t *upl;
+  uint32_t aff;
   res=psync_sql_prep_statement("DELETE FROM task WHERE type=? AND localitemid=?");
   psync_sql_bind_uint(res, 1, PSYNC_UPLOAD_FILE);
   psync_sql_bind_uint(res, 2, localfileid);
   psync_sql_run(res);
-  if (psync_sql_affected_rows()){
-    psync_status_recalc_to_upload();
+  if ((aff=psync_sql_affected_rows())){
+    psync_status_add_to_upload(-(int32_t)aff, 0);
+    psync_status_recalc_to_upload_async();
     psync_send_status_update();
   }
   psync_sql_free_result(res);